@@ -2,6 +2,11 @@
 // License: https://github.com/serge-rgb/milton#license
 
 // Dynamic array template class
+//
+// Elements are moved with realloc and memcpy, so T has to be a plain struct. A zeroed DArray is
+// empty, and allocates on the first push. Arrays made with arena_array take their memory from an
+// arena: growing leaves the old data in the arena, and release only forgets it. They are for arrays
+// that go away with a temporary arena.
 
 #pragma once
 
@@ -10,70 +15,122 @@
 #include "memory.h"
 #include "platform.h"
 
+#define DARRAY_DEFAULT_CAPACITY 32
+
 template <typename T>
 struct DArray
 {
     i64     count;
     i64     capacity;
     T*      data;
+    Arena*  arena;  // NULL for arrays on the heap.
 };
 
 template <typename T>
 DArray<T>
 dynamic_array(i64 capacity)
 {
-    DArray<T> arr;
-    arr.count = 0;
+    DArray<T> arr = {};
     arr.capacity = capacity;
     arr.data = (T*)mlt_calloc(capacity, sizeof(T), "DArray");
     return arr;
 }
 
+template <typename T>
+DArray<T>
+arena_array(Arena* arena, i64 capacity)
+{
+    DArray<T> arr = {};
+    arr.arena = arena;
+    arr.capacity = capacity;
+    arr.data = (T*)arena_alloc_bytes(arena, (size_t)capacity * sizeof(T), Arena_NONE, alignof(T));
+    return arr;
+}
+
+// Moves the elements to an allocation of exactly `capacity` elements.
 template <typename T>
 void
-grow(DArray<T>* arr)
+set_capacity(DArray<T>* arr, i64 capacity)
 {
-    // Default capacity.
-    if ( arr->capacity == 0 ) {
-        arr->capacity = 32;
-    }
-    while ( arr->capacity <= arr->count ) {
-        arr->capacity *= 2;
+    mlt_assert(capacity >= arr->count);
+    if ( arr->arena ) {
+        T* data = (T*)arena_alloc_bytes(arr->arena, (size_t)capacity * sizeof(T), Arena_NONE, alignof(T));
+        if ( arr->count > 0 ) {
+            memcpy(data, arr->data, (size_t)arr->count * sizeof(T));
+        }
+        arr->data = data;
     }
-    if ( arr->data ) {
-        arr->data = (T*)mlt_realloc(arr->data, (size_t)(arr->capacity*sizeof(T)), "DArray");
-        if ( arr->data == NULL ) {
-            milton_die_gracefully("Milton ran out of memory :(");
+    else if ( capacity == 0 ) {
+        if ( arr->data ) {
+            mlt_free(arr->data, "DArray");
         }
     }
+    else if ( arr->data ) {
+        arr->data = (T*)mlt_realloc(arr->data, (size_t)capacity * sizeof(T), "DArray");
+    }
     else {
-        arr->data = (T*)mlt_calloc((size_t)arr->capacity, sizeof(T), "DArray");
+        arr->data = (T*)mlt_calloc((size_t)capacity, sizeof(T), "DArray");
     }
+    if ( capacity > 0 && arr->data == NULL ) {
+        milton_die_gracefully("Milton ran out of memory :(");
+    }
+    arr->capacity = capacity;
 }
 
+// Doubles the capacity until there is room for one more element.
+template <typename T>
+void
+grow(DArray<T>* arr)
+{
+    i64 capacity = arr->capacity > 0 ? arr->capacity : DARRAY_DEFAULT_CAPACITY;
+    while ( capacity <= arr->count ) {
+        capacity *= 2;
+    }
+    set_capacity(arr, capacity);
+}
 
+// Room for `size` elements, and not more.
 template <typename T>
 void
 reserve(DArray<T>* arr, i64 size)
 {
     if ( arr ) {
-        if ( arr->capacity < size || arr->data == NULL ) {
-            arr->capacity = size;
-            grow(arr);
+        if ( arr->capacity < size || (arr->data == NULL && size > 0) ) {
+            set_capacity(arr, size);
         }
     }
 }
 
+// Room for `num` elements after the last one. Grows geometrically, for arrays that are filled a
+// piece at a time.
+template <typename T>
+void
+reserve_more(DArray<T>* arr, i64 num)
+{
+    if ( arr->count + num > arr->capacity || arr->data == NULL ) {
+        set_capacity(arr, max(arr->count + num, max(arr->capacity * 2, (i64)DARRAY_DEFAULT_CAPACITY)));
+    }
+}
+
+// Copies `num` elements to the end of the array. Returns where they went.
 template <typename T>
 T*
-push(DArray<T>* arr, const T& elem)
+append_range(DArray<T>* arr, const T* elems, i64 num)
 {
-    if ( arr->data == NULL ) {
-        arr->capacity = 32;
-        arr->count = 0;
-        grow(arr);
+    reserve_more(arr, num);
+    T* result = arr->data + arr->count;
+    if ( num > 0 ) {
+        memcpy(result, elems, (size_t)num * sizeof(T));
     }
-    else if ( arr->capacity <= arr->count ) {
+    arr->count += num;
+    return result;
+}
+
+template <typename T>
+T*
+push(DArray<T>* arr, const T& elem)
+{
+    if ( arr->data == NULL || arr->capacity <= arr->count ) {
         grow(arr);
     }
     arr->data[arr->count++] = elem;
@@ -119,21 +176,35 @@ count(DArray<T>* arr)
     return arr->count;
 }
 
+// Keeps the capacity. See shrink_to_fit
 template <typename T>
 void
 reset(DArray<T>* arr)
 {
     arr->count = 0;
-    // TODO: set to zero?
 }
 
+// Gives back the room after the last element. Arrays in an arena stay as they are.
+template <typename T>
+void
+shrink_to_fit(DArray<T>* arr)
+{
+    if ( arr->arena == NULL && arr->capacity > arr->count ) {
+        set_capacity(arr, arr->count);
+    }
+}
+
+// The array is empty afterwards, and can be used again.
 template <typename T>
 void
 release(DArray<T>* arr)
 {
-    if ( arr->data ) {
+    if ( arr->data && arr->arena == NULL ) {
         mlt_free(arr->data, "DArray");
     }
+    arr->data = NULL;
+    arr->count = 0;
+    arr->capacity = 0;
 }
 
 // Iteration
@@ -142,20 +213,12 @@ template <typename T>
 T*
 begin(const DArray<T>& arr)
 {
-    T* result = NULL;
-    if ( arr.count > 0 ) {
-        result = &arr.data[0];
-    }
-    return result;
+    return arr.data;
 }
 
 template <typename T>
 T*
 end(const DArray<T>& arr)
 {
-    T* result = NULL;
-    if ( arr.count > 0 ) {
-        result = arr.data + arr.count;
-    }
-    return result;
+    return arr.data + arr.count;
 }
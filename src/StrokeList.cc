@@ -9,32 +9,105 @@ strokelist_init_bucket(StrokeBucket* bucket)
     bucket->bounding_rect = rect_without_size();
 }
 
+// Position of the highest set bit. `value` is not 0.
+static i32
+highest_bit(u64 value)
+{
+#if defined(_MSC_VER)
+    unsigned long bit;
+    _BitScanReverse64(&bit, value);
+    return (i32)bit;
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+}
+
+i32
+strokelist_bucket_index(i64 idx)
+{
+    // Bucket b starts at FIRST * (2^b - 1).
+    return highest_bit((u64)idx / STROKELIST_FIRST_BUCKET_COUNT + 1);
+}
+
+i64
+strokelist_bucket_first(i32 bucket_i)
+{
+    return STROKELIST_FIRST_BUCKET_COUNT * (((i64)1 << bucket_i) - 1);
+}
+
+i64
+strokelist_bucket_capacity(i32 bucket_i)
+{
+    return (i64)STROKELIST_FIRST_BUCKET_COUNT << bucket_i;
+}
+
+i64
+strokelist_bucket_count(StrokeList* list, StrokeBucket* bucket)
+{
+    i64 count = list->count - bucket->first;
+    return bucket->data ? max(0, min(count, bucket->capacity)) : 0;
+}
+
 static StrokeBucket*
-create_bucket(Arena* arena)
+strokelist_bucket(StrokeList* list, i32 bucket_i)
 {
-    StrokeBucket* bucket = arena_alloc_elem(arena, StrokeBucket);
-    strokelist_init_bucket(bucket);
-    return bucket;
+    return bucket_i == 0 ? &list->root : list->buckets[bucket_i];
 }
 
 void
-push(StrokeList* list, const Stroke& element)
+strokelist_set_bucket_rects(StrokeList* list, Rect* rects)
 {
-    int bucket_i = list->count / STROKELIST_BUCKET_COUNT;
-    int i = list->count % STROKELIST_BUCKET_COUNT;
+    for ( StrokeBucket* bucket = &list->root; bucket != NULL; bucket = bucket->next ) {
+        i64 count = strokelist_bucket_count(list, bucket);
+        Rect bounds = rect_without_size();
+        for ( i64 i = 0; i < count; ++i ) {
+            bounds = rect_union(bounds, rects[bucket->first + i]);
+        }
+        bucket->bounding_rect = bounds;
+    }
+}
 
-    StrokeBucket* bucket = &list->root;
-    while ( bucket_i != 0 ) {
-        if ( !bucket->next ) {
-            bucket->next = create_bucket(list->arena);
+void
+strokelist_set_bounding_rects(StrokeList* list, i64 first, i64 count, Rect* rects)
+{
+    mlt_assert(first >= 0 && first + count <= list->count);
+    StrokeBucket* bucket = strokelist_bucket(list, strokelist_bucket_index(first));
+    for ( i64 i = 0; i < count; ++i ) {
+        i64 bucket_offset = first + i - bucket->first;
+        if ( bucket_offset == bucket->capacity ) {
+            bucket = bucket->next;
+            bucket_offset = 0;
         }
-        bucket = bucket->next;
-        bucket_i -= 1;
+        bucket->data[bucket_offset].bounding_rect = rects[i];
+        bucket->bounding_rect = rect_union(bucket->bounding_rect, rects[i]);
     }
+}
 
-    bucket->data[i] = element;
+void
+push(StrokeList* list, const Stroke& element)
+{
+    i32 bucket_i = strokelist_bucket_index(list->count);
+    mlt_assert(bucket_i < STROKELIST_MAX_BUCKETS);
 
-    bucket->bounding_rect = rect_union(bucket->bounding_rect, element.bounding_rect);
+    StrokeBucket* bucket = strokelist_bucket(list, bucket_i);
+    if ( bucket == NULL ) {
+        bucket = arena_alloc_elem(list->arena, StrokeBucket);
+        strokelist_init_bucket(bucket);
+        list->buckets[bucket_i] = bucket;
+        strokelist_bucket(list, bucket_i - 1)->next = bucket;
+    }
+    if ( bucket->data == NULL ) {
+        bucket->first = strokelist_bucket_first(bucket_i);
+        bucket->capacity = strokelist_bucket_capacity(bucket_i);
+        bucket->data = arena_alloc_array(list->arena, bucket->capacity, Stroke);
+    }
+
+    bucket->data[list->count - bucket->first] = element;
+
+    // Strokes that are pushed before their points are known have no size yet.
+    if ( rect_is_valid(element.bounding_rect) ) {
+        bucket->bounding_rect = rect_union(bucket->bounding_rect, element.bounding_rect);
+    }
 
     list->count += 1;
 }
@@ -42,14 +115,8 @@ push(StrokeList* list, const Stroke& element)
 Stroke*
 get(StrokeList* list, i64 idx)
 {
-    int bucket_i = idx / STROKELIST_BUCKET_COUNT;
-    int i = idx % STROKELIST_BUCKET_COUNT;
-    StrokeBucket* bucket = &list->root;
-    while ( bucket_i != 0 ) {
-        bucket = bucket->next;
-        bucket_i -= 1;
-    }
-    return &bucket->data[i];
+    StrokeBucket* bucket = strokelist_bucket(list, strokelist_bucket_index(idx));
+    return &bucket->data[idx - bucket->first];
 }
 
 Stroke
@@ -4,7 +4,8 @@
 // StrokeList
 //
 // - Works as a dynamically-sized array for Strokes.
-// - Pointers to elements in the StrokeList stay valid for the lifetime of the program.
+// - Pointers to elements in the StrokeList stay valid until the canvas is compacted. See
+//   milton_compact_canvas
 
 
 #pragma once
@@ -13,11 +14,16 @@
 
 #include "memory.h"
 
-#define STROKELIST_BUCKET_COUNT 4196
+// Buckets grow geometrically, so that a layer with few strokes costs little. Bucket b holds
+// STROKELIST_FIRST_BUCKET_COUNT << b strokes.
+#define STROKELIST_FIRST_BUCKET_COUNT   32
+#define STROKELIST_MAX_BUCKETS          32
 
 struct StrokeBucket
 {
-    Stroke          data[STROKELIST_BUCKET_COUNT];
+    Stroke*         data;       // NULL until the first stroke of the bucket is pushed.
+    i64             first;      // Index in the list of data[0].
+    i64             capacity;
     StrokeBucket*   next;
     Rect            bounding_rect;
 };
@@ -25,6 +31,7 @@ struct StrokeBucket
 struct StrokeList
 {
     StrokeBucket    root;
+    StrokeBucket*   buckets[STROKELIST_MAX_BUCKETS];  // buckets[0] is unused. The root is bucket 0.
     i64             count;
     Stroke*         operator[](i64 i);
 
@@ -32,6 +39,17 @@ struct StrokeList
 };
 
 void strokelist_init_bucket(StrokeBucket* bucket);
+// Index math for buckets. O(1).
+i32 strokelist_bucket_index(i64 idx);
+i64 strokelist_bucket_first(i32 bucket_i);
+i64 strokelist_bucket_capacity(i32 bucket_i);
+// Number of strokes of the list that are in `bucket`.
+i64 strokelist_bucket_count(StrokeList* list, StrokeBucket* bucket);
+// Sets the bounding rect of every bucket from `rects`, which has the rects of all the strokes.
+void strokelist_set_bucket_rects(StrokeList* list, Rect* rects);
+// Sets the bounding rects of strokes [first, first + count) and grows their buckets to fit them.
+// For strokes that were pushed before their points were known.
+void strokelist_set_bounding_rects(StrokeList* list, i64 first, i64 count, Rect* rects);
 
 void push(StrokeList* list, const Stroke& element);
 Stroke* get(StrokeList* list, i64 idx);
@@ -2,6 +2,8 @@
 // License: https://github.com/serge-rgb/milton#license
 
 #include "canvas.h"
+#include "platform.h"
+#include "stroke_codec.h"
 #include "utils.h"
 
 v4f k_eraser_color = {23,34,45,56};
@@ -51,10 +53,31 @@ is_eraser(v4f color)
     return result;
 }
 
+static Rect
+bounding_rect_for_stroke_points(Stroke* stroke, i32 first, i32 num_points)
+{
+    Rect bb;
+    if ( stroke->format == StrokeFormat_WIDE ) {
+        bb = bounding_rect_for_points(stroke->points + first, num_points);
+    } else {
+        mlt_assert (num_points > 0);
+        bb.top_left = stroke_point(stroke, first);
+        bb.bot_right = bb.top_left;
+        for ( i32 i = first + 1; i < first + num_points; ++i ) {
+            v2l point = stroke_point(stroke, i);
+            bb.left = min(bb.left, point.x);
+            bb.right = max(bb.right, point.x);
+            bb.top = min(bb.top, point.y);
+            bb.bottom = max(bb.bottom, point.y);
+        }
+    }
+    return bb;
+}
+
 Rect
 bounding_box_for_stroke(Stroke* stroke)
 {
-    Rect bb = bounding_rect_for_points(stroke->points, stroke->num_points);
+    Rect bb = bounding_rect_for_stroke_points(stroke, 0, stroke->num_points);
     Rect bb_enlarged = rect_enlarge(bb, stroke->brush.radius);
     return bb_enlarged;
 }
@@ -64,7 +87,7 @@ bounding_box_for_last_n_points(Stroke* stroke, i32 last_n)
 {
     i32 forward = max(stroke->num_points - last_n, 0);
     i32 num_points = min(last_n, stroke->num_points);
-    Rect bb = bounding_rect_for_points(stroke->points + forward, num_points);
+    Rect bb = bounding_rect_for_stroke_points(stroke, forward, num_points);
     Rect bb_enlarged = rect_enlarge(bb, stroke->brush.radius);
     return bb_enlarged;
 }
@@ -78,6 +101,384 @@ canvas_rect_to_raster_rect(CanvasView* view, Rect canvas_rect)
     return raster_rect;
 }
 
+// Packed blocks start with this, followed by what stroke_encode_packed wrote.
+struct StrokePackedHeader
+{
+    u32 size;       // Header included.
+    u32 from_size;  // Block size of the points before they were packed.
+};
+
+size_t
+stroke_points_size(i32 num_points, i32 format)
+{
+    mlt_assert(!(format & (StrokeFormat_PACKED | StrokeFormat_PAGED)));
+    size_t n = (size_t)num_points;
+    size_t size = 0;
+    if ( format == StrokeFormat_WIDE ) {
+        size = n * (sizeof(v2l) + sizeof(f32));
+    } else {
+        size = n * 2 * ((format & StrokeFormat_OFFSETS_16) ? sizeof(u16) : sizeof(u32));
+        if ( !(format & StrokeFormat_CONSTANT_PRESSURE) ) {
+            size += n * sizeof(u16);
+        }
+    }
+    return size;
+}
+
+size_t
+stroke_pool_block_size(i32 class_index)
+{
+    return (size_t)STROKE_POOL_MIN_BLOCK_SIZE << class_index;
+}
+
+static i32
+stroke_pool_class_index(size_t size)
+{
+    i32 ci = 0;
+    while ( stroke_pool_block_size(ci) < size ) {
+        ++ci;
+    }
+    mlt_assert(ci < STROKE_POOL_NUM_CLASSES);
+    return ci;
+}
+
+size_t
+stroke_pool_size_for(size_t size)
+{
+    return stroke_pool_block_size(stroke_pool_class_index(size));
+}
+
+static i32
+stroke_block_class_index(Stroke* stroke)
+{
+    size_t size = 0;
+    if ( stroke->format & StrokeFormat_PACKED ) {
+        size = ((StrokePackedHeader*)stroke->compact)->size;
+    } else {
+        size = stroke_points_size(stroke->num_points, stroke->format);
+    }
+    return stroke_pool_class_index(size);
+}
+
+size_t
+stroke_pool_used_bytes(StrokePool* pool)
+{
+    size_t bytes = 0;
+    for ( i32 ci = 0; ci < STROKE_POOL_NUM_CLASSES; ++ci ) {
+        bytes += stroke_pool_block_size(ci) * (size_t)pool->classes[ci].num_used;
+    }
+    return bytes;
+}
+
+size_t
+stroke_pool_free_bytes(StrokePool* pool)
+{
+    size_t bytes = 0;
+    for ( i32 ci = 0; ci < STROKE_POOL_NUM_CLASSES; ++ci ) {
+        bytes += stroke_pool_block_size(ci) * (size_t)pool->classes[ci].num_free;
+    }
+    return bytes;
+}
+
+static u8*
+stroke_pool_alloc(StrokePool* pool, i32 class_index)
+{
+    mlt_assert(pool->arena);
+    StrokePoolClass* c = &pool->classes[class_index];
+    u8* block = (u8*)c->free_list;
+    if ( block ) {
+        c->free_list = *(void**)block;
+        --c->num_free;
+    } else {
+        block = arena_alloc_bytes(pool->arena, stroke_pool_block_size(class_index), Arena_NONE,
+                                  ARENA_SIMD_ALIGNMENT);
+    }
+    ++c->num_used;
+    return block;
+}
+
+void
+stroke_alloc_points(StrokePool* pool, Stroke* stroke, i32 num_points)
+{
+    i32 ci = stroke_pool_class_index(stroke_points_size(num_points, StrokeFormat_WIDE));
+    u8* block = stroke_pool_alloc(pool, ci);
+    size_t capacity = stroke_pool_block_size(ci) / (sizeof(v2l) + sizeof(f32));
+    stroke->points = (v2l*)block;
+    stroke->pressures = (f32*)(block + sizeof(v2l) * capacity);
+    stroke->compact = NULL;
+    stroke->format = StrokeFormat_WIDE;
+}
+
+void
+stroke_free_points(StrokePool* pool, Stroke* stroke)
+{
+    if ( stroke->format & StrokeFormat_PAGED ) {
+        pool->num_paged -= 1;
+        stroke->compact = NULL;
+        return;
+    }
+    void* block = stroke->format == StrokeFormat_WIDE ? (void*)stroke->points : (void*)stroke->compact;
+    i32 ci = stroke_block_class_index(stroke);
+    if ( stroke->format & StrokeFormat_PACKED ) {
+        StrokePackedHeader* header = (StrokePackedHeader*)stroke->compact;
+        pool->num_packed -= 1;
+        pool->packed_bytes -= stroke_pool_block_size(ci);
+        pool->packed_from_bytes -= header->from_size;
+    }
+    StrokePoolClass* c = &pool->classes[ci];
+    mlt_assert(c->num_used > 0);
+    *(void**)block = c->free_list;
+    c->free_list = block;
+    --c->num_used;
+    ++c->num_free;
+    stroke->points = NULL;
+    stroke->pressures = NULL;
+    stroke->compact = NULL;
+}
+
+void
+stroke_shrink_points(StrokePool* pool, Stroke* stroke, i32 allocated_points)
+{
+    mlt_assert(stroke->format == StrokeFormat_WIDE);
+    if ( stroke_pool_class_index(stroke_points_size(stroke->num_points, StrokeFormat_WIDE)) <
+         stroke_pool_class_index(stroke_points_size(allocated_points, StrokeFormat_WIDE)) ) {
+        Stroke old = *stroke;
+        old.num_points = allocated_points;
+        stroke_alloc_points(pool, stroke, stroke->num_points);
+        memcpy(stroke->points, old.points, sizeof(v2l) * (size_t)stroke->num_points);
+        memcpy(stroke->pressures, old.pressures, sizeof(f32) * (size_t)stroke->num_points);
+        stroke_free_points(pool, &old);
+    }
+}
+
+static u16*
+stroke_compact_pressures(Stroke* stroke)
+{
+    i32 offsets_format = stroke->format & ~StrokeFormat_CONSTANT_PRESSURE;
+    return (u16*)(stroke->compact + stroke_points_size(stroke->num_points,
+                                                       offsets_format | StrokeFormat_CONSTANT_PRESSURE));
+}
+
+// The format that `points` fit in. Sets the origin of compact formats.
+static i32
+stroke_compact_format(v2l* points, f32* pressures, i32 num_points, v2l* out_origin)
+{
+    Rect bounds = bounding_rect_for_points(points, num_points);
+    u64 range = max((u64)(bounds.right - bounds.left), (u64)(bounds.bottom - bounds.top));
+
+    i32 format = StrokeFormat_WIDE;
+    if ( range <= 0xffff ) {
+        format = StrokeFormat_OFFSETS_16;
+    } else if ( range <= 0xffffffff ) {
+        format = StrokeFormat_OFFSETS_32;
+    }
+    // Otherwise the stroke was drawn zoomed out very far, and it stays wide.
+    if ( format != StrokeFormat_WIDE ) {
+        b32 is_constant = true;
+        for ( i32 i = 1; is_constant && i < num_points; ++i ) {
+            is_constant = pressures[i] == pressures[0];
+        }
+        if ( is_constant ) {
+            format |= StrokeFormat_CONSTANT_PRESSURE;
+        }
+    }
+    *out_origin = bounds.top_left;
+    return format;
+}
+
+void
+stroke_copy_points(StrokePool* pool, Stroke* stroke, v2l* points, f32* pressures)
+{
+    i32 num_points = stroke->num_points;
+    mlt_assert(num_points > 0);
+    v2l origin = {};
+    i32 format = stroke_compact_format(points, pressures, num_points, &origin);
+    if ( format == StrokeFormat_WIDE ) {
+        stroke_alloc_points(pool, stroke, num_points);
+        memcpy(stroke->points, points, sizeof(v2l) * (size_t)num_points);
+        memcpy(stroke->pressures, pressures, sizeof(f32) * (size_t)num_points);
+    } else {
+        stroke->compact = stroke_pool_alloc(pool, stroke_pool_class_index(stroke_points_size(num_points, format)));
+        stroke->points = NULL;
+        stroke->pressures = NULL;
+        stroke->format = format;
+        stroke->origin = origin;
+        stroke->pressure = (format & StrokeFormat_CONSTANT_PRESSURE) ? pressures[0] : 0;
+
+        for ( i32 i = 0; i < num_points; ++i ) {
+            v2l offset = points[i] - origin;
+            if ( format & StrokeFormat_OFFSETS_16 ) {
+                ((u16*)stroke->compact)[2*i + 0] = (u16)offset.x;
+                ((u16*)stroke->compact)[2*i + 1] = (u16)offset.y;
+            } else {
+                ((u32*)stroke->compact)[2*i + 0] = (u32)offset.x;
+                ((u32*)stroke->compact)[2*i + 1] = (u32)offset.y;
+            }
+        }
+        if ( !(format & StrokeFormat_CONSTANT_PRESSURE) ) {
+            u16* quantized = stroke_compact_pressures(stroke);
+            for ( i32 i = 0; i < num_points; ++i ) {
+                f32 pressure = min(max(pressures[i], 0.0f), 1.0f);
+                quantized[i] = (u16)(pressure * 65535.0f + 0.5f);
+            }
+        }
+    }
+}
+
+void
+stroke_compact_points(StrokePool* pool, Stroke* stroke)
+{
+    mlt_assert(stroke->format == StrokeFormat_WIDE);
+    v2l origin;
+    if ( stroke_compact_format(stroke->points, stroke->pressures, stroke->num_points, &origin) !=
+         StrokeFormat_WIDE ) {
+        Stroke wide = *stroke;
+        stroke_copy_points(pool, stroke, wide.points, wide.pressures);
+        stroke_free_points(pool, &wide);
+    }
+}
+
+void
+stroke_move_points(StrokePool* pool, Stroke* stroke)
+{
+    if ( stroke->format & StrokeFormat_PAGED ) {
+        pool->num_paged += 1;
+        return;
+    }
+    i32 ci = stroke_block_class_index(stroke);
+    u8* from = stroke->format == StrokeFormat_WIDE ? (u8*)stroke->points : stroke->compact;
+    u8* block = stroke_pool_alloc(pool, ci);
+    if ( stroke->format == StrokeFormat_WIDE ) {
+        // The pressures are after room for as many points as the block fits.
+        memcpy(block, from, stroke_pool_block_size(ci));
+        stroke->pressures = (f32*)(block + ((u8*)stroke->pressures - from));
+        stroke->points = (v2l*)block;
+    } else if ( stroke->format & StrokeFormat_PACKED ) {
+        StrokePackedHeader* header = (StrokePackedHeader*)from;
+        memcpy(block, from, header->size);
+        stroke->compact = block;
+        pool->num_packed += 1;
+        pool->packed_bytes += stroke_pool_block_size(ci);
+        pool->packed_from_bytes += header->from_size;
+    } else {
+        memcpy(block, from, stroke_points_size(stroke->num_points, stroke->format));
+        stroke->compact = block;
+    }
+}
+
+size_t
+stroke_packed_max_size(i32 num_points)
+{
+    return stroke_codec_max_size(num_points);
+}
+
+size_t
+stroke_encode_packed(Stroke* stroke, v2l* scratch_points, f32* scratch_pressures, u8* out)
+{
+    mlt_assert(stroke->compact != NULL && !(stroke->format & StrokeFormat_PACKED));
+    stroke_get_points(stroke, 0, stroke->num_points, scratch_points, scratch_pressures);
+    // Offsets are small numbers, and so is the first varint.
+    for ( i32 i = 0; i < stroke->num_points; ++i ) {
+        scratch_points[i] -= stroke->origin;
+    }
+    return stroke_encode(scratch_points, scratch_pressures, stroke->num_points, out, /*delta_pressures*/true);
+}
+
+b32
+stroke_pack_points(StrokePool* pool, Stroke* stroke, u8* encoded, size_t size)
+{
+    mlt_assert(stroke->compact != NULL && !(stroke->format & (StrokeFormat_PACKED | StrokeFormat_KEEP_UNPACKED)));
+    i32 from_ci = stroke_block_class_index(stroke);
+    size_t packed_size = sizeof(StrokePackedHeader) + size;
+    b32 smaller = from_ci > 0 && packed_size <= stroke_pool_block_size(from_ci - 1);
+    if ( smaller ) {
+        i32 ci = stroke_pool_class_index(packed_size);
+        u8* block = stroke_pool_alloc(pool, ci);
+        StrokePackedHeader* header = (StrokePackedHeader*)block;
+        header->size = (u32)packed_size;
+        header->from_size = (u32)stroke_pool_block_size(from_ci);
+        memcpy(block + sizeof(StrokePackedHeader), encoded, size);
+
+        Stroke compact = *stroke;
+        stroke_free_points(pool, &compact);
+        stroke->compact = block;
+        stroke->format = StrokeFormat_PACKED;
+
+        pool->num_packed += 1;
+        pool->packed_bytes += stroke_pool_block_size(ci);
+        pool->packed_from_bytes += header->from_size;
+    } else {
+        stroke->format |= StrokeFormat_KEEP_UNPACKED;
+    }
+    return smaller;
+}
+
+v2l
+stroke_point(Stroke* stroke, i32 i)
+{
+    mlt_assert(!(stroke->format & (StrokeFormat_PACKED | StrokeFormat_PAGED)));
+    v2l point;
+    if ( stroke->format & StrokeFormat_OFFSETS_16 ) {
+        u16* offset = (u16*)stroke->compact + 2*i;
+        point = { stroke->origin.x + offset[0], stroke->origin.y + offset[1] };
+    } else if ( stroke->format & StrokeFormat_OFFSETS_32 ) {
+        u32* offset = (u32*)stroke->compact + 2*i;
+        point = { stroke->origin.x + offset[0], stroke->origin.y + offset[1] };
+    } else {
+        point = stroke->points[i];
+    }
+    return point;
+}
+
+f32
+stroke_pressure(Stroke* stroke, i32 i)
+{
+    mlt_assert(!(stroke->format & (StrokeFormat_PACKED | StrokeFormat_PAGED)));
+    f32 pressure;
+    if ( stroke->format == StrokeFormat_WIDE ) {
+        pressure = stroke->pressures[i];
+    } else if ( stroke->format & StrokeFormat_CONSTANT_PRESSURE ) {
+        pressure = stroke->pressure;
+    } else {
+        pressure = stroke_compact_pressures(stroke)[i] / 65535.0f;
+    }
+    return pressure;
+}
+
+void
+stroke_get_points(Stroke* stroke, i32 first, i32 num_points, v2l* out_points, f32* out_pressures)
+{
+    if ( stroke->format == StrokeFormat_WIDE ) {
+        memcpy(out_points, stroke->points + first, sizeof(v2l) * (size_t)num_points);
+        memcpy(out_pressures, stroke->pressures + first, sizeof(f32) * (size_t)num_points);
+    } else if ( stroke->format & StrokeFormat_PACKED ) {
+        mlt_assert(first == 0 && num_points == stroke->num_points);
+        StrokePackedHeader* header = (StrokePackedHeader*)stroke->compact;
+        b32 ok = stroke_decode(stroke->compact + sizeof(StrokePackedHeader),
+                               header->size - sizeof(StrokePackedHeader),
+                               num_points, out_points, out_pressures);
+        mlt_assert(ok);
+        for ( i32 i = 0; i < num_points; ++i ) {
+            out_points[i] += stroke->origin;
+        }
+    } else if ( stroke->format & StrokeFormat_PAGED ) {
+        mlt_assert(first == 0 && num_points == stroke->num_points);
+        // The file is only checked when the points are read. A corrupt stroke reads as a dot.
+        if ( !stroke_decode(stroke->compact, stroke->paged_size, num_points, out_points, out_pressures) ) {
+            milton_log("ERROR: Could not decode the points of stroke %d\n", stroke->id);
+            v2l center = (stroke->bounding_rect.top_left + stroke->bounding_rect.bot_right) / (i64)2;
+            for ( i32 i = 0; i < num_points; ++i ) {
+                out_points[i] = center;
+                out_pressures[i] = 0;
+            }
+        }
+    } else {
+        for ( i32 i = 0; i < num_points; ++i ) {
+            out_points[i] = stroke_point(stroke, first + i);
+            out_pressures[i] = stroke_pressure(stroke, first + i);
+        }
+    }
+}
 
 namespace layer {
 
@@ -96,6 +96,84 @@ Rect    bounding_box_for_stroke (Stroke* stroke);
 Rect    bounding_box_for_last_n_points (Stroke* stroke, i32 last_n);
 Rect    canvas_rect_to_raster_rect (CanvasView* view, Rect canvas_rect);
 
+// ---- Stroke pool.
+//
+// The points of a stroke are one block. Wide blocks have room for `capacity` points, followed by
+// room for as many pressures. Block sizes are powers of two, from STROKE_POOL_MIN_BLOCK_SIZE up to
+// what a wide stroke of STROKE_MAX_POINTS needs. Blocks are taken from the arena, and freed blocks
+// are kept in a list for their size, to be handed out again before the arena grows. Packed blocks
+// start with their size. See cold_strokes.h
+
+#define STROKE_POOL_NUM_CLASSES     12  // The last one fits STROKE_MAX_POINTS wide points.
+#define STROKE_POOL_MIN_BLOCK_SIZE  32
+
+struct StrokePoolClass
+{
+    void*   free_list;  // Each free block starts with a pointer to the next one.
+    i64     num_used;
+    i64     num_free;
+};
+
+struct StrokePool
+{
+    Arena*          arena;
+    StrokePoolClass classes[STROKE_POOL_NUM_CLASSES];
+
+    // Packed strokes: their blocks, and the blocks they had before they were packed.
+    i64             num_packed;
+    size_t          packed_bytes;
+    size_t          packed_from_bytes;
+
+    // Paged strokes. They have no block.
+    i64             num_paged;
+};
+
+// Bytes that the points of a stroke need in `format`. Not for packed or paged points.
+size_t  stroke_points_size (i32 num_points, i32 format);
+size_t  stroke_pool_block_size (i32 class_index);
+// Size of the block that `size` bytes of points go in.
+size_t  stroke_pool_size_for (size_t size);
+// Bytes of the blocks in use.
+size_t  stroke_pool_used_bytes (StrokePool* pool);
+// Bytes of the blocks in the free lists.
+size_t  stroke_pool_free_bytes (StrokePool* pool);
+// Wide points: sets `points` and `pressures`, with room for `num_points`. Doesn't change
+// stroke->num_points.
+void    stroke_alloc_points (StrokePool* pool, Stroke* stroke, i32 num_points);
+// For points of any format. `stroke->num_points` must fit in the block the points were allocated
+// with, and not in a smaller one. Paged strokes have nothing to free, and are only counted.
+void    stroke_free_points (StrokePool* pool, Stroke* stroke);
+// For wide points that were allocated with room for `allocated_points` and ended up with fewer.
+// Moves the points to a smaller block if they fit in one.
+void    stroke_shrink_points (StrokePool* pool, Stroke* stroke, i32 allocated_points);
+// Allocates room for stroke->num_points and copies `points` and `pressures` there. The points are
+// compact if they are close enough together.
+void    stroke_copy_points (StrokePool* pool, Stroke* stroke, v2l* points, f32* pressures);
+// Moves wide points from the pool to a compact block, if they are close enough together for one.
+void    stroke_compact_points (StrokePool* pool, Stroke* stroke);
+// Copies the points of a stroke to a block of `pool`, for when the pool they were in goes away with
+// its arena. The old block is left as it is. Paged strokes keep pointing into the file, and are only
+// counted. Not for wide points that point into a mapped file.
+void    stroke_move_points (StrokePool* pool, Stroke* stroke);
+
+// Upper bound for the bytes that stroke_encode_packed writes.
+size_t  stroke_packed_max_size (i32 num_points);
+// Encodes the points of a compact stroke for stroke_pack_points, into `out`. `scratch_points` and
+// `scratch_pressures` need room for the points of the stroke. Doesn't change the stroke or the pool,
+// so it can run on any thread. Returns the number of bytes written.
+size_t  stroke_encode_packed (Stroke* stroke, v2l* scratch_points, f32* scratch_pressures, u8* out);
+// Moves the points of a compact stroke to a packed block with the `size` bytes that
+// stroke_encode_packed wrote for it. Returns false if the packed block wouldn't be smaller, and marks
+// the stroke StrokeFormat_KEEP_UNPACKED.
+b32     stroke_pack_points (StrokePool* pool, Stroke* stroke, u8* encoded, size_t size);
+
+// Read points of any format but packed and paged.
+v2l     stroke_point (Stroke* stroke, i32 i);
+f32     stroke_pressure (Stroke* stroke, i32 i);
+// Copies `num_points` points, starting at `first`, in wide format. Packed and paged points are read
+// whole.
+void    stroke_get_points (Stroke* stroke, i32 first, i32 num_points, v2l* out_points, f32* out_pressures);
+
 // ---- Layer functions.
 
 
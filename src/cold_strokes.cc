@@ -0,0 +1,309 @@
+// Copyright (c) 2015-2017 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+#include "cold_strokes.h"
+
+#include "canvas.h"
+#include "memory.h"
+#include "milton.h"
+#include "persist.h"
+#include "platform.h"
+
+#define COLD_STROKES_INTERVAL_MS    1000                // Between batches.
+#define COLD_STROKES_SCAN_COUNT     (64*1024)           // Strokes looked at for each batch.
+#define COLD_STROKES_BATCH_BYTES    (8*1024*1024)       // Most unpacked bytes in a batch.
+
+struct ColdStrokeJob
+{
+    i32     layer_id;
+    i64     index;      // In the layer.
+    Stroke  stroke;     // As it was when the batch started. `compact` tells if the stroke changed.
+
+    // Set by the thread.
+    size_t  offset;     // Into ColdStrokes::packed
+    size_t  size;
+};
+
+struct ColdStrokes
+{
+    SDL_Thread* thread;
+    SDL_mutex*  mutex;
+    SDL_cond*   cond;
+
+    // Protected by `mutex`.
+    b32         in_flight;
+    b32         done;
+    b32         quit;
+
+    // The batch. Owned by the thread while it's in flight.
+    DArray<ColdStrokeJob>   jobs;
+    DArray<u8>              packed;
+    DArray<v2l>             scratch_points;
+    DArray<f32>             scratch_pressures;
+
+    f32         batch_ms;  // Protected by `mutex`.
+
+    // Main thread only.
+    size_t      budget;
+    i32         cursor_layer_id;  // Where the next scan starts.
+    i64         cursor_index;
+    u32         last_batch_ms;
+    i64         num_batches;
+};
+
+// Returns the time it took, in milliseconds.
+static f32
+cold_strokes_pack_batch(ColdStrokes* cs)
+{
+    u64 start = perf_counter();
+    reset(&cs->packed);
+    for ( i64 i = 0; i < cs->jobs.count; ++i ) {
+        ColdStrokeJob* job = &cs->jobs.data[i];
+        i32 num_points = job->stroke.num_points;
+        if ( cs->scratch_points.capacity < num_points ) {
+            reserve(&cs->scratch_points, num_points);
+            reserve(&cs->scratch_pressures, num_points);
+        }
+        reserve_more(&cs->packed, (i64)stroke_packed_max_size(num_points));
+        job->offset = (size_t)cs->packed.count;
+        job->size = stroke_encode_packed(&job->stroke, cs->scratch_points.data, cs->scratch_pressures.data,
+                                         cs->packed.data + cs->packed.count);
+        cs->packed.count += (i64)job->size;
+    }
+    return perf_count_to_sec(perf_counter() - start) * 1000.0f;
+}
+
+static int  // Thread
+cold_strokes_thread(void* data)
+{
+    ColdStrokes* cs = (ColdStrokes*)data;
+    SDL_LockMutex(cs->mutex);
+    for ( ;; ) {
+        while ( !cs->quit && (!cs->in_flight || cs->done) ) {
+            SDL_CondWait(cs->cond, cs->mutex);
+        }
+        if ( cs->quit ) {
+            break;
+        }
+        SDL_UnlockMutex(cs->mutex);
+
+        f32 ms = cold_strokes_pack_batch(cs);
+
+        SDL_LockMutex(cs->mutex);
+        cs->batch_ms = ms;
+        cs->done = true;
+        SDL_CondBroadcast(cs->cond);
+    }
+    SDL_UnlockMutex(cs->mutex);
+    return 0;
+}
+
+ColdStrokes*
+cold_strokes_init()
+{
+    ColdStrokes* cs = (ColdStrokes*)mlt_calloc(1, sizeof(ColdStrokes), "Strokes");
+    cs->budget = COLD_STROKES_DEFAULT_BUDGET;
+    cs->mutex = SDL_CreateMutex();
+    cs->cond = SDL_CreateCond();
+    if ( cs->mutex && cs->cond ) {
+        cs->thread = SDL_CreateThread(cold_strokes_thread, "Cold strokes", cs);
+    }
+    if ( cs->thread == NULL ) {
+        milton_log("Could not start the cold strokes thread. Strokes won't be packed.\n");
+        if ( cs->mutex ) {
+            SDL_DestroyMutex(cs->mutex);
+        }
+        if ( cs->cond ) {
+            SDL_DestroyCond(cs->cond);
+        }
+        mlt_free(cs, "Strokes");
+    }
+    return cs;
+}
+
+void
+cold_strokes_release(ColdStrokes* cs)
+{
+    if ( cs ) {
+        cold_strokes_cancel(cs);
+
+        SDL_LockMutex(cs->mutex);
+        cs->quit = true;
+        SDL_CondBroadcast(cs->cond);
+        SDL_UnlockMutex(cs->mutex);
+        SDL_WaitThread(cs->thread, NULL);
+
+        SDL_DestroyMutex(cs->mutex);
+        SDL_DestroyCond(cs->cond);
+        release(&cs->jobs);
+        release(&cs->packed);
+        release(&cs->scratch_points);
+        release(&cs->scratch_pressures);
+        mlt_free(cs, "Strokes");
+    }
+}
+
+void
+cold_strokes_set_budget(ColdStrokes* cs, size_t budget)
+{
+    if ( cs ) {
+        cs->budget = budget;
+    }
+}
+
+b32
+cold_strokes_busy(ColdStrokes* cs)
+{
+    b32 busy = false;
+    if ( cs ) {
+        SDL_LockMutex(cs->mutex);
+        busy = cs->in_flight;
+        SDL_UnlockMutex(cs->mutex);
+    }
+    return busy;
+}
+
+void
+cold_strokes_cancel(ColdStrokes* cs)
+{
+    if ( cs ) {
+        SDL_LockMutex(cs->mutex);
+        while ( cs->in_flight && !cs->done ) {
+            SDL_CondWait(cs->cond, cs->mutex);
+        }
+        cs->in_flight = false;
+        cs->done = false;
+        SDL_UnlockMutex(cs->mutex);
+        reset(&cs->jobs);
+        cs->cursor_layer_id = 0;
+        cs->cursor_index = 0;
+    }
+}
+
+// Swaps in the packed points of the strokes that are still as they were when the batch started.
+// Their compact blocks are freed, so nothing else can be reading them.
+static void
+cold_strokes_finish_batch(ColdStrokes* cs, MiltonState* milton_state)
+{
+    CanvasState* canvas = milton_state->canvas;
+    for ( i64 i = 0; i < cs->jobs.count; ++i ) {
+        ColdStrokeJob* job = &cs->jobs.data[i];
+        Layer* layer = layer::get_by_id(canvas->root_layer, job->layer_id);
+        if ( layer && job->index < layer->strokes.count ) {
+            Stroke* stroke = get(&layer->strokes, job->index);
+            if ( stroke->compact == job->stroke.compact && stroke->format == job->stroke.format ) {
+                stroke_pack_points(&canvas->stroke_pool, stroke, cs->packed.data + job->offset, job->size);
+            }
+        }
+    }
+    reset(&cs->jobs);
+    cs->num_batches += 1;
+}
+
+// Picks strokes to pack, scanning the canvas from where the last batch left off.
+static void
+cold_strokes_start_batch(ColdStrokes* cs, MiltonState* milton_state)
+{
+    CanvasState* canvas = milton_state->canvas;
+    StrokePool* pool = &canvas->stroke_pool;
+    size_t unpacked_bytes = stroke_pool_used_bytes(pool) - pool->packed_bytes;
+    if ( unpacked_bytes <= cs->budget ) {
+        return;
+    }
+    size_t batch_bytes = min(unpacked_bytes - cs->budget, (size_t)COLD_STROKES_BATCH_BYTES);
+
+    Layer* layer = layer::get_by_id(canvas->root_layer, cs->cursor_layer_id);
+    if ( layer == NULL ) {
+        layer = canvas->root_layer;
+        cs->cursor_index = 0;
+    }
+    if ( layer == NULL ) {
+        return;
+    }
+    i64 num_to_scan = min(layer::count_strokes(canvas->root_layer), (i64)COLD_STROKES_SCAN_COUNT);
+    u32 now = SDL_GetTicks();
+    size_t num_bytes = 0;
+    for ( i64 num_scanned = 0; num_scanned < num_to_scan && num_bytes < batch_bytes; ) {
+        if ( cs->cursor_index >= layer->strokes.count ) {
+            layer = layer->next ? layer->next : canvas->root_layer;
+            cs->cursor_index = 0;
+            continue;
+        }
+        Stroke* stroke = get(&layer->strokes, cs->cursor_index);
+        if ( stroke->compact != NULL &&
+             !(stroke->format & (StrokeFormat_PACKED | StrokeFormat_KEEP_UNPACKED | StrokeFormat_PAGED)) &&
+             now - stroke->render_element.drawn_ms >= COLD_STROKES_MIN_AGE_MS ) {
+            size_t size = stroke_points_size(stroke->num_points, stroke->format);
+            // The smallest blocks can't get any smaller.
+            if ( size > STROKE_POOL_MIN_BLOCK_SIZE ) {
+                ColdStrokeJob job = {};
+                job.layer_id = layer->id;
+                job.index = cs->cursor_index;
+                job.stroke = *stroke;
+                push(&cs->jobs, job);
+                num_bytes += size;
+            }
+        }
+        ++cs->cursor_index;
+        ++num_scanned;
+    }
+    cs->cursor_layer_id = layer->id;
+
+    if ( cs->jobs.count > 0 ) {
+        SDL_LockMutex(cs->mutex);
+        cs->in_flight = true;
+        cs->done = false;
+        SDL_CondBroadcast(cs->cond);
+        SDL_UnlockMutex(cs->mutex);
+    }
+}
+
+void
+cold_strokes_tick(ColdStrokes* cs, MiltonState* milton_state)
+{
+    if ( cs == NULL ) {
+        return;
+    }
+
+    SDL_LockMutex(cs->mutex);
+    b32 in_flight = cs->in_flight;
+    b32 done = cs->done;
+    SDL_UnlockMutex(cs->mutex);
+
+    // A save that is in progress could be reading the compact points.
+    if ( in_flight && done && !milton_save_in_progress(milton_state) ) {
+        cold_strokes_finish_batch(cs, milton_state);
+        SDL_LockMutex(cs->mutex);
+        cs->in_flight = false;
+        cs->done = false;
+        SDL_UnlockMutex(cs->mutex);
+        in_flight = false;
+    }
+
+    u32 now = SDL_GetTicks();
+    if ( !in_flight &&
+         milton_state->loader == NULL &&
+         now - cs->last_batch_ms >= COLD_STROKES_INTERVAL_MS ) {
+        cs->last_batch_ms = now;
+        cold_strokes_start_batch(cs, milton_state);
+    }
+}
+
+ColdStrokesStats
+cold_strokes_stats(ColdStrokes* cs, MiltonState* milton_state)
+{
+    ColdStrokesStats stats = {};
+    StrokePool* pool = &milton_state->canvas->stroke_pool;
+    stats.unpacked_bytes = stroke_pool_used_bytes(pool) - pool->packed_bytes;
+    stats.packed_bytes = pool->packed_bytes;
+    stats.packed_from_bytes = pool->packed_from_bytes;
+    stats.num_packed = pool->num_packed;
+    if ( cs ) {
+        stats.budget = cs->budget;
+        stats.num_batches = cs->num_batches;
+        SDL_LockMutex(cs->mutex);
+        stats.batch_ms = cs->batch_ms;
+        SDL_UnlockMutex(cs->mutex);
+    }
+    return stats;
+}
@@ -0,0 +1,53 @@
+// Copyright (c) 2015-2017 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+// Cold strokes
+//
+// - When the unpacked points in the stroke pool take more than the budget, strokes that haven't been
+//   drawn for COLD_STROKES_MIN_AGE_MS are packed: their compact points are encoded with the stroke
+//   codec, as offsets from their origin. See StrokeFormat_PACKED
+// - Strokes are packed on a thread of their own, a batch at a time. The main thread picks the
+//   strokes, a slice of the canvas each tick, and swaps in the packed points when the batch is done
+//   and no save is in progress. Strokes that changed in the meantime are left alone.
+// - The renderer unpacks strokes into scratch memory when it cooks them. They stay packed: the
+//   cooked stroke stays on the GPU while it's near the view. See gpu_get_unpack_stats.
+// - The thread reads the points of the strokes in the batch, so points are not freed while a batch
+//   is in flight. See cold_strokes_busy.
+
+#pragma once
+
+#include "common.h"
+
+struct MiltonState;
+struct ColdStrokes;
+
+#define COLD_STROKES_DEFAULT_BUDGET     (256*1024*1024)
+#define COLD_STROKES_MIN_AGE_MS         30000
+
+struct ColdStrokesStats
+{
+    size_t  budget;
+    size_t  unpacked_bytes;     // Pool blocks with points that are not packed.
+    size_t  packed_bytes;       // Pool blocks with packed points.
+    size_t  packed_from_bytes;  // What the packed points took before they were packed.
+    i64     num_packed;         // Strokes that are packed.
+    i64     num_batches;
+    f32     batch_ms;           // Time the thread spent on the last batch.
+};
+
+// Returns NULL if the thread could not be started. Strokes are not packed then.
+ColdStrokes* cold_strokes_init();
+void cold_strokes_release(ColdStrokes* cs);
+
+void cold_strokes_set_budget(ColdStrokes* cs, size_t budget);
+
+// Call every frame, from the main thread. Picks up the batch that finished and starts the next one.
+void cold_strokes_tick(ColdStrokes* cs, MiltonState* milton_state);
+
+// True while the thread has a batch. Points must not be freed then.
+b32  cold_strokes_busy(ColdStrokes* cs);
+
+// Waits for the batch in flight and drops it. Call before the canvas goes away.
+void cold_strokes_cancel(ColdStrokes* cs);
+
+ColdStrokesStats cold_strokes_stats(ColdStrokes* cs, MiltonState* milton_state);
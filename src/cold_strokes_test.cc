@@ -0,0 +1,223 @@
+// Copyright (c) 2015-2017 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+// Packs the cold strokes of a canvas with a budget of zero and checks that every stroke reads back
+// the same, that recently drawn strokes stay unpacked and that a stroke that changes while its batch
+// is in flight is left alone. Then throws away strokes, compacts the canvas and checks that the rest,
+// and an undone stroke, still read back the same. Prints how much smaller packed strokes are, how
+// long they take to unpack compared to reading compact points, and what compaction gives back.
+
+#include "test_helpers.h"
+
+static b32
+stroke_reads_as(Stroke* stroke, v2l* points, f32* pressures, v2l* scratch_points, f32* scratch_pressures)
+{
+    stroke_get_points(stroke, 0, stroke->num_points, scratch_points, scratch_pressures);
+    return memcmp(points, scratch_points, sizeof(v2l) * (size_t)stroke->num_points) == 0 &&
+           memcmp(pressures, scratch_pressures, sizeof(f32) * (size_t)stroke->num_points) == 0;
+}
+
+int
+milton_main()
+{
+    i32 num_layers = 2;
+    i32 strokes_per_layer = 10000;
+
+    MiltonState* milton_state = (MiltonState*)mlt_calloc(1, sizeof(MiltonState), "Strokes");
+    milton_state->canvas = arena_bootstrap(CanvasState, arena, 64*1024*1024);
+    milton_state->view = (CanvasView*)mlt_calloc(1, sizeof(CanvasView), "Strokes");
+    CanvasState* canvas = milton_state->canvas;
+    StrokePool* pool = &canvas->stroke_pool;
+    pool->arena = &canvas->arena;
+
+    // Reference points, one run per stroke.
+    size_t max_points = (size_t)(num_layers * strokes_per_layer + 1) * STROKE_MAX_POINTS / 8 + 2;
+    v2l* points = (v2l*)mlt_calloc(max_points, sizeof(v2l), "Strokes");
+    f32* pressures = (f32*)mlt_calloc(max_points, sizeof(f32), "Strokes");
+    size_t* firsts = (size_t*)mlt_calloc((size_t)(num_layers * strokes_per_layer), sizeof(size_t), "Strokes");
+    v2l* scratch_points = (v2l*)mlt_calloc(STROKE_MAX_POINTS, sizeof(v2l), "Strokes");
+    f32* scratch_pressures = (f32*)mlt_calloc(STROKE_MAX_POINTS, sizeof(f32), "Strokes");
+
+    // Every fifth stroke was drawn just now. The rest look like they haven't been in a while.
+    u32 now = SDL_GetTicks();
+    size_t num_points = 0;
+    i32 num_strokes = 0;
+    for ( i32 li = 0; li < num_layers; ++li ) {
+        milton_new_layer(milton_state);
+        Layer* layer = canvas->working_layer;
+        for ( i32 si = 0; si < strokes_per_layer; ++si ) {
+            Stroke stroke = random_stroke(pool, layer);
+            // What the stroke should read back as.
+            stroke_get_points(&stroke, 0, stroke.num_points, points + num_points, pressures + num_points);
+            stroke.render_element.drawn_ms = (si % 5 == 0) ? now : now - COLD_STROKES_MIN_AGE_MS;
+            layer::layer_push_stroke(layer, stroke);
+            firsts[num_strokes++] = num_points;
+            num_points += (size_t)stroke.num_points;
+        }
+    }
+
+    // Compact points, read on the main thread.
+    u64 start = SDL_GetPerformanceCounter();
+    for ( Layer* l = canvas->root_layer; l != NULL; l = l->next ) {
+        for ( i64 i = 0; i < l->strokes.count; ++i ) {
+            Stroke* s = get(&l->strokes, i);
+            stroke_get_points(s, 0, s->num_points, scratch_points, scratch_pressures);
+        }
+    }
+    f32 compact_seconds = seconds_since(start);
+
+    ColdStrokes* cs = cold_strokes_init();
+    mlt_assert(cs);
+    milton_state->cold_strokes = cs;
+    cold_strokes_set_budget(cs, 0);
+
+    // A stroke of the first batch changes while the batch is in flight.
+    SDL_Delay(COLD_STROKES_INTERVAL_MS);
+    cold_strokes_tick(cs, milton_state);
+    mlt_assert(cold_strokes_busy(cs));
+    Stroke* changed = get(&canvas->root_layer->strokes, 1);
+    Stroke before = *changed;
+    v2l changed_points[STROKE_MAX_POINTS];
+    f32 changed_pressures[STROKE_MAX_POINTS];
+    *changed = random_stroke(pool, canvas->root_layer);
+    stroke_get_points(changed, 0, changed->num_points, changed_points, changed_pressures);
+    changed->render_element.drawn_ms = now - COLD_STROKES_MIN_AGE_MS;
+
+    // Tick until a few intervals go by without a batch.
+    i64 num_packed = 0;
+    u32 last_progress_ms = SDL_GetTicks();
+    while ( SDL_GetTicks() - last_progress_ms < 3 * COLD_STROKES_INTERVAL_MS ) {
+        cold_strokes_tick(cs, milton_state);
+        if ( pool->num_packed != num_packed || cold_strokes_busy(cs) ) {
+            num_packed = pool->num_packed;
+            last_progress_ms = SDL_GetTicks();
+        }
+        SDL_Delay(5);
+    }
+    cold_strokes_cancel(cs);
+    stroke_free_points(pool, &before);
+
+    // The changed stroke was picked up again, by a later batch.
+    mlt_assert(changed->format & StrokeFormat_PACKED);
+    mlt_assert(stroke_reads_as(changed, changed_points, changed_pressures, scratch_points, scratch_pressures));
+
+    // Cold strokes stay unpacked when packing doesn't get them a smaller block.
+    i32 si = 0;
+    i32 num_cold = 0;
+    for ( Layer* l = canvas->root_layer; l != NULL; l = l->next ) {
+        for ( i64 i = 0; i < l->strokes.count; ++i, ++si ) {
+            Stroke* s = get(&l->strokes, i);
+            if ( s != changed ) {
+                mlt_assert(stroke_reads_as(s, points + firsts[si], pressures + firsts[si],
+                                           scratch_points, scratch_pressures));
+            }
+            if ( s->render_element.drawn_ms == now ) {
+                mlt_assert(!(s->format & StrokeFormat_PACKED));
+            } else {
+                ++num_cold;
+            }
+        }
+    }
+    mlt_assert(pool->num_packed > num_cold / 2);
+
+    ColdStrokesStats stats = cold_strokes_stats(cs, milton_state);
+    milton_log("Packed %d of %d cold strokes in %d batches, the last one took %f ms\n",
+               (int)stats.num_packed, num_cold, (int)stats.num_batches, stats.batch_ms);
+    milton_log("Packed strokes take %.1f%% of the %.1f MB they took before\n",
+               100.0 * stats.packed_bytes / stats.packed_from_bytes, stats.packed_from_bytes / (1024.0 * 1024.0));
+
+    // What the renderer pays to unpack them.
+    start = SDL_GetPerformanceCounter();
+    i64 num_packed_points = 0;
+    for ( Layer* l = canvas->root_layer; l != NULL; l = l->next ) {
+        for ( i64 i = 0; i < l->strokes.count; ++i ) {
+            Stroke* s = get(&l->strokes, i);
+            if ( s->format & StrokeFormat_PACKED ) {
+                stroke_get_points(s, 0, s->num_points, scratch_points, scratch_pressures);
+                num_packed_points += s->num_points;
+            }
+        }
+    }
+    f32 packed_seconds = seconds_since(start);
+    milton_log("Reading every stroke: %f ms compact. Unpacking the packed ones: %f ms, %.1f ns per point\n",
+               compact_seconds * 1000.0f, packed_seconds * 1000.0f,
+               packed_seconds * 1e9 / (double)num_packed_points);
+
+    // Throw away most of the top layer, and undo one stroke of what is left.
+    {
+        Layer* top = layer::get_topmost(canvas->root_layer);
+        i64 num_kept = top->strokes.count / 4;
+        while ( top->strokes.count > num_kept ) {
+            Stroke stroke = pop(&top->strokes);
+            milton_discard_stroke(milton_state, &stroke);
+        }
+        push(&canvas->stroke_graveyard, pop(&top->strokes));
+        size_t graveyard_first = firsts[strokes_per_layer + num_kept - 1];
+        i32 working_layer_id = canvas->working_layer->id;
+
+        milton_free_discarded_strokes(milton_state);
+        size_t used_bytes = stroke_pool_used_bytes(pool);
+        i64 num_packed_before = pool->num_packed;
+        size_t waste = milton_canvas_waste(canvas);
+        size_t block_bytes = arena_stats(&canvas->arena).block_bytes;
+
+        start = SDL_GetPerformanceCounter();
+        mlt_assert(milton_compact_canvas(milton_state));
+        f32 compaction_seconds = seconds_since(start);
+        canvas = milton_state->canvas;
+        pool = &canvas->stroke_pool;
+        mlt_assert(pool->arena == &canvas->arena);
+        mlt_assert(stroke_pool_used_bytes(pool) == used_bytes && stroke_pool_free_bytes(pool) == 0);
+        mlt_assert(pool->num_packed == num_packed_before);
+        mlt_assert(canvas->working_layer->id == working_layer_id);
+        mlt_assert(layer::number_of_layers(canvas->root_layer) == num_layers);
+
+        si = 0;
+        for ( Layer* l = canvas->root_layer; l != NULL; l = l->next ) {
+            for ( i64 i = 0; i < l->strokes.count; ++i, ++si ) {
+                Stroke* s = get(&l->strokes, i);
+                mlt_assert(s->layer_id == l->id);
+                if ( si != 1 ) {
+                    mlt_assert(stroke_reads_as(s, points + firsts[si], pressures + firsts[si],
+                                               scratch_points, scratch_pressures));
+                }
+            }
+            si = strokes_per_layer;
+        }
+        Stroke* undone = &canvas->stroke_graveyard.data[0];
+        mlt_assert(stroke_reads_as(undone, points + graveyard_first, pressures + graveyard_first,
+                                   scratch_points, scratch_pressures));
+
+        size_t compacted_bytes = arena_stats(&canvas->arena).block_bytes;
+        mlt_assert(compacted_bytes < block_bytes);
+        milton_log("Compacting the canvas took %f ms. %.1f MB of waste, %.1f MB of arena blocks before, "
+                   "%.1f MB after\n",
+                   compaction_seconds * 1000.0f, waste / (1024.0 * 1024.0),
+                   block_bytes / (1024.0 * 1024.0), compacted_bytes / (1024.0 * 1024.0));
+
+        stroke_free_points(pool, undone);
+        release(&canvas->stroke_graveyard);
+        release(&canvas->discarded_strokes);
+    }
+
+    // Everything goes back to the pool.
+    for ( Layer* l = canvas->root_layer; l != NULL; l = l->next ) {
+        for ( i64 i = 0; i < l->strokes.count; ++i ) {
+            stroke_free_points(pool, get(&l->strokes, i));
+        }
+    }
+    mlt_assert(pool->num_packed == 0 && pool->packed_bytes == 0 && pool->packed_from_bytes == 0);
+    mlt_assert(stroke_pool_used_bytes(pool) == 0);
+
+    cold_strokes_release(cs);
+    mlt_free(points, "Strokes");
+    mlt_free(pressures, "Strokes");
+    mlt_free(firsts, "Strokes");
+    mlt_free(scratch_points, "Strokes");
+    mlt_free(scratch_pressures, "Strokes");
+    arena_free(&canvas->arena);
+    mlt_free(milton_state->view, "Strokes");
+    mlt_free(milton_state, "Strokes");
+
+    return 0;
+}
@@ -1,8 +1,24 @@
 // Copyright (c) 2015-2017 Sergio Gonzalez. All rights reserved.
 // License: https://github.com/serge-rgb/milton#license
 
+// Checks push, exact reserve, append_range, shrink_to_fit, release, arena arrays and iteration over
+// empty arrays. Prints how long it takes to fill an array one element at a time, with append_range,
+// and from an arena.
+
+#include "test_helpers.h"
+
 typedef DArray<int> arri;
 
+static i64
+sum_of(const arri& arr)
+{
+    i64 sum = 0;
+    for ( int v : arr ) {
+        sum += v;
+    }
+    return sum;
+}
+
 int
 milton_main()
 {
@@ -25,5 +41,152 @@ milton_main()
     release(&x);
     release(&y);
 
+    // Released arrays are empty, and work again.
+    mlt_assert(x.data == NULL && x.count == 0 && x.capacity == 0);
+    mlt_assert(sum_of(x) == 0);
+    push(&x, 5);
+    mlt_assert(x.count == 1 && x.data[0] == 5);
+    release(&x);
+
+    // Reserve gives exactly what was asked for, and never less than there is.
+    {
+        arri a = {};
+        reserve(&a, 1000);
+        mlt_assert(a.capacity == 1000 && a.count == 0);
+        reserve(&a, 10);
+        mlt_assert(a.capacity == 1000);
+        for ( int i = 0; i < 1000; ++i ) {
+            push(&a, i);
+        }
+        mlt_assert(a.capacity == 1000);
+        push(&a, 1000);
+        mlt_assert(a.capacity == 2000);
+        release(&a);
+    }
+
+    // Append.
+    {
+        arri a = {};
+        int chunk[100];
+        for ( int i = 0; i < 100; ++i ) {
+            chunk[i] = i;
+        }
+        mlt_assert(append_range(&a, chunk, 0) == a.data && a.count == 0);
+        for ( int i = 0; i < 50; ++i ) {
+            int* dst = append_range(&a, chunk, 1 + i);
+            mlt_assert(dst == a.data + a.count - (1 + i));
+        }
+        i64 n = 0;
+        for ( int i = 0; i < 50; ++i ) {
+            for ( int j = 0; j < 1 + i; ++j ) {
+                mlt_assert(a.data[n++] == j);
+            }
+        }
+        mlt_assert(n == a.count && a.capacity >= a.count && a.capacity <= 2 * a.count);
+        release(&a);
+    }
+
+    // Shrink.
+    {
+        arri a = {};
+        for ( int i = 0; i < 5000; ++i ) {
+            push(&a, i);
+        }
+        a.count = 100;
+        shrink_to_fit(&a);
+        mlt_assert(a.capacity == 100 && a.data[99] == 99);
+        reset(&a);
+        mlt_assert(a.capacity == 100);
+        shrink_to_fit(&a);
+        mlt_assert(a.capacity == 0 && a.data == NULL);
+        mlt_assert(sum_of(a) == 0);
+        push(&a, 7);
+        mlt_assert(sum_of(a) == 7);
+        release(&a);
+    }
+
+    // Iteration.
+    {
+        arri empty = {};
+        mlt_assert(begin(empty) == end(empty));
+        arri reserved = {};
+        reserve(&reserved, 10);
+        mlt_assert(begin(reserved) == end(reserved) && sum_of(reserved) == 0);
+        push(&reserved, 3);
+        push(&reserved, 4);
+        mlt_assert(end(reserved) - begin(reserved) == 2 && sum_of(reserved) == 7);
+        release(&reserved);
+    }
+
+    // Arena arrays grow in the arena, and go away with it.
+    {
+        Arena root = arena_init(1024*1024);
+        Arena frame = arena_push(&root, 64*1024);
+        arri a = arena_array<int>(&frame, 4);
+        for ( int i = 0; i < 10000; ++i ) {
+            push(&a, i);
+        }
+        append_range(&a, a.data, 10);
+        mlt_assert(a.count == 10010 && a.data[10009] == 9);
+        mlt_assert(sum_of(a) == (i64)9999 * 10000 / 2 + 45);
+        shrink_to_fit(&a);
+        release(&a);
+        mlt_assert(a.data == NULL && a.arena == &frame);
+        arena_pop(&frame);
+        arena_free(&root);
+    }
+
+    // Benchmarks.
+    {
+        i64 n = 16*1024*1024;
+        i32 chunk_size = 256;
+        int* chunk = (int*)mlt_calloc((size_t)chunk_size, sizeof(int), "DArray");
+        for ( i32 i = 0; i < chunk_size; ++i ) {
+            chunk[i] = i;
+        }
+
+        arri a = {};
+        u64 start = SDL_GetPerformanceCounter();
+        for ( i64 i = 0; i < n; ++i ) {
+            push(&a, (int)i);
+        }
+        f32 push_seconds = seconds_since(start);
+        i64 push_sum = sum_of(a);
+        release(&a);
+
+        start = SDL_GetPerformanceCounter();
+        reserve(&a, n);
+        for ( i64 i = 0; i < n; ++i ) {
+            push(&a, (int)i);
+        }
+        f32 reserved_seconds = seconds_since(start);
+        mlt_assert(a.capacity == n && sum_of(a) == push_sum);
+        release(&a);
+
+        start = SDL_GetPerformanceCounter();
+        for ( i64 i = 0; i < n; i += chunk_size ) {
+            append_range(&a, chunk, chunk_size);
+        }
+        f32 append_seconds = seconds_since(start);
+        mlt_assert(a.count == n);
+        release(&a);
+
+        Arena arena = arena_init(64*1024*1024);
+        start = SDL_GetPerformanceCounter();
+        arri b = arena_array<int>(&arena, DARRAY_DEFAULT_CAPACITY);
+        for ( i64 i = 0; i < n; ++i ) {
+            push(&b, (int)i);
+        }
+        f32 arena_seconds = seconds_since(start);
+        mlt_assert(sum_of(b) == push_sum);
+        arena_free(&arena);
+
+        milton_log("%d ints: push %.2f ns each, after reserve %.2f ns, append_range of %d %.2f ns, "
+                   "push in an arena %.2f ns\n",
+                   (int)n, push_seconds * 1e9 / n, reserved_seconds * 1e9 / n, chunk_size,
+                   append_seconds * 1e9 / n, arena_seconds * 1e9 / n);
+        mlt_free(chunk, "DArray");
+    }
+
     return 0;
 }
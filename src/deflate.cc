@@ -0,0 +1,336 @@
+// Copyright (c) 2015-2017 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+#include "deflate.h"
+
+#include "memory.h"
+#include "utils.h"
+
+#define DEFLATE_WINDOW_SIZE     (1<<15)
+#define DEFLATE_WINDOW_MASK     (DEFLATE_WINDOW_SIZE - 1)
+#define DEFLATE_HASH_SIZE       (1<<15)
+#define DEFLATE_MIN_MATCH       3
+#define DEFLATE_MAX_MATCH       258
+#define DEFLATE_MAX_STORED      0xffff
+#define ADLER_BASE              65521
+
+// How many previous positions we try for each match, for each compression level.
+static i32 g_max_chain[DEFLATE_MAX_LEVEL + 1] = {
+    0, 2, 4, 8, 16, 24, 32, 64, 128, 512,
+};
+
+static u16 g_length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static u8 g_length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+static u16 g_dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+static u8 g_dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+static u32
+reverse_bits(u32 code, i32 num_bits)
+{
+    u32 result = 0;
+    for ( i32 i = 0; i < num_bits; ++i ) {
+        result = (result << 1) | (code & 1);
+        code >>= 1;
+    }
+    return result;
+}
+
+// Fixed Huffman code for a literal/length symbol, already reversed so that it can be written
+// LSB-first. (RFC 1951, 3.2.6)
+static u32
+fixed_literal_code(i32 symbol, i32* out_num_bits)
+{
+    u32 code = 0;
+    i32 num_bits = 0;
+    if ( symbol < 144 ) {
+        code = 0x30 + symbol;
+        num_bits = 8;
+    } else if ( symbol < 256 ) {
+        code = 0x190 + (symbol - 144);
+        num_bits = 9;
+    } else if ( symbol < 280 ) {
+        code = symbol - 256;
+        num_bits = 7;
+    } else {
+        code = 0xc0 + (symbol - 280);
+        num_bits = 8;
+    }
+    *out_num_bits = num_bits;
+    return reverse_bits(code, num_bits);
+}
+
+static void
+put_bits(Deflater* d, u32 bits, i32 num_bits)
+{
+    d->bit_buffer |= (u64)bits << d->num_bits;
+    d->num_bits += num_bits;
+    while ( d->num_bits >= 8 ) {
+        mlt_assert(d->out_count < d->out_capacity);
+        d->out[d->out_count++] = (u8)(d->bit_buffer & 0xff);
+        d->bit_buffer >>= 8;
+        d->num_bits -= 8;
+    }
+}
+
+static void
+align_to_byte(Deflater* d)
+{
+    if ( d->num_bits > 0 ) {
+        put_bits(d, 0, 8 - d->num_bits);
+    }
+}
+
+// Make sure that there are at least `num_bytes` free bytes in the output buffer.
+static b32
+reserve_output(Deflater* d, size_t num_bytes)
+{
+    if ( d->out_of_memory ) {
+        return false;
+    }
+    if ( d->out_count + num_bytes > d->out_capacity ) {
+        size_t capacity = max(d->out_capacity * 2, d->out_count + num_bytes);
+        u8* out = (u8*)mlt_realloc(d->out, capacity, "Bitmap");
+        if ( out ) {
+            d->out = out;
+            d->out_capacity = capacity;
+        } else {
+            d->out_of_memory = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+put_literal(Deflater* d, u8 literal)
+{
+    i32 num_bits;
+    u32 code = fixed_literal_code(literal, &num_bits);
+    put_bits(d, code, num_bits);
+}
+
+static void
+put_match(Deflater* d, i32 length, i32 distance)
+{
+    i32 li = 28;
+    while ( g_length_base[li] > length ) { --li; }
+    i32 num_bits;
+    u32 code = fixed_literal_code(257 + li, &num_bits);
+    put_bits(d, code, num_bits);
+    put_bits(d, (u32)(length - g_length_base[li]), g_length_extra[li]);
+
+    i32 di = 29;
+    while ( g_dist_base[di] > distance ) { --di; }
+    put_bits(d, reverse_bits((u32)di, 5), 5);
+    put_bits(d, (u32)(distance - g_dist_base[di]), g_dist_extra[di]);
+}
+
+static u32
+hash3(u8* p)
+{
+    u32 v = (u32)p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16);
+    return (v * 2654435761u) >> (32 - 15);
+}
+
+void
+deflater_init(Deflater* deflater, i32 level)
+{
+    *deflater = {};
+    deflater->level = min(max(level, 0), DEFLATE_MAX_LEVEL);
+    deflater->hash_head = (i32*)mlt_calloc(DEFLATE_HASH_SIZE, sizeof(i32), "Bitmap");
+    deflater->hash_prev = (i32*)mlt_calloc(DEFLATE_WINDOW_SIZE, sizeof(i32), "Bitmap");
+    if ( !deflater->hash_head || !deflater->hash_prev ) {
+        deflater->out_of_memory = true;
+    }
+}
+
+void
+deflater_release(Deflater* deflater)
+{
+    if ( deflater->hash_head ) {
+        mlt_free(deflater->hash_head, "Bitmap");
+    }
+    if ( deflater->hash_prev ) {
+        mlt_free(deflater->hash_prev, "Bitmap");
+    }
+    if ( deflater->out ) {
+        mlt_free(deflater->out, "Bitmap");
+    }
+    *deflater = {};
+}
+
+void
+deflater_reset_output(Deflater* deflater)
+{
+    mlt_assert(deflater->num_bits == 0);
+    deflater->out_count = 0;
+}
+
+// Level 0. Stored blocks, followed by the sync flush.
+static void
+deflate_stored(Deflater* d, u8* data, size_t size)
+{
+    size_t max_blocks = size / DEFLATE_MAX_STORED + 2;
+    if ( !reserve_output(d, size + max_blocks * 5) ) {
+        return;
+    }
+    for ( ;; ) {
+        u32 block_size = (u32)min(size, (size_t)DEFLATE_MAX_STORED);
+        // BFINAL=0, BTYPE=00
+        put_bits(d, 0, 3);
+        align_to_byte(d);
+        put_bits(d, block_size, 16);
+        put_bits(d, ~block_size & 0xffff, 16);
+        if ( block_size == 0 ) {
+            // The empty block is the sync flush.
+            break;
+        }
+        memcpy(d->out + d->out_count, data, block_size);
+        d->out_count += block_size;
+        data += block_size;
+        size -= block_size;
+    }
+}
+
+void
+deflate_piece(Deflater* d, u8* data, size_t size)
+{
+    mlt_assert(size < (1u<<31));
+
+    if ( d->level == 0 ) {
+        deflate_stored(d, data, size);
+        return;
+    }
+
+    // Fixed Huffman codes take at most 9 bits per byte. Add some room for the block headers.
+    if ( !reserve_output(d, size + size / 8 + 64) ) {
+        return;
+    }
+
+    for ( i32 i = 0; i < DEFLATE_HASH_SIZE; ++i ) {
+        d->hash_head[i] = -1;
+    }
+
+    // Block header. BFINAL=0, BTYPE=01 (fixed Huffman codes)
+    put_bits(d, 1 << 1, 3);
+
+    i32 n = (i32)size;
+    i32 i = 0;
+    while ( i + DEFLATE_MIN_MATCH <= n ) {
+        u32 h = hash3(data + i);
+
+        i32 best_length = 0;
+        i32 best_distance = 0;
+        i32 max_length = min(DEFLATE_MAX_MATCH, n - i);
+        i32 chain = g_max_chain[d->level];
+        for ( i32 j = d->hash_head[h];
+              j >= 0 && i - j <= DEFLATE_WINDOW_SIZE && chain > 0;
+              j = d->hash_prev[j & DEFLATE_WINDOW_MASK], --chain ) {
+            if ( data[j + best_length] != data[i + best_length] ) {
+                continue;
+            }
+            i32 length = 0;
+            while ( length < max_length && data[j + length] == data[i + length] ) {
+                ++length;
+            }
+            if ( length > best_length ) {
+                best_length = length;
+                best_distance = i - j;
+                if ( length == max_length ) {
+                    break;
+                }
+            }
+        }
+
+        d->hash_prev[i & DEFLATE_WINDOW_MASK] = d->hash_head[h];
+        d->hash_head[h] = i;
+
+        if ( best_length >= DEFLATE_MIN_MATCH ) {
+            put_match(d, best_length, best_distance);
+            for ( i32 k = 1; k < best_length; ++k ) {
+                i32 p = i + k;
+                if ( p + DEFLATE_MIN_MATCH <= n ) {
+                    u32 hp = hash3(data + p);
+                    d->hash_prev[p & DEFLATE_WINDOW_MASK] = d->hash_head[hp];
+                    d->hash_head[hp] = p;
+                }
+            }
+            i += best_length;
+        } else {
+            put_literal(d, data[i]);
+            ++i;
+        }
+    }
+    while ( i < n ) {
+        put_literal(d, data[i++]);
+    }
+
+    // End of block.
+    put_bits(d, 0, 7);
+
+    // Sync flush: An empty stored block, which is byte-aligned.
+    put_bits(d, 0, 3);
+    align_to_byte(d);
+    put_bits(d, 0x0000, 16);
+    put_bits(d, 0xffff, 16);
+}
+
+void
+deflate_finish(Deflater* d)
+{
+    if ( !reserve_output(d, 8) ) {
+        return;
+    }
+    // Empty block with BFINAL=1, BTYPE=01
+    put_bits(d, 1 | (1 << 1), 3);
+    put_bits(d, 0, 7);
+    align_to_byte(d);
+}
+
+u32
+adler32_update(u32 adler, u8* data, size_t size)
+{
+    u32 a = adler & 0xffff;
+    u32 b = adler >> 16;
+    while ( size > 0 ) {
+        // Largest n such that 255n(n+1)/2 + (n+1)(65520) fits in 32 bits.
+        size_t chunk = min(size, (size_t)5552);
+        for ( size_t i = 0; i < chunk; ++i ) {
+            a += data[i];
+            b += a;
+        }
+        a %= ADLER_BASE;
+        b %= ADLER_BASE;
+        data += chunk;
+        size -= chunk;
+    }
+    return (b << 16) | a;
+}
+
+u32
+adler32_combine(u32 adler1, u32 adler2, size_t size2)
+{
+    // Same as zlib's adler32_combine.
+    u32 rem = (u32)(size2 % ADLER_BASE);
+    u32 sum1 = adler1 & 0xffff;
+    u32 sum2 = (u32)(((u64)rem * sum1) % ADLER_BASE);
+    sum1 += (adler2 & 0xffff) + ADLER_BASE - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + ADLER_BASE - rem;
+    if ( sum1 >= ADLER_BASE ) { sum1 -= ADLER_BASE; }
+    if ( sum1 >= ADLER_BASE ) { sum1 -= ADLER_BASE; }
+    if ( sum2 >= (ADLER_BASE << 1) ) { sum2 -= (ADLER_BASE << 1); }
+    if ( sum2 >= ADLER_BASE ) { sum2 -= ADLER_BASE; }
+    return sum1 | (sum2 << 16);
+}
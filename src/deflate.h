@@ -0,0 +1,53 @@
+// Copyright (c) 2015-2017 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+// Deflater
+//
+// - Small DEFLATE (RFC 1951) compressor used for streaming PNG exports.
+// - LZ77 with hash chains and the fixed Huffman codes.
+// - Data is compressed in independent pieces. Each piece ends with a sync flush, so its output ends
+//   on a byte boundary and can be written out as soon as it is compressed. Pieces can be compressed
+//   in parallel, with one Deflater per thread, and concatenated.
+
+#pragma once
+
+#include "common.h"
+
+#define DEFLATE_MAX_LEVEL       9
+#define DEFLATE_DEFAULT_LEVEL   6
+
+struct Deflater
+{
+    i32     level;  // 0: No compression. 1-9: Faster to smaller.
+
+    u8*     out;
+    size_t  out_count;
+    size_t  out_capacity;
+
+    u64     bit_buffer;
+    i32     num_bits;
+
+    b32     out_of_memory;
+
+    i32*    hash_head;  // Most recent position for each hash value.
+    i32*    hash_prev;  // Previous position with the same hash, indexed by position in the window.
+};
+
+void deflater_init(Deflater* deflater, i32 level = DEFLATE_DEFAULT_LEVEL);
+void deflater_release(Deflater* deflater);
+
+// Compresses `size` bytes into `out` as a non-final block, followed by a sync flush. Matches don't
+// reference data from previous calls.
+void deflate_piece(Deflater* deflater, u8* data, size_t size);
+
+// Writes an empty final block. The output is byte-aligned.
+void deflate_finish(Deflater* deflater);
+
+// Empties the output buffer, keeping its memory.
+void deflater_reset_output(Deflater* deflater);
+
+u32 adler32_update(u32 adler, u8* data, size_t size);
+
+// Adler-32 of the concatenation of two pieces, given the checksum of each one and the size of the
+// second.
+u32 adler32_combine(u32 adler1, u32 adler2, size_t size2);
@@ -0,0 +1,401 @@
+// Copyright (c) 2015-2017 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+#include "export_queue.h"
+
+#include "canvas.h"
+#include "image_writer.h"
+#include "memory.h"
+#include "platform.h"
+#include "renderer.h"
+
+#define EXPORT_QUEUE_MAX_JOBS   16
+#define EXPORT_QUEUE_MAX_BANDS  2                           // Rendered bands waiting for the encoder.
+#define EXPORT_QUEUE_RING_SIZE  (EXPORT_QUEUE_MAX_BANDS + 1)  // Room for the end of a job.
+#define EXPORT_STEP_SECONDS     0.008f                      // Time spent rendering tiles each frame.
+
+struct ExportQueue;
+
+struct ExportJob
+{
+    ExportQueue* queue;
+
+    PATH_CHAR   fname[MAX_PATH];
+    CanvasView  view;
+    i32         scale;
+    i32         x;
+    i32         y;
+    i32         w;
+    i32         h;
+    f32         background_alpha;
+    i32         png_level;
+
+    ExportRender*   render;
+    ImageWriter*    writer;
+
+    // Protected by the queue mutex.
+    ExportJobState  state;
+    b32             cancel;
+    b32             failed;
+    i32             rows_written;
+};
+
+// A band of rows for the encoder thread. `rows` is NULL when the job has no more rows.
+struct ExportBand
+{
+    ExportJob*  job;
+    u8*         rows;
+    i32         num_rows;
+};
+
+struct ExportQueue
+{
+    ExportJob*  jobs[EXPORT_QUEUE_MAX_JOBS];
+    i32         num_jobs;
+
+    // Protected by mutex
+    ExportBand  bands[EXPORT_QUEUE_RING_SIZE];
+    i32         band_head;
+    i32         band_count;
+    b32         quit;
+
+    SDL_mutex*  mutex;
+    SDL_cond*   cond;  // Signaled when a band is added or removed.
+    SDL_Thread* thread;
+};
+
+static int
+export_encoder_thread(void* data)
+{
+    ExportQueue* queue = (ExportQueue*)data;
+
+    SDL_LockMutex(queue->mutex);
+    for ( ;; ) {
+        while ( queue->band_count == 0 && !queue->quit ) {
+            SDL_CondWait(queue->cond, queue->mutex);
+        }
+        if ( queue->band_count == 0 ) {
+            break;
+        }
+        ExportBand band = queue->bands[queue->band_head];
+        ExportJob* job = band.job;
+        b32 skip = job->cancel || job->failed;
+        SDL_UnlockMutex(queue->mutex);
+
+        if ( band.rows ) {
+            b32 ok = true;
+            if ( !skip ) {
+                ok = image_writer_rows(job->writer, band.rows, band.num_rows);
+            }
+            mlt_free(band.rows, "Bitmap");
+
+            SDL_LockMutex(queue->mutex);
+            if ( !ok ) {
+                job->failed = true;
+            }
+            job->rows_written += band.num_rows;
+        }
+        else {
+            b32 ok = image_writer_end(job->writer);
+            job->writer = NULL;
+
+            SDL_LockMutex(queue->mutex);
+            // Whatever was written of a job that didn't finish is not an image.
+            if ( job->cancel ) {
+                platform_delete_file(job->fname);
+                job->state = ExportJobState_CANCELED;
+            }
+            else if ( !ok || job->failed ) {
+                platform_delete_file(job->fname);
+                job->state = ExportJobState_FAILED;
+            }
+            else {
+                job->state = ExportJobState_DONE;
+            }
+        }
+        queue->band_head = (queue->band_head + 1) % EXPORT_QUEUE_RING_SIZE;
+        --queue->band_count;
+        SDL_CondBroadcast(queue->cond);
+    }
+    SDL_UnlockMutex(queue->mutex);
+
+    return 0;
+}
+
+// Call with the mutex locked, and check that there is room.
+static void
+push_band(ExportQueue* queue, ExportJob* job, u8* rows, i32 num_rows)
+{
+    mlt_assert(queue->band_count < EXPORT_QUEUE_RING_SIZE);
+    i32 tail = (queue->band_head + queue->band_count) % EXPORT_QUEUE_RING_SIZE;
+    queue->bands[tail] = ExportBand{ job, rows, num_rows };
+    ++queue->band_count;
+    SDL_CondBroadcast(queue->cond);
+}
+
+// Called by the renderer for each band of exported rows. The renderer reuses its buffer, so we copy
+// the rows for the encoder.
+static b32
+export_rows_to_queue(void* data, u8* rows, i32 width, i32 num_rows)
+{
+    ExportJob* job = (ExportJob*)data;
+    ExportQueue* queue = job->queue;
+
+    size_t num_bytes = (size_t)width * num_rows * 4;
+    u8* copy = (u8*)mlt_calloc(num_bytes, 1, "Bitmap");
+    if ( !copy ) {
+        return false;
+    }
+    memcpy(copy, rows, num_bytes);
+
+    SDL_LockMutex(queue->mutex);
+    push_band(queue, job, copy, num_rows);
+    SDL_UnlockMutex(queue->mutex);
+
+    return true;
+}
+
+ExportQueue*
+export_queue_init()
+{
+    ExportQueue* queue = (ExportQueue*)mlt_calloc(1, sizeof(ExportQueue), "Bitmap");
+    if ( queue ) {
+        queue->mutex = SDL_CreateMutex();
+        queue->cond = SDL_CreateCond();
+        queue->thread = SDL_CreateThread(export_encoder_thread, "Export encoder", queue);
+    }
+    return queue;
+}
+
+b32
+export_queue_add(ExportQueue* queue, PATH_CHAR* fname, CanvasView* view, i32 scale,
+                 i32 x, i32 y, i32 w, i32 h, f32 background_alpha, i32 png_level)
+{
+    if ( queue->num_jobs == EXPORT_QUEUE_MAX_JOBS ) {
+        return false;
+    }
+    ExportJob* job = (ExportJob*)mlt_calloc(1, sizeof(ExportJob), "Bitmap");
+    if ( !job ) {
+        return false;
+    }
+    job->queue = queue;
+    PATH_STRNCPY(job->fname, fname, MAX_PATH - 1);
+    job->view = *view;
+    job->scale = scale;
+    job->x = x;
+    job->y = y;
+    job->w = w;
+    job->h = h;
+    job->background_alpha = background_alpha;
+    job->png_level = png_level;
+    job->state = ExportJobState_QUEUED;
+
+    queue->jobs[queue->num_jobs++] = job;
+
+    return true;
+}
+
+static void
+set_state(ExportQueue* queue, ExportJob* job, ExportJobState state)
+{
+    SDL_LockMutex(queue->mutex);
+    job->state = state;
+    SDL_UnlockMutex(queue->mutex);
+}
+
+// Hands the end of the job to the encoder, once there is room for it.
+static void
+finish_rendering(ExportQueue* queue, ExportJob* job)
+{
+    if ( job->render ) {
+        gpu_export_end(job->render);
+        job->render = NULL;
+    }
+    SDL_LockMutex(queue->mutex);
+    if ( queue->band_count < EXPORT_QUEUE_RING_SIZE ) {
+        push_band(queue, job, NULL, 0);
+        job->state = ExportJobState_ENCODING;
+    }
+    SDL_UnlockMutex(queue->mutex);
+}
+
+b32
+export_queue_tick(ExportQueue* queue, MiltonState* milton_state)
+{
+    b32 rendered = false;
+
+    // Jobs render one at a time, in order.
+    ExportJob* job = NULL;
+    SDL_LockMutex(queue->mutex);
+    for ( i32 i = 0; i < queue->num_jobs; ++i ) {
+        ExportJobState state = queue->jobs[i]->state;
+        if ( state == ExportJobState_QUEUED || state == ExportJobState_RENDERING ) {
+            job = queue->jobs[i];
+            break;
+        }
+    }
+    SDL_UnlockMutex(queue->mutex);
+
+    // Only the main thread moves jobs out of these two states.
+    if ( job && job->state == ExportJobState_QUEUED ) {
+        job->writer = image_writer_begin(job->fname, job->w * job->scale, job->h * job->scale, job->png_level);
+        if ( job->writer ) {
+            job->render = gpu_export_begin(milton_state, &job->view, job->scale, job->x, job->y, job->w, job->h,
+                                           job->background_alpha, export_rows_to_queue, job);
+            if ( !job->render ) {
+                // Let the encoder close the file.
+                SDL_LockMutex(queue->mutex);
+                job->failed = true;
+                SDL_UnlockMutex(queue->mutex);
+            }
+            set_state(queue, job, ExportJobState_RENDERING);
+        }
+        else {
+            // image_writer_begin already told the user what went wrong.
+            set_state(queue, job, ExportJobState_FAILED);
+        }
+    }
+
+    if ( job && job->state == ExportJobState_RENDERING ) {
+        SDL_LockMutex(queue->mutex);
+        b32 stop = job->cancel || job->failed;
+        b32 has_room = queue->band_count < EXPORT_QUEUE_MAX_BANDS;
+        SDL_UnlockMutex(queue->mutex);
+
+        if ( job->render && !stop && has_room ) {
+            b32 ok = gpu_export_step(milton_state, job->render, EXPORT_STEP_SECONDS);
+            rendered = true;
+            if ( !ok ) {
+                SDL_LockMutex(queue->mutex);
+                job->failed = true;
+                SDL_UnlockMutex(queue->mutex);
+            }
+            stop = !ok || gpu_export_done(job->render);
+        }
+        if ( stop || !job->render ) {
+            finish_rendering(queue, job);
+        }
+    }
+
+    return rendered;
+}
+
+b32
+export_queue_busy(ExportQueue* queue)
+{
+    b32 busy = false;
+    SDL_LockMutex(queue->mutex);
+    for ( i32 i = 0; i < queue->num_jobs; ++i ) {
+        ExportJobState state = queue->jobs[i]->state;
+        if ( state == ExportJobState_QUEUED ||
+             state == ExportJobState_RENDERING ||
+             state == ExportJobState_ENCODING ) {
+            busy = true;
+        }
+    }
+    SDL_UnlockMutex(queue->mutex);
+    return busy;
+}
+
+i32
+export_queue_num_jobs(ExportQueue* queue)
+{
+    return queue->num_jobs;
+}
+
+ExportJobStatus
+export_queue_job_status(ExportQueue* queue, i32 job_i)
+{
+    mlt_assert(job_i >= 0 && job_i < queue->num_jobs);
+    ExportJob* job = queue->jobs[job_i];
+
+    ExportJobStatus status = {};
+    status.width = job->w * job->scale;
+    status.height = job->h * job->scale;
+
+    SDL_LockMutex(queue->mutex);
+    status.state = job->state;
+    status.progress = (f32)job->rows_written / (f32)status.height;
+    SDL_UnlockMutex(queue->mutex);
+
+    return status;
+}
+
+void
+export_queue_cancel(ExportQueue* queue, i32 job_i)
+{
+    mlt_assert(job_i >= 0 && job_i < queue->num_jobs);
+    ExportJob* job = queue->jobs[job_i];
+
+    SDL_LockMutex(queue->mutex);
+    if ( job->state == ExportJobState_QUEUED ) {
+        job->state = ExportJobState_CANCELED;
+    }
+    else if ( job->state == ExportJobState_RENDERING || job->state == ExportJobState_ENCODING ) {
+        job->cancel = true;
+    }
+    SDL_UnlockMutex(queue->mutex);
+}
+
+void
+export_queue_cancel_all(ExportQueue* queue)
+{
+    for ( i32 i = 0; i < queue->num_jobs; ++i ) {
+        export_queue_cancel(queue, i);
+    }
+}
+
+void
+export_queue_dismiss(ExportQueue* queue, i32 job_i)
+{
+    mlt_assert(job_i >= 0 && job_i < queue->num_jobs);
+    ExportJob* job = queue->jobs[job_i];
+
+    SDL_LockMutex(queue->mutex);
+    b32 finished = job->state == ExportJobState_DONE ||
+                   job->state == ExportJobState_FAILED ||
+                   job->state == ExportJobState_CANCELED;
+    SDL_UnlockMutex(queue->mutex);
+
+    if ( finished ) {
+        mlt_free(job, "Bitmap");
+        for ( i32 i = job_i; i < queue->num_jobs - 1; ++i ) {
+            queue->jobs[i] = queue->jobs[i + 1];
+        }
+        --queue->num_jobs;
+    }
+}
+
+void
+export_queue_release(ExportQueue* queue)
+{
+    export_queue_cancel_all(queue);
+
+    // Hand the jobs that were rendering to the encoder, so that it closes and deletes their files.
+    for ( i32 i = 0; i < queue->num_jobs; ++i ) {
+        ExportJob* job = queue->jobs[i];
+        while ( job->state == ExportJobState_RENDERING ) {
+            finish_rendering(queue, job);
+            if ( job->state == ExportJobState_RENDERING ) {
+                SDL_LockMutex(queue->mutex);
+                while ( queue->band_count == EXPORT_QUEUE_RING_SIZE ) {
+                    SDL_CondWait(queue->cond, queue->mutex);
+                }
+                SDL_UnlockMutex(queue->mutex);
+            }
+        }
+    }
+
+    SDL_LockMutex(queue->mutex);
+    queue->quit = true;
+    SDL_CondBroadcast(queue->cond);
+    SDL_UnlockMutex(queue->mutex);
+    SDL_WaitThread(queue->thread, NULL);
+
+    for ( i32 i = 0; i < queue->num_jobs; ++i ) {
+        mlt_free(queue->jobs[i], "Bitmap");
+    }
+    SDL_DestroyCond(queue->cond);
+    SDL_DestroyMutex(queue->mutex);
+    mlt_free(queue, "Bitmap");
+}
@@ -0,0 +1,59 @@
+// Copyright (c) 2015-2017 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+// ExportQueue
+//
+// - Exports run in the background, so that Milton keeps responding while big images are written.
+// - Tiles are rendered on the main thread, a few each frame. See gpu_export_step.
+// - Bands of rows are handed to an encoder thread, which writes them with an ImageWriter.
+// - Jobs run one after the other, in the order they were added, and can be canceled at any time.
+//   Strokes that are added while a job is rendering may show up in the image.
+
+#pragma once
+
+#include "common.h"
+
+struct CanvasView;
+struct MiltonState;
+struct ExportQueue;
+
+enum ExportJobState
+{
+    ExportJobState_QUEUED,
+    ExportJobState_RENDERING,
+    ExportJobState_ENCODING,  // All rows rendered. The encoder is finishing the file.
+    ExportJobState_DONE,
+    ExportJobState_FAILED,
+    ExportJobState_CANCELED,
+};
+
+struct ExportJobStatus
+{
+    ExportJobState state;
+    f32 progress;  // Fraction of rows written to the file.
+    i32 width;
+    i32 height;
+};
+
+ExportQueue* export_queue_init();
+// Cancels all the jobs and waits for the encoder thread to quit. Call with the GL context current.
+void export_queue_release(ExportQueue* queue);
+
+// Adds an export of the screen rectangle (x, y, w, h) of `view`, scaled up by `scale`. Returns false
+// if there are too many jobs.
+b32 export_queue_add(ExportQueue* queue, PATH_CHAR* fname, CanvasView* view, i32 scale,
+                     i32 x, i32 y, i32 w, i32 h, f32 background_alpha, i32 png_level);
+
+// Call every frame, from the main thread. Returns true if export tiles were rendered, in which case
+// the screen needs a full redraw.
+b32 export_queue_tick(ExportQueue* queue, MiltonState* milton_state);
+
+// True while any job is queued, rendering or encoding.
+b32 export_queue_busy(ExportQueue* queue);
+
+i32             export_queue_num_jobs(ExportQueue* queue);
+ExportJobStatus export_queue_job_status(ExportQueue* queue, i32 job_i);
+void            export_queue_cancel(ExportQueue* queue, i32 job_i);
+void            export_queue_cancel_all(ExportQueue* queue);
+// Removes a job that is done, failed or was canceled.
+void            export_queue_dismiss(ExportQueue* queue, i32 job_i);
@@ -29,6 +29,7 @@
     X(GLboolean, glIsProgram,             GLuint program)                                         \
     X(GLboolean, glIsShader,              GLuint shader)                                          \
     X(void,     glLinkProgram,            GLuint program)                                         \
+    X(void*,    glMapBuffer,              GLenum target, GLenum access)                           \
     X(void,     glShaderSource,           GLuint shader, GLsizei count, const GLchar* *string, const GLint *length) \
     X(void,     glUniform1f,              GLint location, GLfloat v0)                             \
     X(void,     glUniform1i,              GLint location, GLint v0)                               \
@@ -44,6 +45,7 @@
     X(void,     glUniform4iv,             GLint location, GLsizei count, const GLint *value )     \
     X(void,     glUniformMatrix3fv,       GLint location, GLsizei count, GLboolean transpose, const GLfloat* value) \
     X(void,     glUniformMatrix4fv,       GLint location, GLsizei count, GLboolean transpose, const GLfloat* value) \
+    X(GLboolean, glUnmapBuffer,           GLenum target)                                          \
     X(void,     glUseProgram,             GLuint program)                                         \
     X(void,     glValidateProgram,        GLuint program)                                         \
     X(void,     glVertexAttribPointer,    GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const GLvoid *pointer) \
@@ -63,4 +65,8 @@
     X(void,     glTexImage2DMultisample,  GLenum target, GLsizei samples, GLint internalformat, GLsizei width, GLsizei height, GLboolean fixedsamplelocations) \
     X(void,     glDebugMessageCallback, GlDebugCallback callback, void* userparam ) \
     /* glMinSampleShadingARB gets treated separately because Milton can handle it missing. */ \
-    /*X(void,     glMinSampleShadingARB,    GLclampf value)*/
+    /*X(void,     glMinSampleShadingARB,    GLclampf value)*/ \
+    /* Same for ARB_sync. Without fences, readback waits when the pixel buffer is mapped. */ \
+    /*X(GLsync,   glFenceSync,              GLenum condition, GLbitfield flags)*/ \
+    /*X(GLenum,   glClientWaitSync,         GLsync sync, GLbitfield flags, GLuint64 timeout)*/ \
+    /*X(void,     glDeleteSync,             GLsync sync)*/
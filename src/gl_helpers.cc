@@ -23,6 +23,11 @@ GL_DEBUG_CALLBACK(milton_gl_debug_callback)
 
     // Declaring glMinSampleShadingARB because we have a different path for loading it.
     typedef void glMinSampleShadingARBProc(GLclampf value); glMinSampleShadingARBProc* glMinSampleShadingARB;
+
+    // ARB_sync is optional too.
+    typedef GLsync WINAPI glFenceSyncProc(GLenum condition, GLbitfield flags); glFenceSyncProc* glFenceSync;
+    typedef GLenum WINAPI glClientWaitSyncProc(GLsync sync, GLbitfield flags, GLuint64 timeout); glClientWaitSyncProc* glClientWaitSync;
+    typedef void WINAPI glDeleteSyncProc(GLsync sync); glDeleteSyncProc* glDeleteSync;
 #endif  //_WIN32
 
 
@@ -157,6 +162,9 @@ load ()
     GL_FUNCTIONS
 #undef X
     GETADDRESS(glMinSampleShadingARB, /*Not fatal on fail*/false)
+    GETADDRESS(glFenceSync, /*Not fatal on fail*/false)
+    GETADDRESS(glClientWaitSync, /*Not fatal on fail*/false)
+    GETADDRESS(glDeleteSync, /*Not fatal on fail*/false)
 
     bool ok = true;
     // Extension checking.
@@ -167,6 +175,10 @@ load ()
         for ( i64 extension_i = 0; extension_i < num_extensions; ++extension_i ) {
             char* extension_string = (char*)glGetStringi(GL_EXTENSIONS, (GLuint)extension_i);
 
+            if ( strcmp(extension_string, "GL_ARB_sync") == 0 ) {
+                gl::set_flags(GLHelperFlags_SYNC);
+            }
+
             #if MULTISAMPLING_ENABLED
                 if ( strcmp(extension_string, "GL_ARB_sample_shading") == 0 ) {
                     gl::set_flags(GLHelperFlags_SAMPLE_SHADING);
@@ -192,6 +204,9 @@ load ()
                 if ( len < MAX_EXTENSION_LEN ) {
                     memcpy((void*)ext, (void*)begin, len);
                     ext[len]='\0';
+                    if ( strcmp(ext, "GL_ARB_sync") == 0 ) {
+                        gl::set_flags(GLHelperFlags_SYNC);
+                    }
                     #if MULTISAMPLING_ENABLED
                         if ( strcmp(ext, "GL_ARB_sample_shading") == 0 ) {
                             gl::set_flags(GLHelperFlags_SAMPLE_SHADING);
@@ -214,6 +229,12 @@ load ()
     if ( !check_flags(GLHelperFlags_SAMPLE_SHADING) ) {
         glMinSampleShadingARB = NULL;
     }
+    if ( !check_flags(GLHelperFlags_SYNC) || !glFenceSync || !glClientWaitSync || !glDeleteSync ) {
+        g_gl_helper_flags &= ~GLHelperFlags_SYNC;
+        glFenceSync = NULL;
+        glClientWaitSync = NULL;
+        glDeleteSync = NULL;
+    }
 #pragma warning(pop)
 #undef GETADDRESS
 #endif
@@ -25,6 +25,11 @@ GL_DEBUG_CALLBACK(milton_gl_debug_callback);
 
     // Declaring glMinSampleShadingARB because we have a different path for loading it.
     typedef void glMinSampleShadingARBProc (GLclampf value); extern glMinSampleShadingARBProc* glMinSampleShadingARB;
+
+    // ARB_sync is optional too.
+    typedef GLsync WINAPI glFenceSyncProc(GLenum condition, GLbitfield flags); extern glFenceSyncProc* glFenceSync;
+    typedef GLenum WINAPI glClientWaitSyncProc(GLsync sync, GLbitfield flags, GLuint64 timeout); extern glClientWaitSyncProc* glClientWaitSync;
+    typedef void WINAPI glDeleteSyncProc(GLsync sync); extern glDeleteSyncProc* glDeleteSync;
 #endif  //_WIN32
 
 
@@ -32,6 +37,7 @@ enum GLHelperFlags
 {
     GLHelperFlags_SAMPLE_SHADING        = 1<<0,
     GLHelperFlags_TEXTURE_MULTISAMPLE   = 1<<1,
+    GLHelperFlags_SYNC                  = 1<<2,
 };
 
 namespace gl {
@@ -5,7 +5,10 @@
 #include "gui.h"
 
 #include "localization.h"
+#include "cold_strokes.h"
 #include "color.h"
+#include "deflate.h"
+#include "export_queue.h"
 #include "renderer.h"
 #include "milton.h"
 #include "persist.h"
@@ -269,6 +272,9 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform_state,  MiltonStat
             if ( ImGui::MenuItem(LOC(toggle_gui_visibility)) ) {
                 gui_toggle_visibility(milton_state);
             }
+            if ( ImGui::MenuItem("Toggle Memory Usage [F3]") ) {
+                milton_state->memory_window_visible = !milton_state->memory_window_visible;
+            }
 #if MILTON_ENABLE_PROFILING
             if ( ImGui::MenuItem("Toggle Debug Data [BACKQUOTE]") ) {
                 milton_state->viz_window_visible = !milton_state->viz_window_visible;
@@ -618,7 +624,7 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform_state,  MiltonStat
         b32 reset = false;
 
         ImGui::SetNextWindowPos(ImVec2(100, 30), ImGuiSetCond_FirstUseEver);
-        ImGui::SetNextWindowSize({ui_scale*350, ui_scale*235}, ImGuiSetCond_FirstUseEver);  // We don't want to set it *every* time, the user might have preferences
+        ImGui::SetNextWindowSize({ui_scale*350, ui_scale*260}, ImGuiSetCond_FirstUseEver);  // We don't want to set it *every* time, the user might have preferences
 
         // Export window
         if ( ImGui::Begin(LOC(export_DOTS), &opened, ImGuiWindowFlags_NoCollapse) ) {
@@ -638,11 +644,10 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform_state,  MiltonStat
                 if ( exporter->scale <= 0 ) {
                     exporter->scale = 1;
                 }
-                float viewport_limits[2] = {};
-                gpu_get_viewport_limits(milton_state->render_data, viewport_limits);
-
-                while ( exporter->scale*raster_w > viewport_limits[0]
-                        || exporter->scale*raster_h > viewport_limits[1] ) {
+                // Exports are rendered in tiles, so the GPU viewport does not limit the size of the image.
+                while ( exporter->scale > 1
+                        && ((i64)exporter->scale*raster_w > EXPORT_MAX_DIMENSION
+                            || (i64)exporter->scale*raster_h > EXPORT_MAX_DIMENSION) ) {
                     --exporter->scale;
                 }
                 i32 max_scale = milton_state->view->scale / 2;
@@ -657,25 +662,21 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform_state,  MiltonStat
                 ImGui::RadioButton("Transparent background", &radio_v, 1);
                 bool transparent_background = radio_v == 1;
 
+                static int png_level = DEFLATE_DEFAULT_LEVEL;
+                ImGui::SliderInt("PNG compression", &png_level, 0, DEFLATE_MAX_LEVEL);
+
                 if ( ImGui::Button(LOC(export_selection_to_image_DOTS)) ) {
-                    // Render to buffer
-                    int bpp = 4;  // bytes per pixel
-                    i32 w = raster_w * exporter->scale;
-                    i32 h = raster_h * exporter->scale;
-                    size_t size = (size_t)w * h * bpp;
-                    u8* buffer = (u8*)mlt_calloc(1, size, "Bitmap");
-                    if ( buffer ) {
-                        opened = false;
-                        gpu_render_to_buffer(milton_state, buffer, exporter->scale,
-                                             x,y, raster_w, raster_h, transparent_background ? 0.0f : 1.0f);
-                        //milton_render_to_buffer(milton_state, buffer, x,y, raster_w, raster_h, exporter->scale);
-                        PATH_CHAR* fname = platform_save_dialog(FileKind_IMAGE);
-                        if ( fname ) {
-                            milton_save_buffer_to_file(fname, buffer, w, h);
+                    opened = false;
+                    PATH_CHAR* fname = platform_save_dialog(FileKind_IMAGE);
+                    if ( fname ) {
+                        // Exports render every stroke.
+                        milton_load_finish(milton_state);
+                        b32 added = export_queue_add(milton_state->export_queue, fname, milton_state->view,
+                                                     exporter->scale, x, y, raster_w, raster_h,
+                                                     transparent_background ? 0.0f : 1.0f, png_level);
+                        if ( !added ) {
+                            platform_dialog("Too many exports in progress. Try again when some of them are done.", "Error");
                         }
-                        mlt_free (buffer, "Bitmap");
-                    } else {
-                        platform_dialog(LOC(MSG_memerr_did_not_write), LOC(error));
                     }
                 }
             }
@@ -695,6 +696,120 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform_state,  MiltonStat
         }
     }
 
+    // Canvas loading in the background.
+    LoadStatus load_status = {};
+    if ( milton_load_status(milton_state, &load_status) ) {
+        ImGui::SetNextWindowPos(ImVec2(100, ui_scale*100), ImGuiSetCond_FirstUseEver);
+        if ( ImGui::Begin(LOC(loading), NULL, ImGuiWindowFlags_NoCollapse | ImGuiWindowFlags_AlwaysAutoResize) ) {
+            if ( load_status.preview ) {
+                ImGui::Image((ImTextureID)(intptr_t)load_status.preview,
+                             ImVec2(ui_scale*load_status.preview_w, ui_scale*load_status.preview_h));
+            }
+            f32 width = load_status.preview ? load_status.preview_w : 150;
+            ImGui::ProgressBar(load_status.progress, ImVec2(ui_scale*width, 0));
+        } ImGui::End();
+    }
+
+    // Exports running in the background. Also drawn regardless of gui visibility.
+    ExportQueue* export_queue = milton_state->export_queue;
+    if ( export_queue && export_queue_num_jobs(export_queue) > 0 ) {
+        ImGui::SetNextWindowPos(ImVec2(100, ui_scale*300), ImGuiSetCond_FirstUseEver);
+        ImGui::SetNextWindowSize({ui_scale*350, ui_scale*150}, ImGuiSetCond_FirstUseEver);
+        if ( ImGui::Begin(LOC(exports), NULL, ImGuiWindowFlags_NoCollapse) ) {
+            for ( i32 i = 0; i < export_queue_num_jobs(export_queue); ++i ) {
+                ExportJobStatus status = export_queue_job_status(export_queue, i);
+                ImGui::PushID(i);
+                ImGui::Text("%dx%d", status.width, status.height);
+                ImGui::SameLine();
+                b32 finished = false;
+                switch ( status.state ) {
+                    case ExportJobState_QUEUED: {
+                        ImGui::Text(LOC(waiting_DOTS));
+                    } break;
+                    case ExportJobState_RENDERING:
+                    case ExportJobState_ENCODING: {
+                        ImGui::ProgressBar(status.progress, ImVec2(ui_scale*150, 0));
+                    } break;
+                    case ExportJobState_DONE: {
+                        ImGui::Text(LOC(MSG_image_exported));
+                        finished = true;
+                    } break;
+                    case ExportJobState_FAILED: {
+                        ImGui::Text(LOC(MSG_error_writing_file));
+                        finished = true;
+                    } break;
+                    case ExportJobState_CANCELED: {
+                        ImGui::Text(LOC(canceled));
+                        finished = true;
+                    } break;
+                }
+                ImGui::SameLine();
+                if ( finished ) {
+                    if ( ImGui::Button(LOC(ok)) ) {
+                        export_queue_dismiss(export_queue, i);
+                    }
+                } else {
+                    if ( ImGui::Button(LOC(cancel)) ) {
+                        export_queue_cancel(export_queue, i);
+                    }
+                }
+                ImGui::PopID();
+            }
+        } ImGui::End();
+    }
+
+    if ( milton_state->memory_window_visible ) {
+        ImGui::SetNextWindowPos(ImVec2(ui_scale*660, ui_scale*205), ImGuiSetCond_FirstUseEver);
+        ImGui::SetNextWindowSize({ui_scale*350, ui_scale*285}, ImGuiSetCond_FirstUseEver);
+        bool opened = true;
+        if ( ImGui::Begin("Memory Usage ([F3] to toggle)", &opened, ImGuiWindowFlags_NoCollapse) ) {
+            char msg[512] = {};
+            for ( i32 i = 0; i < MemoryCategory_COUNT; ++i ) {
+                MemoryCategoryStats stats = memory_category_stats(i);
+                if ( stats.num_calls > 0 ) {
+                    snprintf(msg, array_count(msg),
+                             "%s: %d allocations, %.1f KB, peak %.1f KB\n",
+                             memory_category_name(i), (int)stats.num_allocations,
+                             stats.bytes / 1024.0, stats.peak_bytes / 1024.0);
+                    ImGui::Text(msg);
+                }
+            }
+            CanvasState* canvas = milton_state->canvas;
+            Arena* arenas[] = { &canvas->arena, &milton_state->root_arena };
+            char* arena_names[] = { "Canvas arena", "Root arena" };
+            for ( i32 i = 0; i < array_count(arenas); ++i ) {
+                ArenaStats stats = arena_stats(arenas[i]);
+                snprintf(msg, array_count(msg),
+                         "%s: %d blocks, %.1f KB used, %.1f KB free\n",
+                         arena_names[i], (int)stats.num_blocks, stats.used_bytes / 1024.0,
+                         (stats.wasted_bytes + stats.free_bytes) / 1024.0);
+                ImGui::Text(msg);
+            }
+            snprintf(msg, array_count(msg),
+                     "Stroke points: %.1f KB\n", stroke_pool_used_bytes(&canvas->stroke_pool) / 1024.0);
+            ImGui::Text(msg);
+            snprintf(msg, array_count(msg),
+                     "Stroke graveyard: %d strokes, %.1f KB\n",
+                     (int)canvas->stroke_graveyard.count,
+                     canvas->stroke_graveyard.capacity * sizeof(Stroke) / 1024.0);
+            ImGui::Text(msg);
+            snprintf(msg, array_count(msg),
+                     "Canvas waste: %.1f KB\n", milton_canvas_waste(canvas) / 1024.0);
+            ImGui::Text(msg);
+            if ( ImGui::Button("Dump to MiltonMemory.json") ) {
+                milton_dump_memory_stats(milton_state);
+            }
+            ImGui::SameLine();
+            // Compacted in the update, where nothing is holding on to strokes or layers.
+            if ( ImGui::Button("Compact canvas") ) {
+                milton_state->flags |= MiltonStateFlags_REQUEST_COMPACTION;
+            }
+        } ImGui::End();
+        if ( !opened ) {
+            milton_state->memory_window_visible = false;
+        }
+    }
+
 #if MILTON_ENABLE_PROFILING
     ImGui::SetNextWindowPos(ImVec2(ui_scale*300, ui_scale*205), ImGuiSetCond_FirstUseEver);
     ImGui::SetNextWindowSize({ui_scale*350, ui_scale*285}, ImGuiSetCond_FirstUseEver);  // We don't want to set it *every* time, the user might have preferences
@@ -743,6 +858,72 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform_state,  MiltonStat
                      gpu_get_num_clipped_strokes(milton_state->canvas->root_layer));
             ImGui::Text(msg);
 
+            {
+                StrokePool* pool = &milton_state->canvas->stroke_pool;
+                size_t used_bytes = 0;
+                size_t free_bytes = 0;
+                for ( i32 ci = 0; ci < STROKE_POOL_NUM_CLASSES; ++ci ) {
+                    size_t block_size = stroke_pool_block_size(ci);
+                    used_bytes += block_size * (size_t)pool->classes[ci].num_used;
+                    free_bytes += block_size * (size_t)pool->classes[ci].num_free;
+                }
+                snprintf(msg, array_count(msg),
+                         "Stroke points: %.1f KB in use, %.1f KB free\n",
+                         used_bytes / 1024.0, free_bytes / 1024.0);
+                ImGui::Text(msg);
+                for ( i32 ci = 0; ci < STROKE_POOL_NUM_CLASSES; ++ci ) {
+                    StrokePoolClass* c = &pool->classes[ci];
+                    if ( c->num_used > 0 || c->num_free > 0 ) {
+                        snprintf(msg, array_count(msg),
+                                 "    %d bytes: %d in use, %d free\n",
+                                 (int)stroke_pool_block_size(ci), (int)c->num_used, (int)c->num_free);
+                        ImGui::Text(msg);
+                    }
+                }
+            }
+
+            {
+                ColdStrokesStats stats = cold_strokes_stats(milton_state->cold_strokes, milton_state);
+                snprintf(msg, array_count(msg),
+                         "Packed strokes: %d, %.1f KB, %.1f%% of %.1f KB unpacked\n",
+                         (int)stats.num_packed, stats.packed_bytes / 1024.0,
+                         stats.packed_from_bytes ? 100.0 * stats.packed_bytes / stats.packed_from_bytes : 0.0,
+                         stats.packed_from_bytes / 1024.0);
+                ImGui::Text(msg);
+                snprintf(msg, array_count(msg),
+                         "    %d batches, last one %f ms\n",
+                         (int)stats.num_batches, stats.batch_ms);
+                ImGui::Text(msg);
+                GpuUnpackStats unpack = gpu_get_unpack_stats(milton_state->render_data);
+                snprintf(msg, array_count(msg),
+                         "    Unpacked %d strokes, %d from the file, in %f ms, at most %f ms in one frame\n",
+                         (int)unpack.num_strokes, (int)unpack.num_paged, unpack.total_ms, unpack.max_clip_ms);
+                ImGui::Text(msg);
+                if ( milton_state->cold_strokes ) {
+                    int budget_mb = (int)(stats.budget / (1024*1024));
+                    if ( ImGui::SliderInt("Unpacked budget (MB)", &budget_mb, 0, 4096) ) {
+                        cold_strokes_set_budget(milton_state->cold_strokes, (size_t)budget_mb * 1024*1024);
+                    }
+                }
+                snprintf(msg, array_count(msg),
+                         "Paged strokes: %d\n", (int)milton_state->canvas->stroke_pool.num_paged);
+                ImGui::Text(msg);
+                int resident_mb = (int)(milton_state->resident_budget / (1024*1024));
+                if ( ImGui::SliderInt("Load budget (MB, 0 for none)", &resident_mb, 0,
+                                      (int)(get_system_RAM() / (1024*1024))) ) {
+                    milton_state->resident_budget = (size_t)resident_mb * 1024*1024;
+                }
+            }
+
+            {
+                ArenaStats stats = arena_stats(&milton_state->canvas->arena);
+                snprintf(msg, array_count(msg),
+                         "Canvas arena: %d blocks, %.1f KB used, %.1f KB wasted, %.1f KB free\n",
+                         (int)stats.num_blocks, stats.used_bytes / 1024.0,
+                         stats.wasted_bytes / 1024.0, stats.free_bytes / 1024.0);
+                ImGui::Text(msg);
+            }
+
             float hist[] = { poll, update, raster, GL, system };
             ImGui::PlotHistogram("Graph",
                           (const float*)hist, array_count(hist));
@@ -752,6 +933,13 @@ milton_imgui_tick(MiltonInput* input, PlatformState* platform_state,  MiltonStat
                      sum);
             ImGui::Text(msg);
 
+            SaveStats save_stats = milton_save_stats(milton_state);
+            snprintf(msg, array_count(msg),
+                     "Saves: %d of %d requests. Last: %.1f KB, written in %.1f ms, %.0f ms after the first request\n",
+                     (int)save_stats.num_saves, (int)save_stats.num_requests,
+                     save_stats.num_bytes / 1024.0, save_stats.write_ms, save_stats.latency_ms);
+            ImGui::Text(msg);
+
             ImGui::Dummy({0,30});
 
             i64 stroke_count = layer::count_strokes(milton_state->canvas->root_layer);
@@ -1111,12 +1299,10 @@ picker_get_bounds(ColorPicker* picker)
 }
 
 void
-eyedropper_input(MiltonGui* gui, u32* buffer, i32 w, i32 h, v2i point)
+eyedropper_input(MiltonGui* gui, u32 pixel)
 {
-    if ( point.y > 0 && point.y <= h && point.x > 0 && point.x <= w ) {
-        v4f color = color_u32_to_v4f(buffer[point.y * w + point.x]);
-        gui_picker_from_rgb(&gui->picker, color.rgb);
-    }
+    v4f color = color_u32_to_v4f(pixel);
+    gui_picker_from_rgb(&gui->picker, color.rgb);
 }
 
 void
@@ -160,5 +160,5 @@ b32  gui_mark_color_used(MiltonGui* gui);
 void gui_deactivate(MiltonGui* gui);
 
 // Eye Dropper
-void eyedropper_input(MiltonGui* gui, u32* canvas_buffer, i32 w, i32 h, v2i point);
+void eyedropper_input(MiltonGui* gui, u32 pixel);
 
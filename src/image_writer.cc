@@ -0,0 +1,592 @@
+// Copyright (c) 2015-2017 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+#include "image_writer.h"
+
+#include "deflate.h"
+#include "localization.h"
+#include "memory.h"
+#include "platform.h"
+#include "tiny_jpeg.h"
+
+#define IMAGE_WRITER_MAX_THREADS    16
+#define PNG_MIN_PIECE_ROWS          16  // Don't split bands into pieces smaller than this.
+
+enum ImageWriterFormat
+{
+    ImageWriterFormat_PNG,
+    ImageWriterFormat_JPEG,
+};
+
+struct ImageWriter;
+
+// A piece of a band of rows, which becomes one IDAT chunk. Each piece is filtered and compressed
+// on its own thread.
+struct PngPiece
+{
+    ImageWriter* writer;
+
+    Deflater deflater;
+    u8*     filter_scratch; // One row per filter type.
+    u8*     filtered;       // Filter byte + filtered row, for each row in the piece.
+    size_t  filtered_capacity;
+
+    // Input
+    u8*     rows;
+    u8*     prev_row;       // Row above the first one.
+    i32     num_rows;
+    b32     is_first;       // The first piece of the image carries the zlib header.
+
+    // Output
+    size_t  filtered_size;
+    u32     adler;
+    u32     crc;            // CRC of the IDAT chunk.
+    b32     ok;
+
+    SDL_Thread* thread;
+    SDL_sem*    start;
+};
+
+struct ImageWriter
+{
+    FILE*   fd;
+    b32     failed;
+
+    ImageWriterFormat format;
+
+    i32     width;
+    i32     height;
+    i32     rows_written;
+
+    // PNG
+    u32     adler;
+    u8*     prev_row;       // Last row of the previous band. Starts as zeros.
+    PngPiece pieces[IMAGE_WRITER_MAX_THREADS];
+    i32     num_threads;    // The first piece is compressed by the calling thread.
+    SDL_sem* pieces_done;
+    b32     quit;
+
+    // JPEG
+    TJEStream* jpeg;
+    u8*     carry;          // Rows that don't complete a block of 8 rows.
+    i32     carry_rows;
+};
+
+// Returns false for unknown extensions.
+static b32
+format_for_fname(PATH_CHAR* fname, ImageWriterFormat* out_format)
+{
+    b32 known = false;
+
+    size_t len = PATH_STRLEN(fname);
+    PATH_CHAR* ext = fname + len;
+    while ( ext > fname && *(ext - 1) != '.' ) {
+        --ext;
+    }
+    if ( ext > fname ) {
+        PATH_CHAR lower[8] = {};
+        size_t ext_len = PATH_STRLEN(ext);
+        if ( ext_len < array_count(lower) ) {
+            for ( size_t i = 0; i < ext_len; ++i ) {
+                lower[i] = PATH_TOLOWER(ext[i]);
+            }
+            if ( !PATH_STRCMP(lower, TO_PATH_STR("png")) ) {
+                *out_format = ImageWriterFormat_PNG;
+                known = true;
+            }
+            else if ( !PATH_STRCMP(lower, TO_PATH_STR("jpg")) || !PATH_STRCMP(lower, TO_PATH_STR("jpeg")) ) {
+                *out_format = ImageWriterFormat_JPEG;
+                known = true;
+            }
+        }
+    }
+    else {
+        platform_dialog("File name missing extension!\n", "Error");
+        return false;
+    }
+
+    if ( !known ) {
+        platform_dialog("File extension not handled by Milton\n", "Info");
+    }
+    return known;
+}
+
+static void
+write_bytes(ImageWriter* writer, void* data, size_t size)
+{
+    if ( !writer->failed && size > 0 ) {
+        if ( fwrite(data, size, 1, writer->fd) != 1 ) {
+            writer->failed = true;
+        }
+    }
+}
+
+// Called by tiny_jpeg
+static void
+jpeg_write_func(void* context, void* data, int size)
+{
+    write_bytes((ImageWriter*)context, data, (size_t)size);
+}
+
+static u32 g_crc_table[256];
+
+// Called before any thread uses crc32_update.
+static void
+crc32_init_table()
+{
+    for ( u32 i = 0; i < 256; ++i ) {
+        u32 c = i;
+        for ( int k = 0; k < 8; ++k ) {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        g_crc_table[i] = c;
+    }
+}
+
+static u32
+crc32_update(u32 crc, u8* data, size_t size)
+{
+    crc = ~crc;
+    for ( size_t i = 0; i < size; ++i ) {
+        crc = g_crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void
+put_u32_be(u8* out, u32 v)
+{
+    out[0] = (u8)(v >> 24);
+    out[1] = (u8)(v >> 16);
+    out[2] = (u8)(v >> 8);
+    out[3] = (u8)(v);
+}
+
+// `prefix` goes before `data` in the chunk. It is used for the zlib header.
+static u32
+png_chunk_crc(char* type, u8* prefix, size_t prefix_size, u8* data, size_t size)
+{
+    u32 crc = crc32_update(0, (u8*)type, 4);
+    crc = crc32_update(crc, prefix, prefix_size);
+    crc = crc32_update(crc, data, size);
+    return crc;
+}
+
+static void
+png_write_chunk_with_crc(ImageWriter* writer, char* type, u8* prefix, size_t prefix_size, u8* data, size_t size,
+                         u32 crc)
+{
+    mlt_assert(prefix_size + size < (1u<<31));
+    u8 header[8];
+    put_u32_be(header, (u32)(prefix_size + size));
+    memcpy(header + 4, type, 4);
+
+    u8 footer[4];
+    put_u32_be(footer, crc);
+
+    write_bytes(writer, header, sizeof(header));
+    write_bytes(writer, prefix, prefix_size);
+    write_bytes(writer, data, size);
+    write_bytes(writer, footer, sizeof(footer));
+}
+
+static void
+png_write_chunk(ImageWriter* writer, char* type, u8* prefix, size_t prefix_size, u8* data, size_t size)
+{
+    u32 crc = png_chunk_crc(type, prefix, prefix_size, data, size);
+    png_write_chunk_with_crc(writer, type, prefix, prefix_size, data, size, crc);
+}
+
+static u8
+paeth(i32 a, i32 b, i32 c)
+{
+    i32 p = a + b - c;
+    i32 pa = MLT_ABS(p - a);
+    i32 pb = MLT_ABS(p - b);
+    i32 pc = MLT_ABS(p - c);
+    if ( pa <= pb && pa <= pc ) { return (u8)a; }
+    if ( pb <= pc ) { return (u8)b; }
+    return (u8)c;
+}
+
+// Filters `row` with each of the five PNG filter types and writes the one with the smallest sum of
+// absolute values to `out`, preceded by the filter type.
+static void
+png_filter_row(PngPiece* piece, u8* row, u8* prev, u8* out)
+{
+    i32 stride = piece->writer->width * 4;
+    const i32 bpp = 4;
+
+    i64 best_sum = -1;
+    i32 best_filter = 0;
+    for ( i32 filter = 0; filter < 5; ++filter ) {
+        u8* f = piece->filter_scratch + filter * stride;
+        i64 sum = 0;
+        for ( i32 i = 0; i < stride; ++i ) {
+            i32 a = i >= bpp ? row[i - bpp] : 0;
+            i32 b = prev[i];
+            i32 c = i >= bpp ? prev[i - bpp] : 0;
+            u8 v = row[i];
+            switch ( filter ) {
+                case 0: { f[i] = v; } break;
+                case 1: { f[i] = (u8)(v - a); } break;
+                case 2: { f[i] = (u8)(v - b); } break;
+                case 3: { f[i] = (u8)(v - ((a + b) >> 1)); } break;
+                case 4: { f[i] = (u8)(v - paeth(a, b, c)); } break;
+            }
+            sum += MLT_ABS((i8)f[i]);
+        }
+        if ( best_sum < 0 || sum < best_sum ) {
+            best_sum = sum;
+            best_filter = filter;
+        }
+    }
+    out[0] = (u8)best_filter;
+    memcpy(out + 1, piece->filter_scratch + best_filter * stride, (size_t)stride);
+}
+
+static u8 g_zlib_header[] = { 0x78, 0x01 };
+
+static void
+png_compress_piece(PngPiece* piece)
+{
+    piece->ok = false;
+
+    size_t stride = (size_t)piece->writer->width * 4;
+    size_t filtered_size = (stride + 1) * piece->num_rows;
+    if ( filtered_size > piece->filtered_capacity ) {
+        if ( piece->filtered ) {
+            mlt_free(piece->filtered, "Bitmap");
+        }
+        piece->filtered = (u8*)mlt_calloc(filtered_size, 1, "Bitmap");
+        if ( !piece->filtered ) {
+            piece->filtered_capacity = 0;
+            return;
+        }
+        piece->filtered_capacity = filtered_size;
+    }
+
+    u8* prev = piece->prev_row;
+    for ( i32 j = 0; j < piece->num_rows; ++j ) {
+        u8* row = piece->rows + j * stride;
+        png_filter_row(piece, row, prev, piece->filtered + j * (stride + 1));
+        prev = row;
+    }
+
+    Deflater* deflater = &piece->deflater;
+    deflater_reset_output(deflater);
+    deflate_piece(deflater, piece->filtered, filtered_size);
+    if ( deflater->out_of_memory ) {
+        return;
+    }
+
+    piece->filtered_size = filtered_size;
+    piece->adler = adler32_update(1, piece->filtered, filtered_size);
+    piece->crc = png_chunk_crc("IDAT", g_zlib_header, piece->is_first ? sizeof(g_zlib_header) : 0,
+                               deflater->out, deflater->out_count);
+    piece->ok = true;
+}
+
+static int  // Thread
+png_compress_thread(void* data)
+{
+    PngPiece* piece = (PngPiece*)data;
+    ImageWriter* writer = piece->writer;
+    for ( ;; ) {
+        SDL_SemWait(piece->start);
+        if ( writer->quit ) {
+            break;
+        }
+        png_compress_piece(piece);
+        SDL_SemPost(writer->pieces_done);
+    }
+    return 0;
+}
+
+static b32
+png_begin(ImageWriter* writer, i32 level)
+{
+    size_t stride = (size_t)writer->width * 4;
+    writer->adler = 1;
+    writer->prev_row = (u8*)mlt_calloc(stride, 1, "Bitmap");
+    if ( !writer->prev_row ) {
+        return false;
+    }
+
+    crc32_init_table();
+
+    writer->num_threads = min(max(SDL_GetCPUCount(), 1), IMAGE_WRITER_MAX_THREADS);
+    writer->pieces_done = SDL_CreateSemaphore(0);
+    if ( !writer->pieces_done ) {
+        return false;
+    }
+    for ( i32 i = 0; i < writer->num_threads; ++i ) {
+        PngPiece* piece = &writer->pieces[i];
+        piece->writer = writer;
+        deflater_init(&piece->deflater, level);
+        piece->filter_scratch = (u8*)mlt_calloc(5 * stride, 1, "Bitmap");
+        if ( piece->deflater.out_of_memory || !piece->filter_scratch ) {
+            return false;
+        }
+        if ( i > 0 ) {
+            piece->start = SDL_CreateSemaphore(0);
+            if ( piece->start ) {
+                piece->thread = SDL_CreateThread(png_compress_thread, "PNG compression", piece);
+            }
+            if ( !piece->thread ) {
+                // Make do with the threads that we have.
+                writer->num_threads = i;
+                break;
+            }
+        }
+    }
+
+    u8 signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    write_bytes(writer, signature, sizeof(signature));
+
+    u8 ihdr[13] = {};
+    put_u32_be(ihdr + 0, (u32)writer->width);
+    put_u32_be(ihdr + 4, (u32)writer->height);
+    ihdr[8] = 8;  // Bit depth
+    ihdr[9] = 6;  // Color type: RGBA
+    png_write_chunk(writer, "IHDR", NULL, 0, ihdr, sizeof(ihdr));
+
+    return true;
+}
+
+// Splits the band in pieces, one per thread. Pieces are written as IDAT chunks, in order, once they
+// have all been compressed.
+static b32
+png_rows(ImageWriter* writer, u8* rows, i32 num_rows)
+{
+    size_t stride = (size_t)writer->width * 4;
+
+    i32 num_pieces = min(writer->num_threads, max(1, num_rows / PNG_MIN_PIECE_ROWS));
+    for ( i32 i = 0; i < num_pieces; ++i ) {
+        PngPiece* piece = &writer->pieces[i];
+        i32 first_row = (i32)((i64)num_rows * i / num_pieces);
+        i32 end_row = (i32)((i64)num_rows * (i + 1) / num_pieces);
+        piece->rows = rows + first_row * stride;
+        piece->prev_row = first_row == 0 ? writer->prev_row : rows + (first_row - 1) * stride;
+        piece->num_rows = end_row - first_row;
+        piece->is_first = writer->rows_written == 0 && i == 0;
+    }
+
+    for ( i32 i = 1; i < num_pieces; ++i ) {
+        SDL_SemPost(writer->pieces[i].start);
+    }
+    png_compress_piece(&writer->pieces[0]);
+    for ( i32 i = 1; i < num_pieces; ++i ) {
+        SDL_SemWait(writer->pieces_done);
+    }
+
+    b32 ok = true;
+    for ( i32 i = 0; ok && i < num_pieces; ++i ) {
+        PngPiece* piece = &writer->pieces[i];
+        ok = piece->ok;
+        if ( ok ) {
+            png_write_chunk_with_crc(writer, "IDAT",
+                                     g_zlib_header, piece->is_first ? sizeof(g_zlib_header) : 0,
+                                     piece->deflater.out, piece->deflater.out_count, piece->crc);
+            writer->adler = adler32_combine(writer->adler, piece->adler, piece->filtered_size);
+        }
+    }
+
+    memcpy(writer->prev_row, rows + (num_rows - 1) * stride, stride);
+
+    return ok;
+}
+
+static b32
+png_end(ImageWriter* writer)
+{
+    Deflater* deflater = &writer->pieces[0].deflater;
+    deflater_reset_output(deflater);
+    deflate_finish(deflater);
+    if ( deflater->out_of_memory ) {
+        return false;
+    }
+    u8 adler[4];
+    put_u32_be(adler, writer->adler);
+    png_write_chunk(writer, "IDAT", NULL, 0, deflater->out, deflater->out_count);
+    // The checksum is the last thing in the zlib stream. It goes after the final block.
+    png_write_chunk(writer, "IDAT", NULL, 0, adler, sizeof(adler));
+    png_write_chunk(writer, "IEND", NULL, 0, NULL, 0);
+    return true;
+}
+
+static b32
+jpeg_begin(ImageWriter* writer)
+{
+    if ( writer->width > 0xffff || writer->height > 0xffff ) {
+        platform_dialog("JPEG images can't be larger than 65535 pixels on either side. Try PNG.", "Error");
+        return false;
+    }
+    writer->carry = (u8*)mlt_calloc((size_t)writer->width * 4 * 8, 1, "Bitmap");
+    if ( writer->carry ) {
+        writer->jpeg = tje_encode_begin(jpeg_write_func, writer, 3, writer->width, writer->height, 4);
+    }
+    return writer->jpeg != NULL;
+}
+
+// tiny_jpeg encodes blocks of 8 rows, so rows that don't complete a block wait in `carry`.
+static b32
+jpeg_rows(ImageWriter* writer, u8* rows, i32 num_rows)
+{
+    b32 ok = true;
+    size_t stride = (size_t)writer->width * 4;
+    i32 rows_received = writer->rows_written;
+    while ( ok && num_rows > 0 ) {
+        if ( writer->carry_rows == 0 ) {
+            i32 n = num_rows - (num_rows % 8);
+            if ( rows_received + num_rows == writer->height ) {
+                n = num_rows;
+            }
+            if ( n > 0 ) {
+                ok = tje_encode_rows(writer->jpeg, rows, n);
+                rows += n * stride;
+                num_rows -= n;
+                rows_received += n;
+                continue;
+            }
+        }
+        i32 n = min(8 - writer->carry_rows, num_rows);
+        memcpy(writer->carry + writer->carry_rows * stride, rows, n * stride);
+        writer->carry_rows += n;
+        rows += n * stride;
+        num_rows -= n;
+        rows_received += n;
+        if ( writer->carry_rows == 8 || rows_received == writer->height ) {
+            ok = tje_encode_rows(writer->jpeg, writer->carry, writer->carry_rows);
+            writer->carry_rows = 0;
+        }
+    }
+    return ok;
+}
+
+static void
+image_writer_free(ImageWriter* writer)
+{
+    writer->quit = true;
+    for ( i32 i = 0; i < IMAGE_WRITER_MAX_THREADS; ++i ) {
+        PngPiece* piece = &writer->pieces[i];
+        if ( piece->thread ) {
+            SDL_SemPost(piece->start);
+            SDL_WaitThread(piece->thread, NULL);
+        }
+        if ( piece->start ) {
+            SDL_DestroySemaphore(piece->start);
+        }
+        deflater_release(&piece->deflater);
+        if ( piece->filter_scratch ) {
+            mlt_free(piece->filter_scratch, "Bitmap");
+        }
+        if ( piece->filtered ) {
+            mlt_free(piece->filtered, "Bitmap");
+        }
+    }
+    if ( writer->pieces_done ) {
+        SDL_DestroySemaphore(writer->pieces_done);
+    }
+    if ( writer->prev_row ) {
+        mlt_free(writer->prev_row, "Bitmap");
+    }
+    if ( writer->carry ) {
+        mlt_free(writer->carry, "Bitmap");
+    }
+    mlt_free(writer, "Bitmap");
+}
+
+ImageWriter*
+image_writer_begin(PATH_CHAR* fname, i32 w, i32 h, i32 png_level)
+{
+    ImageWriterFormat format;
+    if ( !format_for_fname(fname, &format) ) {
+        return NULL;
+    }
+
+    ImageWriter* writer = (ImageWriter*)mlt_calloc(1, sizeof(ImageWriter), "Bitmap");
+    if ( !writer ) {
+        platform_dialog(LOC(MSG_memerr_did_not_write), LOC(error));
+        return NULL;
+    }
+    writer->format = format;
+    writer->width = w;
+    writer->height = h;
+
+    writer->fd = platform_fopen(fname, TO_PATH_STR("wb"));
+    if ( !writer->fd ) {
+        platform_dialog("Could not open file", "Error");
+        image_writer_free(writer);
+        return NULL;
+    }
+
+    b32 ok = false;
+    switch ( format ) {
+        case ImageWriterFormat_PNG: {
+            ok = png_begin(writer, png_level);
+        } break;
+        case ImageWriterFormat_JPEG: {
+            ok = jpeg_begin(writer);
+        } break;
+    }
+
+    if ( !ok || writer->failed ) {
+        if ( writer->jpeg ) {
+            tje_encode_end(writer->jpeg);
+        }
+        fclose(writer->fd);
+        platform_delete_file(fname);
+        platform_dialog(LOC(MSG_error_writing_file), LOC(error));
+        image_writer_free(writer);
+        writer = NULL;
+    }
+
+    return writer;
+}
+
+b32
+image_writer_rows(ImageWriter* writer, u8* rows, i32 num_rows)
+{
+    mlt_assert(writer->rows_written + num_rows <= writer->height);
+
+    b32 ok = !writer->failed;
+    if ( ok ) {
+        switch ( writer->format ) {
+            case ImageWriterFormat_PNG: {
+                ok = png_rows(writer, rows, num_rows);
+            } break;
+            case ImageWriterFormat_JPEG: {
+                ok = jpeg_rows(writer, rows, num_rows);
+            } break;
+        }
+        writer->rows_written += num_rows;
+    }
+    if ( !ok ) {
+        writer->failed = true;
+    }
+    return !writer->failed;
+}
+
+b32
+image_writer_end(ImageWriter* writer)
+{
+    b32 ok = !writer->failed && writer->rows_written == writer->height;
+    switch ( writer->format ) {
+        case ImageWriterFormat_PNG: {
+            if ( ok ) {
+                ok = png_end(writer);
+            }
+        } break;
+        case ImageWriterFormat_JPEG: {
+            // Always call tje_encode_end, since it frees the stream.
+            ok = tje_encode_end(writer->jpeg) && ok;
+        } break;
+    }
+    ok = ok && !writer->failed && !ferror(writer->fd);
+    ok = (fclose(writer->fd) == 0) && ok;
+
+    image_writer_free(writer);
+
+    return ok;
+}
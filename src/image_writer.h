@@ -0,0 +1,26 @@
+// Copyright (c) 2015-2017 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+// ImageWriter
+//
+// - Writes PNG and JPEG files from bands of RGBA rows, as they come off the renderer.
+// - Compressed data is written to disk after every band, so memory use does not depend on the size
+//   of the image.
+// - PNG bands are split into pieces that are compressed in parallel. See deflate.h
+
+#pragma once
+
+#include "common.h"
+#include "deflate.h"
+
+struct ImageWriter;
+
+// Creates `fname` for a w*h image. The format is chosen by the file extension. `png_level` is the
+// deflate compression level, from 0 to DEFLATE_MAX_LEVEL. Shows a dialog and returns NULL on error.
+ImageWriter* image_writer_begin(PATH_CHAR* fname, i32 w, i32 h, i32 png_level = DEFLATE_DEFAULT_LEVEL);
+
+// Writes the next `num_rows` rows of the image, from top to bottom. Returns false on error.
+b32 image_writer_rows(ImageWriter* writer, u8* rows, i32 num_rows);
+
+// Finishes and closes the file, and frees the writer.
+b32 image_writer_end(ImageWriter* writer);
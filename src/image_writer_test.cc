@@ -0,0 +1,76 @@
+// Copyright (c) 2015-2017 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+// Compares PNG export with stb_image_write against ImageWriter, and checks that the ImageWriter
+// output decodes to the same pixels.
+
+#include "test_helpers.h"
+
+static void
+count_bytes_func(void* context, void* data, int size)
+{
+    *(size_t*)context += (size_t)size;
+}
+
+int
+milton_main()
+{
+    // Something that looks like an export: Flat background with some strokes.
+    i32 w = 4096;
+    i32 h = 4096;
+    i32 band_rows = 256;
+    u32* pixels = (u32*)mlt_calloc((size_t)w * h, sizeof(u32), "Bitmap");
+    for ( i32 y = 0; y < h; ++y ) {
+        for ( i32 x = 0; x < w; ++x ) {
+            u32 color = 0xfff0f0f0;
+            i32 dx = (x % 512) - 256;
+            i32 dy = (y % 384) - 192;
+            i32 d = dx*dx + dy*dy;
+            if ( d < 100*100 && d > 90*90 ) {
+                color = 0xff000000 | (u32)(x * 31 + y * 17);
+            }
+            if ( MLT_ABS((x - 2*y) % 700) < 6 ) {
+                color = 0xff2050a0;
+            }
+            pixels[y * w + x] = color;
+        }
+    }
+
+    {
+        size_t num_bytes = 0;
+        u64 start = SDL_GetPerformanceCounter();
+        stbi_write_png_to_func(count_bytes_func, &num_bytes, w, h, 4, pixels, 0);
+        milton_log("stb_image_write: %.3fs, %d bytes\n", seconds_since(start), (int)num_bytes);
+    }
+
+    i32 levels[] = { 0, 1, DEFLATE_DEFAULT_LEVEL, DEFLATE_MAX_LEVEL };
+    for ( i32 li = 0; li < (i32)array_count(levels); ++li ) {
+        PATH_CHAR fname[] = TO_PATH_STR("image_writer_test.png");
+        u64 start = SDL_GetPerformanceCounter();
+        ImageWriter* writer = image_writer_begin(fname, w, h, levels[li]);
+        mlt_assert(writer);
+        for ( i32 y = 0; y < h; y += band_rows ) {
+            image_writer_rows(writer, (u8*)(pixels + (size_t)y * w), min(band_rows, h - y));
+        }
+        b32 ok = image_writer_end(writer);
+        mlt_assert(ok);
+        f32 seconds = seconds_since(start);
+
+        i32 rw = 0, rh = 0, rn = 0;
+        u8* result = stbi_load(fname, &rw, &rh, &rn, 4);
+        mlt_assert(result && rw == w && rh == h);
+        mlt_assert(memcmp(result, pixels, (size_t)w * h * 4) == 0);
+        stbi_image_free(result);
+
+        FILE* fd = platform_fopen(fname, TO_PATH_STR("rb"));
+        fseek(fd, 0, SEEK_END);
+        long num_bytes = ftell(fd);
+        fclose(fd);
+        milton_log("ImageWriter, level %d, %d threads: %.3fs, %ld bytes\n",
+                   levels[li], SDL_GetCPUCount(), seconds, num_bytes);
+    }
+
+    mlt_free(pixels, "Bitmap");
+
+    return 0;
+}
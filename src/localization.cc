@@ -88,6 +88,12 @@ init_localization()
         EN(TXT_disable_stroke_smoothing, "Disable Stroke Smoothing");
         EN(TXT_enable_stroke_smoothing, "Enable Stroke Smoothing");
         EN(TXT_transparent_background, "Transparent background");
+        EN(TXT_loading, "Loading");
+        EN(TXT_exports, "Exports");
+        EN(TXT_waiting_DOTS, "Waiting...");
+        EN(TXT_MSG_image_exported, "Image exported successfully!");
+        EN(TXT_MSG_error_writing_file, "There was an error writing the file.");
+        EN(TXT_canceled, "Canceled.");
     }
 
     {  // Spanish
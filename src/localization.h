@@ -68,6 +68,12 @@ enum Texts
     TXT_disable_stroke_smoothing   ,
     TXT_enable_stroke_smoothing    ,
     TXT_transparent_background     ,
+    TXT_loading                    ,
+    TXT_exports                    ,
+    TXT_waiting_DOTS               ,
+    TXT_MSG_image_exported         ,
+    TXT_MSG_error_writing_file     ,
+    TXT_canceled                   ,
 
     TXT_Count,
 };
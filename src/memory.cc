@@ -7,29 +7,243 @@
 #include "utils.h"
 #include "platform.h"
 
-u8*
-arena_alloc_bytes(Arena* arena, size_t num_bytes, int alloc_flags)
+// Allocations bigger than this fraction of the block size get a block of their own.
+#define ARENA_OWN_BLOCK_FRACTION 4
+
+// ---- Memory accounting.
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+    #define ATOMIC_ADD_I64(ptr, value)      _InterlockedExchangeAdd64((volatile long long*)(ptr), (value))
+    #define ATOMIC_LOAD_I64(ptr)            _InterlockedOr64((volatile long long*)(ptr), 0)
+    #define ATOMIC_CAS_I64(ptr, expected, desired)  (_InterlockedCompareExchange64((volatile long long*)(ptr), (desired), (expected)) == (expected))
+#else
+    #define ATOMIC_ADD_I64(ptr, value)      __atomic_fetch_add((ptr), (value), __ATOMIC_RELAXED)
+    #define ATOMIC_LOAD_I64(ptr)            __atomic_load_n((ptr), __ATOMIC_RELAXED)
+    #define ATOMIC_CAS_I64(ptr, expected, desired)  __atomic_compare_exchange_n((ptr), &(expected), (desired), true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#endif
+
+#define MEMORY_HEADER_MAGIC 0x4d4c5448  // "MLTH"
+
+// 16 bytes, so that what follows is aligned like the memory that calloc returns.
+struct MemoryHeader
+{
+    u64     size;
+    u32     category;
+    u32     magic;
+};
+
+struct ALIGN(64) MemoryCounters
+{
+    i64     num_allocations;
+    i64     bytes;
+    i64     peak_bytes;
+    i64     num_calls;
+};
+
+static MemoryCounters g_memory_counters[MemoryCategory_COUNT];
+
+static const char* g_memory_category_names[MemoryCategory_COUNT] =
+{
+    "Bitmap",
+    "DArray",
+    "Persist",
+    "Setup",
+    "Strings",
+    "Strokes",
+    "Validate",
+    "Other",
+    "Arenas",
+};
+
+// `num_allocations` and `num_calls` are added to the counters, and `bytes` to the bytes.
+static void
+memory_count(i32 category, i64 num_allocations, i64 num_calls, i64 bytes)
+{
+    MemoryCounters* c = &g_memory_counters[category];
+    if ( num_allocations ) {
+        ATOMIC_ADD_I64(&c->num_allocations, num_allocations);
+    }
+    if ( num_calls ) {
+        ATOMIC_ADD_I64(&c->num_calls, num_calls);
+    }
+    if ( bytes ) {
+        i64 total = ATOMIC_ADD_I64(&c->bytes, bytes) + bytes;
+        i64 peak = ATOMIC_LOAD_I64(&c->peak_bytes);
+        while ( total > peak && !ATOMIC_CAS_I64(&c->peak_bytes, peak, total) ) {
+            peak = ATOMIC_LOAD_I64(&c->peak_bytes);
+        }
+    }
+}
+
+i32
+memory_category(const char* name)
+{
+    i32 category = MemoryCategory_OTHER;
+    for ( i32 i = 0; i < MemoryCategory_OTHER; ++i ) {
+        // The names are literals, which are usually merged.
+        if ( name == g_memory_category_names[i] || strcmp(name, g_memory_category_names[i]) == 0 ) {
+            category = i;
+            break;
+        }
+    }
+    return category;
+}
+
+const char*
+memory_category_name(i32 category)
+{
+    mlt_assert(category >= 0 && category < MemoryCategory_COUNT);
+    return g_memory_category_names[category];
+}
+
+MemoryCategoryStats
+memory_category_stats(i32 category)
+{
+    mlt_assert(category >= 0 && category < MemoryCategory_COUNT);
+    MemoryCounters* c = &g_memory_counters[category];
+    MemoryCategoryStats stats = {};
+    stats.num_allocations = ATOMIC_LOAD_I64(&c->num_allocations);
+    stats.bytes = ATOMIC_LOAD_I64(&c->bytes);
+    stats.peak_bytes = ATOMIC_LOAD_I64(&c->peak_bytes);
+    stats.num_calls = ATOMIC_LOAD_I64(&c->num_calls);
+    return stats;
+}
+
+void
+memory_write_json(FILE* fd)
+{
+    fprintf(fd, "{");
+    for ( i32 i = 0; i < MemoryCategory_COUNT; ++i ) {
+        MemoryCategoryStats stats = memory_category_stats(i);
+        fprintf(fd, "%s\n    \"%s\": { \"allocations\": %lld, \"bytes\": %lld, \"peak_bytes\": %lld, \"calls\": %lld }",
+                i == 0 ? "" : ",", memory_category_name(i),
+                (long long)stats.num_allocations, (long long)stats.bytes,
+                (long long)stats.peak_bytes, (long long)stats.num_calls);
+    }
+    fprintf(fd, "\n}");
+}
+
+void*
+calloc_counted(size_t n, size_t sz, const char* category)
+{
+    void* result = NULL;
+    if ( sz == 0 || n <= (SIZE_MAX - sizeof(MemoryHeader)) / sz ) {
+        MemoryHeader* header = (MemoryHeader*)calloc(1, n * sz + sizeof(MemoryHeader));
+        if ( header ) {
+            header->size = n * sz;
+            header->category = (u32)memory_category(category);
+            header->magic = MEMORY_HEADER_MAGIC;
+            memory_count((i32)header->category, 1, 1, (i64)header->size);
+            result = header + 1;
+        }
+    }
+    return result;
+}
+
+void
+free_counted(void* ptr)
+{
+    MemoryHeader* header = (MemoryHeader*)ptr - 1;
+    mlt_assert(header->magic == MEMORY_HEADER_MAGIC);
+    header->magic = 0;
+    memory_count((i32)header->category, -1, 0, -(i64)header->size);
+    free(header);
+}
+
+// Stays in the category it was allocated in.
+void*
+realloc_counted(void* ptr, size_t sz, const char* category)
 {
-    size_t total = arena->count + num_bytes;
-    if ( total > arena->size ) {
+    if ( ptr == NULL ) {
+        return calloc_counted(1, sz, category);
+    }
+    void* result = NULL;
+    MemoryHeader* header = (MemoryHeader*)ptr - 1;
+    mlt_assert(header->magic == MEMORY_HEADER_MAGIC);
+    if ( sz <= SIZE_MAX - sizeof(MemoryHeader) ) {
+        i64 old_size = (i64)header->size;
+        MemoryHeader* new_header = (MemoryHeader*)realloc(header, sz + sizeof(MemoryHeader));
+        if ( new_header ) {
+            new_header->size = sz;
+            memory_count((i32)new_header->category, 0, 1, (i64)sz - old_size);
+            result = new_header + 1;
+        }
+    }
+    return result;
+}
+
+// ---- Arenas.
+
+static u8*
+arena_new_block(Arena* arena, size_t size, int platform_flags)
+{
+    u8* block = (u8*)platform_allocate(size + sizeof(ArenaFooter), platform_flags);
+    if ( block == NULL ) {
+        milton_die_gracefully("Could not allocate memory for arena.");
+    }
+    arena->num_blocks += 1;
+    arena->block_bytes += size;
+    memory_count(MemoryCategory_ARENAS, 1, 1, (i64)(size + sizeof(ArenaFooter)));
+    return block;
+}
+
+static size_t
+arena_padding(u8* ptr, size_t alignment)
+{
+    mlt_assert(alignment > 0 && (alignment & (alignment - 1)) == 0 && alignment <= PLATFORM_ALLOCATION_ALIGNMENT);
+    return (size_t)(-(intptr_t)ptr) & (alignment - 1);
+}
+
+// Child arenas are popped by moving the parent's count back, so they always come from the end of the
+// current block. `own_block` is false for them.
+static u8*
+arena_alloc_bytes_(Arena* arena, size_t num_bytes, size_t alignment, b32 own_block)
+{
+    size_t padding = arena_padding(arena->ptr + arena->count, alignment);
+    if ( arena->count + padding + num_bytes > arena->size ) {
+        if ( own_block && arena->min_block_size > 0 &&
+             num_bytes > arena->min_block_size / ARENA_OWN_BLOCK_FRACTION ) {
+            // Goes after the current block in the list. Blocks are aligned, so no padding. Huge pages
+            // would round it up to whole huge pages, and the rounding is neither used nor counted.
+            u8* block = arena_new_block(arena, num_bytes,
+                                        arena->platform_flags & ~PlatformAllocate_HUGE_PAGES);
+            ArenaFooter* current = (ArenaFooter*)(arena->ptr + arena->size);
+            ArenaFooter* footer = (ArenaFooter*)(block + num_bytes);
+            footer->previous_block = current->previous_block;
+            footer->previous_size = current->previous_size;
+            current->previous_block = block;
+            current->previous_size = num_bytes;
+            return block;
+        }
         size_t new_size = max(num_bytes, arena->min_block_size);
         ArenaFooter arena_footer = {};
         arena_footer.previous_block = arena->ptr;
         arena_footer.previous_size = arena->size;
-        arena->ptr = (u8*)platform_allocate(new_size + sizeof(ArenaFooter));
+        arena->wasted_bytes += arena->size - arena->count;
+        arena->ptr = arena_new_block(arena, new_size, arena->platform_flags);
         arena->size = new_size;
         arena->count = 0;
         *(ArenaFooter*)(arena->ptr + arena->size) = arena_footer;
+        padding = 0;
     }
-    u8* result = arena->ptr + arena->count;
-    arena->count += num_bytes;
+    arena->wasted_bytes += padding;
+    u8* result = arena->ptr + arena->count + padding;
+    arena->count += padding + num_bytes;
     return result;
 }
 
+u8*
+arena_alloc_bytes(Arena* arena, size_t num_bytes, int alloc_flags, size_t alignment)
+{
+    return arena_alloc_bytes_(arena, num_bytes, alignment, /*own_block*/true);
+}
+
 Arena
-arena_init(size_t min_block_size, void* base)
+arena_init(size_t min_block_size, void* base, int platform_flags)
 {
     Arena arena = {};
+    arena.platform_flags = platform_flags;
     if ( min_block_size ) {
         arena.min_block_size = min_block_size;
     }
@@ -40,25 +254,19 @@ arena_init(size_t min_block_size, void* base)
         arena.ptr = (u8*)base;
     }
     else {
-        arena.ptr = (u8*)platform_allocate(arena.min_block_size + sizeof(ArenaFooter));
-    }
-
-    if ( arena.ptr ) {
-        arena.size = arena.min_block_size;
-    }
-    else {
-        milton_die_gracefully("Could not allocate memory for arena.");
+        arena.ptr = arena_new_block(&arena, arena.min_block_size, arena.platform_flags);
     }
+    arena.size = arena.min_block_size;
 
     ArenaFooter footer = {};
-    *(ArenaFooter*)(arena.ptr + sizeof(ArenaFooter)) = footer;
+    *(ArenaFooter*)(arena.ptr + arena.size) = footer;
     return arena;
 }
 
 void*
-arena_bootstrap_(size_t size, size_t obj_size, size_t offset)
+arena_bootstrap_(size_t size, size_t obj_size, size_t offset, int platform_flags)
 {
-    Arena arena = arena_init(size + obj_size);
+    Arena arena = arena_init(size + obj_size, NULL, platform_flags);
     *(Arena*)(arena.ptr + offset) = arena;
     return arena_alloc_bytes((Arena*)(arena.ptr + offset), obj_size);
 }
@@ -73,6 +281,7 @@ arena_free(Arena* arena)
         while ( data ) {
             ArenaFooter footer = *(ArenaFooter*)(data + size);
             platform_deallocate(data);
+            memory_count(MemoryCategory_ARENAS, -1, 0, -(i64)(size + sizeof(ArenaFooter)));
             // Note: If the arena was bootstrapped, it is no longer valid.
             data = footer.previous_block;
             size = footer.previous_size;
@@ -80,6 +289,18 @@ arena_free(Arena* arena)
     }
 }
 
+ArenaStats
+arena_stats(Arena* arena)
+{
+    ArenaStats stats = {};
+    stats.num_blocks = arena->num_blocks;
+    stats.block_bytes = arena->block_bytes;
+    stats.wasted_bytes = arena->wasted_bytes;
+    stats.free_bytes = arena->size - arena->count;
+    stats.used_bytes = stats.block_bytes - stats.wasted_bytes - stats.free_bytes;
+    return stats;
+}
+
 Arena
 arena_spawn(Arena* parent, size_t size)
 {
@@ -108,46 +329,54 @@ arena_push(Arena* parent, size_t in_size)
     {
         child.parent = parent;
         child.id     = parent->num_children;
-        u8* ptr = arena_alloc_bytes(parent, size + sizeof(ArenaFooter));
+        u8* ptr = arena_alloc_bytes_(parent, size + sizeof(ArenaFooter), 1, /*own_block*/false);
         parent->num_children += 1;
         child.ptr = ptr;
         child.size = size;
+        *(ArenaFooter*)(child.ptr + child.size) = {};
     }
     return child;
 }
 
-void
-arena_pop(Arena* child)
+static void
+arena_pop_(Arena* child, b32 clear)
 {
     Arena* parent = child->parent;
     mlt_assert(parent);
 
     // Assert that this child was the latest push.
     mlt_assert ((parent->num_children - 1) == child->id);
+
+    // Free the blocks that the child grew into. The first one belongs to the parent.
     ArenaFooter* footer = (ArenaFooter*)(child->ptr + child->size);
     while ( footer->previous_block ) {
+        ArenaFooter previous = *footer;
         platform_deallocate(child->ptr);
-        child->size = footer->previous_size;
-        child->ptr = footer->previous_block;
+        memory_count(MemoryCategory_ARENAS, -1, 0, -(i64)(child->size + sizeof(ArenaFooter)));
+        child->ptr = previous.previous_block;
+        child->size = previous.previous_size;
         footer = (ArenaFooter*)(child->ptr + child->size);
     }
-    parent->count -= child->size;
-    char* ptr = (char*)(parent->ptr) + parent->count;
-    memset(ptr, 0, child->count);
+    size_t num_bytes = child->size + sizeof(ArenaFooter);
+    parent->count -= num_bytes;
+    if ( clear ) {
+        memset(parent->ptr + parent->count, 0, num_bytes);
+    } else {
+        *footer = {};
+    }
     parent->num_children -= 1;
 }
 
 void
-arena_pop_noclear(Arena* child)
+arena_pop(Arena* child)
 {
-    Arena* parent = child->parent;
-    mlt_assert(parent);
-
-    // Assert that this child was the latest push.
-    mlt_assert ((parent->num_children - 1) == child->id);
+    arena_pop_(child, /*clear*/true);
+}
 
-    parent->count -= child->size;
-    parent->num_children -= 1;
+void
+arena_pop_noclear(Arena* child)
+{
+    arena_pop_(child, /*clear*/false);
 }
 
 void
@@ -241,6 +470,7 @@ void*
 calloc_with_debug(size_t n, size_t sz, char* category, char* file, i64 line)
 {
     mark_allocation(category, n*sz);
+    memory_count(memory_category(category), 1, 1, (i64)(n*sz));
 
     MemDebugHeader* header = (MemDebugHeader*) calloc(1, n*sz + sizeof(*header));
     header->size = n*sz;
@@ -259,6 +489,7 @@ void
 free_with_debug(void* ptr, char* category)
 {
     MemDebugHeader* header = (MemDebugHeader*)ptr - 1;
+    memory_count(memory_category(category), -1, 0, -(i64)header->size);
     if ( g_mem_debug_root == header ) {
         g_mem_debug_root = header->next;
     }
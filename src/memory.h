@@ -4,6 +4,7 @@
 #pragma once
 
 #include "common.h"
+#include "system_includes.h"  // FILE
 
 // TODO: out of memory handler.
 
@@ -13,11 +14,53 @@
     #define mlt_free(ptr, category) free_with_debug(ptr, category); ptr=NULL
     #define mlt_realloc(ptr, sz, category) realloc_with_debug(ptr, sz, category, __FILE__, __LINE__)
 #else
-    #define mlt_calloc(n, sz, category) calloc(n, sz)
-    #define mlt_free(ptr, category) do { if (ptr) { free(ptr); ptr = NULL; } else { mlt_assert(!"Freeing null"); } } while(0)
-    #define mlt_realloc(ptr, sz, category) realloc(ptr, sz)
+    #define mlt_calloc(n, sz, category) calloc_counted(n, sz, category)
+    #define mlt_free(ptr, category) do { if (ptr) { free_counted(ptr); ptr = NULL; } else { mlt_assert(!"Freeing null"); } } while(0)
+    #define mlt_realloc(ptr, sz, category) realloc_counted(ptr, sz, category)
 #endif
 
+// ---- Memory accounting.
+//
+// Every mlt_calloc, mlt_realloc and mlt_free is counted in its category, and so are the blocks that
+// arenas get from the platform. Counters are atomic and each category has its own cache line, so
+// allocating from any thread costs a few atomic adds. Heap allocations start with a MemoryHeader that
+// has their size and category; mlt_free uses those, not the category it is passed. Categories that
+// aren't in the list are counted as "Other".
+
+enum MemoryCategory
+{
+    MemoryCategory_BITMAP,
+    MemoryCategory_DARRAY,
+    MemoryCategory_PERSIST,
+    MemoryCategory_SETUP,
+    MemoryCategory_STRINGS,
+    MemoryCategory_STROKES,
+    MemoryCategory_VALIDATE,
+    MemoryCategory_OTHER,
+
+    MemoryCategory_ARENAS,  // Arena blocks, not heap allocations.
+
+    MemoryCategory_COUNT,
+};
+
+struct MemoryCategoryStats
+{
+    i64     num_allocations;    // Alive.
+    i64     bytes;              // Alive, without headers.
+    i64     peak_bytes;
+    i64     num_calls;          // Every allocation and reallocation so far.
+};
+
+i32                 memory_category(const char* name);
+const char*         memory_category_name(i32 category);
+MemoryCategoryStats memory_category_stats(i32 category);
+// Writes every category as a JSON object, keyed by name.
+void                memory_write_json(FILE* fd);
+
+void* calloc_counted(size_t n, size_t sz, const char* category);
+void  free_counted(void* ptr);
+void* realloc_counted(void* ptr, size_t sz, const char* category);
+
 
 struct Arena
 {
@@ -26,27 +69,47 @@ struct Arena
     size_t  count;
     size_t  min_block_size;
     u8*     ptr;
+    int     platform_flags;     // For platform_allocate, when the arena needs a new block. Not
+                                // for blocks of their own, which never get huge pages.
 
     // For pushing/popping
     Arena*  parent;
     int     id;
     int     num_children;
+
+    // Stats. See arena_stats
+    size_t  num_blocks;         // Blocks from platform_allocate.
+    size_t  block_bytes;        // Their total size.
+    size_t  wasted_bytes;       // Alignment padding, and the tails of blocks that are no longer used.
+};
+
+struct ArenaStats
+{
+    size_t  num_blocks;
+    size_t  block_bytes;
+    size_t  used_bytes;
+    size_t  wasted_bytes;
+    size_t  free_bytes;         // Left in the current block.
 };
 
 // Stored at the end of the arena.
-// If the arena expands, its memory block will point to previous memory blocks.
+// If the arena expands, its memory block will point to previous memory blocks. Allocations that
+// are too big to share a block get a block of their own, which goes right after the current one in
+// the list, so that the current block keeps filling up.
 struct ArenaFooter
 {
     u8*     previous_block;
     size_t  previous_size;
 };
 
-// Create a root arena from a memory block.
-Arena arena_init(size_t min_block_size = 0, void* base = NULL);
+// Create a root arena from a memory block. `base` needs room for min_block_size bytes followed by
+// an ArenaFooter. `platform_flags` is passed to platform_allocate.
+Arena arena_init(size_t min_block_size = 0, void* base = NULL, int platform_flags = 0);
 Arena arena_spawn(Arena* parent, size_t size);
 void  arena_reset(Arena* arena);
 void  arena_reset_noclear(Arena* arena);
 void  arena_free(Arena* arena);
+ArenaStats arena_stats(Arena* arena);
 
 // ==== Temporary arenas.
 // Usage:
@@ -57,12 +120,14 @@ Arena  arena_push(Arena* parent, size_t size = 0);
 void   arena_pop(Arena* child);
 void   arena_pop_noclear(Arena* child);
 
-#define     arena_alloc_elem_(arena, T, flags)          (T *)arena_alloc_bytes((arena), sizeof(T), flags)
-#define     arena_alloc_array_(arena, count, T, flags)  (T *)arena_alloc_bytes((arena), (count) * sizeof(T), flags)
+#define     arena_alloc_elem_(arena, T, flags)          (T *)arena_alloc_bytes((arena), sizeof(T), flags, alignof(T))
+#define     arena_alloc_array_(arena, count, T, flags)  (T *)arena_alloc_bytes((arena), (count) * sizeof(T), flags, alignof(T))
 #define     arena_alloc_elem(arena, T)                  arena_alloc_elem_(arena, T, Arena_NONE)
 #define     arena_alloc_array(arena, count, T)          arena_alloc_array_(arena, count, T, Arena_NONE)
 #define     ARENA_VALIDATE(arena)                       mlt_assert ((arena)->num_children == 0)
-#define     arena_bootstrap(Type, member, size)         (Type*)arena_bootstrap_(size, sizeof(Type), offsetof(Type, member))
+#define     arena_bootstrap(Type, member, size)         (Type*)arena_bootstrap_(size, sizeof(Type), offsetof(Type, member), 0)
+#define     arena_bootstrap_with_flags(Type, member, size, platform_flags)  \
+                                                        (Type*)arena_bootstrap_(size, sizeof(Type), offsetof(Type, member), platform_flags)
 
 enum ArenaAllocOpts
 {
@@ -71,9 +136,12 @@ enum ArenaAllocOpts
     Arena_NOFAIL = 1<<0,
 };
 
-u8* arena_alloc_bytes(Arena* arena, size_t num_bytes, int alloc_flags=Arena_NONE);
+// `alignment` is a power of two, up to PLATFORM_ALLOCATION_ALIGNMENT. Use ARENA_SIMD_ALIGNMENT for
+// arrays that are read with vector instructions.
+#define ARENA_SIMD_ALIGNMENT 32
+u8* arena_alloc_bytes(Arena* arena, size_t num_bytes, int alloc_flags=Arena_NONE, size_t alignment=1);
 
-void* arena_bootstrap_(size_t size, size_t obj_size, size_t offset);
+void* arena_bootstrap_(size_t size, size_t obj_size, size_t offset, int platform_flags);
 
 #if DEBUG_MEMORY_USAGE
     void* calloc_with_debug(size_t n, size_t sz, char* category, char* file, i64 line);
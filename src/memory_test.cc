@@ -0,0 +1,251 @@
+// Copyright (c) 2015-2017 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+// Checks arena alignment, that big allocations don't throw away the current block and that push/pop
+// gives back everything. Checks that the memory counters add up, also with allocations from several
+// threads. Prints how much of an arena is wasted, what counting costs for each allocation, and the
+// dTLB misses of a random walk over a block with and without huge pages.
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "test_helpers.h"
+
+#if defined(__linux__)
+static int
+tlb_counter_open()
+{
+    perf_event_attr attr = {};
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+static u64 g_walk_sum;
+
+// Reads one byte from random 4K pages of a block. Returns the dTLB misses, or -1 if they can't be
+// counted.
+static i64
+tlb_misses_for_walk(int platform_flags, size_t size, f32* out_seconds)
+{
+    i64 misses = -1;
+    Arena arena = arena_init(size, NULL, platform_flags);
+    u8* data = arena_alloc_bytes(&arena, size);
+    for ( size_t i = 0; i < size; i += 4096 ) {
+        data[i] = (u8)i;
+    }
+    i32 num_pages = (i32)(size / 4096);
+#if defined(__linux__)
+    int fd = tlb_counter_open();
+    if ( fd >= 0 ) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+    u64 start = SDL_GetPerformanceCounter();
+    for ( i32 i = 0; i < 4*1024*1024; ++i ) {
+        g_walk_sum += data[(size_t)random_i32(num_pages) * 4096];
+    }
+    *out_seconds = (f32)(SDL_GetPerformanceCounter() - start) / (f32)SDL_GetPerformanceFrequency();
+#if defined(__linux__)
+    if ( fd >= 0 ) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        i64 count = 0;
+        if ( read(fd, &count, sizeof(count)) == sizeof(count) ) {
+            misses = count;
+        }
+        close(fd);
+    }
+#endif
+    arena_free(&arena);
+    return misses;
+}
+
+static b32
+same_stats(MemoryCategoryStats a, MemoryCategoryStats b)
+{
+    return a.num_allocations == b.num_allocations && a.bytes == b.bytes;
+}
+
+static int
+allocating_thread(void* data)
+{
+    for ( i32 i = 0; i < 100000; ++i ) {
+        u8* ptr = (u8*)mlt_calloc(1 + (size_t)(i % 1000), 1, "Strokes");
+        ptr = (u8*)mlt_realloc(ptr, 2000, "Strokes");
+        mlt_free(ptr, "Strokes");
+    }
+    return 0;
+}
+
+int
+milton_main()
+{
+    // Memory counters.
+    {
+        MemoryCategoryStats darray = memory_category_stats(MemoryCategory_DARRAY);
+        u8* ptr = (u8*)mlt_calloc(10, 10, "DArray");
+        mlt_assert(((uintptr_t)ptr % 16) == 0);
+        MemoryCategoryStats now = memory_category_stats(MemoryCategory_DARRAY);
+        mlt_assert(now.num_allocations == darray.num_allocations + 1 && now.bytes == darray.bytes + 100);
+        ptr = (u8*)mlt_realloc(ptr, 1000, "DArray");
+        now = memory_category_stats(MemoryCategory_DARRAY);
+        mlt_assert(now.num_allocations == darray.num_allocations + 1 && now.bytes == darray.bytes + 1000);
+        mlt_assert(now.num_calls == darray.num_calls + 2 && now.peak_bytes >= now.bytes);
+        // Freed under the category it was allocated with.
+        mlt_free(ptr, "Strings");
+        mlt_assert(same_stats(memory_category_stats(MemoryCategory_DARRAY), darray));
+
+        MemoryCategoryStats other = memory_category_stats(MemoryCategory_OTHER);
+        ptr = (u8*)mlt_realloc(NULL, 10, "Not a category");
+        mlt_assert(memory_category_stats(MemoryCategory_OTHER).bytes == other.bytes + 10);
+        mlt_free(ptr, "Not a category");
+        mlt_assert(same_stats(memory_category_stats(MemoryCategory_OTHER), other));
+
+        MemoryCategoryStats arenas = memory_category_stats(MemoryCategory_ARENAS);
+        Arena arena = arena_init(4096);
+        arena_alloc_bytes(&arena, 2000);
+        arena_alloc_bytes(&arena, 3000);  // Its own block.
+        Arena child = arena_push(&arena, 64);
+        arena_alloc_bytes(&child, 1000);
+        now = memory_category_stats(MemoryCategory_ARENAS);
+        mlt_assert(now.num_allocations == arenas.num_allocations + 3);
+        mlt_assert(now.bytes == arenas.bytes + (i64)(4096 + 3000 + 1000 + 3*sizeof(ArenaFooter)));
+        arena_pop(&child);
+        arena_free(&arena);
+        mlt_assert(same_stats(memory_category_stats(MemoryCategory_ARENAS), arenas));
+
+        MemoryCategoryStats strokes = memory_category_stats(MemoryCategory_STROKES);
+        SDL_Thread* threads[4] = {};
+        u64 start = SDL_GetPerformanceCounter();
+        for ( i32 i = 0; i < array_count(threads); ++i ) {
+            threads[i] = SDL_CreateThread(allocating_thread, "Allocating", NULL);
+        }
+        for ( i32 i = 0; i < array_count(threads); ++i ) {
+            SDL_WaitThread(threads[i], NULL);
+        }
+        f32 seconds = (f32)(SDL_GetPerformanceCounter() - start) / (f32)SDL_GetPerformanceFrequency();
+        now = memory_category_stats(MemoryCategory_STROKES);
+        mlt_assert(same_stats(now, strokes));
+        mlt_assert(now.num_calls == strokes.num_calls + 4 * 2 * 100000);
+
+        // Without counting.
+        start = SDL_GetPerformanceCounter();
+        for ( i32 i = 0; i < 100000; ++i ) {
+            u8* p = (u8*)calloc(1 + (size_t)(i % 1000), 1);
+            p = (u8*)realloc(p, 2000);
+            free(p);
+        }
+        f32 plain_seconds = (f32)(SDL_GetPerformanceCounter() - start) / (f32)SDL_GetPerformanceFrequency();
+        start = SDL_GetPerformanceCounter();
+        allocating_thread(NULL);
+        f32 counted_seconds = (f32)(SDL_GetPerformanceCounter() - start) / (f32)SDL_GetPerformanceFrequency();
+        milton_log("Calloc, realloc and free: %.1f ns counted, %.1f ns not counted. %f s on 4 threads\n",
+                   counted_seconds * 1e9 / 100000, plain_seconds * 1e9 / 100000, seconds);
+
+        FILE* fd = tmpfile();
+        mlt_assert(fd);
+        memory_write_json(fd);
+        char json[4096] = {};
+        rewind(fd);
+        fread(json, 1, sizeof(json) - 1, fd);
+        fclose(fd);
+        mlt_assert(json[0] == '{' && strstr(json, "\"Arenas\": { \"allocations\": ") != NULL);
+    }
+
+
+    // Alignment.
+    {
+        Arena arena = arena_init(4096);
+        for ( i32 i = 0; i < 1000; ++i ) {
+            size_t alignment = (size_t)1 << random_i32(7);
+            u8* ptr = arena_alloc_bytes(&arena, 1 + (size_t)random_i32(100), Arena_NONE, alignment);
+            mlt_assert(((uintptr_t)ptr & (alignment - 1)) == 0);
+        }
+        v2l* points = arena_alloc_array(&arena, 3, v2l);
+        mlt_assert(((uintptr_t)points % alignof(v2l)) == 0);
+        arena_free(&arena);
+    }
+
+    // A big allocation gets its own block, and the current one keeps filling up.
+    {
+        Arena arena = arena_init(4096);
+        u8* a = arena_alloc_bytes(&arena, 100);
+        u8* big = arena_alloc_bytes(&arena, 4000);
+        u8* b = arena_alloc_bytes(&arena, 100);
+        mlt_assert(b == a + 100);
+        mlt_assert(big < a || big >= a + 4096);
+        memset(big, 0xff, 4000);
+        ArenaStats stats = arena_stats(&arena);
+        mlt_assert(stats.num_blocks == 2);
+        mlt_assert(stats.used_bytes == 4200);
+        mlt_assert(stats.wasted_bytes == 0);
+        arena_free(&arena);
+    }
+
+    // Push and pop give back everything, also when the child grows new blocks.
+    {
+        Arena arena = arena_init(1024*1024);
+        arena_alloc_bytes(&arena, 10);
+        size_t count = arena.count;
+        for ( i32 i = 0; i < 1000; ++i ) {
+            Arena child = arena_push(&arena, 4096);
+            for ( i32 j = 0; j < i % 10; ++j ) {
+                arena_alloc_bytes(&child, 1000);
+            }
+            if ( i % 2 ) {
+                arena_pop(&child);
+            } else {
+                arena_pop_noclear(&child);
+            }
+            mlt_assert(arena.count == count);
+        }
+        mlt_assert(arena_stats(&arena).num_blocks == 1);
+        arena_free(&arena);
+    }
+
+    // Waste, with allocations like the ones of the canvas.
+    {
+        Arena arena = arena_init(2*1024*1024);
+        for ( i32 i = 0; i < 100000; ++i ) {
+            i32 num_points = 2 << random_i32(11);
+            arena_alloc_bytes(&arena, (size_t)num_points * (sizeof(v2l) + sizeof(f32)), Arena_NONE,
+                              ARENA_SIMD_ALIGNMENT);
+        }
+        ArenaStats stats = arena_stats(&arena);
+        milton_log("Arena: %d blocks, %.1f MB used, %.1f KB wasted (%.3f%%)\n",
+                   (int)stats.num_blocks, stats.used_bytes / (1024.0 * 1024.0),
+                   stats.wasted_bytes / 1024.0,
+                   100.0 * stats.wasted_bytes / stats.block_bytes);
+        arena_free(&arena);
+    }
+
+    // TLB misses.
+    {
+        size_t size = 256*1024*1024;
+        f32 small_seconds = 0;
+        f32 huge_seconds = 0;
+        i64 small_pages = tlb_misses_for_walk(PlatformAllocate_NONE, size, &small_seconds);
+        i64 huge_pages = tlb_misses_for_walk(PlatformAllocate_HUGE_PAGES, size, &huge_seconds);
+        milton_log("4M random reads: %f s with small pages, %f s with huge pages\n",
+                   small_seconds, huge_seconds);
+        if ( small_pages >= 0 && huge_pages >= 0 ) {
+            milton_log("dTLB misses: %lld with small pages, %lld with huge pages\n",
+                       (long long)small_pages, (long long)huge_pages);
+        } else {
+            milton_log("dTLB misses: not available\n");
+        }
+    }
+
+    return 0;
+}
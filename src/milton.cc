@@ -6,6 +6,8 @@
 #include "common.h"
 #include "color.h"
 #include "canvas.h"
+#include "cold_strokes.h"
+#include "export_queue.h"
 #include "gui.h"
 #include "renderer.h"
 #include "localization.h"
@@ -112,6 +114,7 @@ clear_stroke_redo(MiltonState* milton_state)
 {
     while ( milton_state->canvas->stroke_graveyard.count > 0 ) {
         Stroke s = pop(&milton_state->canvas->stroke_graveyard);
+        milton_discard_stroke(milton_state, &s);
     }
     for ( i64 i = 0; i < milton_state->canvas->redo_stack.count; ++i ) {
         HistoryElement h = milton_state->canvas->redo_stack.data[i];
@@ -283,12 +286,17 @@ milton_set_canvas_file_(MiltonState* milton_state, PATH_CHAR* fname, b32 is_defa
         milton_state->flags &= ~MiltonStateFlags_DEFAULT_CANVAS;
     }
 
+    // Changes that are waiting to be saved go to the old file.
+    milton_save_flush(milton_state);
+
     u64 len = PATH_STRLEN(fname);
     if ( len > MAX_PATH ) {
         milton_log("milton_set_canvas_file: fname was too long %lu\n", len);
         fname = TO_PATH_STR("MiltonPersist.mlt");
     }
     milton_state->mlt_file_path = fname;
+    // The journal belongs to the old file. The next change will save the whole canvas.
+    milton_journal_close(milton_state);
 
     if ( !is_default ) {
         milton_set_last_canvas_fname(fname);
@@ -384,15 +392,13 @@ milton_init(MiltonState* milton_state, i32 width, i32 height, f32 ui_scale, PATH
 {
     init_localization();
 
-    milton_state->canvas = arena_bootstrap(CanvasState, arena, 1024*1024);
+    milton_state->canvas = arena_bootstrap_with_flags(CanvasState, arena, CANVAS_ARENA_BLOCK_SIZE,
+                                                      PlatformAllocate_HUGE_PAGES);
+    milton_state->canvas->stroke_pool.arena = &milton_state->canvas->arena;
     milton_state->working_stroke.points    = arena_alloc_array(&milton_state->root_arena, STROKE_MAX_POINTS, v2l);
     milton_state->working_stroke.pressures = arena_alloc_array(&milton_state->root_arena, STROKE_MAX_POINTS, f32);
 
-#if MILTON_SAVE_ASYNC
-    milton_state->save_mutex = SDL_CreateMutex();
-    milton_state->save_flag = SaveEnum_GOOD_TO_GO;
-    milton_state->save_cond = SDL_CreateCond();
-#endif
+    milton_saver_init(milton_state);
 
     milton_state->bytes_per_pixel = 4;
 
@@ -417,6 +423,15 @@ milton_init(MiltonState* milton_state, i32 width, i32 height, f32 ui_scale, PATH
     milton_state->view = arena_alloc_elem(&milton_state->root_arena, CanvasView);
     milton_set_default_view(milton_state);
 
+    milton_state->export_queue = export_queue_init();
+    if ( !milton_state->export_queue ) {
+        milton_die_gracefully("Could not create the export queue.");
+    }
+
+    milton_state->cold_strokes = cold_strokes_init();
+    // Strokes past it stay on disk when loading. See persist.h
+    milton_state->resident_budget = get_system_RAM() / 4;
+
     milton_state->view->screen_size = { width, height };
 
     gpu_init(milton_state->render_data, milton_state->view, &milton_state->gui->picker);
@@ -516,8 +531,18 @@ milton_resize_and_pan(MiltonState* milton_state, v2l pan_delta, v2i new_screen_s
 void
 milton_reset_canvas(MiltonState* milton_state)
 {
+    // Changes that are waiting to be saved belong to this canvas.
+    milton_save_flush(milton_state);
+    milton_load_cancel(milton_state);
+
     CanvasState* canvas = milton_state->canvas;
 
+    // Exports that are still rendering would pick up the next canvas.
+    if ( milton_state->export_queue ) {
+        export_queue_cancel_all(milton_state->export_queue);
+    }
+    cold_strokes_cancel(milton_state->cold_strokes);
+
     gpu_free_strokes(milton_state->render_data, milton_state->canvas);
     milton_state->mlt_binary_version = MILTON_MINOR_VERSION;
     milton_state->last_save_time = {};
@@ -526,10 +551,15 @@ milton_reset_canvas(MiltonState* milton_state)
     release(&canvas->history);
     release(&canvas->redo_stack);
     release(&canvas->stroke_graveyard);
+    release(&canvas->discarded_strokes);
+
+    platform_unmap_file(&canvas->mapped_file);
+    milton_journal_close(milton_state);
 
-    size_t size = canvas->arena.min_block_size;
     arena_free(&canvas->arena);  // Note: This destroys the canvas
-    milton_state->canvas = arena_bootstrap(CanvasState, arena, size);
+    milton_state->canvas = arena_bootstrap_with_flags(CanvasState, arena, CANVAS_ARENA_BLOCK_SIZE,
+                                                      PlatformAllocate_HUGE_PAGES);
+    milton_state->canvas->stroke_pool.arena = &milton_state->canvas->arena;
 
     mlt_assert(milton_state->canvas->history.count == 0);
 }
@@ -578,12 +608,6 @@ milton_switch_mode(MiltonState* milton_state, MiltonMode mode)
         milton_state->last_mode = milton_state->current_mode;
         milton_state->current_mode = mode;
 
-        if ( milton_state->last_mode == MiltonMode::EYEDROPPER &&
-             milton_state->eyedropper_buffer != NULL ) {
-            mlt_free(milton_state->eyedropper_buffer, "Bitmap");
-            milton_state->eyedropper_buffer = NULL;
-        }
-
         if ( mode == MiltonMode::EXPORTING && milton_state->gui->visible ) {
             gui_toggle_visibility(milton_state);
         }
@@ -599,6 +623,64 @@ milton_use_previous_mode(MiltonState* milton_state)
     milton_switch_mode(milton_state, milton_state->last_mode);
 }
 
+b32
+milton_undo(MiltonState* milton_state)
+{
+    b32 changed = false;
+    // Grab undo elements. They might be from deleted layers, so discard dead results.
+    while ( milton_state->canvas->history.count > 0 ) {
+        HistoryElement h = pop(&milton_state->canvas->history);
+        Layer* l = layer::get_by_id(milton_state->canvas->root_layer, h.layer_id);
+        // found a thing to undo.
+        if ( l ) {
+            if ( l->strokes.count > 0 ) {
+                milton_save_before_undo(milton_state, l);
+                Stroke stroke = pop(&l->strokes);
+                // Cooked again if it is redone.
+                gpu_free_strokes(&stroke, 1, milton_state->render_data);
+                push(&milton_state->canvas->stroke_graveyard, stroke);
+                push(&milton_state->canvas->redo_stack, h);
+
+                changed = true;
+            }
+            break;
+        }
+    }
+    return changed;
+}
+
+b32
+milton_redo(MiltonState* milton_state)
+{
+    b32 changed = false;
+    if ( milton_state->canvas->redo_stack.count > 0 ) {
+        HistoryElement h = pop(&milton_state->canvas->redo_stack);
+        switch ( h.type ) {
+        case HistoryElement_STROKE_ADD: {
+            Layer* l = layer::get_by_id(milton_state->canvas->root_layer, h.layer_id);
+            if ( l && count(&milton_state->canvas->stroke_graveyard) > 0 ) {
+                Stroke stroke = pop(&milton_state->canvas->stroke_graveyard);
+                if ( stroke.layer_id == h.layer_id ) {
+                    push(&l->strokes, stroke);
+                    push(&milton_state->canvas->history, h);
+
+                    changed = true;
+
+                    break;
+                }
+                milton_discard_stroke(milton_state, &stroke);
+                stroke = pop(&milton_state->canvas->stroke_graveyard);  // Keep popping in case the graveyard has info from deleted layers
+                milton_discard_stroke(milton_state, &stroke);
+            }
+
+        } break;
+        /* case HistoryElement_LAYER_DELETE: { */
+        /* } break; */
+        }
+    }
+    return changed;
+}
+
 void
 milton_try_quit(MiltonState* milton_state)
 {
@@ -606,45 +688,14 @@ milton_try_quit(MiltonState* milton_state)
 }
 
 void
-milton_save_postlude(MiltonState* milton_state)
+milton_save_postlude(MiltonState* milton_state, i64 num_strokes)
 {
     milton_state->last_save_time = platform_get_walltime();
-    milton_state->last_save_stroke_count = layer::count_strokes(milton_state->canvas->root_layer);
+    milton_state->last_save_stroke_count = num_strokes;
 
     milton_state->flags &= ~MiltonStateFlags_LAST_SAVE_FAILED;
 }
 
-#if MILTON_SAVE_ASYNC
-int  // Thread
-milton_save_async(void* state_)
-{
-    MiltonState* milton_state = (MiltonState*)state_;
-
-    SDL_LockMutex(milton_state->save_mutex);
-    i64 flag = milton_state->save_flag;
-
-    if( flag == SaveEnum_GOOD_TO_GO ) {
-        milton_state->save_flag = SaveEnum_IN_USE;
-        SDL_UnlockMutex(milton_state->save_mutex);
-
-        milton_save(milton_state);
-
-        SDL_LockMutex(milton_state->save_mutex);
-
-        milton_state->save_flag = SaveEnum_GOOD_TO_GO;
-
-        SDL_CondSignal(milton_state->save_cond);
-
-        SDL_UnlockMutex(milton_state->save_mutex);
-    }
-    else if ( flag == SaveEnum_IN_USE ) {
-        SDL_UnlockMutex(milton_state->save_mutex);
-    }
-
-    return flag;
-}
-#endif
-
 void
 milton_new_layer(MiltonState* milton_state)
 {
@@ -652,13 +703,24 @@ milton_new_layer(MiltonState* milton_state)
     i32 id = canvas->layer_guid++;
     milton_log("Increased guid to %d\n", canvas->layer_guid);
 
-    Layer* layer = arena_alloc_elem(&canvas->arena, Layer);
+    Layer* layer = NULL;
+    // A save that is in progress could be reading the strokes of a deleted layer.
+    if ( canvas->deleted_layers && !milton_save_in_progress(milton_state) ) {
+        layer = canvas->deleted_layers;
+        canvas->deleted_layers = layer->next;
+        StrokeList strokes = layer->strokes;
+        reset(&strokes);
+        *layer = {};
+        layer->strokes = strokes;
+    } else {
+        layer = arena_alloc_elem(&canvas->arena, Layer);
+        layer->strokes.arena = &canvas->arena;
+        strokelist_init_bucket(&layer->strokes.root);
+    }
     {
         layer->id = id;
         layer->flags = LayerFlags_VISIBLE;
-        layer->strokes.arena = &canvas->arena;
         layer->alpha = 1.0f;
-        strokelist_init_bucket(&layer->strokes.root);
     }
     snprintf(layer->name, 1024, "Layer %d", layer->id);
 
@@ -683,7 +745,13 @@ milton_set_working_layer(MiltonState* milton_state, Layer* layer)
 void
 milton_delete_working_layer(MiltonState* milton_state)
 {
-    Layer* layer = milton_state->canvas->working_layer;
+    // Every stroke of the layer is discarded. None of them can still be loading.
+    if ( !milton_load_finish(milton_state) ) {
+        return;
+    }
+    CanvasState* canvas = milton_state->canvas;
+    Layer* layer = canvas->working_layer;
+    b32 unlinked = false;
     if ( layer->next || layer->prev ) {
         if (layer->next) layer->next->prev = layer->prev;
         if (layer->prev) layer->prev->next = layer->next;
@@ -692,13 +760,174 @@ milton_delete_working_layer(MiltonState* milton_state)
         if (layer->next) wl = layer->next;
         else wl = layer->prev;
         milton_set_working_layer(milton_state, wl);
+        unlinked = true;
+    }
+    if ( layer == canvas->root_layer )
+        canvas->root_layer = canvas->working_layer;
+
+    // The only layer is not deleted, and its strokes stay live.
+    if ( unlinked ) {
+        for ( i64 i = 0; i < layer->strokes.count; ++i ) {
+            milton_discard_stroke(milton_state, get(&layer->strokes, i));
+        }
+        layer->prev = NULL;
+        layer->next = canvas->deleted_layers;
+        canvas->deleted_layers = layer;
     }
-    if ( layer == milton_state->canvas->root_layer )
-        milton_state->canvas->root_layer = milton_state->canvas->working_layer;
 
     // milton_state->flags |= MiltonStateFlags_REQUEST_QUALITY_REDRAW;
 }
 
+// Strokes that the stroke pool keeps track of. Wide points of loaded strokes can point into the mapped
+// file instead.
+static b32
+stroke_points_are_pooled(CanvasState* canvas, Stroke* stroke)
+{
+    PlatformMappedFile* file = &canvas->mapped_file;
+    b32 in_file = (u8*)stroke->points >= file->data && (u8*)stroke->points < file->data + file->size;
+    return stroke->compact != NULL || (stroke->points != NULL && !in_file);
+}
+
+void
+milton_discard_stroke(MiltonState* milton_state, Stroke* stroke)
+{
+    CanvasState* canvas = milton_state->canvas;
+    gpu_free_strokes(stroke, 1, milton_state->render_data);
+    if ( stroke_points_are_pooled(canvas, stroke) ) {
+        push(&canvas->discarded_strokes, *stroke);
+    }
+}
+
+// The saver might be writing discarded strokes, and the cold strokes thread might be packing them.
+// Their points are reused once they are done.
+static b32
+milton_free_discarded_strokes(MiltonState* milton_state)
+{
+    b32 freed = false;
+    CanvasState* canvas = milton_state->canvas;
+    if ( canvas->discarded_strokes.count > 0 &&
+         !milton_save_in_progress(milton_state) &&
+         !cold_strokes_busy(milton_state->cold_strokes) ) {
+        for ( i64 i = 0; i < canvas->discarded_strokes.count; ++i ) {
+            stroke_free_points(&canvas->stroke_pool, &canvas->discarded_strokes.data[i]);
+        }
+        reset(&canvas->discarded_strokes);
+        freed = true;
+    }
+    return freed;
+}
+
+size_t
+milton_canvas_waste(CanvasState* canvas)
+{
+    ArenaStats stats = arena_stats(&canvas->arena);
+    return stats.wasted_bytes + stroke_pool_free_bytes(&canvas->stroke_pool);
+}
+
+static b32
+milton_canvas_is_wasteful(CanvasState* canvas)
+{
+    size_t waste = milton_canvas_waste(canvas);
+    return waste > CANVAS_COMPACTION_MIN_WASTE &&
+           waste > (size_t)(CANVAS_COMPACTION_WASTE_RATIO * arena_stats(&canvas->arena).block_bytes);
+}
+
+b32
+milton_compact_canvas(MiltonState* milton_state)
+{
+    // The saver and the cold strokes thread read points, and the loader pushes strokes.
+    if ( milton_save_in_progress(milton_state) ||
+         cold_strokes_busy(milton_state->cold_strokes) ||
+         milton_state->loader != NULL ) {
+        return false;
+    }
+    milton_free_discarded_strokes(milton_state);
+    mlt_assert(milton_state->canvas->discarded_strokes.count == 0);
+
+    u64 start = perf_counter();
+    CanvasState* canvas = milton_state->canvas;
+    size_t old_bytes = arena_stats(&canvas->arena).block_bytes;
+
+    CanvasState* compacted = arena_bootstrap_with_flags(CanvasState, arena, CANVAS_ARENA_BLOCK_SIZE,
+                                                        PlatformAllocate_HUGE_PAGES);
+    {
+        // The arrays and the mapped file are not in the arena, and move over as they are.
+        Arena arena = compacted->arena;
+        *compacted = *canvas;
+        compacted->arena = arena;
+        compacted->root_layer = NULL;
+        compacted->working_layer = NULL;
+        compacted->deleted_layers = NULL;
+        compacted->stroke_pool = {};
+        compacted->stroke_pool.arena = &compacted->arena;
+    }
+
+    // The layers, then their strokes, then the points. Strokes stay in the order they are drawn in,
+    // which is the order the clip loop goes through them.
+    Layer* prev = NULL;
+    for ( Layer* layer = canvas->root_layer; layer != NULL; layer = layer->next ) {
+        Layer* copy = arena_alloc_elem(&compacted->arena, Layer);
+        *copy = *layer;
+        copy->strokes = {};
+        copy->strokes.arena = &compacted->arena;
+        strokelist_init_bucket(&copy->strokes.root);
+        LayerEffect** e = &copy->effects;
+        for ( LayerEffect* src = layer->effects; src != NULL; src = src->next ) {
+            *e = arena_alloc_elem(&compacted->arena, LayerEffect);
+            **e = *src;
+            e = &(*e)->next;
+        }
+        *e = NULL;
+        copy->prev = prev;
+        copy->next = NULL;
+        if ( prev ) {
+            prev->next = copy;
+        } else {
+            compacted->root_layer = copy;
+        }
+        if ( layer == canvas->working_layer ) {
+            compacted->working_layer = copy;
+        }
+        prev = copy;
+    }
+    Layer* copy = compacted->root_layer;
+    for ( Layer* layer = canvas->root_layer; layer != NULL; layer = layer->next, copy = copy->next ) {
+        for ( StrokeBucket* bucket = &layer->strokes.root; bucket != NULL; bucket = bucket->next ) {
+            i64 count = strokelist_bucket_count(&layer->strokes, bucket);
+            for ( i64 i = 0; i < count; ++i ) {
+                push(&copy->strokes, bucket->data[i]);
+            }
+        }
+    }
+    for ( Layer* layer = compacted->root_layer; layer != NULL; layer = layer->next ) {
+        for ( StrokeBucket* bucket = &layer->strokes.root; bucket != NULL; bucket = bucket->next ) {
+            i64 count = strokelist_bucket_count(&layer->strokes, bucket);
+            for ( i64 i = 0; i < count; ++i ) {
+                Stroke* stroke = &bucket->data[i];
+                if ( stroke_points_are_pooled(canvas, stroke) ) {
+                    stroke_move_points(&compacted->stroke_pool, stroke);
+                }
+            }
+        }
+    }
+    // Undone strokes come back with redo.
+    for ( i64 i = 0; i < compacted->stroke_graveyard.count; ++i ) {
+        Stroke* stroke = &compacted->stroke_graveyard.data[i];
+        if ( stroke_points_are_pooled(canvas, stroke) ) {
+            stroke_move_points(&compacted->stroke_pool, stroke);
+        }
+    }
+
+    milton_state->canvas = compacted;
+    arena_free(&canvas->arena);  // Note: This destroys the old canvas
+
+    milton_log("Compacted the canvas from %.1f MB to %.1f MB in %.1f ms\n",
+               old_bytes / (1024.0 * 1024.0),
+               arena_stats(&compacted->arena).block_bytes / (1024.0 * 1024.0),
+               perf_count_to_sec(perf_counter() - start) * 1000.0f);
+    return true;
+}
+
 b32
 milton_brush_smoothing_enabled(MiltonState* milton_state)
 {
@@ -716,6 +945,54 @@ milton_toggle_brush_smoothing(MiltonState* milton_state)
     }
 }
 
+static void
+write_arena_json(FILE* fd, char* name, Arena* arena)
+{
+    ArenaStats stats = arena_stats(arena);
+    fprintf(fd, ",\n\"%s\": { \"blocks\": %lld, \"block_bytes\": %lld, \"used_bytes\": %lld, \"wasted_bytes\": %lld, \"free_bytes\": %lld }",
+            name, (long long)stats.num_blocks, (long long)stats.block_bytes, (long long)stats.used_bytes,
+            (long long)stats.wasted_bytes, (long long)stats.free_bytes);
+}
+
+template <typename T>
+static void
+write_darray_json(FILE* fd, char* name, DArray<T>* arr)
+{
+    fprintf(fd, ",\n\"%s\": { \"count\": %lld, \"bytes\": %lld }",
+            name, (long long)arr->count, (long long)(arr->capacity * (i64)sizeof(T)));
+}
+
+void
+milton_dump_memory_stats(MiltonState* milton_state)
+{
+    PATH_CHAR fname[MAX_PATH] = {};
+    PATH_STRNCPY(fname, TO_PATH_STR("MiltonMemory.json"), MAX_PATH);
+    platform_fname_at_config(fname, MAX_PATH);
+    FILE* fd = platform_fopen(fname, TO_PATH_STR("wb"));
+    if ( fd == NULL ) {
+        milton_log("Could not create the memory stats file.\n");
+        return;
+    }
+
+    CanvasState* canvas = milton_state->canvas;
+    StrokePool* pool = &canvas->stroke_pool;
+    fprintf(fd, "{\n\"heap\": ");
+    memory_write_json(fd);
+    write_arena_json(fd, "canvas_arena", &canvas->arena);
+    write_arena_json(fd, "root_arena", &milton_state->root_arena);
+    fprintf(fd, ",\n\"canvas_waste\": %lld", (long long)milton_canvas_waste(canvas));
+    fprintf(fd, ",\n\"stroke_pool\": { \"used_bytes\": %lld, \"packed\": %lld, \"packed_bytes\": %lld, \"paged\": %lld }",
+            (long long)stroke_pool_used_bytes(pool), (long long)pool->num_packed,
+            (long long)pool->packed_bytes, (long long)pool->num_paged);
+    write_darray_json(fd, "stroke_graveyard", &canvas->stroke_graveyard);
+    write_darray_json(fd, "discarded_strokes", &canvas->discarded_strokes);
+    write_darray_json(fd, "history", &canvas->history);
+    write_darray_json(fd, "redo_stack", &canvas->redo_stack);
+    fprintf(fd, "\n}\n");
+    fclose(fd);
+    milton_log("Wrote MiltonMemory.json to the config directory.\n");
+}
+
 static void
 milton_validate(MiltonState* milton_state)
 {
@@ -765,16 +1042,15 @@ milton_validate(MiltonState* milton_state)
 
 // Copy points from in_stroke to out_stroke, but do interpolation to smooth it out.
 static void
-copy_with_smooth_interpolation(Arena* arena, CanvasView* view, Stroke* in_stroke, Stroke* out_stroke)
+copy_with_smooth_interpolation(StrokePool* pool, CanvasView* view, Stroke* in_stroke, Stroke* out_stroke)
 {
     i32 num_points = in_stroke->num_points;
 
-    // At most we are adding twice as many points. This is wasteful but at the moment it looks like
-    // a reasonable tradeoff vs the complexity/perf hit of using something smaller.
+    // At most we are adding twice as many points. The points are moved to a smaller block
+    // afterwards if they fit in one.
 
     if ( num_points >= 4 && 2*num_points <= STROKE_MAX_POINTS ) {
-        out_stroke->points    = arena_alloc_array(arena, 2*num_points, v2l);
-        out_stroke->pressures = arena_alloc_array(arena, 2*num_points, f32);
+        stroke_alloc_points(pool, out_stroke, 2*num_points);
 
         // Push the first points.
         memcpy(out_stroke->points, in_stroke->points, 4 * sizeof(v2l));
@@ -845,11 +1121,11 @@ copy_with_smooth_interpolation(Arena* arena, CanvasView* view, Stroke* in_stroke
         }
 
         out_stroke->num_points = out_i;
+        stroke_shrink_points(pool, out_stroke, 2*num_points);
     }
     // Four or less points in stroke, or stroke is too large.
     else {
-        out_stroke->points    = arena_alloc_array(arena, num_points, v2l);
-        out_stroke->pressures = arena_alloc_array(arena, num_points, f32);
+        stroke_alloc_points(pool, out_stroke, num_points);
 
         memcpy(out_stroke->points, in_stroke->points, in_stroke->num_points * sizeof(v2l));
         memcpy(out_stroke->pressures, in_stroke->pressures, in_stroke->num_points * sizeof(f32));
@@ -870,12 +1146,11 @@ milton_update_and_render(MiltonState* milton_state, MiltonInput* input)
     b32 draw_custom_rectangle = false;  // Custom rectangle used for new strokes, undo/redo.
     Rect custom_rectangle = rect_without_size();
 
+    // New strokes, undo and redo are appended to the journal. The whole canvas is saved when the
+    // journal can't be used or gets too big. See persist.h
     b32 should_save =
             ((input->flags & MiltonInputFlags_OPEN_FILE)) ||
-            ((input->flags & MiltonInputFlags_SAVE_FILE)) ||
-            ((input->flags & MiltonInputFlags_END_STROKE)) ||
-            ((input->flags & MiltonInputFlags_UNDO)) ||
-            ((input->flags & MiltonInputFlags_REDO));
+            ((input->flags & MiltonInputFlags_SAVE_FILE));
 
     if ( input->flags & MiltonInputFlags_OPEN_FILE ) {
         milton_load(milton_state);
@@ -967,53 +1242,32 @@ milton_update_and_render(MiltonState* milton_state, MiltonInput* input)
     }
 
     { // Undo / Redo
+        b32 changed = false;
+        if ( (input->flags & (MiltonInputFlags_UNDO | MiltonInputFlags_REDO)) ) {
+            // Undo works on every stroke, including the ones that are still loading.
+            milton_load_finish(milton_state);
+        }
         if ( (input->flags & MiltonInputFlags_UNDO) ) {
-            // Grab undo elements. They might be from deleted layers, so discard dead results.
-            while ( milton_state->canvas->history.count > 0 ) {
-                HistoryElement h = pop(&milton_state->canvas->history);
-                Layer* l = layer::get_by_id(milton_state->canvas->root_layer, h.layer_id);
-                // found a thing to undo.
-                if ( l ) {
-                    if ( l->strokes.count > 0 ) {
-                        Stroke* stroke_ptr = peek(&l->strokes);
-                        Stroke stroke = pop(&l->strokes);
-                        push(&milton_state->canvas->stroke_graveyard, stroke);
-                        push(&milton_state->canvas->redo_stack, h);
-
-                        do_full_redraw = true;
-                        render_flags |= RenderDataFlags_WITH_BLUR;
-                    }
-                    break;
-                }
+            changed = milton_undo(milton_state);
+            if ( changed && !milton_journal_append(milton_state, JournalOp_UNDO, NULL) ) {
+                should_save = true;
             }
         }
         else if ( (input->flags & MiltonInputFlags_REDO) ) {
-            if ( milton_state->canvas->redo_stack.count > 0 ) {
-                HistoryElement h = pop(&milton_state->canvas->redo_stack);
-                switch ( h.type ) {
-                case HistoryElement_STROKE_ADD: {
-                    Layer* l = layer::get_by_id(milton_state->canvas->root_layer, h.layer_id);
-                    if ( l && count(&milton_state->canvas->stroke_graveyard) > 0 ) {
-                        Stroke stroke = pop(&milton_state->canvas->stroke_graveyard);
-                        if ( stroke.layer_id == h.layer_id ) {
-                            push(&l->strokes, stroke);
-                            push(&milton_state->canvas->history, h);
-
-                            do_full_redraw = true;
-                            render_flags |= RenderDataFlags_WITH_BLUR;
-
-
-                            break;
-                        }
-                        stroke = pop(&milton_state->canvas->stroke_graveyard);  // Keep popping in case the graveyard has info from deleted layers
-                    }
-
-                } break;
-                /* case HistoryElement_LAYER_DELETE: { */
-                /* } break; */
+            changed = milton_redo(milton_state);
+            if ( changed ) {
+                // Replaying a redo is the same as adding the stroke again.
+                HistoryElement h = milton_state->canvas->history.data[milton_state->canvas->history.count - 1];
+                Layer* l = layer::get_by_id(milton_state->canvas->root_layer, h.layer_id);
+                if ( !milton_journal_append(milton_state, JournalOp_STROKE_ADD, peek(&l->strokes)) ) {
+                    should_save = true;
                 }
             }
         }
+        if ( changed ) {
+            do_full_redraw = true;
+            render_flags |= RenderDataFlags_WITH_BLUR;
+        }
     }
 
     // If the current mode is Pen or Eraser, we show the hover. It can be unset under various conditions later.
@@ -1102,17 +1356,6 @@ milton_update_and_render(MiltonState* milton_state, MiltonInput* input)
     }
 
     if ( milton_state->current_mode == MiltonMode::EYEDROPPER ) {
-        if ( milton_state->eyedropper_buffer == NULL ) {
-            size_t bpp = 4;
-            i32 w = milton_state->view->screen_size.w;
-            i32 h = milton_state->view->screen_size.h;
-            milton_state->eyedropper_buffer = (u8*)mlt_calloc(w*h*bpp, 1, "Bitmap");
-            if ( milton_state->eyedropper_buffer ) {
-                gpu_render_to_buffer(milton_state, milton_state->eyedropper_buffer, 1,
-                                     0,0,w,h, 1.0f);
-            }
-
-        }
         v2i point = {};
         b32 in = false;
         if ( (input->flags & MiltonInputFlags_CLICK) ) {
@@ -1123,12 +1366,10 @@ milton_update_and_render(MiltonState* milton_state, MiltonInput* input)
             point = input->hover_point;
             in = true;
         }
-        if ( in ) {
-            mlt_assert(milton_state->eyedropper_buffer != NULL);
-            eyedropper_input(milton_state->gui, (u32*)milton_state->eyedropper_buffer,
-                             milton_state->view->screen_size.w,
-                             milton_state->view->screen_size.h,
-                             point);
+        // Read back the pixel under the cursor from the last rendered frame.
+        u32 pixel = 0;
+        if ( in && gpu_read_canvas_pixels(milton_state->render_data, point.x, point.y, 1, 1, &pixel) ) {
+            eyedropper_input(milton_state->gui, pixel);
             gpu_update_picker(milton_state->render_data, &milton_state->gui->picker);
         }
         if( input->flags & MiltonInputFlags_CLICKUP ) {
@@ -1157,7 +1398,8 @@ milton_update_and_render(MiltonState* milton_state, MiltonInput* input)
                 // Copy current stroke.
                 Stroke new_stroke = {};
                 CanvasState* canvas = milton_state->canvas;
-                copy_with_smooth_interpolation(&canvas->arena, milton_state->view, &milton_state->working_stroke, &new_stroke);
+                copy_with_smooth_interpolation(&canvas->stroke_pool, milton_state->view, &milton_state->working_stroke, &new_stroke);
+                stroke_compact_points(&canvas->stroke_pool, &new_stroke);
                 {
                     new_stroke.brush = milton_state->working_stroke.brush;
                     new_stroke.layer_id = milton_state->view->working_layer_id;
@@ -1176,6 +1418,9 @@ milton_update_and_render(MiltonState* milton_state, MiltonInput* input)
                 mlt_assert(new_stroke.num_points > 0);
                 mlt_assert(new_stroke.num_points <= STROKE_MAX_POINTS);
                 auto* stroke = layer::layer_push_stroke(milton_state->canvas->working_layer, new_stroke);
+                if ( !milton_journal_append(milton_state, JournalOp_STROKE_ADD, stroke) ) {
+                    should_save = true;
+                }
 
                 // Invalidate working stroke render element
 
@@ -1252,6 +1497,20 @@ milton_update_and_render(MiltonState* milton_state, MiltonInput* input)
 
     PROFILE_GRAPH_END(update);
 
+    if ( export_queue_tick(milton_state->export_queue, milton_state) ) {
+        // Export tiles were rendered with their own view.
+        do_full_redraw = true;
+    }
+
+    if ( milton_load_tick(milton_state) ) {
+        do_full_redraw = true;
+        render_flags |= RenderDataFlags_WITH_BLUR;
+    }
+
+    if ( milton_journal_needs_compaction(milton_state) ) {
+        should_save = true;
+    }
+
     if ( !(milton_state->flags & MiltonStateFlags_RUNNING) ) {
         // Someone tried to kill milton from outside the update. Make sure we save.
         should_save = true;
@@ -1260,15 +1519,16 @@ milton_update_and_render(MiltonState* milton_state, MiltonInput* input)
     }
 
     if ( should_save ) {
+        // The whole canvas is about to be written. Write it from fresh storage if it's worth it.
+        if ( milton_canvas_is_wasteful(milton_state->canvas) ) {
+            milton_state->flags |= MiltonStateFlags_REQUEST_COMPACTION;
+        }
         if ( !(milton_state->flags & MiltonStateFlags_RUNNING) ) {
             // Always save synchronously when exiting.
             milton_save(milton_state);
         } else {
-#if MILTON_SAVE_ASYNC
-            SDL_CreateThread(milton_save_async, "Async Save Thread", (void*)milton_state);
-#else
-            milton_save(milton_state);
-#endif
+            // Requests are coalesced and written by milton_save_tick.
+            milton_save_async(milton_state);
         }
         // We're about to close and the last save failed and the drawing changed.
         if (    !(milton_state->flags & MiltonStateFlags_RUNNING)
@@ -1313,15 +1573,14 @@ milton_update_and_render(MiltonState* milton_state, MiltonInput* input)
         // About to quit.
         if ( !(milton_state->flags & MiltonStateFlags_RUNNING) ) {
 
-            // Make sure that async save threads have finished.
-#if MILTON_SAVE_ASYNC
-            while ( milton_state->save_flag == SaveEnum_IN_USE ) {
-                SDL_CondWait(milton_state->save_cond, milton_state->save_mutex);
-                mlt_assert(milton_state->save_flag == SaveEnum_GOOD_TO_GO);
-            }
-#endif
+            // Make sure that the saver thread has finished.
+            milton_saver_release(milton_state);
 
             // Release resources
+            export_queue_release(milton_state->export_queue);
+            milton_state->export_queue = NULL;
+            cold_strokes_release(milton_state->cold_strokes);
+            milton_state->cold_strokes = NULL;
             milton_reset_canvas(milton_state);
             gpu_release_data(milton_state->render_data);
 
@@ -1331,6 +1590,19 @@ milton_update_and_render(MiltonState* milton_state, MiltonInput* input)
         }
     }
 
+    // Start a save once the requests settle, and pick up the one that finished.
+    milton_save_tick(milton_state);
+    if ( milton_free_discarded_strokes(milton_state) && milton_canvas_is_wasteful(milton_state->canvas) ) {
+        milton_state->flags |= MiltonStateFlags_REQUEST_COMPACTION;
+    }
+    // Tried again every frame until nothing is reading the canvas.
+    if ( (milton_state->flags & MiltonStateFlags_REQUEST_COMPACTION) &&
+         (milton_state->flags & MiltonStateFlags_RUNNING) &&
+         milton_compact_canvas(milton_state) ) {
+        milton_state->flags &= ~MiltonStateFlags_REQUEST_COMPACTION;
+    }
+    cold_strokes_tick(milton_state->cold_strokes, milton_state);
+
     i32 view_x = 0;
     i32 view_y = 0;
     i32 view_width = 0;
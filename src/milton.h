@@ -9,6 +9,8 @@
 #include "canvas.h"
 #include "DArray.h"
 #include "profiler.h"
+#include "platform.h"
+#include "persist.h"
 
 #define MILTON_USE_VAO              0
 #define STROKE_MAX_POINTS           2048
@@ -19,6 +21,13 @@
 #define MILTON_MAX_BRUSH_SIZE       80
 #define MILTON_HIDE_BRUSH_OVERLAY_AT_THIS_SIZE 12
 #define HOVER_FLASH_THRESHOLD_MS    500  // How long does the hidden brush hover show when it has changed size.
+// Canvas arena blocks are backed by huge pages. Leave room for the CanvasState and the block's
+// bookkeeping so that a block fits in one 2MB page.
+#define CANVAS_ARENA_BLOCK_SIZE     (2*1024*1024 - 64*1024)
+// The canvas is compacted when the bytes of its arena that are not in use pass both of these. See
+// milton_compact_canvas
+#define CANVAS_COMPACTION_MIN_WASTE     (16*1024*1024)
+#define CANVAS_COMPACTION_WASTE_RATIO   0.25f
 
 
 struct MiltonGLState
@@ -63,6 +72,8 @@ struct HistoryElement
 };
 
 struct MiltonGui;
+struct ExportQueue;
+struct ColdStrokes;
 struct RenderData;
 struct CanvasView;
 struct Layer;
@@ -78,10 +89,19 @@ struct CanvasState
 
     DArray<HistoryElement> history;
     DArray<HistoryElement> redo_stack;
-    //Layer**         layer_graveyard;
+    // Deleted layers, linked by `next`. Their stroke lists are reused by milton_new_layer.
+    Layer*      deleted_layers;
     DArray<Stroke>         stroke_graveyard;
 
     i32         stroke_id_count;
+
+    // Points and pressures of strokes, unless they point into `mapped_file`.
+    StrokePool      stroke_pool;
+    // Strokes that are gone for good. See milton_discard_stroke
+    DArray<Stroke>  discarded_strokes;
+
+    // Loaded canvas file. Stroke points and pressures can point into it.
+    PlatformMappedFile mapped_file;
 };
 
 struct MiltonState
@@ -93,7 +113,6 @@ struct MiltonState
     i32 max_width;
     i32 max_height;
 
-    u8* eyedropper_buffer;  // Get pixels from OpenGL framebuffer and store them here for eydropper operations.
 
     // The screen is rendered in blockgroups
     // Each blockgroup is rendered in blocks of size (block_width*block_width).
@@ -112,11 +131,10 @@ struct MiltonState
                                         // when the mlt file gets large.
                                         // Check that all the strokes are saved at quit time in case that
                                         // the last MoveFileEx failed.
-#if MILTON_SAVE_ASYNC
-    SDL_mutex*  save_mutex;
-    i64         save_flag;   // See SaveEnum
-    SDL_cond*   save_cond;
-#endif
+    MltJournal  journal;
+    MltSaver*   saver;  // NULL when saving synchronously.
+    MltLoader*  loader;  // While the strokes of the canvas are loading. See persist.h
+    size_t      resident_budget;  // Bytes of points that loading decodes, at most. 0 for no limit.
 
     // ---- The Painting
     CanvasState*    canvas;
@@ -142,10 +160,16 @@ struct MiltonState
 
     RenderData* render_data;  // Hardware Renderer
 
+    ExportQueue* export_queue;  // Image exports running in the background.
+
+    ColdStrokes* cold_strokes;  // Packs strokes that are off screen. NULL if its thread didn't start.
+
     // Heap
     Arena       root_arena;     // Lives forever
     Arena       canvas_arena;   // Gets reset every canvas.
 
+    b32 memory_window_visible;
+
     // ====
     // Debug helpers
     // ====
@@ -164,7 +188,7 @@ enum MiltonStateFlags
     MiltonStateFlags_RUNNING                = 1 << 0,
                                            // 1 << 1 unused
     MiltonStateFlags_REQUEST_QUALITY_REDRAW = 1 << 2,
-                                           // 1 << 3 unused
+    MiltonStateFlags_REQUEST_COMPACTION     = 1 << 3,  // See milton_compact_canvas
     MiltonStateFlags_NEW_CANVAS             = 1 << 4,
     MiltonStateFlags_DEFAULT_CANVAS         = 1 << 5,
     MiltonStateFlags_IGNORE_NEXT_CLICKUP    = 1 << 6,  // When selecting eyedropper from menu, avoid the click from selecting the color...
@@ -210,12 +234,6 @@ struct MiltonInput
 };
 
 
-enum SaveEnum
-{
-    SaveEnum_IN_USE,
-    SaveEnum_GOOD_TO_GO,
-};
-
 void milton_init(MiltonState* milton_state, i32 width, i32 height, f32 ui_scale, PATH_CHAR* file_to_open);
 
 // Expects absolute path
@@ -224,7 +242,8 @@ void milton_set_default_canvas_file(MiltonState* milton_state);
 void milton_set_last_canvas_fname(PATH_CHAR* last_fname);
 void milton_unset_last_canvas_fname();
 
-void milton_save_postlude(MiltonState* milton_state);
+// num_strokes: Number of strokes that were saved.
+void milton_save_postlude(MiltonState* milton_state, i64 num_strokes);
 
 
 void milton_reset_canvas(MiltonState* milton_state);
@@ -250,11 +269,19 @@ void milton_switch_mode(MiltonState* milton_state, MiltonMode mode);
 // Our "game loop" inner function.
 void milton_update_and_render(MiltonState* milton_state, MiltonInput* input);
 
+// Return true if a stroke was removed or restored.
+b32 milton_undo(MiltonState* milton_state);
+b32 milton_redo(MiltonState* milton_state);
+
 void milton_try_quit(MiltonState* milton_state);
 
 void milton_new_layer(MiltonState* milton_state);
 void milton_set_working_layer(MiltonState* milton_state, Layer* layer);
 void milton_delete_working_layer(MiltonState* milton_state);
+
+// For strokes that are out of the canvas and can't come back. Their GL buffers are deleted, and their
+// points go back to the stroke pool once no save can be reading them.
+void milton_discard_stroke(MiltonState* milton_state, Stroke* stroke);
 void milton_set_background_color(MiltonState* milton_state, v3f background_color);
 
 // Set the center of the zoom
@@ -263,3 +290,15 @@ void milton_set_zoom_at_screen_center(MiltonState* milton_state);
 
 b32  milton_brush_smoothing_enabled(MiltonState* milton_state);
 void milton_toggle_brush_smoothing(MiltonState* milton_state);
+
+// Writes the memory counters, the arenas and the big arrays of the canvas to MiltonMemory.json, in
+// the config directory. See memory.h
+void milton_dump_memory_stats(MiltonState* milton_state);
+
+// Copies the layers, the strokes and their points to a new canvas arena, in the order the clip loop
+// goes through them, and frees the old one. Gets rid of the free blocks of the stroke pool, deleted
+// layers and half-used arena blocks. Pointers to strokes and layers change. Returns false if it
+// has to wait for a save, the cold strokes thread or a load, in which case nothing changed.
+b32  milton_compact_canvas(MiltonState* milton_state);
+// Bytes of the canvas arena that hold nothing: free stroke blocks and the ends of blocks.
+size_t milton_canvas_waste(CanvasState* canvas);
@@ -5,7 +5,7 @@
 
 
 #define MILTON_MAJOR_VERSION 1
-#define MILTON_MINOR_VERSION 5
+#define MILTON_MINOR_VERSION 6
 #define MILTON_MICRO_VERSION 2
 
 #define MILTON_DEBUG 1
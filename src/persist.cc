@@ -3,14 +3,16 @@
 
 #include "persist.h"
 
-#include <stb_image_write.h>
-
 #include "common.h"
 #include "gui.h"
 #include "memory.h"
 #include "milton.h"
 #include "platform.h"
-#include "tiny_jpeg.h"
+#include "renderer.h"
+#include "stroke_codec.h"
+
+#include "stb_image.h"
+#include "stb_image_write.h"
 
 
 #define MILTON_MAGIC_NUMBER 0X11DECAF3
@@ -51,6 +53,1903 @@ milton_unset_last_canvas_fname()
     }
 }
 
+// ---- MLT v6
+//
+// Chunked format. A fixed header is followed by chunks, and the file ends with a table of contents
+// (TOC) that has the type, offset and size of each chunk. Layers and blocks of strokes can be found
+// and read without reading anything that comes before them. Readers skip chunks they don't know.
+//
+// Chunks start at multiples of MLT_CHUNK_ALIGNMENT. See milton_file_format.md
+
+#define MLT_CHUNK_ALIGNMENT     16
+#define MLT_BLOCK_MAX_STROKES   1024
+#define MLT_BLOCK_MAX_BYTES     (1024*1024)  // Point and pressure data per block, unless a stroke is bigger.
+#define MLT_LOAD_MAX_THREADS    16
+// The largest preview fits in MLT_PREVIEW_MAX_SIZE^2. Each one after that is half the size, down to
+// MLT_PREVIEW_MIN_SIZE.
+#define MLT_PREVIEW_MAX_SIZE    512
+#define MLT_PREVIEW_MIN_SIZE    32
+#define MLT_LOAD_PREVIEW_SIZE   256  // Shown while the strokes load.
+// Strokes per group rect of a STROKE_INDEX. What a StrokeList bucket used to hold: older readers use
+// the group rects as bucket rects when the sizes match. Newer ones compute bucket rects from the
+// stroke rects.
+#define MLT_STROKE_INDEX_GROUP_SIZE 4196
+
+enum MltChunkType
+{
+    MltChunk_CANVAS     = 1,  // CanvasView, layer guid, picker color, color buttons, brushes.
+    MltChunk_LAYER      = 2,  // Layer properties and effects.
+    MltChunk_STROKES    = 3,  // A block of consecutive strokes of one layer.
+    MltChunk_HISTORY    = 4,
+    MltChunk_JOURNAL_ID = 5,  // Ties the file to its journal. See persist.h
+    MltChunk_STROKES_PACKED = 6,  // Like STROKES, encoded with stroke_encode. TOC entries are the same.
+    MltChunk_STROKE_INDEX = 7,  // Bounding rects of the strokes of one layer, after its STROKES chunks.
+    MltChunk_PREVIEW    = 8,  // One level of a pyramid of images of the canvas. See milton_load_preview.
+};
+
+struct MltHeader
+{
+    u32 magic;
+    u32 version;
+    u64 toc_offset;
+    u64 toc_count;
+};
+
+struct MltTocEntry
+{
+    u32     type;           // MltChunkType
+    i32     layer_id;       // LAYER, STROKES
+    u64     offset;         // From the beginning of the file.
+    u64     size;
+    i32     first_stroke;   // STROKES: Index in the saved layer of the first stroke in the block.
+    i32     num_strokes;    // LAYER: Strokes in the layer. STROKES: Strokes in the block.
+    Rect    bounding_rect;  // LAYER, STROKES: Bounds of the strokes, in canvas space.
+};
+
+// The JOURNAL_ID chunk. Older files only have `id`.
+struct MltJournalId
+{
+    u64     id;         // Different for every save. The journal of this file starts with it.
+    // Changes made while the file was being written are at the end of the previous journal, after
+    // `prev_size` bytes. Until the journal is started over, they are replayed from there.
+    u64     prev_id;
+    u64     prev_size;
+};
+
+// A STROKES chunk has num_strokes MltStrokeHeaders, then the points of every stroke, then the
+// pressures of every stroke.
+struct MltStrokeHeader
+{
+    Brush   brush;
+    i32     num_points;
+    i32     layer_id;
+};
+
+// A STROKES_PACKED chunk has num_strokes MltPackedStrokeHeaders, then the encoded points and
+// pressures of every stroke.
+struct MltPackedStrokeHeader
+{
+    Brush   brush;
+    i32     num_points;
+    i32     layer_id;
+    u32     num_bytes;  // Size of the encoded stroke.
+};
+
+// A STROKE_INDEX chunk has an MltStrokeIndex, then the bounding rects of groups of `group_size`
+// consecutive strokes, then the bounding rect of every stroke of the layer. Loading it saves
+// computing them from the points. The checksum covers the rects.
+struct MltStrokeIndex
+{
+    i32     num_strokes;
+    i32     group_size;
+    i32     num_groups;
+    u32     checksum;
+};
+
+enum MltPreviewFormat
+{
+    MltPreviewFormat_PNG = 1,
+};
+
+// A PREVIEW chunk has an MltPreviewHeader, then the image file.
+struct MltPreviewHeader
+{
+    i32     width;
+    i32     height;
+    i32     level;      // 0 is the largest.
+    u32     format;     // MltPreviewFormat
+};
+
+// FNV-1a
+static u32
+mlt_hash(u32 hash, void* data, size_t size)
+{
+    u8* bytes = (u8*)data;
+    for ( size_t i = 0; i < size; ++i ) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Writes go through a big buffer, so that a file is written with few system calls no matter how
+// small its fields are. Big writes, like the points of long strokes or an encoded block, skip the
+// buffer and are gathered with it into one write straight from their own memory.
+#define MLT_WRITE_BUFFER_SIZE   (1 * 1024 * 1024)
+#define MLT_WRITE_DIRECT_SIZE   (64 * 1024)
+
+// Writes to `fd`, or to `buffer` when it is set.
+struct MltWriter
+{
+    FILE*   fd;
+    u64     offset;
+    b32     ok;
+
+    u8*     out;        // Written to `fd` by mlt_flush.
+    size_t  out_count;
+
+    DArray<MltTocEntry> toc;
+    DArray<u8>*         buffer;
+    DArray<u8>          scratch;  // Encoded strokes of a packed block, or a preview image.
+    DArray<Stroke>      strokes;  // The block being written.
+    DArray<Rect>        rects;    // Bounds of the strokes written so far in the current layer.
+    DArray<v2l>         points;   // A compact stroke in wide format. See mlt_stroke_points
+    DArray<f32>         pressures;
+};
+
+// Writes what is buffered, followed by `size` bytes of `data`.
+static void
+mlt_flush(MltWriter* w, void* data = NULL, size_t size = 0)
+{
+    if ( w->ok && (w->out_count > 0 || size > 0) ) {
+        PlatformBuffer buffers[] = {
+            { w->out, w->out_count },
+            { data, size },
+        };
+        w->ok = platform_write_gather(w->fd, buffers, (i32)array_count(buffers));
+    }
+    w->out_count = 0;
+}
+
+static void
+mlt_write(MltWriter* w, void* data, size_t size)
+{
+    if ( w->ok && size > 0 ) {
+        if ( w->buffer ) {
+            append_range(w->buffer, (u8*)data, (i64)size);
+        } else if ( size >= MLT_WRITE_DIRECT_SIZE ) {
+            mlt_flush(w, data, size);
+        } else {
+            if ( w->out == NULL ) {
+                w->out = (u8*)mlt_calloc(MLT_WRITE_BUFFER_SIZE, 1, "Persist");
+            }
+            if ( w->out_count + size > MLT_WRITE_BUFFER_SIZE ) {
+                mlt_flush(w);
+            }
+            memcpy(w->out + w->out_count, data, size);
+            w->out_count += size;
+        }
+        w->offset += size;
+    }
+}
+
+// Flushes the writer and frees what it allocated. Returns false if anything failed to be written.
+static b32
+mlt_writer_release(MltWriter* w)
+{
+    if ( w->fd ) {
+        mlt_flush(w);
+    }
+    if ( w->out ) {
+        mlt_free(w->out, "Persist");
+    }
+    release(&w->toc);
+    release(&w->scratch);
+    release(&w->strokes);
+    release(&w->rects);
+    release(&w->points);
+    release(&w->pressures);
+
+    return w->ok;
+}
+
+// Files have wide points. Compact ones are read into the writer, and are good until the next call.
+static void
+mlt_stroke_points(MltWriter* w, Stroke* stroke, v2l** out_points, f32** out_pressures)
+{
+    if ( stroke->format == StrokeFormat_WIDE ) {
+        *out_points = stroke->points;
+        *out_pressures = stroke->pressures;
+    } else {
+        if ( w->points.capacity < stroke->num_points ) {
+            reserve(&w->points, stroke->num_points);
+            reserve(&w->pressures, stroke->num_points);
+        }
+        stroke_get_points(stroke, 0, stroke->num_points, w->points.data, w->pressures.data);
+        *out_points = w->points.data;
+        *out_pressures = w->pressures.data;
+    }
+}
+
+static void
+mlt_write_layer_props(MltWriter* w, char* name, i32 flags, f32 alpha, LayerEffect* effects)
+{
+    i32 len = (i32)(strlen(name) + 1);
+    mlt_write(w, &len, sizeof(i32));
+    mlt_write(w, name, (size_t)len);
+    mlt_write(w, &flags, sizeof(flags));
+    mlt_write(w, &alpha, sizeof(alpha));
+
+    i64 num_effects = 0;
+    for ( LayerEffect* e = effects; e != NULL; e = e->next ) {
+        ++num_effects;
+    }
+    mlt_write(w, &num_effects, sizeof(num_effects));
+    for ( LayerEffect* e = effects; e != NULL; e = e->next ) {
+        mlt_write(w, &e->type, sizeof(e->type));
+        mlt_write(w, &e->enabled, sizeof(e->enabled));
+        switch ( e->type ) {
+            case LayerEffectType_BLUR: {
+                mlt_write(w, &e->blur.original_scale, sizeof(e->blur.original_scale));
+                mlt_write(w, &e->blur.kernel_size, sizeof(e->blur.kernel_size));
+            } break;
+        }
+    }
+}
+
+// ---- Snapshots. See persist.h
+
+struct MltSnapshotLayer
+{
+    i32             id;
+    char            name[MAX_LAYER_NAME_LEN];
+    i32             flags;
+    f32             alpha;
+    LayerEffect*    effects;        // Copies, freed with the snapshot.
+
+    StrokeList*     strokes;
+    i64             num_strokes;    // In the layer when the snapshot was taken.
+    // Strokes below `intact_count` are still in the layer. The rest were undone since, and are kept
+    // in `undone`, last stroke first. Both are protected by MltSnapshot::mutex
+    i64             intact_count;
+    DArray<Stroke>  undone;
+};
+
+struct MltSnapshot
+{
+    PATH_CHAR       fname[MAX_PATH];
+    u32             version;
+    CanvasView      view;
+    i32             layer_guid;
+    v3f             picker_rgb;
+    PickerData      picker_data;    // For v4 and older.
+    DArray<v4f>     button_colors;
+    Brush           brushes[BrushEnum_COUNT];
+    i32             brush_sizes[BrushEnum_COUNT];
+    DArray<HistoryElement>      history;
+    DArray<MltSnapshotLayer>    layers;
+    i64             num_strokes;
+
+    MltJournalId    journal_id;     // v6 only.
+
+    // The canvas as it was on screen, RGBA. NULL when there is nothing to read it from. The writer
+    // scales it down in place.
+    u32*            preview;
+    i32             preview_w;
+    i32             preview_h;
+
+    SDL_mutex*      mutex;          // NULL when the canvas doesn't change during the save.
+    u32             request_ms;     // SDL_GetTicks() of the first request.
+
+    // Set by mlt_write_snapshot
+    b32             could_not_create;
+    b32             move_failed;
+    b32             ok;
+    u64             num_bytes;
+    f32             write_seconds;
+};
+
+// Saving in the background. See persist.h
+#define MILTON_SAVE_DEBOUNCE_MS     500
+#define MILTON_SAVE_MAX_DELAY_MS    5000
+
+struct MltSaver
+{
+    SDL_Thread*     thread;
+    SDL_mutex*      mutex;
+    SDL_cond*       cond;
+
+    // Protected by `mutex`.
+    MltSnapshot*    snapshot;       // Set by the main thread. NULL when the saver is idle.
+    b32             snapshot_done;
+    b32             quit;
+
+    // Main thread only.
+    b32             pending;
+    u32             first_request_ms;
+    u32             last_request_ms;
+    SaveStats       stats;
+};
+
+static void
+mlt_snapshot_take(MiltonState* milton_state, MltSnapshot* s, SDL_mutex* mutex)
+{
+    CanvasState* canvas = milton_state->canvas;
+    MiltonGui* gui = milton_state->gui;
+
+    PATH_STRNCPY(s->fname, milton_state->mlt_file_path, MAX_PATH - 1);
+    s->version = milton_state->mlt_binary_version;
+    s->view = *milton_state->view;
+    s->layer_guid = canvas->layer_guid;
+    s->picker_rgb = gui_get_picker_rgb(gui);
+    s->picker_data = gui->picker.data;
+    for ( ColorButton* b = gui->picker.color_buttons; b != NULL; b = b->next ) {
+        push(&s->button_colors, b->rgba);
+    }
+    memcpy(s->brushes, milton_state->brushes, sizeof(s->brushes));
+    memcpy(s->brush_sizes, milton_state->brush_sizes, sizeof(s->brush_sizes));
+
+    if ( canvas->history.count > 0 ) {
+        reserve(&s->history, canvas->history.count);
+        append_range(&s->history, canvas->history.data, canvas->history.count);
+    }
+
+    for ( Layer* layer = canvas->root_layer; layer != NULL; layer = layer->next ) {
+        MltSnapshotLayer sl = {};
+        sl.id = layer->id;
+        memcpy(sl.name, layer->name, sizeof(sl.name));
+        sl.flags = layer->flags;
+        sl.alpha = layer->alpha;
+        LayerEffect** e = &sl.effects;
+        for ( LayerEffect* src = layer->effects; src != NULL; src = src->next ) {
+            *e = (LayerEffect*)mlt_calloc(1, sizeof(LayerEffect), "Persist");
+            **e = *src;
+            (*e)->next = NULL;
+            e = &(*e)->next;
+        }
+        sl.strokes = &layer->strokes;
+        sl.num_strokes = layer->strokes.count;
+        sl.intact_count = sl.num_strokes;
+        s->num_strokes += sl.num_strokes;
+        push(&s->layers, sl);
+    }
+
+    if ( s->version >= 6 ) {
+        MltJournal* journal = &milton_state->journal;
+        // Something that a previous save of this file is unlikely to have used.
+        s->journal_id.id = ((u64)time(NULL) << 32) ^ perf_counter() ^ (u64)getpid();
+        if ( journal->fd ) {
+            s->journal_id.prev_id = journal->base_id;
+            s->journal_id.prev_size = journal->num_bytes;
+        }
+
+        v2i size = milton_state->view->screen_size;
+        if ( milton_state->render_data && size.w > 0 && size.h > 0 ) {
+            s->preview = (u32*)mlt_calloc((size_t)size.w * (size_t)size.h, sizeof(u32), "Persist");
+            if ( s->preview &&
+                 gpu_read_canvas_pixels(milton_state->render_data, 0, 0, size.w, size.h, s->preview) ) {
+                s->preview_w = size.w;
+                s->preview_h = size.h;
+            } else if ( s->preview ) {
+                mlt_free(s->preview, "Persist");
+                s->preview = NULL;
+            }
+        }
+    }
+
+    s->mutex = mutex;
+    s->request_ms = SDL_GetTicks();
+}
+
+static void
+mlt_snapshot_release(MltSnapshot* s)
+{
+    for ( i64 i = 0; i < s->layers.count; ++i ) {
+        MltSnapshotLayer* sl = &s->layers.data[i];
+        LayerEffect* e = sl->effects;
+        while ( e ) {
+            LayerEffect* next = e->next;
+            mlt_free(e, "Persist");
+            e = next;
+        }
+        release(&sl->undone);
+    }
+    release(&s->layers);
+    release(&s->history);
+    release(&s->button_colors);
+    if ( s->preview ) {
+        mlt_free(s->preview, "Persist");
+    }
+}
+
+// Copies strokes [first, first + count) of the layer, as they were when the snapshot was taken.
+static void
+mlt_snapshot_get_strokes(MltSnapshot* s, MltSnapshotLayer* sl, i64 first, i64 count, DArray<Stroke>* out)
+{
+    if ( out->capacity < count ) {
+        reserve(out, count);
+    }
+    out->count = 0;
+
+    if ( s->mutex ) {
+        SDL_LockMutex(s->mutex);
+    }
+    i64 end = first + count;
+    for ( i64 i = first; i < end; ) {
+        if ( i < sl->intact_count ) {
+            // Runs of strokes in the same bucket. The render element belongs to the main thread and
+            // is not copied.
+            i64 run = min(end, sl->intact_count) - i;
+            i32 bucket_i = strokelist_bucket_index(i);
+            run = min(run, strokelist_bucket_first(bucket_i) + strokelist_bucket_capacity(bucket_i) - i);
+            Stroke* src = get(sl->strokes, i);
+            for ( i64 k = 0; k < run; ++k ) {
+                Stroke* dst = &out->data[out->count++];
+                *dst = Stroke{};
+                dst->id = src[k].id;
+                dst->brush = src[k].brush;
+                dst->paged_size = src[k].paged_size;
+                dst->points = src[k].points;
+                dst->pressures = src[k].pressures;
+                dst->compact = src[k].compact;
+                dst->origin = src[k].origin;
+                dst->pressure = src[k].pressure;
+                dst->format = src[k].format;
+                dst->num_points = src[k].num_points;
+                dst->layer_id = src[k].layer_id;
+                dst->bounding_rect = src[k].bounding_rect;
+            }
+            i += run;
+        } else {
+            out->data[out->count++] = sl->undone.data[sl->num_strokes - 1 - i];
+            ++i;
+        }
+    }
+    if ( s->mutex ) {
+        SDL_UnlockMutex(s->mutex);
+    }
+}
+
+// ---- MLT v6 writer
+
+static i64
+mlt_begin_chunk(MltWriter* w, u32 type, i32 layer_id)
+{
+    u8 zeros[MLT_CHUNK_ALIGNMENT] = {};
+    u64 padding = (MLT_CHUNK_ALIGNMENT - (w->offset % MLT_CHUNK_ALIGNMENT)) % MLT_CHUNK_ALIGNMENT;
+    mlt_write(w, zeros, padding);
+
+    MltTocEntry entry = {};
+    entry.type = type;
+    entry.layer_id = layer_id;
+    entry.offset = w->offset;
+    entry.bounding_rect = rect_without_size();
+    push(&w->toc, entry);
+    return w->toc.count - 1;
+}
+
+static void
+mlt_end_chunk(MltWriter* w, i64 entry_i)
+{
+    MltTocEntry* entry = get(&w->toc, entry_i);
+    entry->size = w->offset - entry->offset;
+}
+
+static b32
+mlt_valid_stroke(Stroke* stroke)
+{
+    return stroke->num_points > 0 && stroke->num_points < STROKE_MAX_POINTS;
+}
+
+static void
+mlt_write_packed_stroke_block(MltWriter* w, i32 layer_id, Stroke* strokes, i32 count)
+{
+    i64 entry_i = mlt_begin_chunk(w, MltChunk_STROKES_PACKED, layer_id);
+    Rect bounds = rect_without_size();
+    i32 num_strokes = 0;
+
+    DArray<u8>* scratch = &w->scratch;
+    scratch->count = 0;
+    for ( i32 i = 0; i < count; ++i ) {
+        Stroke* stroke = &strokes[i];
+        if ( mlt_valid_stroke(stroke) ) {
+            b32 paged = stroke->format == StrokeFormat_PAGED;
+            size_t num_bytes = 0;
+            if ( paged ) {
+                // Already encoded, in the file it was loaded from.
+                num_bytes = stroke->paged_size;
+                append_range(scratch, stroke->compact, (i64)num_bytes);
+            } else {
+                reserve_more(scratch, (i64)stroke_codec_max_size(stroke->num_points));
+                v2l* points;
+                f32* pressures;
+                mlt_stroke_points(w, stroke, &points, &pressures);
+                num_bytes = stroke_encode(points, pressures, stroke->num_points, scratch->data + scratch->count);
+                scratch->count += (i64)num_bytes;
+            }
+
+            MltPackedStrokeHeader header = {};
+            header.brush = stroke->brush;
+            header.num_points = stroke->num_points;
+            header.layer_id = stroke->layer_id;
+            header.num_bytes = (u32)num_bytes;
+            mlt_write(w, &header, sizeof(header));
+            bounds = rect_union(bounds, stroke->bounding_rect);
+            push(&w->rects, stroke->bounding_rect);
+            ++num_strokes;
+        } else {
+            milton_log("WARNING: Trying to write a stroke of size %d\n", stroke->num_points);
+        }
+    }
+    mlt_write(w, scratch->data, (size_t)scratch->count);
+
+    mlt_end_chunk(w, entry_i);
+    MltTocEntry* entry = get(&w->toc, entry_i);
+    entry->num_strokes = num_strokes;
+    entry->bounding_rect = bounds;
+}
+
+// Halves an RGBA image in place, averaging 2x2 pixels.
+static void
+mlt_halve_preview(u32* pixels, i32* w, i32* h)
+{
+    i32 src_w = *w;
+    i32 dst_w = max(1, *w / 2);
+    i32 dst_h = max(1, *h / 2);
+    // Destination pixels come before the source pixels that are still to be read.
+    for ( i32 y = 0; y < dst_h; ++y ) {
+        u8* row0 = (u8*)(pixels + (2 * y) * src_w);
+        u8* row1 = (u8*)(pixels + min(2 * y + 1, *h - 1) * src_w);
+        u8* dst = (u8*)(pixels + y * dst_w);
+        for ( i32 x = 0; x < dst_w; ++x ) {
+            i32 x0 = 4 * (2 * x);
+            i32 x1 = 4 * min(2 * x + 1, src_w - 1);
+            for ( i32 c = 0; c < 4; ++c ) {
+                dst[4 * x + c] = (u8)((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) / 4);
+            }
+        }
+    }
+    *w = dst_w;
+    *h = dst_h;
+}
+
+// Called by stb_image_write
+static void
+mlt_png_write_func(void* context, void* data, int size)
+{
+    append_range((DArray<u8>*)context, (u8*)data, (i64)size);
+}
+
+static void
+mlt_write_previews(MltWriter* w, MltSnapshot* s)
+{
+    i32 width = s->preview_w;
+    i32 height = s->preview_h;
+    while ( max(width, height) > MLT_PREVIEW_MAX_SIZE ) {
+        mlt_halve_preview(s->preview, &width, &height);
+    }
+
+    DArray<u8>* png = &w->scratch;
+    for ( i32 level = 0; w->ok && max(width, height) >= MLT_PREVIEW_MIN_SIZE; ++level ) {
+        // Like the canvas on screen, previews are opaque.
+        for ( i64 i = 0; i < (i64)width * height; ++i ) {
+            s->preview[i] |= 0xff000000;
+        }
+        png->count = 0;
+        if ( !stbi_write_png_to_func(mlt_png_write_func, png, width, height, 4, s->preview, 0) ) {
+            break;
+        }
+
+        i64 entry_i = mlt_begin_chunk(w, MltChunk_PREVIEW, 0);
+        MltPreviewHeader header = {};
+        header.width = width;
+        header.height = height;
+        header.level = level;
+        header.format = MltPreviewFormat_PNG;
+        mlt_write(w, &header, sizeof(header));
+        mlt_write(w, png->data, (size_t)png->count);
+        mlt_end_chunk(w, entry_i);
+
+        mlt_halve_preview(s->preview, &width, &height);
+    }
+}
+
+// Writes the rects collected in w->rects for the layer, and starts over for the next one.
+static void
+mlt_write_stroke_index(MltWriter* w, i32 layer_id, Rect layer_bounds)
+{
+    i64 entry_i = mlt_begin_chunk(w, MltChunk_STROKE_INDEX, layer_id);
+
+    DArray<Rect>* rects = &w->rects;
+    MltStrokeIndex index = {};
+    index.num_strokes = (i32)rects->count;
+    index.group_size = MLT_STROKE_INDEX_GROUP_SIZE;
+    index.num_groups = (index.num_strokes + index.group_size - 1) / index.group_size;
+
+    // The group rects go in front of the stroke rects.
+    i64 num_groups = index.num_groups;
+    if ( rects->capacity < rects->count + num_groups ) {
+        reserve(rects, rects->count + num_groups);
+    }
+    memmove(rects->data + num_groups, rects->data, sizeof(Rect) * (size_t)rects->count);
+    for ( i64 g = 0; g < num_groups; ++g ) {
+        Rect* first = rects->data + num_groups + g * index.group_size;
+        i64 count = min((i64)index.group_size, index.num_strokes - g * index.group_size);
+        Rect bounds = rect_without_size();
+        for ( i64 i = 0; i < count; ++i ) {
+            bounds = rect_union(bounds, first[i]);
+        }
+        rects->data[g] = bounds;
+    }
+    rects->count += num_groups;
+
+    index.checksum = mlt_hash(2166136261u, rects->data, sizeof(Rect) * (size_t)rects->count);
+    mlt_write(w, &index, sizeof(index));
+    mlt_write(w, rects->data, sizeof(Rect) * (size_t)rects->count);
+    rects->count = 0;
+
+    mlt_end_chunk(w, entry_i);
+    MltTocEntry* entry = get(&w->toc, entry_i);
+    entry->num_strokes = index.num_strokes;
+    entry->bounding_rect = layer_bounds;
+}
+
+static b32
+milton_save_v6(MltSnapshot* s, FILE* fd, u64* out_size)
+{
+    MltWriter writer = {};
+    MltWriter* w = &writer;
+    w->fd = fd;
+    w->ok = true;
+
+    // The TOC offset is filled in at the end.
+    MltHeader header = {};
+    header.magic = MILTON_MAGIC_NUMBER;
+    header.version = s->version;
+    mlt_write(w, &header, sizeof(header));
+
+    {
+        i64 entry_i = mlt_begin_chunk(w, MltChunk_CANVAS, 0);
+        mlt_write(w, &s->view, sizeof(CanvasView));
+        mlt_write(w, &s->layer_guid, sizeof(i32));
+        mlt_write(w, &s->picker_rgb, sizeof(v3f));
+
+        i32 button_count = (i32)s->button_colors.count;
+        mlt_write(w, &button_count, sizeof(i32));
+        mlt_write(w, s->button_colors.data, sizeof(v4f) * (size_t)button_count);
+
+        mlt_write(w, s->brushes, sizeof(Brush) * BrushEnum_COUNT);
+        mlt_write(w, s->brush_sizes, sizeof(i32) * BrushEnum_COUNT);
+        mlt_end_chunk(w, entry_i);
+    }
+
+    if ( s->preview ) {
+        mlt_write_previews(w, s);
+    }
+
+    for ( i64 li = 0; w->ok && li < s->layers.count; ++li ) {
+        MltSnapshotLayer* layer = &s->layers.data[li];
+        if ( layer->num_strokes > INT_MAX ) {
+            milton_die_gracefully("FATAL. Number of strokes in layer greater than can be stored in file format. ");
+        }
+        i64 layer_entry_i = mlt_begin_chunk(w, MltChunk_LAYER, layer->id);
+        mlt_write_layer_props(w, layer->name, layer->flags, layer->alpha, layer->effects);
+        mlt_end_chunk(w, layer_entry_i);
+
+        // Blocks of strokes.
+        i32 num_strokes = (i32)layer->num_strokes;
+        Rect layer_bounds = rect_without_size();
+        i32 layer_stroke_count = 0;
+        for ( i32 first = 0; w->ok && first < num_strokes; ) {
+            DArray<Stroke>* strokes = &w->strokes;
+            mlt_snapshot_get_strokes(s, layer, first, min(num_strokes - first, MLT_BLOCK_MAX_STROKES), strokes);
+            i32 count = 0;
+            size_t bytes = 0;
+            while ( count < strokes->count ) {
+                size_t stroke_bytes = (size_t)strokes->data[count].num_points * (sizeof(v2l) + sizeof(f32));
+                if ( count > 0 && bytes + stroke_bytes > MLT_BLOCK_MAX_BYTES ) {
+                    break;
+                }
+                bytes += stroke_bytes;
+                ++count;
+            }
+            i64 block_i = w->toc.count;
+            mlt_write_packed_stroke_block(w, layer->id, strokes->data, count);
+            MltTocEntry* block = get(&w->toc, block_i);
+            // Strokes that could not be written are not counted.
+            block->first_stroke = layer_stroke_count;
+            layer_bounds = rect_union(layer_bounds, block->bounding_rect);
+            layer_stroke_count += block->num_strokes;
+            first += count;
+        }
+        MltTocEntry* layer_entry = get(&w->toc, layer_entry_i);
+        layer_entry->num_strokes = layer_stroke_count;
+        layer_entry->bounding_rect = layer_bounds;
+
+        mlt_write_stroke_index(w, layer->id, layer_bounds);
+    }
+
+    {
+        i64 entry_i = mlt_begin_chunk(w, MltChunk_HISTORY, 0);
+        i32 history_count = (i32)s->history.count;
+        if ( s->history.count > INT_MAX ) {
+            history_count = 0;
+        }
+        mlt_write(w, &history_count, sizeof(history_count));
+        mlt_write(w, s->history.data, sizeof(HistoryElement) * (size_t)history_count);
+        mlt_end_chunk(w, entry_i);
+    }
+
+    {
+        i64 entry_i = mlt_begin_chunk(w, MltChunk_JOURNAL_ID, 0);
+        mlt_write(w, &s->journal_id, sizeof(MltJournalId));
+        mlt_end_chunk(w, entry_i);
+    }
+
+    // TOC, and its location in the header.
+    header.toc_offset = w->offset;
+    header.toc_count = (u64)w->toc.count;
+    mlt_write(w, w->toc.data, sizeof(MltTocEntry) * (size_t)w->toc.count);
+    *out_size = w->offset;
+    mlt_flush(w);
+    if ( w->ok ) {
+        w->ok = fseek(fd, 0, SEEK_SET) == 0;
+        mlt_write(w, &header, sizeof(header));
+    }
+
+    return mlt_writer_release(w);
+}
+
+// Reads from a mapped file, checking that we don't go past the end of a chunk.
+struct MltCursor
+{
+    u8*     data;
+    u64     size;
+    u64     pos;
+    b32     ok;
+};
+
+static u8*
+mlt_take(MltCursor* c, u64 size)
+{
+    u8* result = NULL;
+    if ( c->ok && size <= c->size - c->pos ) {
+        result = c->data + c->pos;
+        c->pos += size;
+    } else {
+        c->ok = false;
+    }
+    return result;
+}
+
+static void
+mlt_read(MltCursor* c, void* dst, u64 size)
+{
+    u8* src = mlt_take(c, size);
+    if ( src ) {
+        memcpy(dst, src, size);
+    }
+}
+
+static void
+mlt_read_layer_props(MltCursor* c, CanvasState* canvas, Layer* layer)
+{
+    i32 len = 0;
+    mlt_read(c, &len, sizeof(i32));
+    if ( len <= 0 || len > MAX_LAYER_NAME_LEN ) {
+        milton_log("Corrupt file. Layer name is too long.\n");
+        c->ok = false;
+    }
+    mlt_read(c, layer->name, (u64)len);
+    layer->name[MAX_LAYER_NAME_LEN - 1] = '\0';
+    mlt_read(c, &layer->flags, sizeof(layer->flags));
+    mlt_read(c, &layer->alpha, sizeof(layer->alpha));
+
+    i64 num_effects = 0;
+    mlt_read(c, &num_effects, sizeof(num_effects));
+    layer->effects = NULL;
+    LayerEffect** e = &layer->effects;
+    for ( i64 ei = 0; c->ok && ei < num_effects; ++ei ) {
+        *e = arena_alloc_elem(&canvas->arena, LayerEffect);
+        mlt_read(c, &(*e)->type, sizeof((*e)->type));
+        mlt_read(c, &(*e)->enabled, sizeof((*e)->enabled));
+        switch ( (*e)->type ) {
+            case LayerEffectType_BLUR: {
+                mlt_read(c, &(*e)->blur.original_scale, sizeof((*e)->blur.original_scale));
+                mlt_read(c, &(*e)->blur.kernel_size, sizeof((*e)->blur.kernel_size));
+            } break;
+        }
+        e = &(*e)->next;
+    }
+}
+
+static MltCursor
+mlt_cursor(u8* data, u64 size)
+{
+    MltCursor c = {};
+    c.data = data;
+    c.size = size;
+    c.ok = true;
+    return c;
+}
+
+// A STROKES or STROKES_PACKED chunk. Its strokes are pushed to their layer before they are decoded,
+// so that their order and IDs don't depend on which thread decodes them. They have empty bounding
+// rects, so nothing draws them, until their block is published.
+struct MltStrokeBlock
+{
+    u32             type;
+    void*           headers;
+    u8*             data;           // Encoded strokes, or raw points followed by raw pressures.
+    u64             num_points;
+    i32             num_strokes;
+    i32             num_live;       // Leading strokes that are still in the layer. See mlt_loader_prepare
+    i64             first_stroke;   // Index into MltLoader::strokes
+    i64             first_in_layer;
+    i32             first_id;
+    Layer*          layer;
+    Rect            bounding_rect;  // From the TOC.
+    Rect*           rects;          // Bounding rect of each stroke.
+    v2l*            points;         // Decoded, until they are copied to the strokes when published.
+    f32*            pressures;
+    b32             zero_copy;
+    b32             has_rects;      // `rects` points into a STROKE_INDEX chunk.
+    b32             paged;          // Its strokes are left in the file. See mlt_loader_prepare
+    b32             ok;
+    SDL_atomic_t    decoded;
+    b32             published;
+};
+
+struct MltLoader
+{
+    DArray<MltStrokeBlock>  blocks;
+    DArray<Stroke*>         strokes;
+    DArray<Rect>            rects;           // For blocks without a STROKE_INDEX.
+    DArray<i32>             indexed_layers;  // Layers whose rects came from a STROKE_INDEX chunk.
+    DArray<i64>             order;           // Blocks in the order in which they are decoded.
+    StrokePool*             pool;            // Decoded points are made compact when published.
+    size_t                  resident_budget; // See MiltonState::resident_budget. 0 when nothing is paged.
+    i64                     num_paged_strokes;
+    SDL_atomic_t            next_block;
+    SDL_atomic_t            quit;
+
+    // Streaming. See milton_load_tick
+    SDL_Thread*             threads[MLT_LOAD_MAX_THREADS];
+    i32                     num_threads;
+    i64                     num_published;  // Blocks
+    i64                     num_published_strokes;
+    i64                     num_live_strokes;
+    u64                     start;  // perf_counter
+    b32                     ok;
+    u32                     preview;
+    i32                     preview_w;
+    i32                     preview_h;
+};
+
+static Stroke
+mlt_stroke_from_header(MltStrokeBlock* block, i32 i)
+{
+    Stroke stroke = Stroke{};
+    if ( block->type == MltChunk_STROKES_PACKED ) {
+        MltPackedStrokeHeader* header = (MltPackedStrokeHeader*)block->headers + i;
+        stroke.brush = header->brush;
+        stroke.num_points = header->num_points;
+        stroke.layer_id = header->layer_id;
+    } else {
+        MltStrokeHeader* header = (MltStrokeHeader*)block->headers + i;
+        stroke.brush = header->brush;
+        stroke.num_points = header->num_points;
+        stroke.layer_id = header->layer_id;
+    }
+    return stroke;
+}
+
+// Checks the stroke headers and pushes strokes without points to `layer`. The points are filled in
+// by mlt_decode_stroke_block. When `zero_copy` is set, strokes point into the mapped file instead of
+// copying into the arena.
+static b32
+mlt_add_stroke_block(MiltonState* milton_state, MltLoader* loader, Layer* layer, u32 type,
+                     MltCursor* c, i32 num_strokes, Rect bounding_rect, b32 zero_copy)
+{
+    CanvasState* canvas = milton_state->canvas;
+    loader->pool = &canvas->stroke_pool;
+
+    MltStrokeBlock block = {};
+    block.type = type;
+    block.num_strokes = num_strokes;
+    block.num_live = num_strokes;
+    block.first_stroke = loader->strokes.count;
+    block.first_in_layer = layer->strokes.count;
+    block.first_id = canvas->stroke_id_count;
+    block.layer = layer;
+    block.bounding_rect = bounding_rect;
+    block.ok = true;
+
+    if ( type == MltChunk_STROKES_PACKED ) {
+        block.headers = mlt_take(c, sizeof(MltPackedStrokeHeader) * (u64)num_strokes);
+        block.data = c->data + c->pos;
+        zero_copy = false;
+    } else {
+        block.headers = mlt_take(c, sizeof(MltStrokeHeader) * (u64)num_strokes);
+        block.data = c->data + c->pos;
+    }
+
+    for ( i32 i = 0; c->ok && i < num_strokes; ++i ) {
+        Stroke stroke = mlt_stroke_from_header(&block, i);
+        if ( type == MltChunk_STROKES_PACKED ) {
+            mlt_take(c, ((MltPackedStrokeHeader*)block.headers)[i].num_bytes);
+        }
+        if ( c->ok && (stroke.num_points <= 0 || stroke.num_points >= STROKE_MAX_POINTS) ) {
+            milton_log("ERROR: File has a stroke with %d points\n", stroke.num_points);
+            c->ok = false;
+        }
+        block.num_points += (u64)stroke.num_points;
+    }
+
+    v2l* points = NULL;
+    f32* pressures = NULL;
+    if ( type == MltChunk_STROKES ) {
+        points = (v2l*)mlt_take(c, sizeof(v2l) * block.num_points);
+        pressures = (f32*)mlt_take(c, sizeof(f32) * block.num_points);
+        if ( (uintptr_t)points % alignof(v2l) != 0 || (uintptr_t)pressures % alignof(f32) != 0 ) {
+            zero_copy = false;
+        }
+    }
+    block.zero_copy = zero_copy;
+
+    for ( i32 i = 0; c->ok && i < num_strokes; ++i ) {
+        Stroke stroke = mlt_stroke_from_header(&block, i);
+        stroke.id = canvas->stroke_id_count++;
+
+        // Otherwise the points are set when the block is published.
+        if ( zero_copy ) {
+            stroke.points = points;
+            stroke.pressures = pressures;
+            points += stroke.num_points;
+            pressures += stroke.num_points;
+        }
+        // Set when the block is published.
+        stroke.bounding_rect = rect_without_size();
+
+        push(&loader->strokes, layer::layer_push_stroke(layer, stroke));
+    }
+
+    if ( c->ok ) {
+        push(&loader->blocks, block);
+    }
+    return c->ok;
+}
+
+// Call once every block has been added, and the journal replayed. An undo in the journal pops loaded
+// strokes from the end of their layer, and the journal's own strokes can then take their place, so
+// only the strokes that are still in the layer are decoded. Blocks that intersect `visible` are
+// decoded first.
+//
+// With a resident budget, packed blocks are paged once the points of the blocks before them would
+// take more than the budget in memory. Paged blocks are only decoded when their rects aren't in a
+// STROKE_INDEX, and their points are dropped as soon as the rects are computed.
+static void
+mlt_loader_prepare(MltLoader* loader, Rect visible)
+{
+    loader->ok = true;
+    reserve(&loader->rects, loader->strokes.count);
+    loader->rects.count = loader->strokes.count;
+
+    for ( i64 bi = 0; bi < loader->blocks.count; ++bi ) {
+        MltStrokeBlock* block = &loader->blocks.data[bi];
+        i64 num_in_layer = block->layer->strokes.count - block->first_in_layer;
+        i32 num_live = (i32)max((i64)0, min(num_in_layer, (i64)block->num_strokes));
+        for ( i32 i = 0; i < num_live; ++i ) {
+            if ( loader->strokes.data[block->first_stroke + i]->id != block->first_id + i ) {
+                num_live = i;
+            }
+        }
+        block->num_live = num_live;
+        loader->num_live_strokes += num_live;
+
+        if ( !block->has_rects ) {
+            block->rects = loader->rects.data + block->first_stroke;
+        }
+    }
+
+    reset(&loader->order);
+    size_t resident_bytes = 0;
+    for ( i32 pass = 0; pass < 2; ++pass ) {
+        for ( i64 bi = 0; bi < loader->blocks.count; ++bi ) {
+            MltStrokeBlock* block = &loader->blocks.data[bi];
+            b32 is_visible = rect_intersects_rect(block->bounding_rect, visible);
+            if ( is_visible != (pass == 0) ) {
+                continue;
+            }
+            // What the points take if they are close together. Zero copy points are in the file already.
+            size_t size = 0;
+            for ( i32 i = 0; !block->zero_copy && i < block->num_live; ++i ) {
+                i32 num_points = mlt_stroke_from_header(block, i).num_points;
+                size += stroke_pool_size_for(stroke_points_size(num_points, StrokeFormat_OFFSETS_16));
+            }
+            if ( loader->resident_budget > 0 &&
+                 block->type == MltChunk_STROKES_PACKED &&
+                 resident_bytes + size > loader->resident_budget ) {
+                block->paged = true;
+            } else {
+                resident_bytes += size;
+            }
+            if ( block->paged && block->has_rects ) {
+                SDL_AtomicSet(&block->decoded, 1);
+            } else {
+                push(&loader->order, bi);
+            }
+        }
+    }
+}
+
+static void
+mlt_block_free_points(MltStrokeBlock* block)
+{
+    if ( block->points ) {
+        mlt_free(block->points, "Persist");
+        mlt_free(block->pressures, "Persist");
+    }
+}
+
+// Runs on any thread. The block was checked by mlt_add_stroke_block, except for the encoded points.
+// Strokes are only read by the main thread until the block is published, so their points are decoded
+// into the block.
+static void
+mlt_decode_stroke_block(MltLoader* loader, MltStrokeBlock* block)
+{
+    u8* data = block->data;
+    v2l* points = (v2l*)block->data;
+    f32* pressures = (f32*)(block->data + sizeof(v2l) * block->num_points);
+    if ( !block->zero_copy ) {
+        block->points = (v2l*)mlt_calloc((size_t)block->num_points, sizeof(v2l), "Persist");
+        block->pressures = (f32*)mlt_calloc((size_t)block->num_points, sizeof(f32), "Persist");
+    }
+    v2l* out_points = block->points;
+    f32* out_pressures = block->pressures;
+
+    for ( i32 i = 0; block->ok && i < block->num_live; ++i ) {
+        Stroke header = mlt_stroke_from_header(block, i);
+        size_t num_points = (size_t)header.num_points;
+        if ( block->type == MltChunk_STROKES_PACKED ) {
+            u32 num_bytes = ((MltPackedStrokeHeader*)block->headers)[i].num_bytes;
+            block->ok = stroke_decode(data, num_bytes, header.num_points, out_points, out_pressures);
+            data += num_bytes;
+        } else if ( !block->zero_copy ) {
+            // The file might not be aligned.
+            memcpy(out_points, points, sizeof(v2l) * num_points);
+            memcpy(out_pressures, pressures, sizeof(f32) * num_points);
+        }
+        if ( block->ok && !block->has_rects ) {
+            Rect bounds = bounding_rect_for_points(block->zero_copy ? points : out_points, header.num_points);
+            block->rects[i] = rect_enlarge(bounds, header.brush.radius);
+        }
+        points += num_points;
+        pressures += num_points;
+        out_points += num_points;
+        out_pressures += num_points;
+    }
+    if ( block->paged ) {
+        // Only the rects were needed.
+        mlt_block_free_points(block);
+    }
+    // The points and rects are written before `decoded` is.
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&block->decoded, 1);
+}
+
+static int  // Thread
+mlt_decode_thread(void* data)
+{
+    MltLoader* loader = (MltLoader*)data;
+    while ( !SDL_AtomicGet(&loader->quit) ) {
+        i64 order_i = SDL_AtomicAdd(&loader->next_block, 1);
+        if ( order_i >= loader->order.count ) {
+            break;
+        }
+        mlt_decode_stroke_block(loader, &loader->blocks.data[loader->order.data[order_i]]);
+    }
+    return 0;
+}
+
+// Starts up to `num_threads` decoder threads and returns without waiting for them.
+static void
+mlt_loader_start(MltLoader* loader, i32 num_threads)
+{
+    num_threads = min(num_threads, MLT_LOAD_MAX_THREADS);
+    num_threads = (i32)min((i64)num_threads, loader->order.count);
+
+    SDL_AtomicSet(&loader->next_block, 0);
+    for ( i32 i = 0; i < num_threads; ++i ) {
+        loader->threads[i] = SDL_CreateThread(mlt_decode_thread, "MLT decoder", loader);
+        if ( !loader->threads[i] ) {
+            // Make do with the threads that we have.
+            break;
+        }
+        loader->num_threads = i + 1;
+    }
+}
+
+// Strokes of a paged block read their points from the mapped file.
+static void
+mlt_page_stroke_block(MltLoader* loader, MltStrokeBlock* block)
+{
+    u8* data = block->data;
+    for ( i32 i = 0; i < block->num_live; ++i ) {
+        u32 num_bytes = ((MltPackedStrokeHeader*)block->headers)[i].num_bytes;
+        Stroke* stroke = loader->strokes.data[block->first_stroke + i];
+        stroke->compact = data;
+        stroke->paged_size = num_bytes;
+        stroke->format = StrokeFormat_PAGED;
+        data += num_bytes;
+    }
+    loader->pool->num_paged += block->num_live;
+    loader->num_paged_strokes += block->num_live;
+}
+
+// Main thread. Gives the strokes of every decoded block their bounding rects, so that they are drawn
+// from now on. Returns true if anything was published.
+static b32
+mlt_loader_publish(MltLoader* loader)
+{
+    b32 published = false;
+    for ( i64 bi = 0; bi < loader->blocks.count; ++bi ) {
+        MltStrokeBlock* block = &loader->blocks.data[bi];
+        if ( block->published || !SDL_AtomicGet(&block->decoded) ) {
+            continue;
+        }
+        SDL_MemoryBarrierAcquire();
+        block->published = true;
+        loader->num_published += 1;
+        if ( block->ok ) {
+            strokelist_set_bounding_rects(&block->layer->strokes, block->first_in_layer, block->num_live,
+                                          block->rects);
+            if ( block->paged ) {
+                mlt_page_stroke_block(loader, block);
+            }
+            v2l* points = block->points;
+            f32* pressures = block->pressures;
+            for ( i32 i = 0; points && i < block->num_live; ++i ) {
+                Stroke* stroke = loader->strokes.data[block->first_stroke + i];
+                stroke_copy_points(loader->pool, stroke, points, pressures);
+                points += stroke->num_points;
+                pressures += stroke->num_points;
+            }
+            loader->num_published_strokes += block->num_live;
+            published = true;
+        } else {
+            milton_log("ERROR: Could not decode stroke block %d\n", (int)bi);
+            loader->ok = false;
+        }
+        mlt_block_free_points(block);
+    }
+    return published;
+}
+
+// Decodes the rest of the blocks on the calling thread, along with the decoder threads, and waits
+// for all of them. With `cancel`, decoders stop after their current block.
+static void
+mlt_loader_join(MltLoader* loader, b32 cancel)
+{
+    if ( cancel ) {
+        SDL_AtomicSet(&loader->quit, 1);
+    } else {
+        mlt_decode_thread(loader);
+    }
+    for ( i32 i = 0; i < loader->num_threads; ++i ) {
+        SDL_WaitThread(loader->threads[i], NULL);
+    }
+    loader->num_threads = 0;
+}
+
+static void
+mlt_loader_release(MltLoader* loader)
+{
+    mlt_assert(loader->num_threads == 0);
+    if ( loader->preview ) {
+        gpu_free_image(loader->preview);
+    }
+    for ( i64 bi = 0; bi < loader->blocks.count; ++bi ) {
+        mlt_block_free_points(&loader->blocks.data[bi]);
+    }
+    release(&loader->blocks);
+    release(&loader->strokes);
+    release(&loader->rects);
+    release(&loader->indexed_layers);
+    release(&loader->order);
+}
+
+// Decodes every block with up to `num_threads` threads, counting the calling thread, and publishes
+// them.
+static b32
+mlt_decode_stroke_blocks(MltLoader* loader, i32 num_threads)
+{
+    mlt_loader_start(loader, num_threads - 1);
+    mlt_loader_join(loader, /*cancel*/false);
+    mlt_loader_publish(loader);
+    return loader->ok;
+}
+
+// Keeps the bounding rects of the strokes of `layer`, which have all been added, for when they are
+// published. If the index can't be used, the rects are computed from the points as usual.
+static void
+mlt_load_stroke_index(MltLoader* loader, Layer* layer, MltCursor* c)
+{
+    MltStrokeIndex index = {};
+    mlt_read(c, &index, sizeof(index));
+    b32 ok = c->ok &&
+             index.num_strokes == layer->strokes.count &&
+             index.group_size > 0 &&
+             index.num_groups == (i32)((index.num_strokes + (i64)index.group_size - 1) / index.group_size);
+    u64 size = ok ? sizeof(Rect) * ((u64)index.num_groups + (u64)index.num_strokes) : 0;
+    Rect* rects = ok ? (Rect*)mlt_take(c, size) : NULL;
+    ok = rects != NULL &&
+         (uintptr_t)rects % alignof(Rect) == 0 &&
+         mlt_hash(2166136261u, rects, size) == index.checksum;
+
+    if ( ok ) {
+        // Buckets can be bigger than what has been published so far.
+        Rect* stroke_rects = rects + index.num_groups;
+        strokelist_set_bucket_rects(&layer->strokes, stroke_rects);
+        for ( i64 bi = 0; bi < loader->blocks.count; ++bi ) {
+            MltStrokeBlock* block = &loader->blocks.data[bi];
+            if ( block->layer == layer ) {
+                block->rects = stroke_rects + block->first_in_layer;
+                block->has_rects = true;
+            }
+        }
+        push(&loader->indexed_layers, layer->id);
+    } else {
+        milton_log("Stroke index of layer %d does not match. Computing bounding rects.\n", layer->id);
+    }
+    // Strokes are still fine without it.
+    c->ok = true;
+}
+
+static b32
+mlt_layer_is_indexed(MltLoader* loader, i32 layer_id)
+{
+    for ( i64 i = 0; i < loader->indexed_layers.count; ++i ) {
+        if ( loader->indexed_layers.data[i] == layer_id ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Loads a single raw stroke on the calling thread.
+static b32
+mlt_load_journal_stroke(MiltonState* milton_state, Layer* layer, MltCursor* c)
+{
+    MltLoader loader = {};
+    b32 ok = mlt_add_stroke_block(milton_state, &loader, layer, MltChunk_STROKES, c, 1, rect_without_size(),
+                                  /*zero_copy*/false);
+    if ( ok ) {
+        mlt_loader_prepare(&loader, rect_without_size());
+        ok = mlt_decode_stroke_blocks(&loader, 1);
+    }
+    mlt_loader_release(&loader);
+    return ok;
+}
+
+// Reads everything but the stroke points of a v6 file from `file`, and adds the strokes of every
+// block to `loader`. With `keep_mapping`, strokes past MiltonState::resident_budget are paged, the
+// strokes of STROKES blocks point into the file instead of being copied, and `file` must stay mapped
+// for as long as the canvas is loaded. Otherwise it must stay mapped until the loader is done.
+// Milton writes STROKES_PACKED blocks, so only files from before them have STROKES blocks.
+static b32
+mlt_load_v6_begin(MiltonState* milton_state, MltLoader* loader, PlatformMappedFile* file, b32 keep_mapping,
+                  i32* out_layer_guid, MltJournalId* out_journal_id)
+{
+    b32 ok = true;
+    CanvasState* canvas = milton_state->canvas;
+    loader->resident_budget = keep_mapping ? milton_state->resident_budget : 0;
+
+    MltCursor fc = mlt_cursor(file->data, file->size);
+    MltHeader header = {};
+    mlt_read(&fc, &header, sizeof(header));
+    ok = fc.ok &&
+         header.toc_offset <= file->size &&
+         header.toc_count <= (file->size - header.toc_offset) / sizeof(MltTocEntry);
+
+    b32 has_canvas = false;
+    v2i saved_size = milton_state->view->screen_size;
+    i32 saved_working_layer_id = 0;
+
+    for ( u64 i = 0; ok && i < header.toc_count; ++i ) {
+        // The TOC is not necessarily aligned.
+        MltTocEntry toc_entry = {};
+        memcpy(&toc_entry, file->data + header.toc_offset + i * sizeof(MltTocEntry), sizeof(MltTocEntry));
+        MltTocEntry* entry = &toc_entry;
+        if ( entry->offset > file->size || entry->size > file->size - entry->offset ) {
+            ok = false;
+            break;
+        }
+        if ( entry->type != MltChunk_CANVAS &&
+             entry->type != MltChunk_LAYER &&
+             entry->type != MltChunk_STROKES &&
+             entry->type != MltChunk_STROKES_PACKED &&
+             entry->type != MltChunk_HISTORY &&
+             entry->type != MltChunk_JOURNAL_ID &&
+             entry->type != MltChunk_STROKE_INDEX ) {
+            // Written by a newer Milton, or not needed for loading, like PREVIEW. We can do without it.
+            continue;
+        }
+
+        MltCursor c = mlt_cursor(file->data + entry->offset, entry->size);
+        switch ( entry->type ) {
+            case MltChunk_CANVAS: {
+                mlt_read(&c, milton_state->view, sizeof(CanvasView));
+                // The screen size might hurt us.
+                milton_state->view->screen_size = saved_size;
+                // Creating layers changes working_layer_id.
+                saved_working_layer_id = milton_state->view->working_layer_id;
+
+                mlt_read(&c, out_layer_guid, sizeof(i32));
+
+                v3f rgb = {};
+                mlt_read(&c, &rgb, sizeof(rgb));
+                if ( c.ok ) {
+                    gui_picker_from_rgb(&milton_state->gui->picker, rgb);
+                }
+
+                i32 button_count = 0;
+                mlt_read(&c, &button_count, sizeof(i32));
+                ColorButton* btn = milton_state->gui->picker.color_buttons;
+                for ( i32 bi = 0; btn != NULL && bi < button_count; ++bi, btn = btn->next ) {
+                    mlt_read(&c, &btn->rgba, sizeof(v4f));
+                }
+
+                mlt_read(&c, &milton_state->brushes, sizeof(Brush) * BrushEnum_COUNT);
+                mlt_read(&c, &milton_state->brush_sizes, sizeof(i32) * BrushEnum_COUNT);
+                has_canvas = c.ok;
+            } break;
+            case MltChunk_LAYER: {
+                milton_new_layer(milton_state);
+                Layer* layer = canvas->working_layer;
+                layer->id = entry->layer_id;
+                mlt_read_layer_props(&c, canvas, layer);
+            } break;
+            case MltChunk_STROKES:
+            case MltChunk_STROKES_PACKED: {
+                Layer* layer = layer::get_by_id(canvas->root_layer, entry->layer_id);
+                if ( layer == NULL || entry->first_stroke != layer->strokes.count || entry->num_strokes < 0 ||
+                     mlt_layer_is_indexed(loader, layer->id) ) {
+                    c.ok = false;
+                } else {
+                    mlt_add_stroke_block(milton_state, loader, layer, entry->type, &c, entry->num_strokes,
+                                         entry->bounding_rect, keep_mapping);
+                }
+            } break;
+            case MltChunk_STROKE_INDEX: {
+                Layer* layer = layer::get_by_id(canvas->root_layer, entry->layer_id);
+                if ( layer ) {
+                    mlt_load_stroke_index(loader, layer, &c);
+                }
+            } break;
+            case MltChunk_JOURNAL_ID: {
+                *out_journal_id = MltJournalId{};
+                mlt_read(&c, out_journal_id, min(entry->size, (u64)sizeof(MltJournalId)));
+            } break;
+            case MltChunk_HISTORY: {
+                i32 history_count = 0;
+                mlt_read(&c, &history_count, sizeof(history_count));
+                if ( c.ok && history_count >= 0 &&
+                     (u64)history_count * sizeof(HistoryElement) <= c.size - c.pos ) {
+                    reset(&canvas->history);
+                    reserve(&canvas->history, history_count);
+                    mlt_read(&c, canvas->history.data, sizeof(HistoryElement) * (u64)history_count);
+                    canvas->history.count = history_count;
+                } else {
+                    c.ok = false;
+                }
+            } break;
+        }
+        ok = c.ok;
+    }
+
+    if ( ok && !has_canvas ) {
+        ok = false;
+    }
+    if ( ok ) {
+        milton_state->view->working_layer_id = saved_working_layer_id;
+    }
+
+    return ok;
+}
+
+// Loads a v6 file from `file`, decoding strokes with up to `num_threads` threads before returning.
+// See mlt_load_v6_begin for `keep_mapping`.
+static b32
+milton_load_v6(MiltonState* milton_state, PlatformMappedFile* file, b32 keep_mapping,
+               i32 num_threads, i32* out_layer_guid, MltJournalId* out_journal_id)
+{
+    MltLoader loader = {};
+    b32 ok = mlt_load_v6_begin(milton_state, &loader, file, keep_mapping, out_layer_guid, out_journal_id);
+    if ( ok ) {
+        mlt_loader_prepare(&loader, rect_without_size());
+        ok = mlt_decode_stroke_blocks(&loader, num_threads);
+    }
+    mlt_loader_release(&loader);
+    return ok;
+}
+
+u8*
+milton_load_preview(PATH_CHAR* fname, i32 max_size, i32* out_w, i32* out_h)
+{
+    u8* pixels = NULL;
+    PlatformMappedFile file = {};
+    if ( !platform_map_file(fname, &file) ) {
+        return NULL;
+    }
+
+    MltCursor fc = mlt_cursor(file.data, file.size);
+    MltHeader header = {};
+    mlt_read(&fc, &header, sizeof(header));
+    b32 ok = fc.ok &&
+             header.magic == MILTON_MAGIC_NUMBER &&
+             header.version >= 6 &&
+             header.toc_offset <= file.size &&
+             header.toc_count <= (file.size - header.toc_offset) / sizeof(MltTocEntry);
+
+    // The largest preview that fits, or the smallest one.
+    MltTocEntry best = {};
+    MltPreviewHeader best_header = {};
+    for ( u64 i = 0; ok && i < header.toc_count; ++i ) {
+        MltTocEntry entry = {};
+        memcpy(&entry, file.data + header.toc_offset + i * sizeof(MltTocEntry), sizeof(MltTocEntry));
+        if ( entry.type != MltChunk_PREVIEW ||
+             entry.offset > file.size || entry.size > file.size - entry.offset ) {
+            continue;
+        }
+        MltCursor c = mlt_cursor(file.data + entry.offset, entry.size);
+        MltPreviewHeader preview = {};
+        mlt_read(&c, &preview, sizeof(preview));
+        if ( !c.ok || preview.format != MltPreviewFormat_PNG ) {
+            continue;
+        }
+        i32 size = max(preview.width, preview.height);
+        i32 best_size = max(best_header.width, best_header.height);
+        b32 fits = size <= max_size;
+        b32 best_fits = best.type != 0 && best_size <= max_size;
+        if ( best.type == 0 ||
+             (fits && (!best_fits || size > best_size)) ||
+             (!fits && !best_fits && size < best_size) ) {
+            best = entry;
+            best_header = preview;
+        }
+    }
+
+    if ( ok && best.type != 0 ) {
+        u8* png = file.data + best.offset + sizeof(MltPreviewHeader);
+        int png_size = (int)(best.size - sizeof(MltPreviewHeader));
+        int w = 0, h = 0, n = 0;
+        u8* decoded = stbi_load_from_memory(png, png_size, &w, &h, &n, 4);
+        if ( decoded ) {
+            pixels = (u8*)mlt_calloc((size_t)w * (size_t)h, 4, "Persist");
+            if ( pixels ) {
+                memcpy(pixels, decoded, (size_t)w * (size_t)h * 4);
+                *out_w = w;
+                *out_h = h;
+            }
+            stbi_image_free(decoded);
+        }
+    }
+
+    platform_unmap_file(&file);
+    return pixels;
+}
+
+// ---- Journal. See persist.h
+
+#define MLT_JOURNAL_MAGIC               0x11DECAF4
+#define MLT_JOURNAL_VERSION             1
+#define MLT_JOURNAL_MIN_COMPACTION_SIZE (16*1024*1024)
+
+struct MltJournalHeader
+{
+    u32 magic;
+    u32 version;
+    u64 base_id;
+};
+
+// Followed by `size` bytes of payload.
+struct MltJournalRecord
+{
+    u32 op;         // JournalOp
+    u32 size;
+    u32 checksum;   // Of the payload. A crash while appending leaves a record that doesn't match.
+    u32 reserved;
+};
+
+enum MltJournalReplay
+{
+    MltJournalReplay_NONE,   // There is no journal for this file.
+    MltJournalReplay_CLEAN,  // Every record was replayed.
+    MltJournalReplay_TORN,   // Some records at the end could not be replayed.
+};
+
+static u32
+mlt_layers_hash(MiltonState* milton_state)
+{
+    u32 hash = 2166136261u;
+    hash = mlt_hash(hash, &milton_state->canvas->layer_guid, sizeof(i32));
+    hash = mlt_hash(hash, &milton_state->view->working_layer_id, sizeof(i32));
+    for ( Layer* layer = milton_state->canvas->root_layer; layer != NULL; layer = layer->next ) {
+        hash = mlt_hash(hash, &layer->id, sizeof(layer->id));
+        hash = mlt_hash(hash, layer->name, strlen(layer->name));
+        hash = mlt_hash(hash, &layer->flags, sizeof(layer->flags));
+        hash = mlt_hash(hash, &layer->alpha, sizeof(layer->alpha));
+        for ( LayerEffect* e = layer->effects; e != NULL; e = e->next ) {
+            hash = mlt_hash(hash, &e->type, sizeof(e->type));
+            hash = mlt_hash(hash, &e->enabled, sizeof(e->enabled));
+            hash = mlt_hash(hash, &e->blur, sizeof(e->blur));
+        }
+    }
+    return hash;
+}
+
+static b32
+mlt_journal_fname(MiltonState* milton_state, PATH_CHAR* out_fname)
+{
+    PATH_CHAR suffix[] = TO_PATH_STR(".journal");
+    size_t len = PATH_STRLEN(milton_state->mlt_file_path);
+    b32 ok = len + array_count(suffix) <= MAX_PATH;
+    if ( ok ) {
+        PATH_STRCPY(out_fname, milton_state->mlt_file_path);
+        PATH_STRCPY(out_fname + len, suffix);
+    }
+    return ok;
+}
+
+// Opens the journal of the canvas file. With `keep_records`, new records go after the existing
+// ones. Otherwise the journal starts out empty.
+static void
+mlt_journal_open(MiltonState* milton_state, u64 base_id, u64 base_size, b32 keep_records)
+{
+    milton_journal_close(milton_state);
+
+    PATH_CHAR fname[MAX_PATH] = {};
+    if ( !mlt_journal_fname(milton_state, fname) ) {
+        return;
+    }
+
+    MltJournal* journal = &milton_state->journal;
+    FILE* fd = platform_fopen(fname, keep_records ? TO_PATH_STR("ab") : TO_PATH_STR("wb"));
+    b32 ok = fd != NULL;
+    if ( ok && !keep_records ) {
+        MltJournalHeader header = {};
+        header.magic = MLT_JOURNAL_MAGIC;
+        header.version = MLT_JOURNAL_VERSION;
+        header.base_id = base_id;
+        ok = fwrite_checked(&header, sizeof(header), 1, fd) && fflush(fd) == 0;
+    }
+    if ( ok ) {
+        ok = fseek(fd, 0, SEEK_END) == 0;
+    }
+    if ( ok ) {
+        journal->fd = fd;
+        journal->base_id = base_id;
+        journal->base_size = base_size;
+        journal->num_bytes = (u64)ftell(fd);
+        journal->layers_hash = mlt_layers_hash(milton_state);
+    } else {
+        milton_log("Could not open the journal. Every change will save the whole canvas.\n");
+        if ( fd ) {
+            fclose(fd);
+        }
+    }
+}
+
+// Starts the journal of a file that was just written or loaded. Changes made while the file was
+// being written are copied over from the end of the previous journal.
+static void
+mlt_journal_restart(MiltonState* milton_state, MltJournalId* journal_id, u64 base_size)
+{
+    milton_journal_close(milton_state);
+
+    b32 keep_records = false;
+    b32 carried_over = true;
+    PATH_CHAR fname[MAX_PATH] = {};
+    PlatformMappedFile file = {};
+    if ( mlt_journal_fname(milton_state, fname) && platform_map_file(fname, &file) ) {
+        MltCursor c = mlt_cursor(file.data, file.size);
+        MltJournalHeader header = {};
+        mlt_read(&c, &header, sizeof(header));
+        b32 valid = c.ok &&
+                    header.magic == MLT_JOURNAL_MAGIC &&
+                    header.version == MLT_JOURNAL_VERSION;
+        if ( valid && header.base_id == journal_id->id ) {
+            keep_records = true;
+        } else if ( valid &&
+                    journal_id->prev_id != 0 &&
+                    header.base_id == journal_id->prev_id &&
+                    journal_id->prev_size >= sizeof(header) &&
+                    journal_id->prev_size < file.size ) {
+            // Write the new journal next to the old one, so that a crash leaves one of them whole.
+            PATH_CHAR tmp_fname[MAX_PATH] = {};
+            PATH_CHAR suffix[] = TO_PATH_STR(".tmp");
+            size_t len = PATH_STRLEN(fname);
+            b32 ok = len + array_count(suffix) <= MAX_PATH;
+            FILE* fd = NULL;
+            if ( ok ) {
+                PATH_STRCPY(tmp_fname, fname);
+                PATH_STRCPY(tmp_fname + len, suffix);
+                fd = platform_fopen(tmp_fname, TO_PATH_STR("wb"));
+                ok = fd != NULL;
+            }
+            if ( ok ) {
+                header.base_id = journal_id->id;
+                ok = fwrite_checked(&header, sizeof(header), 1, fd) &&
+                     fwrite_checked(file.data + journal_id->prev_size,
+                                    (size_t)(file.size - journal_id->prev_size), 1, fd);
+                ok = (fclose(fd) == 0) && ok;
+            }
+            platform_unmap_file(&file);
+            if ( ok ) {
+                ok = platform_move_file(tmp_fname, fname);
+            }
+            keep_records = ok;
+            carried_over = ok;
+        }
+    }
+    platform_unmap_file(&file);
+
+    mlt_journal_open(milton_state, journal_id->id, base_size, keep_records);
+    if ( !carried_over ) {
+        milton_log("Could not carry the journal over to the new file.\n");
+        // The changes are only in memory. Save them again.
+        milton_save_async(milton_state);
+    }
+}
+
+static b32
+mlt_journal_write_record(MltJournal* journal, JournalOp op, DArray<u8>* payload)
+{
+    MltJournalRecord record = {};
+    record.op = op;
+    record.size = (u32)payload->count;
+    record.checksum = mlt_hash(2166136261u, payload->data, (size_t)payload->count);
+
+    b32 ok = fwrite_checked(&record, sizeof(record), 1, journal->fd) &&
+             (payload->count == 0 || fwrite_checked(payload->data, (size_t)payload->count, 1, journal->fd));
+    if ( ok ) {
+        journal->num_bytes += sizeof(record) + (u64)payload->count;
+    }
+    return ok;
+}
+
+b32
+milton_journal_append(MiltonState* milton_state, JournalOp op, Stroke* stroke)
+{
+    MltJournal* journal = &milton_state->journal;
+    if ( journal->fd == NULL ) {
+        return false;
+    }
+
+    DArray<u8> payload = {};
+    MltWriter writer = {};
+    MltWriter* w = &writer;
+    w->ok = true;
+    w->buffer = &payload;
+
+    b32 ok = true;
+
+    // Layers changed since the last record.
+    u32 layers_hash = mlt_layers_hash(milton_state);
+    if ( layers_hash != journal->layers_hash ) {
+        CanvasState* canvas = milton_state->canvas;
+        i32 num_layers = layer::number_of_layers(canvas->root_layer);
+        mlt_write(w, &canvas->layer_guid, sizeof(i32));
+        mlt_write(w, &milton_state->view->working_layer_id, sizeof(i32));
+        mlt_write(w, &num_layers, sizeof(i32));
+        for ( Layer* layer = canvas->root_layer; layer != NULL; layer = layer->next ) {
+            mlt_write(w, &layer->id, sizeof(i32));
+            mlt_write_layer_props(w, layer->name, layer->flags, layer->alpha, layer->effects);
+        }
+        ok = mlt_journal_write_record(journal, JournalOp_LAYERS, &payload);
+        if ( ok ) {
+            journal->layers_hash = layers_hash;
+        }
+        payload.count = 0;
+    }
+
+    if ( ok ) {
+        switch ( op ) {
+            case JournalOp_STROKE_ADD: {
+                mlt_assert(stroke && mlt_valid_stroke(stroke));
+                MltStrokeHeader header = {};
+                header.brush = stroke->brush;
+                header.num_points = stroke->num_points;
+                header.layer_id = stroke->layer_id;
+                mlt_write(w, &header, sizeof(header));
+                v2l* points;
+                f32* pressures;
+                mlt_stroke_points(w, stroke, &points, &pressures);
+                mlt_write(w, points, sizeof(v2l) * (size_t)stroke->num_points);
+                mlt_write(w, pressures, sizeof(f32) * (size_t)stroke->num_points);
+            } break;
+            case JournalOp_UNDO: {
+            } break;
+            default: {
+                INVALID_CODE_PATH;
+            } break;
+        }
+        ok = mlt_journal_write_record(journal, op, &payload);
+    }
+    if ( ok ) {
+        ok = fflush(journal->fd) == 0;
+    }
+    if ( !ok ) {
+        milton_log("Could not write to the journal.\n");
+        milton_journal_close(milton_state);
+    }
+
+    release(&payload);
+
+    return ok;
+}
+
+b32
+milton_journal_needs_compaction(MiltonState* milton_state)
+{
+    MltJournal* journal = &milton_state->journal;
+    MltSaver* saver = milton_state->saver;
+    if ( saver && (saver->pending || saver->snapshot) ) {
+        // A save is on its way.
+        return false;
+    }
+    return journal->fd != NULL &&
+           journal->num_bytes > max((u64)MLT_JOURNAL_MIN_COMPACTION_SIZE, journal->base_size / 2);
+}
+
+void
+milton_journal_close(MiltonState* milton_state)
+{
+    MltJournal* journal = &milton_state->journal;
+    if ( journal->fd ) {
+        fclose(journal->fd);
+    }
+    *journal = {};
+}
+
+// Sets the order, ids and properties of every layer. Layers that are not in the record were deleted.
+static void
+mlt_journal_replay_layers(MiltonState* milton_state, MltCursor* c, i32* out_layer_guid)
+{
+    CanvasState* canvas = milton_state->canvas;
+
+    i32 layer_guid = 0;
+    i32 working_layer_id = 0;
+    i32 num_layers = 0;
+    mlt_read(c, &layer_guid, sizeof(i32));
+    mlt_read(c, &working_layer_id, sizeof(i32));
+    mlt_read(c, &num_layers, sizeof(i32));
+    if ( num_layers <= 0 ) {
+        c->ok = false;
+    }
+
+    DArray<Layer*> layers = {};
+    for ( i32 i = 0; c->ok && i < num_layers; ++i ) {
+        i32 id = 0;
+        mlt_read(c, &id, sizeof(i32));
+        Layer* layer = layer::get_by_id(canvas->root_layer, id);
+        for ( i64 j = 0; layer != NULL && j < layers.count; ++j ) {
+            if ( layers.data[j] == layer ) {
+                c->ok = false;  // Repeated id.
+            }
+        }
+        if ( c->ok && layer == NULL ) {
+            milton_new_layer(milton_state);
+            layer = canvas->working_layer;
+            layer->id = id;
+        }
+        if ( c->ok ) {
+            mlt_read_layer_props(c, canvas, layer);
+            push(&layers, layer);
+        }
+    }
+
+    if ( c->ok ) {
+        for ( i64 i = 0; i < layers.count; ++i ) {
+            Layer* layer = layers.data[i];
+            layer->prev = i > 0 ? layers.data[i - 1] : NULL;
+            layer->next = i < layers.count - 1 ? layers.data[i + 1] : NULL;
+        }
+        canvas->root_layer = layers.data[0];
+        canvas->layer_guid = layer_guid;
+        *out_layer_guid = layer_guid;
+
+        Layer* working_layer = layer::get_by_id(canvas->root_layer, working_layer_id);
+        milton_set_working_layer(milton_state, working_layer ? working_layer : canvas->root_layer);
+    }
+
+    release(&layers);
+}
+
+// Replays the journal of `journal_id`, or the end of the previous journal if the file was saved
+// while changes were being made.
+static MltJournalReplay
+mlt_journal_replay(MiltonState* milton_state, MltJournalId* journal_id, i32* inout_layer_guid)
+{
+    MltJournalReplay result = MltJournalReplay_NONE;
+    CanvasState* canvas = milton_state->canvas;
+
+    PATH_CHAR fname[MAX_PATH] = {};
+    PlatformMappedFile file = {};
+    if ( !mlt_journal_fname(milton_state, fname) || !platform_map_file(fname, &file) ) {
+        return result;
+    }
+
+    MltCursor fc = mlt_cursor(file.data, file.size);
+    MltJournalHeader header = {};
+    mlt_read(&fc, &header, sizeof(header));
+    b32 valid = fc.ok &&
+                header.magic == MLT_JOURNAL_MAGIC &&
+                header.version == MLT_JOURNAL_VERSION;
+    if ( valid && header.base_id != journal_id->id ) {
+        valid = journal_id->prev_id != 0 &&
+                header.base_id == journal_id->prev_id &&
+                journal_id->prev_size >= sizeof(header) &&
+                journal_id->prev_size <= file.size;
+        fc.pos = journal_id->prev_size;
+    }
+    if ( valid ) {
+        result = MltJournalReplay_CLEAN;
+        i64 num_records = 0;
+        while ( fc.pos < fc.size ) {
+            MltJournalRecord record = {};
+            mlt_read(&fc, &record, sizeof(record));
+            u8* data = mlt_take(&fc, record.size);
+            if ( !fc.ok || mlt_hash(2166136261u, data, record.size) != record.checksum ) {
+                result = MltJournalReplay_TORN;
+                break;
+            }
+
+            MltCursor c = mlt_cursor(data, record.size);
+            switch ( record.op ) {
+                case JournalOp_STROKE_ADD: {
+                    MltStrokeHeader stroke_header = {};
+                    memcpy(&stroke_header, data, min((size_t)record.size, sizeof(stroke_header)));
+                    Layer* layer = layer::get_by_id(canvas->root_layer, stroke_header.layer_id);
+                    if ( layer && mlt_load_journal_stroke(milton_state, layer, &c) ) {
+                        HistoryElement h = { HistoryElement_STROKE_ADD, layer->id };
+                        push(&canvas->history, h);
+                    } else {
+                        c.ok = false;
+                    }
+                } break;
+                case JournalOp_UNDO: {
+                    milton_undo(milton_state);
+                } break;
+                case JournalOp_LAYERS: {
+                    mlt_journal_replay_layers(milton_state, &c, inout_layer_guid);
+                } break;
+                default: {
+                    c.ok = false;
+                } break;
+            }
+            if ( !c.ok ) {
+                result = MltJournalReplay_TORN;
+                break;
+            }
+            ++num_records;
+        }
+        milton_log("Replayed %d journal records.\n", (int)num_records);
+    }
+
+    // Undone strokes can't be redone after loading.
+    reset(&canvas->redo_stack);
+    for ( i64 i = 0; i < canvas->stroke_graveyard.count; ++i ) {
+        milton_discard_stroke(milton_state, &canvas->stroke_graveyard.data[i]);
+    }
+    reset(&canvas->stroke_graveyard);
+
+    // Strokes were copied. The journal is about to be appended to or replaced.
+    platform_unmap_file(&file);
+
+    return result;
+}
+
 void
 milton_load(MiltonState* milton_state)
 {
@@ -109,6 +2008,59 @@ milton_load(MiltonState* milton_state)
             goto END;
         }
 
+        if ( milton_magic != MILTON_MAGIC_NUMBER ) {
+            platform_dialog("MLT file could not be loaded. Magic number mismatch.", "Problem");
+            milton_unset_last_canvas_fname();
+            ok = false;
+            goto END;
+        }
+
+        if ( milton_binary_version >= 6 ) {
+            fclose(fd);
+            // Strokes point into the mapping until the canvas is reset. See milton_reset_canvas.
+            PlatformMappedFile* file = &milton_state->canvas->mapped_file;
+            MltJournalId journal_id = {};
+            MltLoader* loader = (MltLoader*)mlt_calloc(1, sizeof(MltLoader), "Persist");
+            ok = platform_map_file(milton_state->mlt_file_path, file) &&
+                 mlt_load_v6_begin(milton_state, loader, file, PLATFORM_MAPPED_FILES_CAN_BE_REPLACED,
+                                   &layer_guid, &journal_id);
+            if ( ok ) {
+                // Changes made after the last full save.
+                MltJournalReplay replay = mlt_journal_replay(milton_state, &journal_id, &layer_guid);
+                if ( replay != MltJournalReplay_TORN ) {
+                    mlt_journal_restart(milton_state, &journal_id, file->size);
+                }
+                // Otherwise there is no journal until the next full save.
+
+                // Points are decoded in the background, starting with the strokes on screen. See
+                // milton_load_tick
+                CanvasView* view = milton_state->view;
+                Rect visible = {};
+                visible.top_left = raster_to_canvas(view, v2l{0, 0});
+                visible.bot_right = raster_to_canvas(view, v2l{view->screen_size.w, view->screen_size.h});
+                mlt_loader_prepare(loader, visible);
+                loader->start = perf_counter();
+                mlt_loader_start(loader, max(1, SDL_GetCPUCount() - 1));
+
+                if ( milton_state->render_data ) {
+                    i32 w = 0;
+                    i32 h = 0;
+                    u8* pixels = milton_load_preview(milton_state->mlt_file_path, MLT_LOAD_PREVIEW_SIZE, &w, &h);
+                    if ( pixels ) {
+                        loader->preview = gpu_create_image(pixels, w, h);
+                        loader->preview_w = w;
+                        loader->preview_h = h;
+                        mlt_free(pixels, "Persist");
+                    }
+                }
+                milton_state->loader = loader;
+            } else {
+                mlt_loader_release(loader);
+                mlt_free(loader, "Persist");
+            }
+            goto END;
+        }
+
         if ( milton_binary_version >= 4 ) {
             READ(milton_state->view, sizeof(CanvasView), 1, fd);
         } else {
@@ -129,13 +2081,6 @@ milton_load(MiltonState* milton_state)
         // The process of loading changes state. working_layer_id changes when creating layers.
         saved_working_layer_id = milton_state->view->working_layer_id;
 
-        if ( milton_magic != MILTON_MAGIC_NUMBER ) {
-            platform_dialog("MLT file could not be loaded. Magic number mismatch.", "Problem");
-            milton_unset_last_canvas_fname();
-            ok = false;
-            goto END;
-        }
-
         num_layers = 0;
         READ(&num_layers, sizeof(i32), 1, fd);
         READ(&layer_guid, sizeof(i32), 1, fd);
@@ -176,14 +2121,14 @@ milton_load(MiltonState* milton_state)
                                    stroke.num_points);
                         // Older versions have a possible off-by-one bug here.
                         if (stroke.num_points < STROKE_MAX_POINTS)  {
-                            stroke.points = arena_alloc_array(&canvas->arena, stroke.num_points, v2l);
+                            stroke_alloc_points(&canvas->stroke_pool, &stroke, STROKE_MAX_POINTS - 1);
                             READ(stroke.points, sizeof(v2l), (size_t)stroke.num_points, fd);
-                            stroke.pressures = arena_alloc_array(&canvas->arena, stroke.num_points, f32);
                             READ(stroke.pressures, sizeof(f32), (size_t)stroke.num_points, fd);
                             READ(&stroke.layer_id, sizeof(i32), 1, fd);
                             stroke.num_points = STROKE_MAX_POINTS - 1;
 
                             stroke.bounding_rect = bounding_box_for_stroke(&stroke);
+                            stroke_compact_points(&canvas->stroke_pool, &stroke);
 
                             layer::layer_push_stroke(layer, stroke);
                         } else {
@@ -191,22 +2136,22 @@ milton_load(MiltonState* milton_state)
                             goto END;
                         }
                     } else {
+                        stroke_alloc_points(&canvas->stroke_pool, &stroke, stroke.num_points);
                         if ( milton_binary_version >= 4 ) {
-                            stroke.points = arena_alloc_array(&canvas->arena, stroke.num_points, v2l);
                             READ(stroke.points, sizeof(v2l), (size_t)stroke.num_points, fd);
                         } else {
-                            stroke.points = arena_alloc_array(&canvas->arena, stroke.num_points, v2l);
                             v2i* points_32bit = (v2i*)mlt_calloc((size_t)stroke.num_points, sizeof(v2i), "Persist");
 
                             READ(points_32bit, sizeof(v2i), (size_t)stroke.num_points, fd);
                             for (int i = 0; i < stroke.num_points; ++i) {
                                 stroke.points[i] = VEC2L(points_32bit[i]);
                             }
+                            mlt_free(points_32bit, "Persist");
                         }
-                        stroke.pressures = arena_alloc_array(&canvas->arena, stroke.num_points, f32);
                         READ(stroke.pressures, sizeof(f32), (size_t)stroke.num_points, fd);
                         READ(&stroke.layer_id, sizeof(i32), 1, fd);
                         stroke.bounding_rect = bounding_box_for_stroke(&stroke);
+                        stroke_compact_points(&canvas->stroke_pool, &stroke);
 
                         layer::layer_push_stroke(layer, stroke);
                     }
@@ -326,171 +2271,508 @@ END:
 #undef READ
 }
 
-void
-milton_save(MiltonState* milton_state)
-{
-    // Declaring variables here to silence compiler warnings about GOTO jumping declarations.
-    i32 history_count = 0;
-    u32 milton_binary_version = 0;
-    i32 num_layers = 0;
-    milton_state->flags |= MiltonStateFlags_LAST_SAVE_FAILED;  // Assume failure. Remove flag on success.
-
-    int pid = (int)getpid();
-    PATH_CHAR tmp_fname[MAX_PATH] = {};
-    PATH_SNPRINTF(tmp_fname, MAX_PATH, TO_PATH_STR("milton_tmp.%d.mlt"), pid);
+// ---- Streaming. See persist.h
 
-    platform_fname_at_config(tmp_fname, MAX_PATH);
+static void
+mlt_loader_free(MiltonState* milton_state)
+{
+    MltLoader* loader = milton_state->loader;
+    if ( loader ) {
+        milton_state->loader = NULL;
+        mlt_loader_join(loader, /*cancel*/true);
+        mlt_loader_release(loader);
+        mlt_free(loader, "Persist");
+    }
+}
 
-    FILE* fd = platform_fopen(tmp_fname, TO_PATH_STR("wb"));
+// Main thread. Every block has been published, or one of them could not be decoded.
+static void
+mlt_load_end(MiltonState* milton_state)
+{
+    MltLoader* loader = milton_state->loader;
+    b32 ok = loader->ok;
+    milton_log("Loaded %d strokes in %.3fs, %d of them paged\n", (int)loader->num_published_strokes,
+               perf_count_to_sec(perf_counter() - loader->start), (int)loader->num_paged_strokes);
+    mlt_loader_free(milton_state);
+    milton_state->flags |= MiltonStateFlags_REQUEST_QUALITY_REDRAW;
+
+    if ( !PLATFORM_MAPPED_FILES_CAN_BE_REPLACED ) {
+        // Points were copied to the arena, and saving replaces the file.
+        platform_unmap_file(&milton_state->canvas->mapped_file);
+    }
+    if ( !ok ) {
+        // What was drawn while loading must not replace the file.
+        if ( milton_state->saver ) {
+            milton_state->saver->pending = false;
+        }
+        platform_dialog("Tried to load a corrupt Milton file or there was an error reading from disk.", "Error");
+        milton_reset_canvas_and_set_default(milton_state);
+    }
+}
 
-    b32 ok = true;
+b32
+milton_load_tick(MiltonState* milton_state)
+{
+    MltLoader* loader = milton_state->loader;
+    if ( loader == NULL ) {
+        return false;
+    }
+    b32 published = mlt_loader_publish(loader);
+    if ( !loader->ok || loader->num_published == loader->blocks.count ) {
+        mlt_load_end(milton_state);
+    }
+    return published;
+}
 
-    if ( fd ) {
-#define WRITE(address, sz, num, fd) do { ok = fwrite_checked(address, sz, num, fd); if (!ok) { goto END; }  } while(0)
-        u32 milton_magic = MILTON_MAGIC_NUMBER;
+b32
+milton_load_finish(MiltonState* milton_state)
+{
+    MltLoader* loader = milton_state->loader;
+    if ( loader == NULL ) {
+        return true;
+    }
+    mlt_loader_join(loader, /*cancel*/false);
+    mlt_loader_publish(loader);
+    b32 ok = loader->ok;
+    mlt_load_end(milton_state);
+    return ok;
+}
 
-        WRITE(&milton_magic, sizeof(u32), 1, fd);
+void
+milton_load_cancel(MiltonState* milton_state)
+{
+    mlt_loader_free(milton_state);
+}
 
-        milton_binary_version = milton_state->mlt_binary_version;
+b32
+milton_load_status(MiltonState* milton_state, LoadStatus* out_status)
+{
+    MltLoader* loader = milton_state->loader;
+    if ( loader == NULL ) {
+        return false;
+    }
+    *out_status = LoadStatus{};
+    out_status->progress = loader->num_live_strokes > 0 ?
+            (f32)loader->num_published_strokes / (f32)loader->num_live_strokes : 1.0f;
+    out_status->preview = loader->preview;
+    out_status->preview_w = loader->preview_w;
+    out_status->preview_h = loader->preview_h;
+    return true;
+}
 
-        WRITE(&milton_binary_version, sizeof(u32), 1, fd);
-        WRITE(milton_state->view, sizeof(CanvasView), 1, fd);
+// MLT v5 and older.
+static b32
+mlt_save_legacy(MltSnapshot* s, FILE* fd)
+{
+    MltWriter writer = {};
+    MltWriter* w = &writer;
+    w->fd = fd;
+    w->ok = true;
+    u32 milton_magic = MILTON_MAGIC_NUMBER;
+    u32 milton_binary_version = s->version;
+    i32 num_layers = (i32)s->layers.count;
+    i32 history_count = 0;
+    DArray<Stroke>* strokes = &w->strokes;
 
-        num_layers = layer::number_of_layers(milton_state->canvas->root_layer);
-        WRITE(&num_layers, sizeof(i32), 1, fd);
-        WRITE(&milton_state->canvas->layer_guid, sizeof(i32), 1, fd);
+#define WRITE(address, sz, num) do { mlt_write(w, address, (sz) * (num)); if (!w->ok) { goto END; }  } while(0)
+    WRITE(&milton_magic, sizeof(u32), 1);
+    WRITE(&milton_binary_version, sizeof(u32), 1);
+    WRITE(&s->view, sizeof(CanvasView), 1);
 
-        for ( Layer* layer = milton_state->canvas->root_layer; layer; layer=layer->next  ) {
-            if ( layer->strokes.count > INT_MAX ) {
-                milton_die_gracefully("FATAL. Number of strokes in layer greater than can be stored in file format. ");
-            }
-            i32 num_strokes = (i32)layer->strokes.count;
-            char* name = layer->name;
-            i32 len = (i32)(strlen(name) + 1);
-            WRITE(&len, sizeof(i32), 1, fd);
-            WRITE(name, sizeof(char), (size_t)len, fd);
-            WRITE(&layer->id, sizeof(i32), 1, fd);
-            WRITE(&layer->flags, sizeof(layer->flags), 1, fd);
-            WRITE(&num_strokes, sizeof(i32), 1, fd);
-            if ( ok ) {
-                for ( i32 stroke_i = 0; ok && stroke_i < num_strokes; ++stroke_i ) {
-                    Stroke* stroke = get(&layer->strokes, stroke_i);
-                    mlt_assert(stroke->num_points > 0);
-                    if (stroke->num_points > 0 && stroke->num_points < STROKE_MAX_POINTS) {
-                        WRITE(&stroke->brush, sizeof(Brush), 1, fd);
-                        WRITE(&stroke->num_points, sizeof(i32), 1, fd);
-                        WRITE(stroke->points, sizeof(v2l), (size_t)stroke->num_points, fd);
-                        WRITE(stroke->pressures, sizeof(f32), (size_t)stroke->num_points, fd);
-                        WRITE(&stroke->layer_id, sizeof(i32), 1, fd);
-                        if ( !ok ) {
-                            break;
-                        }
-                    } else {
-                        milton_log("WARNING: Trying to write a stroke of size %d\n", stroke->num_points);
-                    }
+    WRITE(&num_layers, sizeof(i32), 1);
+    WRITE(&s->layer_guid, sizeof(i32), 1);
 
+    for ( i64 li = 0; li < s->layers.count; ++li ) {
+        MltSnapshotLayer* layer = &s->layers.data[li];
+        if ( layer->num_strokes > INT_MAX ) {
+            milton_die_gracefully("FATAL. Number of strokes in layer greater than can be stored in file format. ");
+        }
+        i32 num_strokes = (i32)layer->num_strokes;
+        char* name = layer->name;
+        i32 len = (i32)(strlen(name) + 1);
+        WRITE(&len, sizeof(i32), 1);
+        WRITE(name, sizeof(char), (size_t)len);
+        WRITE(&layer->id, sizeof(i32), 1);
+        WRITE(&layer->flags, sizeof(layer->flags), 1);
+        WRITE(&num_strokes, sizeof(i32), 1);
+        for ( i32 first = 0; first < num_strokes; first += MLT_BLOCK_MAX_STROKES ) {
+            mlt_snapshot_get_strokes(s, layer, first, min(num_strokes - first, MLT_BLOCK_MAX_STROKES), strokes);
+            for ( i64 i = 0; i < strokes->count; ++i ) {
+                Stroke* stroke = &strokes->data[i];
+                mlt_assert(stroke->num_points > 0);
+                if ( mlt_valid_stroke(stroke) ) {
+                    v2l* points;
+                    f32* pressures;
+                    mlt_stroke_points(w, stroke, &points, &pressures);
+                    WRITE(&stroke->brush, sizeof(Brush), 1);
+                    WRITE(&stroke->num_points, sizeof(i32), 1);
+                    WRITE(points, sizeof(v2l), (size_t)stroke->num_points);
+                    WRITE(pressures, sizeof(f32), (size_t)stroke->num_points);
+                    WRITE(&stroke->layer_id, sizeof(i32), 1);
+                } else {
+                    milton_log("WARNING: Trying to write a stroke of size %d\n", stroke->num_points);
                 }
-            } else {
-                ok = false;
             }
-            {
-                i64 num_effects = 0;
-                for ( LayerEffect* e = layer->effects; e != NULL; e = e->next ) {
-                    ++num_effects;
-                }
-                WRITE(&num_effects, sizeof(num_effects), 1, fd);
-                for ( LayerEffect* e = layer->effects; e != NULL; e = e->next ) {
-                    WRITE(&e->type, sizeof(e->type), 1, fd);
-                    WRITE(&e->enabled, sizeof(e->enabled), 1, fd);
-                    switch (e->type) {
-                        case LayerEffectType_BLUR: {
-                            WRITE(&e->blur.original_scale, sizeof(e->blur.original_scale), 1, fd);
-                            WRITE(&e->blur.kernel_size, sizeof(e->blur.kernel_size), 1, fd);
-                        } break;
-                    }
+        }
+        {
+            i64 num_effects = 0;
+            for ( LayerEffect* e = layer->effects; e != NULL; e = e->next ) {
+                ++num_effects;
+            }
+            WRITE(&num_effects, sizeof(num_effects), 1);
+            for ( LayerEffect* e = layer->effects; e != NULL; e = e->next ) {
+                WRITE(&e->type, sizeof(e->type), 1);
+                WRITE(&e->enabled, sizeof(e->enabled), 1);
+                switch (e->type) {
+                    case LayerEffectType_BLUR: {
+                        WRITE(&e->blur.original_scale, sizeof(e->blur.original_scale), 1);
+                        WRITE(&e->blur.kernel_size, sizeof(e->blur.kernel_size), 1);
+                    } break;
                 }
             }
         }
+    }
 
-        if ( milton_binary_version >= 5 ) {
-           v3f rgb = gui_get_picker_rgb(milton_state->gui);
-           WRITE(&rgb, sizeof(rgb), 1, fd);
+    if ( milton_binary_version >= 5 ) {
+       WRITE(&s->picker_rgb, sizeof(v3f), 1);
+    }
+    else {
+       WRITE(&s->picker_data, sizeof(PickerData), 1);
+    }
+
+    // Buttons
+    {
+        i32 button_count = (i32)s->button_colors.count;
+        WRITE(&button_count, sizeof(i32), 1);
+        for ( i32 i = 0; i < button_count; ++i ) {
+            WRITE(&s->button_colors.data[i], sizeof(v4f), 1);
         }
-        else {
-           WRITE(&milton_state->gui->picker.data, sizeof(PickerData), 1, fd);
+    }
+
+    // Brush
+    if ( milton_binary_version >= 2 ) {
+        // PEN, ERASER
+        WRITE(s->brushes, sizeof(Brush), BrushEnum_COUNT);
+        // Sizes
+        WRITE(s->brush_sizes, sizeof(i32), BrushEnum_COUNT);
+    }
+
+    history_count = (i32)s->history.count;
+    if ( s->history.count > INT_MAX ) {
+        history_count = 0;
+    }
+    WRITE(&history_count, sizeof(history_count), 1);
+    WRITE(s->history.data, sizeof(HistoryElement), (size_t)history_count);
+
+    // MLT 3
+    // Layer alpha
+    if ( milton_binary_version >= 3 ) {
+        for ( i64 li = 0; li < s->layers.count; ++li ) {
+            WRITE(&s->layers.data[li].alpha, sizeof(f32), 1);
         }
+    }
+#undef WRITE
+END:
+    return mlt_writer_release(w);
+}
 
-        // Buttons
-        if ( ok ) {
-            i32 button_count = 0;
-            MiltonGui* gui = milton_state->gui;
-            // Count buttons
-            for (ColorButton* b = gui->picker.color_buttons; b!= NULL; b = b->next, button_count++) { }
-            // Write
-            WRITE(&button_count, sizeof(i32), 1, fd);
+// Writes the snapshot to a temporary file, then moves it over the canvas file. Runs on any thread.
+static void
+mlt_write_snapshot(MltSnapshot* s)
+{
+    u64 start = perf_counter();
+
+    int pid = (int)getpid();
+    PATH_CHAR tmp_fname[MAX_PATH] = {};
+    PATH_SNPRINTF(tmp_fname, MAX_PATH, TO_PATH_STR("milton_tmp.%d.mlt"), pid);
+
+    platform_fname_at_config(tmp_fname, MAX_PATH);
+
+    FILE* fd = platform_fopen(tmp_fname, TO_PATH_STR("wb"));
+    if ( fd == NULL ) {
+        s->could_not_create = true;
+        return;
+    }
+
+    b32 ok = false;
+    if ( s->version >= 6 ) {
+        ok = milton_save_v6(s, fd, &s->num_bytes);
+    } else {
+        ok = mlt_save_legacy(s, fd);
+        s->num_bytes = (u64)ftell(fd);
+    }
+
+    int file_error = ferror(fd);
+    if ( ok && file_error == 0 ) {
+        int close_ret = fclose(fd);
+        if ( close_ret == 0 ) {
+            ok = platform_move_file(tmp_fname, s->fname);
             if ( ok ) {
-                for ( ColorButton* b = gui->picker.color_buttons;
-                      ok && b!= NULL;
-                      b = b->next ) {
-                    WRITE(&b->rgba, sizeof(v4f), 1, fd);
-                }
+                //  \o/
+                s->ok = true;
+            }
+            else {
+                milton_log("Could not move file. Moving on. Avoiding this save.\n");
+                s->move_failed = true;
             }
         }
+        else {
+            milton_log("File error when closing handle. Error code %d. \n", close_ret);
+        }
+    }
+    else {
+        milton_log("File IO error. Error code %d. \n", file_error);
+        fclose(fd);
+    }
 
-        // Brush
-        if ( milton_binary_version >= 2 ) {
-            // PEN, ERASER
-            WRITE(&milton_state->brushes, sizeof(Brush), BrushEnum_COUNT, fd);
-            // Sizes
-            WRITE(&milton_state->brush_sizes, sizeof(i32), BrushEnum_COUNT, fd);
+    s->write_seconds = perf_count_to_sec(perf_counter() - start);
+}
+
+// ---- Saver thread
+
+// Main thread. Takes the result of a save.
+static void
+mlt_save_finish(MiltonState* milton_state, MltSnapshot* s)
+{
+    if ( s->could_not_create ) {
+        milton_die_gracefully("Could not create file for saving! ");
+    }
+
+    if ( s->ok ) {
+        milton_save_postlude(milton_state, s->num_strokes);
+        if ( s->version >= 6 && PATH_STRCMP(s->fname, milton_state->mlt_file_path) == 0 ) {
+            // The file has everything that was in the journal when the snapshot was taken.
+            mlt_journal_restart(milton_state, &s->journal_id, s->num_bytes);
+        }
+    } else {
+        milton_state->flags |= MiltonStateFlags_LAST_SAVE_FAILED;
+        if ( s->move_failed ) {
+            milton_state->flags |= MiltonStateFlags_MOVE_FILE_FAILED;
         }
+    }
 
-        history_count = (i32)milton_state->canvas->history.count;
-        if ( milton_state->canvas->history.count > INT_MAX ) {
-            history_count = 0;
+    MltSaver* saver = milton_state->saver;
+    if ( saver ) {
+        SaveStats* stats = &saver->stats;
+        stats->num_saves += 1;
+        stats->num_bytes = s->num_bytes;
+        stats->total_num_bytes += s->num_bytes;
+        stats->write_ms = s->write_seconds * 1000.0f;
+        stats->latency_ms = (f32)(SDL_GetTicks() - s->request_ms);
+    }
+}
+
+// Main thread. Waits for the save in progress, if any, and finishes it.
+static void
+mlt_saver_wait(MiltonState* milton_state)
+{
+    MltSaver* saver = milton_state->saver;
+    if ( saver && saver->snapshot ) {
+        SDL_LockMutex(saver->mutex);
+        while ( !saver->snapshot_done ) {
+            SDL_CondWait(saver->cond, saver->mutex);
         }
-        WRITE(&history_count, sizeof(history_count), 1, fd);
-        WRITE(milton_state->canvas->history.data, sizeof(*milton_state->canvas->history.data), (size_t)history_count, fd);
+        MltSnapshot* s = saver->snapshot;
+        saver->snapshot = NULL;
+        SDL_UnlockMutex(saver->mutex);
 
-        // MLT 3
-        // Layer alpha
-        if ( milton_binary_version >= 3 ) {
-            Layer* l = milton_state->canvas->root_layer;
-            for ( i64 i = 0; ok && i < num_layers; ++i ) {
-                mlt_assert(l);
-                WRITE(&l->alpha, sizeof(l->alpha), 1, fd);
-                l = l->next;
-            }
+        mlt_save_finish(milton_state, s);
+        mlt_snapshot_release(s);
+        mlt_free(s, "Persist");
+    }
+}
+
+static int  // Thread
+mlt_saver_thread(void* data)
+{
+    MltSaver* saver = (MltSaver*)data;
+    SDL_LockMutex(saver->mutex);
+    for ( ;; ) {
+        while ( !saver->quit && (saver->snapshot == NULL || saver->snapshot_done) ) {
+            SDL_CondWait(saver->cond, saver->mutex);
         }
-END:
-        int file_error = ferror(fd);
-        if ( file_error == 0 ) {
-            int close_ret = fclose(fd);
-            if ( close_ret == 0 ) {
-                ok = platform_move_file(tmp_fname, milton_state->mlt_file_path);
-                if ( ok ) {
-                    //  \o/
-                    milton_save_postlude(milton_state);
-                }
-                else {
-                    milton_log("Could not move file. Moving on. Avoiding this save.\n");
-                    milton_state->flags |= MiltonStateFlags_MOVE_FILE_FAILED;
-                }
-            }
-            else {
-                milton_log("File error when closing handle. Error code %d. \n", close_ret);
-            }
+        if ( saver->quit ) {
+            break;
         }
-        else {
-            milton_log("File IO error. Error code %d. \n", file_error);
+        MltSnapshot* s = saver->snapshot;
+        SDL_UnlockMutex(saver->mutex);
+
+        mlt_write_snapshot(s);
+
+        SDL_LockMutex(saver->mutex);
+        saver->snapshot_done = true;
+        SDL_CondBroadcast(saver->cond);
+    }
+    SDL_UnlockMutex(saver->mutex);
+    return 0;
+}
+
+void
+milton_saver_init(MiltonState* milton_state)
+{
+#if MILTON_SAVE_ASYNC
+    MltSaver* saver = (MltSaver*)mlt_calloc(1, sizeof(MltSaver), "Persist");
+    saver->mutex = SDL_CreateMutex();
+    saver->cond = SDL_CreateCond();
+    if ( saver->mutex && saver->cond ) {
+        saver->thread = SDL_CreateThread(mlt_saver_thread, "Saver", saver);
+    }
+    if ( saver->thread ) {
+        milton_state->saver = saver;
+    } else {
+        milton_log("Could not start the saver thread. Saving on the main thread.\n");
+        if ( saver->mutex ) {
+            SDL_DestroyMutex(saver->mutex);
         }
+        if ( saver->cond ) {
+            SDL_DestroyCond(saver->cond);
+        }
+        mlt_free(saver, "Persist");
+    }
+#endif
+}
 
+void
+milton_saver_release(MiltonState* milton_state)
+{
+    MltSaver* saver = milton_state->saver;
+    if ( saver ) {
+        milton_save_flush(milton_state);
+
+        SDL_LockMutex(saver->mutex);
+        saver->quit = true;
+        SDL_CondBroadcast(saver->cond);
+        SDL_UnlockMutex(saver->mutex);
+        SDL_WaitThread(saver->thread, NULL);
+
+        SDL_DestroyMutex(saver->mutex);
+        SDL_DestroyCond(saver->cond);
+        mlt_free(saver, "Persist");
+        milton_state->saver = NULL;
     }
-    else {
-        milton_die_gracefully("Could not create file for saving! ");
+}
+
+void
+milton_save(MiltonState* milton_state)
+{
+    // The snapshot needs every stroke.
+    if ( !milton_load_finish(milton_state) ) {
         return;
     }
-#undef WRITE
+    mlt_saver_wait(milton_state);
+    if ( milton_state->saver ) {
+        // This save has every change that was requested.
+        milton_state->saver->pending = false;
+    }
+
+    // Nothing changes the canvas while we write it.
+    MltSnapshot s = {};
+    mlt_snapshot_take(milton_state, &s, NULL);
+    mlt_write_snapshot(&s);
+    mlt_save_finish(milton_state, &s);
+    mlt_snapshot_release(&s);
+}
+
+void
+milton_save_async(MiltonState* milton_state)
+{
+    MltSaver* saver = milton_state->saver;
+    if ( saver ) {
+        u32 now = SDL_GetTicks();
+        if ( !saver->pending ) {
+            saver->pending = true;
+            saver->first_request_ms = now;
+        }
+        saver->last_request_ms = now;
+        saver->stats.num_requests += 1;
+    } else {
+        milton_save(milton_state);
+    }
+}
+
+void
+milton_save_tick(MiltonState* milton_state)
+{
+    MltSaver* saver = milton_state->saver;
+    if ( saver == NULL ) {
+        return;
+    }
+
+    if ( saver->snapshot ) {
+        SDL_LockMutex(saver->mutex);
+        b32 done = saver->snapshot_done;
+        SDL_UnlockMutex(saver->mutex);
+        if ( done ) {
+            mlt_saver_wait(milton_state);
+        }
+    }
+
+    u32 now = SDL_GetTicks();
+    if ( saver->pending &&
+         saver->snapshot == NULL &&
+         milton_state->loader == NULL &&
+         (now - saver->last_request_ms >= MILTON_SAVE_DEBOUNCE_MS ||
+          now - saver->first_request_ms >= MILTON_SAVE_MAX_DELAY_MS) ) {
+        MltSnapshot* s = (MltSnapshot*)mlt_calloc(1, sizeof(MltSnapshot), "Persist");
+        mlt_snapshot_take(milton_state, s, saver->mutex);
+        s->request_ms = saver->first_request_ms;
+        saver->pending = false;
+
+        SDL_LockMutex(saver->mutex);
+        saver->snapshot = s;
+        saver->snapshot_done = false;
+        SDL_CondBroadcast(saver->cond);
+        SDL_UnlockMutex(saver->mutex);
+    }
+}
+
+void
+milton_save_flush(MiltonState* milton_state)
+{
+    mlt_saver_wait(milton_state);
+    if ( milton_state->saver && milton_state->saver->pending ) {
+        milton_save(milton_state);
+    }
+}
+
+void
+milton_save_before_undo(MiltonState* milton_state, Layer* layer)
+{
+    MltSaver* saver = milton_state->saver;
+    MltSnapshot* s = saver ? saver->snapshot : NULL;
+    if ( s == NULL ) {
+        return;
+    }
+    for ( i64 li = 0; li < s->layers.count; ++li ) {
+        MltSnapshotLayer* sl = &s->layers.data[li];
+        i64 last = layer->strokes.count - 1;
+        if ( sl->strokes == &layer->strokes && last >= 0 && last < sl->intact_count ) {
+            // Only the last stroke is ever undone, so the snapshot's strokes go away one by one,
+            // from the end.
+            mlt_assert(last == sl->intact_count - 1);
+            SDL_LockMutex(saver->mutex);
+            push(&sl->undone, *get(&layer->strokes, last));
+            sl->intact_count = last;
+            SDL_UnlockMutex(saver->mutex);
+        }
+    }
+}
+
+b32
+milton_save_in_progress(MiltonState* milton_state)
+{
+    MltSaver* saver = milton_state->saver;
+    return saver != NULL && saver->snapshot != NULL;
+}
+
+SaveStats
+milton_save_stats(MiltonState* milton_state)
+{
+    SaveStats stats = {};
+    if ( milton_state->saver ) {
+        stats = milton_state->saver->stats;
+    }
+    return stats;
 }
 
 PATH_CHAR*
@@ -537,100 +2819,6 @@ milton_set_last_canvas_fname(PATH_CHAR* last_fname)
     }
 }
 
-// Called by stb_image
-static void
-write_func(void* context, void* data, int size)
-{
-    FILE* fd = *(FILE**)context;
-
-    if ( fd ) {
-        size_t written = fwrite(data, (size_t)size, 1, fd);
-        if ( written != 1 ) {
-            fclose(fd);
-            *(FILE**)context = NULL;
-        }
-    }
-}
-
-void
-milton_save_buffer_to_file(PATH_CHAR* fname, u8* buffer, i32 w, i32 h)
-{
-    int len = 0;
-    {
-        size_t sz = PATH_STRLEN(fname);
-        if ( sz > ((1u << 31) -1) ) {
-            milton_die_gracefully("A really, really long file name. This shouldn't happen.");
-        }
-        len = (int)sz;
-    }
-    size_t ext_sz = ( len+1 ) * sizeof(PATH_CHAR);
-    PATH_CHAR* fname_copy = (PATH_CHAR*)mlt_calloc(ext_sz, 1, "Strings");
-    fname_copy[0] = '\0';
-    PATH_STRCPY(fname_copy, fname);
-
-    // NOTE: This should work with unicode.
-    int ext_len = 0;
-    PATH_CHAR* ext = fname_copy + len;
-    b32 found = false;
-    {
-        int safety = len;
-        while ( *--ext != '.' ) {
-            if( safety-- == 0 ) {
-                break;
-            }
-        }
-        if ( safety > 0 ) {
-            found = true;
-            ext_len = len - safety;
-            ++ext;
-        }
-    }
-
-    if ( found ) {
-        for ( int i = 0; i < ext_len; ++i ) {
-            PATH_CHAR c = ext[i];
-            ext[i] = PATH_TOLOWER(c);
-        }
-
-        FILE* fd = NULL;
-
-        fd = platform_fopen(fname, TO_PATH_STR("wb"));
-
-        if ( fd ) {
-            if ( !PATH_STRCMP(ext, TO_PATH_STR("png")) ) {
-                stbi_write_png_to_func(write_func, &fd, w, h, 4, buffer, 0);
-            }
-            else if ( !PATH_STRCMP(ext, TO_PATH_STR("jpg")) || !PATH_STRCMP(ext, TO_PATH_STR("jpeg")) ) {
-                tje_encode_with_func(write_func, &fd, 3, w, h, 4, buffer);
-            }
-            else {
-                platform_dialog("File extension not handled by Milton\n", "Info");
-            }
-
-            // !! fd might have been set to NULL if write_func failed.
-            if ( fd ) {
-                if ( ferror(fd) ) {
-                    platform_dialog("Unknown error when writing to file :(", "Unknown error");
-                }
-                else {
-                    platform_dialog("Image exported successfully!", "Success");
-                }
-                fclose(fd);
-            }
-            else {
-                platform_dialog("File created, but there was an error writing to it.", "Error");
-            }
-        }
-        else {
-            platform_dialog ( "Could not open file", "Error" );
-        }
-    }
-    else {
-        platform_dialog("File name missing extension!\n", "Error");
-    }
-    mlt_free(fname_copy, "Strings");
-}
-
 void
 milton_prefs_load(PlatformPrefs* prefs)
 {
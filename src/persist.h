@@ -5,13 +5,130 @@
 
 #include "platform.h"
 
+struct Layer;
 struct MiltonState;
+struct MltLoader;
+struct MltSaver;
+struct Stroke;
+
+// Loading
+//
+// - milton_load reads the layers, the history and the journal, and returns while the points of MLT
+//   v6 strokes are decoded on other threads. Blocks of strokes that were on screen are decoded first.
+// - Strokes are in their layers from the start, with empty bounding rects so that nothing draws
+//   them. milton_load_tick gives them their rects as their blocks are decoded.
+// - New strokes can be drawn while loading. They go after the loaded strokes of their layer, as
+//   they would have if the file had loaded at once.
+// - Anything that needs every stroke, like saving, exporting or undo, calls milton_load_finish.
+// - Canvases don't have to fit in memory. Packed blocks are decoded, visible ones first, until their
+//   points would take more than MiltonState::resident_budget. The strokes of the rest are paged:
+//   their points stay in the mapped file, and are decoded from it when they are drawn or saved. The
+//   OS keeps as much of the file in memory as it can. Not on Windows, where the mapping can't
+//   outlive the load. See StrokeFormat_PAGED
+
+// Saving
+//
+// - milton_save writes the whole canvas before returning. milton_save_async leaves it to the saver
+//   thread, which writes a snapshot of the canvas while the main thread keeps drawing.
+// - Async requests are coalesced. A save starts once there have been no requests for
+//   MILTON_SAVE_DEBOUNCE_MS, or MILTON_SAVE_MAX_DELAY_MS after the first one.
+// - A snapshot copies everything but the strokes. Strokes are only ever appended to a layer, except
+//   by undo, which hands the undone stroke to the snapshot with milton_save_before_undo. Points are
+//   not changed once a stroke is finished, and aren't freed while a save is in progress.
+// - Finished saves are picked up by milton_save_tick, on the main thread. It doesn't start a save
+//   while a canvas is loading.
+
+// Journal
+//
+// Saving the whole canvas after every stroke costs O(canvas). Instead, new strokes, undo and redo
+// are appended to a journal next to the canvas file (<canvas>.journal), and the canvas is saved in
+// full only when the journal gets big, the file is opened or saved explicitly, and on quit. A full
+// save starts a new journal, carrying over the records that were written while the save was in
+// progress. Loading replays the journal on top of the file, so nothing is lost if Milton crashes
+// between full saves, or during one.
+//
+// Layer changes are recorded with the next operation. View, brush and color changes are only kept
+// by full saves, as before. Only MLT v6 canvases have a journal.
+
+enum JournalOp
+{
+    JournalOp_STROKE_ADD = 1,  // Also used for redo.
+    JournalOp_UNDO       = 2,
+    JournalOp_LAYERS     = 3,  // Order, ids and properties of every layer.
+};
+
+struct MltJournal
+{
+    FILE*   fd;
+    u64     base_id;      // Identifies the canvas file that the journal applies to.
+    u64     base_size;    // Size of that file.
+    u64     num_bytes;
+    u32     layers_hash;  // Layer properties at the time of the last JournalOp_LAYERS.
+};
+
+struct LoadStatus
+{
+    f32     progress;   // Fraction of strokes that are in place.
+    u32     preview;    // gpu_create_image of the file's preview. 0 if it has none.
+    i32     preview_w;
+    i32     preview_h;
+};
+
+struct SaveStats
+{
+    i64     num_saves;
+    i64     num_requests;   // Async requests. Many of them end up in the same save.
+    u64     num_bytes;      // Of the last save.
+    u64     total_num_bytes;
+    f32     write_ms;       // Time spent writing the last save.
+    f32     latency_ms;     // From the first request to the last save being in place.
+};
 
 PATH_CHAR* milton_get_last_canvas_fname();
 
 void milton_load(MiltonState* milton_state);
 void milton_save(MiltonState* milton_state);
-void milton_save_buffer_to_file(PATH_CHAR* fname, u8* buffer, i32 w, i32 h);
+
+// MLT v6 files have a few sizes of a picture of the canvas as it was on screen when saved. Returns
+// the largest one that fits in max_size*max_size, or the smallest one, as RGBA rows from top to
+// bottom. Doesn't read the strokes. Returns NULL if the file has no preview. Free with mlt_free.
+u8* milton_load_preview(PATH_CHAR* fname, i32 max_size, i32* out_w, i32* out_h);
+
+// Call every frame, from the main thread. Returns true if more strokes are in place, and the
+// canvas should be redrawn.
+b32  milton_load_tick(MiltonState* milton_state);
+// Waits for the rest of the strokes. Returns false if the file turned out to be corrupt, in which
+// case the default canvas was set.
+b32  milton_load_finish(MiltonState* milton_state);
+// Stops loading without waiting. Strokes that were not loaded stay empty. For when the canvas is
+// about to be reset.
+void milton_load_cancel(MiltonState* milton_state);
+// Returns false when nothing is loading.
+b32  milton_load_status(MiltonState* milton_state, LoadStatus* out_status);
+
+// Starts the saver thread. Without it, milton_save_async saves right away.
+void milton_saver_init(MiltonState* milton_state);
+// Does the pending save, if any, and stops the saver thread.
+void milton_saver_release(MiltonState* milton_state);
+void milton_save_async(MiltonState* milton_state);
+// Call every frame, from the main thread.
+void milton_save_tick(MiltonState* milton_state);
+// Finishes the save in progress, and does a pending one right away. Call before the canvas is reset
+// or its file changes.
+void milton_save_flush(MiltonState* milton_state);
+// Call before an undo pops a stroke from `layer`.
+void milton_save_before_undo(MiltonState* milton_state, Layer* layer);
+// True while the saver thread is writing a snapshot. It reads the points of strokes that have left
+// the canvas since the snapshot was taken, so they can't be freed yet.
+b32  milton_save_in_progress(MiltonState* milton_state);
+SaveStats milton_save_stats(MiltonState* milton_state);
+
+// Returns false if there is no journal, or if writing to it failed. The caller should then save
+// the whole canvas. `stroke` is only used by JournalOp_STROKE_ADD.
+b32  milton_journal_append(MiltonState* milton_state, JournalOp op, Stroke* stroke);
+// True when the journal is big enough that a full save is cheaper than replaying it.
+b32  milton_journal_needs_compaction(MiltonState* milton_state);
+void milton_journal_close(MiltonState* milton_state);
 
 void milton_prefs_load(PlatformPrefs* prefs);
 void milton_prefs_save(PlatformPrefs* prefs);
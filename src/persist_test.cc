@@ -0,0 +1,310 @@
+// Copyright (c) 2015-2017 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+// Saves a big canvas in the v6 format and in the old format, timing both, and times loading it with
+// 1 to 16 decoder threads. Every load must give the same strokes, in the same order and with the same
+// IDs. Loads it again with a small resident budget, and checks that paged strokes read back and save
+// the same. Then it breaks the stroke indices and checks that the bounding rects computed from the
+// points are the same, paged or not. Maps a file bigger than memory. Prints how many bytes of memory
+// the points take.
+
+#include "test_helpers.h"
+
+static b32
+same_points(Stroke* a, Stroke* b)
+{
+    static v2l points_a[STROKE_MAX_POINTS];
+    static v2l points_b[STROKE_MAX_POINTS];
+    static f32 pressures_a[STROKE_MAX_POINTS];
+    static f32 pressures_b[STROKE_MAX_POINTS];
+    b32 same = a->num_points == b->num_points;
+    if ( same ) {
+        stroke_get_points(a, 0, a->num_points, points_a, pressures_a);
+        stroke_get_points(b, 0, b->num_points, points_b, pressures_b);
+        same = memcmp(points_a, points_b, sizeof(v2l) * (size_t)a->num_points) == 0 &&
+               memcmp(pressures_a, pressures_b, sizeof(f32) * (size_t)a->num_points) == 0;
+    }
+    return same;
+}
+
+// Same strokes, in the same order, with the same IDs and rects.
+static void
+check_same_canvas(MiltonState* a_state, MiltonState* b_state)
+{
+    Layer* a = a_state->canvas->root_layer;
+    Layer* b = b_state->canvas->root_layer;
+    for ( ; a != NULL; a = a->next, b = b->next ) {
+        mlt_assert(b != NULL && a->id == b->id && a->strokes.count == b->strokes.count);
+        mlt_assert(memcmp(&a->strokes.root.bounding_rect, &b->strokes.root.bounding_rect, sizeof(Rect)) == 0);
+        for ( i64 i = 0; i < a->strokes.count; ++i ) {
+            Stroke* sa = get(&a->strokes, i);
+            Stroke* sb = get(&b->strokes, i);
+            mlt_assert(sa->id == sb->id && sa->num_points == sb->num_points);
+            mlt_assert(memcmp(&sa->bounding_rect, &sb->bounding_rect, sizeof(Rect)) == 0);
+            mlt_assert(same_points(sa, sb));
+        }
+    }
+    mlt_assert(b == NULL);
+}
+
+static MiltonState*
+test_milton_state()
+{
+    MiltonState* milton_state = (MiltonState*)mlt_calloc(1, sizeof(MiltonState), "Persist");
+    milton_state->canvas = arena_bootstrap(CanvasState, arena, 64*1024*1024);
+    milton_state->canvas->stroke_pool.arena = &milton_state->canvas->arena;
+    milton_state->view = (CanvasView*)mlt_calloc(1, sizeof(CanvasView), "Persist");
+    milton_state->gui = (MiltonGui*)mlt_calloc(1, sizeof(MiltonGui), "Persist");
+    milton_state->mlt_binary_version = MILTON_MINOR_VERSION;
+    return milton_state;
+}
+
+static void
+test_milton_state_free(MiltonState* milton_state)
+{
+    release(&milton_state->canvas->history);
+    arena_free(&milton_state->canvas->arena);
+    mlt_free(milton_state->view, "Persist");
+    mlt_free(milton_state->gui, "Persist");
+    mlt_free(milton_state, "Persist");
+}
+
+int
+milton_main()
+{
+    i32 num_layers = 4;
+    i32 strokes_per_layer = 50000;
+
+    MiltonState* saved = test_milton_state();
+    for ( i32 li = 0; li < num_layers; ++li ) {
+        milton_new_layer(saved);
+        Layer* layer = saved->canvas->working_layer;
+        for ( i32 si = 0; si < strokes_per_layer; ++si ) {
+            Stroke stroke = random_stroke(&saved->canvas->stroke_pool, layer);
+            stroke.id = saved->canvas->stroke_id_count++;
+            layer::layer_push_stroke(layer, stroke);
+        }
+    }
+    {
+        StrokePool* pool = &saved->canvas->stroke_pool;
+        size_t num_bytes = 0;
+        for ( i32 ci = 0; ci < STROKE_POOL_NUM_CLASSES; ++ci ) {
+            num_bytes += stroke_pool_block_size(ci) * (size_t)pool->classes[ci].num_used;
+        }
+        i64 num_points = 0;
+        for ( Layer* l = saved->canvas->root_layer; l != NULL; l = l->next ) {
+            for ( i64 i = 0; i < l->strokes.count; ++i ) {
+                num_points += get(&l->strokes, i)->num_points;
+            }
+        }
+        milton_log("Points in memory: %.1f bytes per point, %d when wide\n",
+                   (double)num_bytes / (double)num_points, (int)(sizeof(v2l) + sizeof(f32)));
+    }
+
+    PATH_CHAR fname[] = TO_PATH_STR("persist_test.mlt");
+    saved->mlt_file_path = fname;
+    FILE* fd = platform_fopen(fname, TO_PATH_STR("wb"));
+    mlt_assert(fd);
+    u64 file_size = 0;
+    MltSnapshot snapshot = {};
+    mlt_snapshot_take(saved, &snapshot, /*mutex*/NULL);
+    u64 start = SDL_GetPerformanceCounter();
+    b32 ok = milton_save_v6(&snapshot, fd, &file_size) && fflush(fd) == 0;
+    f32 seconds = seconds_since(start);
+    mlt_assert(ok);
+    fclose(fd);
+    milton_log("Save: %.3fs (%.1f MB/s of file)\n", seconds, file_size / (1024.0 * 1024.0) / seconds);
+
+    // The old format has many small fields per stroke.
+    {
+        PATH_CHAR legacy_fname[] = TO_PATH_STR("persist_test_v5.mlt");
+        FILE* legacy_fd = platform_fopen(legacy_fname, TO_PATH_STR("wb"));
+        mlt_assert(legacy_fd);
+        snapshot.version = 5;
+        start = SDL_GetPerformanceCounter();
+        ok = mlt_save_legacy(&snapshot, legacy_fd) && fflush(legacy_fd) == 0;
+        seconds = seconds_since(start);
+        mlt_assert(ok);
+        u64 legacy_size = (u64)ftell(legacy_fd);
+        fclose(legacy_fd);
+        platform_delete_file(legacy_fname);
+        milton_log("Save, old format: %.3fs (%.1f MB/s of file)\n",
+                   seconds, legacy_size / (1024.0 * 1024.0) / seconds);
+    }
+    mlt_snapshot_release(&snapshot);
+
+    PlatformMappedFile file = {};
+    ok = platform_map_file(fname, &file);
+    mlt_assert(ok);
+
+    MiltonState* first = NULL;
+    i32 thread_counts[] = { 1, 2, 4, 8, 16 };
+    for ( i32 ti = 0; ti < (i32)array_count(thread_counts); ++ti ) {
+        MiltonState* loaded = test_milton_state();
+        i32 layer_guid = 0;
+        MltJournalId journal_id = {};
+        u64 start = SDL_GetPerformanceCounter();
+        ok = milton_load_v6(loaded, &file, /*keep_mapping*/false, thread_counts[ti], &layer_guid, &journal_id);
+        f32 seconds = seconds_since(start);
+        mlt_assert(ok);
+        milton_log("%d threads: %.3fs (%.1f MB/s of file)\n",
+                   thread_counts[ti], seconds, file_size / (1024.0 * 1024.0) / seconds);
+
+        if ( first == NULL ) {
+            first = loaded;
+            continue;
+        }
+        check_same_canvas(first, loaded);
+        mlt_assert(loaded->canvas->stroke_id_count == saved->canvas->stroke_id_count);
+        test_milton_state_free(loaded);
+    }
+
+    // The first load matches the canvas that was saved.
+    Layer* a = saved->canvas->root_layer;
+    Layer* b = first->canvas->root_layer;
+    for ( ; a != NULL; a = a->next, b = b->next ) {
+        for ( i64 i = 0; i < a->strokes.count; ++i ) {
+            Stroke* sa = get(&a->strokes, i);
+            Stroke* sb = get(&b->strokes, i);
+            mlt_assert(sa->id == sb->id);
+            mlt_assert(memcmp(&sa->bounding_rect, &sb->bounding_rect, sizeof(Rect)) == 0);
+            mlt_assert(same_points(sa, sb));
+        }
+        mlt_assert(memcmp(&a->strokes.root.bounding_rect, &b->strokes.root.bounding_rect, sizeof(Rect)) == 0);
+    }
+
+    // With room for a quarter of the points, most blocks are paged.
+    size_t resident_budget = stroke_pool_used_bytes(&first->canvas->stroke_pool) / 4;
+    {
+        MiltonState* loaded = test_milton_state();
+        loaded->resident_budget = resident_budget;
+        i32 layer_guid = 0;
+        MltJournalId journal_id = {};
+        u64 start = SDL_GetPerformanceCounter();
+        ok = milton_load_v6(loaded, &file, /*keep_mapping*/true, 4, &layer_guid, &journal_id);
+        f32 seconds = seconds_since(start);
+        mlt_assert(ok);
+        StrokePool* pool = &loaded->canvas->stroke_pool;
+        i64 num_strokes = layer::count_strokes(loaded->canvas->root_layer);
+        mlt_assert(pool->num_paged > num_strokes / 2 && pool->num_paged < num_strokes);
+        milton_log("4 threads, %d of %d strokes paged: %.3fs. Points take %.1f MB, %.1f MB without paging\n",
+                   (int)pool->num_paged, (int)num_strokes, seconds,
+                   stroke_pool_used_bytes(pool) / (1024.0 * 1024.0),
+                   stroke_pool_used_bytes(&first->canvas->stroke_pool) / (1024.0 * 1024.0));
+
+        start = SDL_GetPerformanceCounter();
+        check_same_canvas(first, loaded);
+        milton_log("Reading every stroke, twice: %.3fs\n", seconds_since(start));
+
+        // Paged strokes are written as they are in the file.
+        PATH_CHAR paged_fname[] = TO_PATH_STR("persist_test_paged.mlt");
+        FILE* paged_fd = platform_fopen(paged_fname, TO_PATH_STR("wb"));
+        mlt_assert(paged_fd);
+        MltSnapshot paged_snapshot = {};
+        loaded->mlt_file_path = paged_fname;
+        mlt_snapshot_take(loaded, &paged_snapshot, /*mutex*/NULL);
+        start = SDL_GetPerformanceCounter();
+        u64 paged_size = 0;
+        ok = milton_save_v6(&paged_snapshot, paged_fd, &paged_size) && fflush(paged_fd) == 0;
+        seconds = seconds_since(start);
+        mlt_assert(ok);
+        fclose(paged_fd);
+        mlt_snapshot_release(&paged_snapshot);
+        milton_log("Save, paged: %.3fs (%.1f MB/s of file)\n", seconds, paged_size / (1024.0 * 1024.0) / seconds);
+
+        PlatformMappedFile paged_file = {};
+        ok = platform_map_file(paged_fname, &paged_file);
+        mlt_assert(ok);
+        MiltonState* reloaded = test_milton_state();
+        ok = milton_load_v6(reloaded, &paged_file, /*keep_mapping*/false, 4, &layer_guid, &journal_id);
+        mlt_assert(ok);
+        check_same_canvas(first, reloaded);
+        test_milton_state_free(reloaded);
+        platform_unmap_file(&paged_file);
+        platform_delete_file(paged_fname);
+
+        for ( Layer* l = loaded->canvas->root_layer; l != NULL; l = l->next ) {
+            for ( i64 i = 0; i < l->strokes.count; ++i ) {
+                stroke_free_points(pool, get(&l->strokes, i));
+            }
+        }
+        mlt_assert(pool->num_paged == 0 && stroke_pool_used_bytes(pool) == 0);
+        test_milton_state_free(loaded);
+    }
+
+    // Without the stroke indices, bounding rects are computed from the points. The mapping is read
+    // only, so the indices are broken in a copy of the file.
+    {
+        u8* copy = (u8*)mlt_calloc((size_t)file.size, 1, "Persist");
+        memcpy(copy, file.data, (size_t)file.size);
+        PlatformMappedFile broken = { copy, file.size };
+        MltHeader* header = (MltHeader*)broken.data;
+        i32 num_broken = 0;
+        for ( u64 i = 0; i < header->toc_count; ++i ) {
+            MltTocEntry* entry = (MltTocEntry*)(broken.data + header->toc_offset) + i;
+            if ( entry->type == MltChunk_STROKE_INDEX ) {
+                MltStrokeIndex* index = (MltStrokeIndex*)(broken.data + entry->offset);
+                index->checksum ^= 1;
+                ++num_broken;
+            }
+        }
+        mlt_assert(num_broken == num_layers);
+
+        MiltonState* loaded = test_milton_state();
+        i32 layer_guid = 0;
+        MltJournalId journal_id = {};
+        u64 start = SDL_GetPerformanceCounter();
+        ok = milton_load_v6(loaded, &broken, /*keep_mapping*/false, 1, &layer_guid, &journal_id);
+        f32 seconds = seconds_since(start);
+        mlt_assert(ok);
+        milton_log("1 thread, without stroke indices: %.3fs\n", seconds);
+
+        Layer* a = first->canvas->root_layer;
+        Layer* b = loaded->canvas->root_layer;
+        for ( ; a != NULL; a = a->next, b = b->next ) {
+            mlt_assert(memcmp(&a->strokes.root.bounding_rect, &b->strokes.root.bounding_rect, sizeof(Rect)) == 0);
+            for ( i64 i = 0; i < a->strokes.count; ++i ) {
+                mlt_assert(memcmp(&get(&a->strokes, i)->bounding_rect, &get(&b->strokes, i)->bounding_rect,
+                                  sizeof(Rect)) == 0);
+            }
+        }
+        test_milton_state_free(loaded);
+
+        // Paged blocks are decoded for their rects.
+        loaded = test_milton_state();
+        loaded->resident_budget = resident_budget;
+        ok = milton_load_v6(loaded, &broken, /*keep_mapping*/true, 4, &layer_guid, &journal_id);
+        mlt_assert(ok);
+        mlt_assert(loaded->canvas->stroke_pool.num_paged > 0);
+        check_same_canvas(first, loaded);
+        test_milton_state_free(loaded);
+        mlt_free(copy, "Persist");
+    }
+
+#if defined(__linux__)
+    // A file bigger than memory and swap can be mapped, since its pages are only read.
+    {
+        PATH_CHAR big_fname[] = TO_PATH_STR("persist_test_big.mlt");
+        FILE* big_fd = platform_fopen(big_fname, TO_PATH_STR("wb"));
+        mlt_assert(big_fd);
+        u64 big_size = 4 * (u64)get_system_RAM();
+        ok = ftruncate(fileno(big_fd), (off_t)big_size) == 0;  // Sparse. Takes no room on disk.
+        fclose(big_fd);
+        if ( ok ) {
+            PlatformMappedFile big = {};
+            mlt_assert(platform_map_file(big_fname, &big));
+            mlt_assert(big.size == big_size && big.data[big_size / 2] == 0);
+            platform_unmap_file(&big);
+        } else {
+            milton_log("Could not make a file of %.1f GB. Not mapping it.\n", big_size / (1024.0 * 1024.0 * 1024.0));
+        }
+        platform_delete_file(big_fname);
+    }
+#endif
+
+    platform_unmap_file(&file);
+    test_milton_state_free(first);
+    test_milton_state_free(saved);
+
+    return 0;
+}
@@ -106,7 +106,17 @@ typedef struct TabletState_s TabletState;
 
 int milton_main(bool is_fullscreen, char* file_to_open);
 
-void*   platform_allocate(size_t size);
+// Memory from platform_allocate is zeroed, and aligned to PLATFORM_ALLOCATION_ALIGNMENT. Returns
+// NULL when out of memory.
+#define PLATFORM_ALLOCATION_ALIGNMENT 64
+enum PlatformAllocateFlags
+{
+    PlatformAllocate_NONE       = 0,
+    // Ask for huge pages, for big blocks that are used for a long time. Fewer TLB misses when
+    // walking them. Ignored where huge pages can't be had without special setup.
+    PlatformAllocate_HUGE_PAGES = 1<<0,
+};
+void*   platform_allocate(size_t size, int flags = PlatformAllocate_NONE);
 #define platform_deallocate(pointer) platform_deallocate_internal((pointer)); {(pointer) = NULL;}
 void    platform_deallocate_internal(void* ptr);
 float   platform_ui_scale(PlatformState* p);
@@ -148,6 +158,15 @@ struct PlatformPrefs
 // Defined in platform_windows.cc
 FILE*   platform_fopen(const PATH_CHAR* fname, const PATH_CHAR* mode);
 
+// Writes the buffers, in order, at the current position of `fd`. Anything buffered in `fd` is
+// written first. Buffers are taken straight from their memory, so big ones are not copied.
+struct PlatformBuffer
+{
+    void*   data;
+    size_t  size;
+};
+b32     platform_write_gather(FILE* fd, PlatformBuffer* buffers, i32 count);
+
 // Returns a 0-terminated string with the full path of the target file. NULL if error.
 PATH_CHAR*   platform_open_dialog(FileKind kind);
 PATH_CHAR*   platform_save_dialog(FileKind kind);
@@ -168,8 +187,27 @@ enum DeleteErrorTolerance
     DeleteErrorTolerance_OK_NOT_EXIST = 1<<1,
 };
 b32     platform_delete_file_at_config(PATH_CHAR* fname, int error_tolerance);
+b32     platform_delete_file(PATH_CHAR* fname);
 void    platform_fname_at_config(PATH_CHAR* fname, size_t len);
 
+// A whole file mapped into memory, read only. Pages are read from the file as they are touched, and
+// can be dropped again, so the file can be bigger than memory.
+struct PlatformMappedFile
+{
+    u8* data;
+    u64 size;
+};
+b32     platform_map_file(PATH_CHAR* fname, PlatformMappedFile* out_file);
+void    platform_unmap_file(PlatformMappedFile* file);
+
+#if defined(_WIN32)
+// A mapped file can't be replaced on Windows. Saving the canvas replaces its file, so the mapping
+// can't outlive the load.
+#define PLATFORM_MAPPED_FILES_CAN_BE_REPLACED 0
+#else
+#define PLATFORM_MAPPED_FILES_CAN_BE_REPLACED 1
+#endif
+
 // Does *not* verify link. Do not expose to user facing inputs.
 void    platform_open_link(char* link);
 
@@ -36,27 +36,57 @@ void        platform_load_gl_func_pointers() {}
 void        platform_load_gl_func_pointers() {}
 #endif
 
-typedef struct UnixMemoryHeader_s
+// In front of every allocation. Padded so that the memory after it is aligned.
+typedef union UnixMemoryHeader_u
 {
-    size_t size;
+    size_t  mapped_size;  // Of the whole mapping, header included.
+    u8      padding[PLATFORM_ALLOCATION_ALIGNMENT];
 } UnixMemoryHeader;
 
+#define UNIX_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
 void*
-platform_allocate(size_t size)
+platform_allocate(size_t size, int flags)
 {
-    u8* ptr = (u8*)mmap(NULL, size + sizeof(UnixMemoryHeader),
-                        PROT_WRITE | PROT_READ,
-                        /*MAP_NORESERVE |*/ MAP_PRIVATE | MAP_ANONYMOUS,
-                        -1, 0);
-    if ( ptr ) {
-        // NOTE: This should be a footer if we intend on returning aligned data.
-        *((UnixMemoryHeader*)ptr) = (UnixMemoryHeader)
-        {
-            .size = size,
-        };
-        ptr += sizeof(UnixMemoryHeader);
+    u8* base = NULL;
+    size_t mapped_size = size + sizeof(UnixMemoryHeader);
+#if defined(MADV_HUGEPAGE)
+    if ( flags & PlatformAllocate_HUGE_PAGES ) {
+        // Transparent huge pages only back aligned huge-page-sized ranges. Map one page more than
+        // needed and unmap around an aligned range.
+        size_t huge_size = (mapped_size + UNIX_HUGE_PAGE_SIZE - 1) & ~((size_t)UNIX_HUGE_PAGE_SIZE - 1);
+        u8* ptr = (u8*)mmap(NULL, huge_size + UNIX_HUGE_PAGE_SIZE,
+                            PROT_WRITE | PROT_READ,
+                            MAP_PRIVATE | MAP_ANONYMOUS,
+                            -1, 0);
+        if ( ptr != MAP_FAILED ) {
+            u8* aligned = (u8*)(((uintptr_t)ptr + UNIX_HUGE_PAGE_SIZE - 1) & ~((uintptr_t)UNIX_HUGE_PAGE_SIZE - 1));
+            if ( aligned > ptr ) {
+                munmap(ptr, (size_t)(aligned - ptr));
+            }
+            munmap(aligned + huge_size, (size_t)(ptr + UNIX_HUGE_PAGE_SIZE - aligned));
+            // Only a hint. The kernel may not have huge pages to give.
+            madvise(aligned, huge_size, MADV_HUGEPAGE);
+            base = aligned;
+            mapped_size = huge_size;
+        }
+    }
+#endif
+    if ( base == NULL ) {
+        u8* ptr = (u8*)mmap(NULL, mapped_size,
+                            PROT_WRITE | PROT_READ,
+                            /*MAP_NORESERVE |*/ MAP_PRIVATE | MAP_ANONYMOUS,
+                            -1, 0);
+        if ( ptr != MAP_FAILED ) {
+            base = ptr;
+        }
+    }
+    u8* result = NULL;
+    if ( base ) {
+        ((UnixMemoryHeader*)base)->mapped_size = mapped_size;
+        result = base + sizeof(UnixMemoryHeader);
     }
-    return ptr;
+    return result;
 }
 
 void
@@ -64,8 +94,7 @@ platform_deallocate_internal(void* ptr)
 {
     mlt_assert(ptr);
     u8* begin = (u8*)ptr - sizeof(UnixMemoryHeader);
-    size_t size = *((size_t*)begin);
-    munmap(ptr, size);
+    munmap(begin, ((UnixMemoryHeader*)begin)->mapped_size);
 }
 
 void
@@ -88,6 +117,98 @@ str_to_path_char(char* str, PATH_CHAR* out, size_t out_sz)
     }
 }
 
+b32
+platform_delete_file(PATH_CHAR* fname)
+{
+    return remove(fname) == 0;
+}
+
+b32
+platform_map_file(PATH_CHAR* fname, PlatformMappedFile* out_file)
+{
+    b32 ok = false;
+    *out_file = {};
+
+    int fd = open(fname, O_RDONLY);
+    if ( fd != -1 ) {
+        struct stat st = {};
+        if ( fstat(fd, &st) == 0 && st.st_size > 0 ) {
+            // Read only, so that the mapping isn't charged against commit, and files bigger than
+            // memory can be mapped.
+            void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if ( data != MAP_FAILED ) {
+                // Loading touches the whole file, visible blocks first. Read it ahead in the
+                // background instead of faulting it in a page at a time. Big canvases are mostly
+                // paged, and read as they are drawn.
+                if ( (size_t)st.st_size < get_system_RAM() / 2 ) {
+                    madvise(data, (size_t)st.st_size, MADV_WILLNEED);
+                }
+                out_file->data = (u8*)data;
+                out_file->size = (u64)st.st_size;
+                ok = true;
+            }
+        }
+        // The mapping stays valid after closing the descriptor.
+        close(fd);
+    }
+    if ( !ok ) {
+        milton_log("Could not map file %s\n", fname);
+    }
+    return ok;
+}
+
+void
+platform_unmap_file(PlatformMappedFile* file)
+{
+    if ( file->data ) {
+        munmap(file->data, (size_t)file->size);
+    }
+    *file = {};
+}
+
+b32
+platform_write_gather(FILE* fd, PlatformBuffer* buffers, i32 count)
+{
+    b32 ok = fflush(fd) == 0;
+    int fildes = fileno(fd);
+    struct iovec iov[64];
+    i32 first = 0;
+    size_t done = 0;  // Bytes of buffers[first] already written.
+    while ( ok ) {
+        // Partial writes stop anywhere, even in the middle of a buffer.
+        while ( first < count && done == buffers[first].size ) {
+            ++first;
+            done = 0;
+        }
+        if ( first == count ) {
+            break;
+        }
+        int num_iov = 0;
+        for ( i32 i = first; i < count && num_iov < (int)array_count(iov); ++i ) {
+            size_t skip = i == first ? done : 0;
+            iov[num_iov].iov_base = (u8*)buffers[i].data + skip;
+            iov[num_iov].iov_len = buffers[i].size - skip;
+            ++num_iov;
+        }
+        ssize_t written = writev(fildes, iov, num_iov);
+        if ( written <= 0 ) {
+            ok = written < 0 && errno == EINTR;
+            continue;
+        }
+        size_t left = (size_t)written;
+        while ( left > 0 ) {
+            size_t n = min(left, buffers[first].size - done);
+            done += n;
+            left -= n;
+            if ( done == buffers[first].size ) {
+                ++first;
+                done = 0;
+            }
+        }
+    }
+    return ok;
+}
+
 void
 platform_cursor_show()
 {
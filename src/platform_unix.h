@@ -20,6 +20,8 @@
     // #define _GNU_SOURCE //temporarily targeting gcc for program_invocation_name
     #include <sys/stat.h>
     #include <sys/time.h>
+    #include <fcntl.h>
+    #include <sys/uio.h>
     #include <errno.h>
     #include <time.h>
     #include <ctype.h>
@@ -28,6 +30,10 @@
 
 #elif defined(__MACH__)
     #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <sys/uio.h>
+    #include <errno.h>
     #include <unistd.h> // getpid
     #else
     #error "This is not the Unix you're looking for"
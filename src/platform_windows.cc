@@ -69,8 +69,10 @@ platform_fopen(const PATH_CHAR* fname, const PATH_CHAR* mode)
     return fd;
 }
 
+// Large pages need the "Lock pages in memory" privilege, which users don't have by default, so
+// PlatformAllocate_HUGE_PAGES is ignored. VirtualAlloc returns memory aligned to 64KB.
 void*
-platform_allocate(size_t size)
+platform_allocate(size_t size, int flags)
 {
     void* result = VirtualAlloc(NULL,
                                 (size),
@@ -351,6 +353,71 @@ win32_print_error(int err)
 #pragma warning (pop)
 }
 
+b32
+platform_delete_file(PATH_CHAR* fname)
+{
+    b32 ok = DeleteFileW(fname);
+    if ( !ok ) {
+        win32_print_error((int)GetLastError());
+    }
+    return ok;
+}
+
+b32
+platform_map_file(PATH_CHAR* fname, PlatformMappedFile* out_file)
+{
+    b32 ok = false;
+    *out_file = {};
+
+    HANDLE file = CreateFileW(fname, GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if ( file != INVALID_HANDLE_VALUE ) {
+        LARGE_INTEGER size = {};
+        if ( GetFileSizeEx(file, &size) && size.QuadPart > 0 ) {
+            // Read only, so that the view isn't charged against commit, and files bigger than
+            // memory can be mapped.
+            HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if ( mapping != NULL ) {
+                void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                if ( data != NULL ) {
+                    out_file->data = (u8*)data;
+                    out_file->size = (u64)size.QuadPart;
+                    ok = true;
+                }
+                // The view keeps the mapping alive.
+                CloseHandle(mapping);
+            }
+        }
+        CloseHandle(file);
+    }
+    if ( !ok ) {
+        win32_print_error((int)GetLastError());
+    }
+    return ok;
+}
+
+void
+platform_unmap_file(PlatformMappedFile* file)
+{
+    if ( file->data ) {
+        UnmapViewOfFile(file->data);
+    }
+    *file = {};
+}
+
+b32
+platform_write_gather(FILE* fd, PlatformBuffer* buffers, i32 count)
+{
+    // The CRT writes big buffers straight to the file, without copying them into its own.
+    b32 ok = true;
+    for ( i32 i = 0; ok && i < count; ++i ) {
+        if ( buffers[i].size > 0 ) {
+            ok = fwrite(buffers[i].data, buffers[i].size, 1, fd) == 1;
+        }
+    }
+    return ok;
+}
+
 b32
 platform_move_file(PATH_CHAR* src, PATH_CHAR* dest)
 {
@@ -29,6 +29,16 @@
 // render center.
 #define RENDER_CHUNK_SIZE_LOG2 28
 
+// Exports are rendered in tiles of at most EXPORT_TILE_SIZE pixels per side (or the viewport limit,
+// if smaller) and handed out in bands of rows that take at most EXPORT_BAND_BYTES.
+#define EXPORT_TILE_SIZE 2048
+#define EXPORT_BAND_BYTES (32*1024*1024)
+
+// The clip array is shrunk when it has room for this many times the elements of the last frame, and
+// for more than CLIP_ARRAY_MIN_CAPACITY.
+#define CLIP_ARRAY_SHRINK_FACTOR 4
+#define CLIP_ARRAY_MIN_CAPACITY 1024
+
 struct RenderData
 {
     f32 viewport_limits[2];  // OpenGL limits to the framebuffer size.
@@ -69,11 +79,17 @@ struct RenderData
     GLuint helper_texture;  // Used for various effects..
     GLuint stencil_texture;
     GLuint fbo;
+    // With multisampling, the canvas is resolved here to read its pixels.
+    GLuint resolve_texture;
+    GLuint resolve_fbo;
 
     i32 flags;  // RenderDataFlags enum
 
     DArray<RenderElement> clip_array;
 
+    GpuUnpackStats unpack_stats;
+    f32 clip_unpack_ms;  // Spent unpacking in the current clip.
+
     // Screen size.
     i32 width;
     i32 height;
@@ -573,6 +589,11 @@ gpu_init(RenderData* render_data, CanvasView* view, ColorPicker* picker)
         glBindFramebufferEXT(GL_FRAMEBUFFER, render_data->fbo);
         print_framebuffer_status();
         glBindFramebufferEXT(GL_FRAMEBUFFER, 0);
+
+        if ( gl::check_flags(GLHelperFlags_TEXTURE_MULTISAMPLE) ) {
+            render_data->resolve_texture = gl::new_color_texture(view->screen_size.w, view->screen_size.h);
+            render_data->resolve_fbo = gl::new_fbo(render_data->resolve_texture, 0, GL_TEXTURE_2D);
+        }
     }
     // VBO for picker
     glGenBuffers(1, &render_data->vbo_picker);
@@ -594,6 +615,7 @@ gpu_resize(RenderData* render_data, CanvasView* view)
         gl::resize_color_texture_multisample(render_data->canvas_texture, render_data->width, render_data->height);
         gl::resize_color_texture_multisample(render_data->helper_texture, render_data->width, render_data->height);
         gl::resize_depth_stencil_texture_multisample(render_data->stencil_texture, render_data->width, render_data->height);
+        gl::resize_color_texture(render_data->resolve_texture, render_data->width, render_data->height);
     }
     else {
         gl::resize_color_texture(render_data->eraser_texture, render_data->width, render_data->height);
@@ -715,6 +737,12 @@ gpu_get_num_clipped_strokes(Layer* root_layer)
     return count;
 }
 
+GpuUnpackStats
+gpu_get_unpack_stats(RenderData* render_data)
+{
+    return render_data->unpack_stats;
+}
+
 static void
 set_screen_size(RenderData* render_data, float* fscreen)
 {
@@ -772,6 +800,26 @@ gpu_cook_stroke(Arena* arena, RenderData* render_data, Stroke* stroke, CookStrok
         mlt_assert(stroke->render_element.vbo_pointb != 0);
     } else {
         auto npoints = stroke->num_points;
+        // Compact strokes are read into wide points first.
+        v2l* points = stroke->points;
+        f32* pressures = stroke->pressures;
+        Arena points_arena = {};
+        if ( stroke->format != StrokeFormat_WIDE ) {
+            u64 start = perf_counter();
+            points_arena = arena_push(arena, (sizeof(v2l) + sizeof(f32)) * (size_t)npoints);
+            points = arena_alloc_array(&points_arena, npoints, v2l);
+            pressures = arena_alloc_array(&points_arena, npoints, f32);
+            stroke_get_points(stroke, 0, npoints, points, pressures);
+            if ( stroke->format & (StrokeFormat_PACKED | StrokeFormat_PAGED) ) {
+                f32 ms = perf_count_to_sec(perf_counter() - start) * 1000.0f;
+                GpuUnpackStats* stats = &render_data->unpack_stats;
+                stats->num_strokes += 1;
+                stats->num_paged += (stroke->format & StrokeFormat_PAGED) ? 1 : 0;
+                stats->num_points += npoints;
+                stats->total_ms += ms;
+                render_data->clip_unpack_ms += ms;
+            }
+        }
         if ( npoints == 1 ) {
             // Create a 2-point stroke and recurse
             Stroke duplicate = *stroke;
@@ -779,10 +827,12 @@ gpu_cook_stroke(Arena* arena, RenderData* render_data, Stroke* stroke, CookStrok
             Arena scratch_arena = arena_push(arena);
             duplicate.points = arena_alloc_array(&scratch_arena, 2, v2l);
             duplicate.pressures = arena_alloc_array(&scratch_arena, 2, f32);
-            duplicate.points[0] = stroke->points[0];  // It will be set relative to the center in the recursed call.
-            duplicate.points[1] = stroke->points[0];
-            duplicate.pressures[0] = stroke->pressures[0];
-            duplicate.pressures[1] = stroke->pressures[0];
+            duplicate.compact = NULL;
+            duplicate.format = StrokeFormat_WIDE;
+            duplicate.points[0] = points[0];  // It will be set relative to the center in the recursed call.
+            duplicate.points[1] = points[0];
+            duplicate.pressures[0] = pressures[0];
+            duplicate.pressures[1] = pressures[0];
 
             gpu_cook_stroke(&scratch_arena, render_data, &duplicate, cook_option);
 
@@ -825,12 +875,12 @@ gpu_cook_stroke(Arena* arena, RenderData* render_data, Stroke* stroke, CookStrok
             size_t bpoints_i = 0;
             size_t indices_i = 0;
             for ( i64 i=0; i < npoints-1; ++i ) {
-                v2i point_i = relative_to_render_center(render_data, stroke->points[i]);
-                v2i point_j = relative_to_render_center(render_data, stroke->points[i+1]);
+                v2i point_i = relative_to_render_center(render_data, points[i]);
+                v2i point_j = relative_to_render_center(render_data, points[i+1]);
 
                 Brush brush = stroke->brush;
-                float radius_i = stroke->pressures[i]*brush.radius;
-                float radius_j = stroke->pressures[i+1]*brush.radius;
+                float radius_i = pressures[i]*brush.radius;
+                float radius_j = pressures[i+1]*brush.radius;
 
                 i32 min_x = min(point_i.x-radius_i, point_j.x-radius_j);
                 i32 min_y = min(point_i.y-radius_i, point_j.y-radius_j);
@@ -866,8 +916,8 @@ gpu_cook_stroke(Arena* arena, RenderData* render_data, Stroke* stroke, CookStrok
                 indices[indices_i++] = (u16)(idx + 3);
 
                 // Pressures are in (0,1] but we need to encode them as integers.
-                float pressure_a = stroke->pressures[i];
-                float pressure_b = stroke->pressures[i+1];
+                float pressure_a = pressures[i];
+                float pressure_b = pressures[i+1];
 
                 // Add attributes for each new vertex.
                 for ( int repeat = 0; repeat < 4; ++repeat ) {
@@ -947,6 +997,9 @@ gpu_cook_stroke(Arena* arena, RenderData* render_data, Stroke* stroke, CookStrok
 
             arena_pop(&scratch_arena);
         }
+        if ( points_arena.parent ) {
+            arena_pop(&points_arena);
+        }
     }
 }
 
@@ -999,14 +1052,8 @@ gpu_free_strokes(RenderData* render_data, CanvasState* canvas)
               l = l->next ) {
             StrokeList* sl = &l->strokes;
             StrokeBucket* bucket = &sl->root;
-            i64 count = sl->count;
             while ( bucket ) {
-                if ( count >= STROKELIST_BUCKET_COUNT ) {
-                    count -= STROKELIST_BUCKET_COUNT;
-                    gpu_free_strokes(bucket->data, STROKELIST_BUCKET_COUNT, render_data);
-                } else {
-                    gpu_free_strokes(bucket->data, count, render_data);
-                }
+                gpu_free_strokes(bucket->data, strokelist_bucket_count(sl, bucket), render_data);
                 bucket = bucket->next;
             }
         }
@@ -1032,12 +1079,18 @@ gpu_clip_strokes_and_update(Arena* arena,
     screen_bounds.top = y;
     screen_bounds.bottom = y+h;
 
+    // Give back what a frame with many more strokes on screen left behind.
+    if ( clip_array->capacity > CLIP_ARRAY_SHRINK_FACTOR * max(clip_array->count, (i64)CLIP_ARRAY_MIN_CAPACITY) ) {
+        shrink_to_fit(clip_array);
+    }
     reset(clip_array);
     #if MILTON_ENABLE_PROFILING
     {
         render_data->clipped_count = 0;
     }
     #endif
+    u32 now_ms = SDL_GetTicks();
+    render_data->clip_unpack_ms = 0;
     for ( Layer* l = root_layer;
           l != NULL;
           l = l->next ) {
@@ -1047,20 +1100,14 @@ gpu_clip_strokes_and_update(Arena* arena,
         }
 
         StrokeBucket* bucket = &l->strokes.root;
-        i64 bucket_i = 0;
 
         while ( bucket ) {
-            i64 count = 0;
-            if ( l->strokes.count < bucket_i * STROKELIST_BUCKET_COUNT ) {
+            i64 count = strokelist_bucket_count(&l->strokes, bucket);
+            if ( count == 0 ) {
                // There is an allocated bucket but we have already iterated
                // through all the actual strokes.
                break;
             }
-            if ( l->strokes.count - bucket_i*STROKELIST_BUCKET_COUNT >= STROKELIST_BUCKET_COUNT ) {
-                count = STROKELIST_BUCKET_COUNT;
-            } else {
-                count = l->strokes.count % STROKELIST_BUCKET_COUNT;
-            }
             Rect bbox = bucket->bounding_rect;
             bbox.top_left = canvas_to_raster(view, bbox.top_left);
             bbox.bot_right = canvas_to_raster(view, bbox.bot_right);
@@ -1087,6 +1134,7 @@ gpu_clip_strokes_and_update(Arena* arena,
                         // a pixel. We don't draw it in that case.
                         if ( !is_outside && area!=0 ) {
                             gpu_cook_stroke(arena, render_data, s);
+                            s->render_element.drawn_ms = now_ms;
                             push(clip_array, s->render_element);
                         }
                         else if ( is_outside && ( flags & ClipFlags_UPDATE_GPU_DATA ) ) {
@@ -1117,7 +1165,6 @@ gpu_clip_strokes_and_update(Arena* arena,
             }
             #endif
             bucket = bucket->next;
-            bucket_i += 1;
         }
 
         // Add the working stroke on the current layer.
@@ -1133,6 +1180,9 @@ gpu_clip_strokes_and_update(Arena* arena,
         p->layer_alpha = l->alpha;
         p->effects = l->effects;
     }
+
+    GpuUnpackStats* stats = &render_data->unpack_stats;
+    stats->max_clip_ms = max(stats->max_clip_ms, render_data->clip_unpack_ms);
 }
 
 static void
@@ -1555,53 +1605,42 @@ gpu_render(RenderData* render_data,  i32 view_x, i32 view_y, i32 view_width, i32
     glUseProgram(0);
 }
 
-void
-gpu_render_to_buffer(MiltonState* milton_state, u8* buffer, i32 scale, i32 x, i32 y, i32 w, i32 h, f32 background_alpha)
+// Returns how far, in pixels, the blur effects of the canvas reach beyond the pixel being blurred.
+// Export tiles render this many extra pixels on each side so that there are no seams.
+static i32
+export_blur_margin(Layer* root_layer, i32 scale)
 {
-    CanvasView saved_view = *milton_state->view;
-    RenderData* render_data = milton_state->render_data;
-    CanvasView* view = milton_state->view;
-
-    i32 saved_width = render_data->width;
-    i32 saved_height = render_data->height;
-    GLuint saved_fbo = render_data->fbo;
-
-    i32 buf_w = w * scale;
-    i32 buf_h = h * scale;
-
-    v2i center = milton_state->view->screen_size / 2;
-    v2i pan_delta = v2i{x + (w / 2), y + (h / 2)} - center;
-
-    milton_set_zoom_at_point(milton_state, center);
-
-    milton_state->view->pan_center =
-        milton_state->view->pan_center + VEC2L(pan_delta)*milton_state->view->scale;
-
-    milton_state->view->screen_size = v2i{buf_w, buf_h};
-    render_data->width = buf_w;
-    render_data->height = buf_h;
-
-    milton_state->view->zoom_center = milton_state->view->screen_size / 2;
-    if ( scale > 1 ) {
-        milton_state->view->scale = (i32)ceill(((f32)milton_state->view->scale / (f32)scale));
+    i32 margin = 0;
+    for ( Layer* l = root_layer; l != NULL; l = l->next ) {
+        if ( !(l->flags & LayerFlags_VISIBLE) ) {
+            continue;
+        }
+        for ( LayerEffect* e = l->effects; e != NULL; e = e->next ) {
+            if ( e->enabled && e->type == LayerEffectType_BLUR ) {
+                i32 kernel_size = min(200, e->blur.kernel_size * e->blur.original_scale / scale);
+                // Three box filter iterations.
+                margin = max(margin, 3 * kernel_size);
+            }
+        }
     }
+    return margin;
+}
 
-    gpu_resize(render_data, view);
-    gpu_update_canvas(render_data, milton_state->canvas, view);
-
-    // TODO: Check for out-of-memory errors.
+// Render one tile with the current view. Leaves the result in the bound framebuffer.
+static void
+gpu_render_export_tile(MiltonState* milton_state, i32 tile_w, i32 tile_h, f32 background_alpha)
+{
+    RenderData* render_data = milton_state->render_data;
 
-    mlt_assert(buf_w == render_data->width);
-    mlt_assert(buf_h == render_data->height);
+    gpu_update_canvas(render_data, milton_state->canvas, milton_state->view);
 
-    glViewport(0, 0, buf_w, buf_h);
-    glScissor(0, 0, buf_w, buf_h);
+    glViewport(0, 0, tile_w, tile_h);
+    glScissor(0, 0, tile_w, tile_h);
     gpu_clip_strokes_and_update(&milton_state->root_arena, render_data, milton_state->view, milton_state->canvas->root_layer,
-                                &milton_state->working_stroke, 0, 0, buf_w, buf_h);
+                                &milton_state->working_stroke, 0, 0, tile_w, tile_h);
 
     render_data->flags |= RenderDataFlags_WITH_BLUR;
-    gpu_render_canvas(render_data, 0, 0, buf_w, buf_h, background_alpha);
-
+    gpu_render_canvas(render_data, 0, 0, tile_w, tile_h, background_alpha);
 
     // Post processing
     if ( !gl::check_flags(GLHelperFlags_TEXTURE_MULTISAMPLE) ) {
@@ -1620,53 +1659,435 @@ gpu_render_to_buffer(MiltonState* milton_state, u8* buffer, i32 scale, i32 x, i3
     } else {
         glBindFramebufferEXT(GL_DRAW_FRAMEBUFFER, 0);
         glBindFramebufferEXT(GL_READ_FRAMEBUFFER, render_data->fbo);
-        glBlitFramebufferEXT(0, 0, buf_w, buf_h,
-                             0, 0, buf_w, buf_h, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        glBlitFramebufferEXT(0, 0, tile_w, tile_h,
+                             0, 0, tile_w, tile_h, GL_COLOR_BUFFER_BIT, GL_LINEAR);
         glBindFramebufferEXT(GL_FRAMEBUFFER, 0);
     }
 
     glEnable(GL_DEPTH_TEST);
+}
+
+// A tile in flight, being copied from the framebuffer to a pixel buffer object.
+struct ExportReadback
+{
+    GLuint  pbo;
+    GLsync  fence;      // NULL without ARB_sync. Then, mapping the buffer waits for the copy.
+    b32     pending;
+
+    // Where the tile goes.
+    u8*     band;
+    i32     band_width;
+    i32     x;
+    i32     cols;
+    i32     rows;
+    b32     last_in_band;   // The band is complete once this tile is copied.
+};
 
-    // Read onto buffer
-    glReadPixels(0,0,
-                 buf_w, buf_h,
+static void
+export_readback_begin(ExportReadback* readback, i32 read_x, i32 read_y)
+{
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->pbo);
+    glReadPixels(read_x, read_y,
+                 readback->cols, readback->rows,
                  GL_RGBA,
                  GL_UNSIGNED_BYTE,
-                 (GLvoid*)buffer);
-
-    {  // Flip texture
-        u32* pixels = (u32*)buffer;
-        for ( i64 j = 0; j < buf_h / 2; ++j ) {
-            for ( i64 i = 0; i < buf_w; ++i ) {
-                i64 idx_up = j * buf_w + i;
-                i64 j_down = buf_h - 1 - j;
-                i64 idx_down = j_down * buf_w + i;
-                // Swap
-                u32 pixel = pixels[idx_down];
-                pixels[idx_down] = pixels[idx_up];
-                pixels[idx_up] = pixel;
+                 (GLvoid*)0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    if ( gl::check_flags(GLHelperFlags_SYNC) ) {
+        readback->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    // Get the GPU started on the copy.
+    glFlush();
+    readback->pending = true;
+}
+
+// Waits for the copy to finish and moves the tile into its band, flipping it. Hands the band to
+// rows_func if this was its last tile.
+static b32
+export_readback_end(ExportReadback* readback, ExportRowsFunc* rows_func, void* rows_data)
+{
+    b32 ok = true;
+
+    if ( readback->fence ) {
+        GLenum wait = GL_TIMEOUT_EXPIRED;
+        while ( wait == GL_TIMEOUT_EXPIRED ) {
+            wait = glClientWaitSync(readback->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000 /*1 second*/);
+        }
+        if ( wait == GL_WAIT_FAILED ) {
+            milton_log("[ERROR] Waiting for export readback failed.\n");
+        }
+        glDeleteSync(readback->fence);
+        readback->fence = NULL;
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->pbo);
+    u8* tile_pixels = (u8*)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    if ( tile_pixels ) {
+        size_t stride = (size_t)readback->cols * 4;
+        for ( i32 j = 0; j < readback->rows; ++j ) {
+            u8* src = tile_pixels + (size_t)(readback->rows - 1 - j) * stride;
+            u8* dst = readback->band + ((size_t)j * readback->band_width + readback->x) * 4;
+            memcpy(dst, src, stride);
+        }
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    } else {
+        milton_log("[ERROR] Could not map export pixel buffer.\n");
+        ok = false;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    readback->pending = false;
+
+    if ( ok && readback->last_in_band ) {
+        ok = rows_func(rows_data, readback->band, readback->band_width, readback->rows);
+    }
+    return ok;
+}
+
+struct ExportRender
+{
+    CanvasView  view;       // The view used for the tiles.
+    v2l         center;     // Canvas point at the center of the image.
+    f32         background_alpha;
+
+    i32 buf_w;
+    i32 buf_h;
+    i32 tile_w;
+    i32 tile_h;
+    i32 margin;
+    i32 cols;   // Area of each tile that ends up in the image.
+    i32 rows;
+
+    // Next tile to render.
+    i32 band_y;
+    i32 tile_x;
+    i32 band_i;
+    i32 tile_i;
+
+    i32 rows_done;  // Rows handed to rows_func.
+
+    // Two bands, so that the GPU can render the first tile of a band while the previous one is being
+    // handed to rows_func.
+    u8*             bands[2];
+    ExportReadback  readbacks[2];
+    GLuint          pbos[2];
+
+    ExportRowsFunc* rows_func;
+    void*           rows_data;
+};
+
+ExportRender*
+gpu_export_begin(MiltonState* milton_state, CanvasView* view, i32 scale, i32 x, i32 y, i32 w, i32 h,
+                 f32 background_alpha, ExportRowsFunc* rows_func, void* rows_data)
+{
+    RenderData* render_data = milton_state->render_data;
+
+    ExportRender* render = (ExportRender*)mlt_calloc(1, sizeof(ExportRender), "Bitmap");
+    if ( !render ) {
+        return NULL;
+    }
+
+    render->view = *view;
+    render->background_alpha = background_alpha;
+    render->rows_func = rows_func;
+    render->rows_data = rows_data;
+
+    i32 buf_w = w * scale;
+    i32 buf_h = h * scale;
+    render->buf_w = buf_w;
+    render->buf_h = buf_h;
+
+    // Canvas point at the center of the exported image. Tiles are positioned relative to it with
+    // integer offsets, so there is no loss of precision regardless of the size of the output.
+    v2i region_center = v2i{x + (w / 2), y + (h / 2)};
+    render->center = view->pan_center + VEC2L(region_center - view->zoom_center) * view->scale;
+
+    if ( scale > 1 ) {
+        render->view.scale = (i32)ceill(((f32)view->scale / (f32)scale));
+    }
+
+    float viewport_limits[2] = {};
+    gpu_get_viewport_limits(render_data, viewport_limits);
+
+    i32 tile_w = min((i32)viewport_limits[0], EXPORT_TILE_SIZE);
+    i32 tile_h = min((i32)viewport_limits[1], EXPORT_TILE_SIZE);
+    render->tile_w = tile_w;
+    render->tile_h = tile_h;
+
+    render->margin = min(export_blur_margin(milton_state->canvas->root_layer, render->view.scale),
+                         min(tile_w, tile_h) / 4);
+
+    render->cols = tile_w - 2*render->margin;
+    i32 rows = tile_h - 2*render->margin;
+    // Keep the band of rows that we hand out under a fixed size, however wide the image is.
+    rows = min(rows, max(16, (i32)(EXPORT_BAND_BYTES / ((i64)buf_w * 4))));
+    rows = min(rows, buf_h);
+    render->rows = rows;
+
+    render->view.screen_size = v2i{tile_w, tile_h};
+    render->view.zoom_center = render->view.screen_size / 2;
+
+    render->bands[0] = (u8*)mlt_calloc((size_t)buf_w * rows * 4, 1, "Bitmap");
+    render->bands[1] = (u8*)mlt_calloc((size_t)buf_w * rows * 4, 1, "Bitmap");
+    if ( !render->bands[0] || !render->bands[1] ) {
+        gpu_export_end(render);
+        return NULL;
+    }
+
+    // Tiles are read back through pixel buffer objects. The tile that was just rendered is copied
+    // into its band while the GPU works on the next one.
+    glGenBuffers(2, render->pbos);
+    for ( i32 i = 0; i < 2; ++i ) {
+        render->readbacks[i].pbo = render->pbos[i];
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, render->pbos[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)render->cols * rows * 4, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    return render;
+}
+
+b32
+gpu_export_step(MiltonState* milton_state, ExportRender* render, f32 max_seconds)
+{
+    b32 ok = true;
+
+    RenderData* render_data = milton_state->render_data;
+
+    CanvasView saved_view = *milton_state->view;
+    i32 saved_width = render_data->width;
+    i32 saved_height = render_data->height;
+    GLuint saved_fbo = render_data->fbo;
+
+    CanvasView* view = milton_state->view;
+    *view = render->view;
+    render_data->width = render->tile_w;
+    render_data->height = render->tile_h;
+
+    gpu_resize(render_data, view);
+
+    i32 buf_w = render->buf_w;
+    i32 buf_h = render->buf_h;
+    i32 cols = render->cols;
+    i32 margin = render->margin;
+
+    u64 start = perf_counter();
+
+    if ( render->band_y >= buf_h ) {
+        // All tiles are rendered. Resolve the last one.
+        for ( i32 i = 0; ok && i < 2; ++i ) {
+            if ( render->readbacks[i].pending ) {
+                ok = export_readback_end(&render->readbacks[i], render->rows_func, render->rows_data);
+                render->rows_done += render->readbacks[i].rows;
             }
         }
     }
 
-    // Cleanup.
+    // Render tiles until the time is up or a band is complete, so that the caller never gets more
+    // than one band per step.
+    b32 band_complete = false;
+    while ( ok && !band_complete && render->band_y < buf_h ) {
+        i32 band_y = render->band_y;
+        i32 tile_x = render->tile_x;
+        i32 band_rows = min(render->rows, buf_h - band_y);
+        i32 tile_cols = min(cols, buf_w - tile_x);
+
+        // Top-left corner of the rendered tile in image pixels, including the margin.
+        v2i origin = v2i{tile_x - margin, band_y - margin};
+        v2l offset = VEC2L(origin + view->zoom_center - v2i{buf_w / 2, buf_h / 2});
+        view->pan_center = render->center + offset * view->scale;
+
+        gpu_render_export_tile(milton_state, render->tile_w, render->tile_h, render->background_alpha);
+
+        ExportReadback* readback = &render->readbacks[render->tile_i % 2];
+        readback->band = render->bands[render->band_i % 2];
+        readback->band_width = buf_w;
+        readback->x = tile_x;
+        readback->cols = tile_cols;
+        readback->rows = band_rows;
+        readback->last_in_band = tile_x + cols >= buf_w;
+
+        // GL is bottom-left.
+        export_readback_begin(readback, margin, render->tile_h - margin - band_rows);
+
+        // Resolve the previous tile while the GPU renders this one.
+        ExportReadback* previous = &render->readbacks[(render->tile_i + 1) % 2];
+        if ( previous->pending ) {
+            band_complete = previous->last_in_band;
+            ok = export_readback_end(previous, render->rows_func, render->rows_data);
+            if ( band_complete ) {
+                render->rows_done += previous->rows;
+            }
+        }
+
+        // Next tile.
+        ++render->tile_i;
+        render->tile_x += cols;
+        if ( render->tile_x >= buf_w ) {
+            render->tile_x = 0;
+            render->band_y += render->rows;
+            ++render->band_i;
+        }
+
+        if ( perf_count_to_sec(perf_counter() - start) > max_seconds ) {
+            break;
+        }
+    }
 
-    render_data->fbo = saved_fbo;
     *milton_state->view = saved_view;
     render_data->width = saved_width;
     render_data->height = saved_height;
+    render_data->fbo = saved_fbo;
 
     glBindFramebufferEXT(GL_FRAMEBUFFER, render_data->fbo);
 
-    gpu_resize(render_data, view);
-    gpu_update_canvas(render_data, milton_state->canvas, view);
+    gpu_resize(render_data, milton_state->view);
+
+    return ok;
+}
+
+b32
+gpu_export_done(ExportRender* render)
+{
+    return render->rows_done >= render->buf_h;
+}
+
+f32
+gpu_export_progress(ExportRender* render)
+{
+    return (f32)render->rows_done / (f32)render->buf_h;
+}
+
+void
+gpu_export_end(ExportRender* render)
+{
+    for ( i32 i = 0; i < 2; ++i ) {
+        if ( render->readbacks[i].fence ) {
+            glDeleteSync(render->readbacks[i].fence);
+        }
+        if ( render->bands[i] ) {
+            mlt_free(render->bands[i], "Bitmap");
+        }
+    }
+    if ( render->pbos[0] ) {
+        glDeleteBuffers(2, render->pbos);
+    }
+    mlt_free(render, "Bitmap");
+}
+
+b32
+gpu_render_to_rows(MiltonState* milton_state, i32 scale, i32 x, i32 y, i32 w, i32 h, f32 background_alpha,
+                   ExportRowsFunc* rows_func, void* rows_data)
+{
+    b32 ok = false;
+
+    ExportRender* render = gpu_export_begin(milton_state, milton_state->view, scale, x, y, w, h,
+                                            background_alpha, rows_func, rows_data);
+    if ( render ) {
+        ok = true;
+        while ( ok && !gpu_export_done(render) ) {
+            ok = gpu_export_step(milton_state, render, FLT_MAX);
+        }
+        gpu_export_end(render);
+    }
 
     // Re-render
+    RenderData* render_data = milton_state->render_data;
+    gpu_update_canvas(render_data, milton_state->canvas, milton_state->view);
     gpu_clip_strokes_and_update(&milton_state->root_arena,
                                 render_data, milton_state->view, milton_state->canvas->root_layer,
                                 &milton_state->working_stroke, 0, 0, render_data->width,
                                 render_data->height);
     gpu_render(render_data, 0, 0, render_data->width, render_data->height);
+
+    return ok;
+}
+
+struct RowsToBuffer
+{
+    u8* buffer;
+    i32 y;
+};
+
+static b32
+copy_rows_to_buffer(void* data, u8* rows, i32 width, i32 num_rows)
+{
+    RowsToBuffer* dst = (RowsToBuffer*)data;
+    size_t stride = (size_t)width * 4;
+    memcpy(dst->buffer + dst->y * stride, rows, num_rows * stride);
+    dst->y += num_rows;
+    return true;
+}
+
+b32
+gpu_render_to_buffer(MiltonState* milton_state, u8* buffer, i32 scale, i32 x, i32 y, i32 w, i32 h, f32 background_alpha)
+{
+    RowsToBuffer dst = { buffer, 0 };
+    return gpu_render_to_rows(milton_state, scale, x, y, w, h, background_alpha, copy_rows_to_buffer, &dst);
+}
+
+b32
+gpu_read_canvas_pixels(RenderData* render_data, i32 x, i32 y, i32 w, i32 h, u32* out_pixels)
+{
+    if ( x < 0 || y < 0 || w <= 0 || h <= 0 ||
+         x + w > render_data->width || y + h > render_data->height ) {
+        return false;
+    }
+
+    // GL is bottom-left.
+    i32 gl_y = render_data->height - y - h;
+
+    glBindFramebufferEXT(GL_FRAMEBUFFER, render_data->fbo);
+    if ( !gl::check_flags(GLHelperFlags_TEXTURE_MULTISAMPLE) ) {
+        glFramebufferTexture2DEXT(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                                  render_data->canvas_texture, 0);
+        glReadPixels(x, gl_y, w, h, GL_RGBA, GL_UNSIGNED_BYTE, (GLvoid*)out_pixels);
+    } else {
+        // Multisampled textures can't be read directly. Resolve only the rectangle, into the
+        // resolve texture. A resolve can't move pixels, so the rectangle is at the same place in both.
+        glFramebufferTexture2DEXT(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D_MULTISAMPLE,
+                                  render_data->canvas_texture, 0);
+
+        glBindFramebufferEXT(GL_DRAW_FRAMEBUFFER, render_data->resolve_fbo);
+        glBindFramebufferEXT(GL_READ_FRAMEBUFFER, render_data->fbo);
+        glBlitFramebufferEXT(x, gl_y, x + w, gl_y + h,
+                             x, gl_y, x + w, gl_y + h, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+        glBindFramebufferEXT(GL_FRAMEBUFFER, render_data->resolve_fbo);
+        glReadPixels(x, gl_y, w, h, GL_RGBA, GL_UNSIGNED_BYTE, (GLvoid*)out_pixels);
+    }
+    glBindFramebufferEXT(GL_FRAMEBUFFER, 0);
+
+    // Flip
+    for ( i32 j = 0; j < h / 2; ++j ) {
+        u32* top = out_pixels + j * w;
+        u32* bottom = out_pixels + (h - 1 - j) * w;
+        for ( i32 i = 0; i < w; ++i ) {
+            u32 tmp = top[i];
+            top[i] = bottom[i];
+            bottom[i] = tmp;
+        }
+    }
+
+    return true;
+}
+
+u32
+gpu_create_image(u8* pixels, i32 w, i32 h)
+{
+    GLuint texture = gl::new_color_texture(w, h);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return (u32)texture;
+}
+
+void
+gpu_free_image(u32 image)
+{
+    GLuint texture = (GLuint)image;
+    glDeleteTextures(1, &texture);
 }
 
 void
@@ -31,6 +31,8 @@ struct RenderElement
     };
 
     int     flags;  // RenderElementFlags enum;
+
+    u32     drawn_ms;  // SDL_GetTicks() of the last clip that drew the stroke.
 };
 
 enum RenderDataFlags
@@ -81,6 +83,17 @@ void gpu_update_canvas(RenderData* render_data, CanvasState* canvas, CanvasView*
 void gpu_get_viewport_limits(RenderData* render_data, float* out_viewport_limits);
 i32  gpu_get_num_clipped_strokes(Layer* root_layer);
 
+// Packed and paged strokes are unpacked to cook them, on the main thread. See cold_strokes.h
+struct GpuUnpackStats
+{
+    i64 num_strokes;
+    i64 num_paged;  // Read from the canvas file.
+    i64 num_points;
+    f32 total_ms;
+    f32 max_clip_ms;  // The longest a single clip spent unpacking.
+};
+GpuUnpackStats gpu_get_unpack_stats(RenderData* render_data);
+
 
 enum CookStrokeOpt
 {
@@ -91,6 +104,8 @@ void gpu_cook_stroke(Arena* arena, RenderData* render_data, Stroke* stroke,
                      CookStrokeOpt cook_option = CookStroke_NEW);
 
 void gpu_free_strokes(RenderData* render_data, CanvasState* canvas);
+// Deletes the GL buffers of the strokes. Strokes are cooked again when they come into view.
+void gpu_free_strokes(Stroke* strokes, i64 count, RenderData* render_data);
 
 
 // Creates OpenGL objects for strokes that are in view but are not loaded on the GPU. Deletes
@@ -109,7 +124,36 @@ void gpu_clip_strokes_and_update(Arena* arena,
 void gpu_reset_render_flags(RenderData* render_data, int flags);
 
 void gpu_render(RenderData* render_data,  i32 view_x, i32 view_y, i32 view_width, i32 view_height);
-void gpu_render_to_buffer(MiltonState* milton_state, u8* buffer, i32 scale, i32 x, i32 y, i32 w, i32 h, f32 background_alpha);
+
+// Renders the screen rectangle (x, y, w, h) scaled up by `scale`. The image is rendered in tiles that
+// fit in the GPU viewport, and rows are handed to `rows_func` in bands, from top to bottom, as RGBA
+// pixels. Stops and returns false if `rows_func` returns false or if we run out of memory.
+#define EXPORT_MAX_DIMENSION (1<<20)  // Largest width or height of an exported image.
+typedef b32 ExportRowsFunc(void* data, u8* rows, i32 width, i32 num_rows);
+b32 gpu_render_to_rows(MiltonState* milton_state, i32 scale, i32 x, i32 y, i32 w, i32 h, f32 background_alpha,
+                       ExportRowsFunc* rows_func, void* rows_data);
+// Same as gpu_render_to_rows, into a (w*scale)x(h*scale) RGBA buffer.
+b32 gpu_render_to_buffer(MiltonState* milton_state, u8* buffer, i32 scale, i32 x, i32 y, i32 w, i32 h, f32 background_alpha);
+
+// The same export, a few tiles at a time, so that the UI keeps running between steps. `view` is the
+// view in which (x, y, w, h) was selected. It is copied, so the user can pan and zoom meanwhile.
+struct ExportRender;
+ExportRender* gpu_export_begin(MiltonState* milton_state, CanvasView* view, i32 scale, i32 x, i32 y, i32 w, i32 h,
+                               f32 background_alpha, ExportRowsFunc* rows_func, void* rows_data);
+// Renders tiles for about `max_seconds`, handing out at most one band. Leaves the view as it was, but
+// the screen must be redrawn. Returns false on error.
+b32  gpu_export_step(MiltonState* milton_state, ExportRender* render, f32 max_seconds);
+b32  gpu_export_done(ExportRender* render);
+f32  gpu_export_progress(ExportRender* render);
+void gpu_export_end(ExportRender* render);
+
+// Reads a w*h RGBA rectangle of the canvas as it was last rendered, without the GUI. (x,y) is the
+// top-left corner in screen coordinates. Returns false if the rectangle is not on screen.
+b32 gpu_read_canvas_pixels(RenderData* render_data, i32 x, i32 y, i32 w, i32 h, u32* out_pixels);
+
+// A texture for ImGui::Image, from w*h RGBA rows, top to bottom.
+u32  gpu_create_image(u8* pixels, i32 w, i32 h);
+void gpu_free_image(u32 image);
 
 void gpu_release_data(RenderData* render_data);
 
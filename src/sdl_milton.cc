@@ -5,6 +5,7 @@
 #include <imgui_impl_sdl_gl3.h>
 
 #include "milton.h"
+#include "export_queue.h"
 #include "gl_helpers.h"
 #include "gui.h"
 #include "persist.h"
@@ -468,6 +469,9 @@ sdl_event_loop(MiltonState* milton_state, PlatformState* platform_state)
                         else if ( keycode == SDLK_F1 ) {
                             gui_toggle_help(milton_state->gui);
                         }
+                        else if ( keycode == SDLK_F3 ) {
+                            milton_state->memory_window_visible = !milton_state->memory_window_visible;
+                        }
                         else if ( keycode == SDLK_1 ) {
                             milton_set_pen_alpha(milton_state, 0.1f);
                         }
@@ -1226,6 +1230,10 @@ milton_main(bool is_fullscreen, char* file_to_open)
         #if REDRAW_EVERY_FRAME
         platform_state.force_next_frame = true;
         #endif
+        // Exports render a few tiles every frame.
+        if ( milton_state->export_queue && export_queue_busy(milton_state->export_queue) ) {
+            platform_state.force_next_frame = true;
+        }
         // IMGUI events might update until the frame after they are created.
         if ( !platform_state.force_next_frame ) {
             SDL_WaitEvent(NULL);
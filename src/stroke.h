@@ -16,13 +16,45 @@ struct Brush
     f32 alpha;
 };
 
+// How the points of a stroke are kept in memory. Strokes on the canvas are compact when their
+// points are close enough together. Read them with stroke_point and stroke_pressure, or with
+// stroke_get_points, which works for any format.
+enum StrokeFormat
+{
+    // `points` and `pressures`. The working stroke, strokes that are being built, and strokes that
+    // point into a mapped file.
+    StrokeFormat_WIDE               = 0,
+
+    // `compact` has the offsets of the points from `origin`, x then y, followed by the pressures
+    // quantized to u16, unless they are all `pressure`.
+    StrokeFormat_OFFSETS_16         = 1<<0,
+    StrokeFormat_OFFSETS_32         = 1<<1,
+    StrokeFormat_CONSTANT_PRESSURE  = 1<<2,
+
+    // `compact` has the offsets from `origin` encoded with the stroke codec. Strokes that haven't
+    // been drawn for a while. See cold_strokes.h
+    StrokeFormat_PACKED             = 1<<3,
+    // Compact points that packing doesn't make any smaller.
+    StrokeFormat_KEEP_UNPACKED      = 1<<4,
+
+    // The points are only in the canvas file. `compact` points into the mapped file, at the
+    // `paged_size` bytes that the stroke codec wrote for the stroke. Strokes of big canvases that
+    // loading left on disk. See persist.h
+    StrokeFormat_PAGED              = 1<<5,
+};
+
 struct Stroke
 {
     i32             id;
 
     Brush           brush;
+    u32             paged_size;  // StrokeFormat_PAGED
     v2l*            points;
     f32*            pressures;
+    u8*             compact;
+    v2l             origin;
+    f32             pressure;
+    i32             format;  // StrokeFormat
     i32             num_points;
     i32             layer_id;
     Rect            bounding_rect;
@@ -0,0 +1,175 @@
+// Copyright (c) 2015-2017 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+#include "stroke_codec.h"
+
+#include "utils.h"
+
+#define STROKE_CODEC_MAX_VARINT     10  // Bytes in a 64 bit varint.
+#define STROKE_CODEC_PRESSURE_SCALE 65535.0f
+
+enum PressureEncoding
+{
+    PressureEncoding_CONSTANT   = 0,  // One f32 for all the points.
+    PressureEncoding_U16        = 1,  // Quantized to [0, 65535].
+    PressureEncoding_F32        = 2,
+    PressureEncoding_U16_DELTA  = 3,  // Quantized, each one a varint difference with the previous one.
+};
+
+static u8*
+put_varint(u8* out, i64 value)
+{
+    // Zig-zag, so that small negative numbers are small too.
+    u64 v = ((u64)value << 1) ^ (u64)(value >> 63);
+    while ( v >= 0x80 ) {
+        *out++ = (u8)(v | 0x80);
+        v >>= 7;
+    }
+    *out++ = (u8)v;
+    return out;
+}
+
+static u8*
+get_varint(u8* in, u8* end, i64* out_value)
+{
+    u64 v = 0;
+    for ( i32 shift = 0; in && shift < 64; shift += 7 ) {
+        if ( in == end ) {
+            in = NULL;
+            break;
+        }
+        u8 byte = *in++;
+        v |= (u64)(byte & 0x7f) << shift;
+        if ( !(byte & 0x80) ) {
+            *out_value = (i64)(v >> 1) ^ -(i64)(v & 1);
+            return in;
+        }
+    }
+    return NULL;
+}
+
+size_t
+stroke_codec_max_size(i32 num_points)
+{
+    return 1 + sizeof(f32) * (size_t)num_points + 2 * STROKE_CODEC_MAX_VARINT * (size_t)num_points;
+}
+
+size_t
+stroke_encode(v2l* points, f32* pressures, i32 num_points, u8* out, b32 delta_pressures)
+{
+    u8* begin = out;
+
+    v2l prev = {};
+    for ( i32 i = 0; i < num_points; ++i ) {
+        // Wrap around instead of overflowing. Decoding wraps back.
+        out = put_varint(out, (i64)((u64)points[i].x - (u64)prev.x));
+        out = put_varint(out, (i64)((u64)points[i].y - (u64)prev.y));
+        prev = points[i];
+    }
+
+    PressureEncoding encoding = PressureEncoding_CONSTANT;
+    for ( i32 i = 0; i < num_points; ++i ) {
+        if ( pressures[i] < 0.0f || pressures[i] > 1.0f || pressures[i] != pressures[i] ) {
+            encoding = PressureEncoding_F32;
+            break;
+        }
+        if ( pressures[i] != pressures[0] ) {
+            encoding = delta_pressures ? PressureEncoding_U16_DELTA : PressureEncoding_U16;
+        }
+    }
+
+    *out++ = (u8)encoding;
+    switch ( encoding ) {
+        case PressureEncoding_CONSTANT: {
+            if ( num_points > 0 ) {
+                memcpy(out, &pressures[0], sizeof(f32));
+                out += sizeof(f32);
+            }
+        } break;
+        case PressureEncoding_U16: {
+            for ( i32 i = 0; i < num_points; ++i ) {
+                u16 q = (u16)(pressures[i] * STROKE_CODEC_PRESSURE_SCALE + 0.5f);
+                *out++ = (u8)(q & 0xff);
+                *out++ = (u8)(q >> 8);
+            }
+        } break;
+        case PressureEncoding_F32: {
+            memcpy(out, pressures, sizeof(f32) * (size_t)num_points);
+            out += sizeof(f32) * (size_t)num_points;
+        } break;
+        case PressureEncoding_U16_DELTA: {
+            i64 prev_q = 0;
+            for ( i32 i = 0; i < num_points; ++i ) {
+                i64 q = (u16)(pressures[i] * STROKE_CODEC_PRESSURE_SCALE + 0.5f);
+                out = put_varint(out, q - prev_q);
+                prev_q = q;
+            }
+        } break;
+    }
+
+    mlt_assert((size_t)(out - begin) <= stroke_codec_max_size(num_points));
+    return (size_t)(out - begin);
+}
+
+b32
+stroke_decode(u8* data, size_t size, i32 num_points, v2l* out_points, f32* out_pressures)
+{
+    u8* in = data;
+    u8* end = data + size;
+
+    v2l prev = {};
+    for ( i32 i = 0; in && i < num_points; ++i ) {
+        i64 dx = 0;
+        i64 dy = 0;
+        in = get_varint(in, end, &dx);
+        in = in ? get_varint(in, end, &dy) : NULL;
+        prev.x = (i64)((u64)prev.x + (u64)dx);
+        prev.y = (i64)((u64)prev.y + (u64)dy);
+        out_points[i] = prev;
+    }
+    if ( in == NULL || in == end ) {
+        return false;
+    }
+
+    b32 ok = false;
+    u8 encoding = *in++;
+    size_t remaining = (size_t)(end - in);
+    switch ( encoding ) {
+        case PressureEncoding_CONSTANT: {
+            f32 pressure = 0.0f;
+            ok = num_points == 0 ? remaining == 0 : remaining == sizeof(f32);
+            if ( ok && num_points > 0 ) {
+                memcpy(&pressure, in, sizeof(f32));
+                for ( i32 i = 0; i < num_points; ++i ) {
+                    out_pressures[i] = pressure;
+                }
+            }
+        } break;
+        case PressureEncoding_U16: {
+            ok = remaining == 2 * (size_t)num_points;
+            for ( i32 i = 0; ok && i < num_points; ++i ) {
+                u16 q = (u16)(in[2*i] | (in[2*i + 1] << 8));
+                out_pressures[i] = q / STROKE_CODEC_PRESSURE_SCALE;
+            }
+        } break;
+        case PressureEncoding_F32: {
+            ok = remaining == sizeof(f32) * (size_t)num_points;
+            if ( ok ) {
+                memcpy(out_pressures, in, remaining);
+            }
+        } break;
+        case PressureEncoding_U16_DELTA: {
+            i64 q = 0;
+            for ( i32 i = 0; in && i < num_points; ++i ) {
+                i64 dq = 0;
+                in = get_varint(in, end, &dq);
+                q = (i64)((u64)q + (u64)dq);
+                in = (q >= 0 && q <= 0xffff) ? in : NULL;
+                out_pressures[i] = (u16)q / STROKE_CODEC_PRESSURE_SCALE;
+            }
+            ok = in == end;
+        } break;
+    }
+
+    return ok;
+}
@@ -0,0 +1,29 @@
+// Copyright (c) 2015-2017 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+// Stroke codec
+//
+// - Compact encoding of stroke points and pressures, used by MLT v6 packed stroke blocks.
+// - Points are stored as zig-zag varints: the first point, then the difference with the previous
+//   point. Consecutive points are close to each other, so most coordinates take one or two bytes.
+//   Points are stored exactly.
+// - Pressures are stored as a single value when they are all the same (mouse strokes), and quantized
+//   to 16 bits otherwise. Pressures outside of [0, 1] are stored as they are.
+// - Packed strokes in memory also store the quantized pressures as differences, which are small for
+//   pen input. MLT files don't.
+
+#pragma once
+
+#include "common.h"
+#include "vector.h"
+
+// Upper bound for the size of an encoded stroke.
+size_t stroke_codec_max_size(i32 num_points);
+
+// Encodes `num_points` points and pressures into `out`, which must have room for
+// stroke_codec_max_size(num_points) bytes. Returns the number of bytes written.
+size_t stroke_encode(v2l* points, f32* pressures, i32 num_points, u8* out, b32 delta_pressures = false);
+
+// Decodes a stroke of `num_points` points from the `size` bytes at `data`. Returns false if the
+// data is not a valid stroke of that many points.
+b32 stroke_decode(u8* data, size_t size, i32 num_points, v2l* out_points, f32* out_pressures);
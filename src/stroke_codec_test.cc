@@ -0,0 +1,118 @@
+// Copyright (c) 2015-2017 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+// Checks that strokes survive stroke_encode/stroke_decode, with and without differences of
+// pressures, and compares the size and speed of the encoding with the raw points and pressures that
+// MLT files used to store.
+
+#include "test_helpers.h"
+
+int
+milton_main()
+{
+    // Something that looks like a canvas: Strokes drawn at different zoom levels, with a tablet and
+    // with a mouse.
+    i32 num_strokes = 20000;
+    Stroke* strokes = (Stroke*)mlt_calloc((size_t)num_strokes, sizeof(Stroke), "Strokes");
+    size_t raw_size = 0;
+    size_t total_points = 0;
+    for ( i32 si = 0; si < num_strokes; ++si ) {
+        Stroke* s = &strokes[si];
+        s->num_points = 2 + random_i32(STROKE_MAX_POINTS / 8);
+        s->points = (v2l*)mlt_calloc((size_t)s->num_points, sizeof(v2l), "Strokes");
+        s->pressures = (f32*)mlt_calloc((size_t)s->num_points, sizeof(f32), "Strokes");
+
+        i64 scale = (i64)1 << random_i32(16);
+        b32 mouse = random_i32(4) == 0;
+        v2l p = { (i64)random_i32(1 << 30) - (1 << 29), (i64)random_i32(1 << 30) - (1 << 29) };
+        f32 pressure = 0.5f;
+        for ( i32 i = 0; i < s->num_points; ++i ) {
+            p.x += (random_i32(9) - 4) * scale;
+            p.y += (random_i32(9) - 4) * scale;
+            pressure = min(1.0f, max(0.01f, pressure + (random_i32(101) - 50) / 1000.0f));
+            s->points[i] = p;
+            s->pressures[i] = mouse ? 1.0f : pressure;
+        }
+        raw_size += s->num_points * (sizeof(v2l) + sizeof(f32));
+        total_points += (size_t)s->num_points;
+    }
+    // A few that don't fit the usual case.
+    strokes[0].points[0] = { LLONG_MIN, LLONG_MAX };
+    strokes[1].pressures[0] = NO_PRESSURE_INFO;
+
+    u8* encoded = (u8*)mlt_calloc(raw_size * 2, 1, "Strokes");
+    size_t* offsets = (size_t*)mlt_calloc((size_t)num_strokes + 1, sizeof(size_t), "Strokes");
+
+    u64 start = SDL_GetPerformanceCounter();
+    size_t encoded_size = 0;
+    for ( i32 si = 0; si < num_strokes; ++si ) {
+        offsets[si] = encoded_size;
+        encoded_size += stroke_encode(strokes[si].points, strokes[si].pressures, strokes[si].num_points,
+                                      encoded + encoded_size);
+    }
+    offsets[num_strokes] = encoded_size;
+    f32 encode_seconds = seconds_since(start);
+
+    v2l* points = (v2l*)mlt_calloc(STROKE_MAX_POINTS, sizeof(v2l), "Strokes");
+    f32* pressures = (f32*)mlt_calloc(STROKE_MAX_POINTS, sizeof(f32), "Strokes");
+
+    start = SDL_GetPerformanceCounter();
+    for ( i32 si = 0; si < num_strokes; ++si ) {
+        b32 ok = stroke_decode(encoded + offsets[si], offsets[si + 1] - offsets[si], strokes[si].num_points,
+                               points, pressures);
+        mlt_assert(ok);
+    }
+    f32 decode_seconds = seconds_since(start);
+
+    // Points are exact. Pressures are within the quantization step. Encoding again gives the same
+    // pressures, so saving a file many times doesn't change it.
+    for ( i32 si = 0; si < num_strokes; ++si ) {
+        Stroke* s = &strokes[si];
+        size_t size = offsets[si + 1] - offsets[si];
+        stroke_decode(encoded + offsets[si], size, s->num_points, points, pressures);
+        mlt_assert(memcmp(points, s->points, sizeof(v2l) * (size_t)s->num_points) == 0);
+        for ( i32 i = 0; i < s->num_points; ++i ) {
+            mlt_assert(MLT_ABS(pressures[i] - s->pressures[i]) <= 0.5f / 65535.0f + 1e-7f);
+        }
+
+        u8* again = (u8*)mlt_calloc(stroke_codec_max_size(s->num_points), 1, "Strokes");
+        size_t again_size = stroke_encode(points, pressures, s->num_points, again);
+        mlt_assert(again_size == size);
+        v2l* again_points = (v2l*)mlt_calloc((size_t)s->num_points, sizeof(v2l), "Strokes");
+        f32* again_pressures = (f32*)mlt_calloc((size_t)s->num_points, sizeof(f32), "Strokes");
+        stroke_decode(again, again_size, s->num_points, again_points, again_pressures);
+        mlt_assert(memcmp(again_pressures, pressures, sizeof(f32) * (size_t)s->num_points) == 0);
+
+        // Differences of pressures decode to the same pressures.
+        again_size = stroke_encode(s->points, s->pressures, s->num_points, again, /*delta_pressures*/true);
+        mlt_assert(stroke_decode(again, again_size, s->num_points, again_points, again_pressures));
+        mlt_assert(memcmp(again_points, points, sizeof(v2l) * (size_t)s->num_points) == 0);
+        mlt_assert(memcmp(again_pressures, pressures, sizeof(f32) * (size_t)s->num_points) == 0);
+        mlt_assert(!stroke_decode(again, again_size - 1, s->num_points, again_points, again_pressures));
+        mlt_free(again, "Strokes");
+        mlt_free(again_points, "Strokes");
+        mlt_free(again_pressures, "Strokes");
+
+        // Truncated data is rejected.
+        mlt_assert(!stroke_decode(encoded + offsets[si], size - 1, s->num_points, points, pressures));
+    }
+
+    milton_log("%d strokes, %d points. Raw: %d bytes. Encoded: %d bytes (%.2fx smaller)\n",
+               num_strokes, (int)total_points, (int)raw_size, (int)encoded_size,
+               (double)raw_size / (double)encoded_size);
+    milton_log("Encode: %.3fs (%.1f MB/s of raw data). Decode: %.3fs (%.1f MB/s)\n",
+               encode_seconds, raw_size / (1024.0 * 1024.0) / encode_seconds,
+               decode_seconds, raw_size / (1024.0 * 1024.0) / decode_seconds);
+
+    for ( i32 si = 0; si < num_strokes; ++si ) {
+        mlt_free(strokes[si].points, "Strokes");
+        mlt_free(strokes[si].pressures, "Strokes");
+    }
+    mlt_free(strokes, "Strokes");
+    mlt_free(encoded, "Strokes");
+    mlt_free(offsets, "Strokes");
+    mlt_free(points, "Strokes");
+    mlt_free(pressures, "Strokes");
+
+    return 0;
+}
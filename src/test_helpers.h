@@ -0,0 +1,48 @@
+// Copyright (c) 2015-2017 Sergio Gonzalez. All rights reserved.
+// License: https://github.com/serge-rgb/milton#license
+
+// Helpers shared by the *_test.cc programs. The random numbers come from a fixed seed, so every run
+// of a test sees the same data.
+
+#pragma once
+
+static f32
+seconds_since(u64 start)
+{
+    return (f32)(SDL_GetPerformanceCounter() - start) / (f32)SDL_GetPerformanceFrequency();
+}
+
+static u32 g_test_seed = 1234;
+
+static i32
+random_i32(i32 max_value)
+{
+    g_test_seed = g_test_seed * 1103515245 + 12345;
+    return (i32)((g_test_seed >> 8) % (u32)max_value);
+}
+
+// A stroke like a drawn one: small steps from a random start, and a pressure that changes slowly,
+// or stays at 1 like with a mouse. The points end up compact in the pool.
+static Stroke
+random_stroke(StrokePool* pool, Layer* layer)
+{
+    Stroke stroke = Stroke{};
+    stroke.layer_id = layer->id;
+    stroke.brush.radius = 1 + random_i32(100);
+    stroke.brush.alpha = 1.0f;
+    stroke.num_points = 2 + random_i32(STROKE_MAX_POINTS / 8);
+    b32 mouse = random_i32(4) == 0;
+    stroke_alloc_points(pool, &stroke, stroke.num_points);
+    v2l p = { (i64)random_i32(1 << 30), (i64)random_i32(1 << 30) };
+    f32 pressure = 0.5f;
+    for ( i32 i = 0; i < stroke.num_points; ++i ) {
+        p.x += random_i32(9) - 4;
+        p.y += random_i32(9) - 4;
+        pressure = min(1.0f, max(0.01f, pressure + (random_i32(9) - 4) / 10000.0f));
+        stroke.points[i] = p;
+        stroke.pressures[i] = mouse ? 1.0f : pressure;
+    }
+    stroke.bounding_rect = bounding_box_for_stroke(&stroke);
+    stroke_compact_points(pool, &stroke);
+    return stroke;
+}
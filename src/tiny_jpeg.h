@@ -12,7 +12,7 @@
  *
  * Features
  *  - Implements Baseline DCT JPEG compression.
- *  - No dynamic allocations.
+ *  - No dynamic allocations, except for the streaming interface.
  *
  * This library is coded in the spirit of the stb libraries and mostly follows
  * the stb guidelines.
@@ -160,6 +160,34 @@ int tje_encode_with_func(tje_write_func* func,
                          const int num_components,
                          const unsigned char* src_data);
 
+// - tje_encode_begin, tje_encode_rows, tje_encode_end -
+//
+// Usage
+//  Streaming version of tje_encode_with_func, for images that are not in
+//  memory all at once. tje_encode_begin writes the JPEG header and returns a
+//  stream (or NULL on error). Pass the image to tje_encode_rows in consecutive
+//  bands of rows, from top to bottom. Every band except the last one must
+//  have a multiple of 8 rows. tje_encode_end finishes the image and frees the
+//  stream.
+//
+//  RETURN:
+//      tje_encode_rows and tje_encode_end return 0 on error. 1 on success.
+
+typedef struct TJEState_s TJEStream;
+
+TJEStream* tje_encode_begin(tje_write_func* func,
+                            void* context,
+                            const int quality,
+                            const int width,
+                            const int height,
+                            const int num_components);
+
+int tje_encode_rows(TJEStream* stream,
+                    const unsigned char* src_rows,
+                    const int num_rows);
+
+int tje_encode_end(TJEStream* stream);
+
 #endif // TJE_HEADER_GUARD
 
 
@@ -194,12 +222,14 @@ int tje_encode_with_func(tje_write_func* func,
 #include <stdio.h>  // FILE, puts
 #include <string.h> // memcpy(float)[rsp+208h]
 
+#if !defined(TJE_MALLOC)
+#include <stdlib.h>
+#define TJE_MALLOC(sz) malloc(sz)
+#define TJE_FREE(p) free(p)
+#endif
 
-#define TJEI_BUFFER_SIZE 1024
 
-// Buffer TJE_BUFFER_SIZE in memory and flush when ready
-static size_t tjei_g_output_buffer_count;
-static uint8_t tjei_g_output_buffer[TJEI_BUFFER_SIZE];
+#define TJEI_BUFFER_SIZE 1024
 
 
 #ifdef _WIN32
@@ -231,6 +261,13 @@ typedef struct {
     tje_write_func* func;
 } TJEWriteContext;
 
+#if TJE_USE_FAST_DCT
+struct TJEProcessedQT {
+    float chroma[64];
+    float luma[64];
+};
+#endif
+
 typedef struct TJEState_s {
     uint8_t     ehuffsize[4][257];
     uint16_t    ehuffcode[4][256];
@@ -241,7 +278,26 @@ typedef struct TJEState_s {
     uint8_t     qt_luma[64];
     uint8_t     qt_chroma[64];
 
+#if TJE_USE_FAST_DCT
+    struct TJEProcessedQT pqt;
+#endif
+
     TJEWriteContext write_context;
+
+    // Buffer TJE_BUFFER_SIZE in memory and flush when ready
+    size_t      output_buffer_count;
+    uint8_t     output_buffer[TJEI_BUFFER_SIZE];
+
+    // Encoding progress, kept between calls to tjei_encode_rows.
+    int         width;
+    int         height;
+    int         num_components;
+    int         rows_encoded;
+    int         pred_y;
+    int         pred_b;
+    int         pred_r;
+    uint32_t    bitbuffer;
+    uint32_t    location;
 } TJEState;
 
 // ============================================================
@@ -449,17 +505,17 @@ static void tjei_write(TJEState* state, void* data, size_t num_bytes, size_t num
     size_t to_write = num_bytes * num_elements;
 
     // Cap to the buffer available size and copy memory.
-    size_t capped_count = tjei_min(to_write, TJEI_BUFFER_SIZE - 1 - tjei_g_output_buffer_count);
+    size_t capped_count = tjei_min(to_write, TJEI_BUFFER_SIZE - 1 - state->output_buffer_count);
 
-    memcpy(tjei_g_output_buffer + tjei_g_output_buffer_count, data, capped_count);
-    tjei_g_output_buffer_count += capped_count;
+    memcpy(state->output_buffer + state->output_buffer_count, data, capped_count);
+    state->output_buffer_count += capped_count;
 
-    assert (tjei_g_output_buffer_count <= TJEI_BUFFER_SIZE - 1);
+    assert (state->output_buffer_count <= TJEI_BUFFER_SIZE - 1);
 
     // Flush the buffer.
-    if ( tjei_g_output_buffer_count == TJEI_BUFFER_SIZE - 1 ) {
-        state->write_context.func(state->write_context.context, tjei_g_output_buffer, (int)tjei_g_output_buffer_count);
-        tjei_g_output_buffer_count = 0;
+    if ( state->output_buffer_count == TJEI_BUFFER_SIZE - 1 ) {
+        state->write_context.func(state->write_context.context, state->output_buffer, (int)state->output_buffer_count);
+        state->output_buffer_count = 0;
     }
 
     // Recursively calling ourselves with the rest of the buffer.
@@ -869,13 +925,6 @@ enum {
     TJEI_CHROMA_AC,
 };
 
-#if TJE_USE_FAST_DCT
-struct TJEProcessedQT {
-    float chroma[64];
-    float luma[64];
-};
-#endif
-
 // Set up huffman tables in state.
 static void tjei_huff_expand (TJEState* state)
 {
@@ -918,22 +967,32 @@ static void tjei_huff_expand (TJEState* state)
     }
 }
 
-static int tjei_encode_main(TJEState* state,
-                            const unsigned char* src_data,
-                            const int width,
-                            const int height,
-                            const int src_num_components)
+// Writes everything up to the start of scan.
+static int tjei_write_header(TJEState* state,
+                             const int width,
+                             const int height,
+                             const int src_num_components)
 {
     if (src_num_components != 3 && src_num_components != 4) {
         return 0;
     }
 
-    if (width > 0xffff || height > 0xffff) {
+    if (width <= 0 || height <= 0 || width > 0xffff || height > 0xffff) {
         return 0;
     }
 
+    state->width = width;
+    state->height = height;
+    state->num_components = src_num_components;
+    state->rows_encoded = 0;
+    state->pred_y = 0;
+    state->pred_b = 0;
+    state->pred_r = 0;
+    state->bitbuffer = 0;
+    state->location = 0;
+
 #if TJE_USE_FAST_DCT
-    struct TJEProcessedQT pqt;
+    struct TJEProcessedQT* pqt = &state->pqt;
     // Again, taken from classic japanese implementation.
     //
     /* For float AA&N IDCT method, divisors are equal to quantization
@@ -953,8 +1012,8 @@ static int tjei_encode_main(TJEState* state,
     for(int y=0; y<8; y++) {
         for(int x=0; x<8; x++) {
             int i = y*8 + x;
-            pqt.luma[y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * state->qt_luma[tjei_zig_zag[i]]);
-            pqt.chroma[y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * state->qt_chroma[tjei_zig_zag[i]]);
+            pqt->luma[y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * state->qt_luma[tjei_zig_zag[i]]);
+            pqt->chroma[y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * state->qt_chroma[tjei_zig_zag[i]]);
         }
     }
 #endif
@@ -1048,41 +1107,62 @@ static int tjei_encode_main(TJEState* state,
         tjei_write(state, &header, sizeof(TJEScanHeader), 1);
 
     }
-    // Write compressed data.
+    return 1;
+}
+
+// Write compressed data for the next `num_rows` rows of the image. `src_data`
+// points to the first of them.
+static int tjei_encode_rows(TJEState* state,
+                            const unsigned char* src_data,
+                            const int num_rows)
+{
+    const int width = state->width;
+    const int src_num_components = state->num_components;
+
+    if (num_rows <= 0 || state->rows_encoded + num_rows > state->height) {
+        return 0;
+    }
+    // Blocks can't straddle two calls.
+    if (state->rows_encoded + num_rows < state->height && (num_rows % 8) != 0) {
+        return 0;
+    }
+
+#if TJE_USE_FAST_DCT
+    struct TJEProcessedQT* pqt = &state->pqt;
+#endif
 
     float du_y[64];
     float du_b[64];
     float du_r[64];
 
-    // Set diff to 0.
-    int pred_y = 0;
-    int pred_b = 0;
-    int pred_r = 0;
+    int* pred_y = &state->pred_y;
+    int* pred_b = &state->pred_b;
+    int* pred_r = &state->pred_r;
 
     // Bit stack
-    uint32_t bitbuffer = 0;
-    uint32_t location = 0;
+    uint32_t* bitbuffer = &state->bitbuffer;
+    uint32_t* location = &state->location;
 
 
-    for ( int y = 0; y < height; y += 8 ) {
+    for ( int y = 0; y < num_rows; y += 8 ) {
         for ( int x = 0; x < width; x += 8 ) {
             // Block loop: ====
             for ( int off_y = 0; off_y < 8; ++off_y ) {
                 for ( int off_x = 0; off_x < 8; ++off_x ) {
                     int block_index = (off_y * 8 + off_x);
 
-                    int src_index = (((y + off_y) * width) + (x + off_x)) * src_num_components;
+                    size_t src_index = (((size_t)(y + off_y) * width) + (x + off_x)) * src_num_components;
 
                     int col = x + off_x;
                     int row = y + off_y;
 
-                    if(row >= height) {
-                        src_index -= (width * (row - height + 1)) * src_num_components;
+                    if(row >= num_rows) {
+                        src_index -= ((size_t)width * (row - num_rows + 1)) * src_num_components;
                     }
                     if(col >= width) {
-                        src_index -= (col - width + 1) * src_num_components;
+                        src_index -= (size_t)(col - width + 1) * src_num_components;
                     }
-                    assert(src_index < width * height * src_num_components);
+                    assert(src_index < (size_t)width * num_rows * src_num_components);
 
                     uint8_t r = src_data[src_index + 0];
                     uint8_t g = src_data[src_index + 1];
@@ -1100,53 +1180,74 @@ static int tjei_encode_main(TJEState* state,
 
             tjei_encode_and_write_MCU(state, du_y,
 #if TJE_USE_FAST_DCT
-                                     pqt.luma,
+                                     pqt->luma,
 #else
                                      state->qt_luma,
 #endif
                                      state->ehuffsize[TJEI_LUMA_DC], state->ehuffcode[TJEI_LUMA_DC],
                                      state->ehuffsize[TJEI_LUMA_AC], state->ehuffcode[TJEI_LUMA_AC],
-                                     &pred_y, &bitbuffer, &location);
+                                     pred_y, bitbuffer, location);
             tjei_encode_and_write_MCU(state, du_b,
 #if TJE_USE_FAST_DCT
-                                     pqt.chroma,
+                                     pqt->chroma,
 #else
                                      state->qt_chroma,
 #endif
                                      state->ehuffsize[TJEI_CHROMA_DC], state->ehuffcode[TJEI_CHROMA_DC],
                                      state->ehuffsize[TJEI_CHROMA_AC], state->ehuffcode[TJEI_CHROMA_AC],
-                                     &pred_b, &bitbuffer, &location);
+                                     pred_b, bitbuffer, location);
             tjei_encode_and_write_MCU(state, du_r,
 #if TJE_USE_FAST_DCT
-                                     pqt.chroma,
+                                     pqt->chroma,
 #else
                                      state->qt_chroma,
 #endif
                                      state->ehuffsize[TJEI_CHROMA_DC], state->ehuffcode[TJEI_CHROMA_DC],
                                      state->ehuffsize[TJEI_CHROMA_AC], state->ehuffcode[TJEI_CHROMA_AC],
-                                     &pred_r, &bitbuffer, &location);
+                                     pred_r, bitbuffer, location);
 
 
         }
     }
+    state->rows_encoded += num_rows;
 
-    // Finish the image.
+    return 1;
+}
+
+// Finish the image.
+static int tjei_write_end(TJEState* state)
+{
+    if (state->rows_encoded != state->height) {
+        return 0;
+    }
     { // Flush
-        if (location > 0 && location < 8) {
-            tjei_write_bits(state, &bitbuffer, &location, (uint16_t)(8 - location), 0);
+        if (state->location > 0 && state->location < 8) {
+            tjei_write_bits(state, &state->bitbuffer, &state->location, (uint16_t)(8 - state->location), 0);
         }
     }
     uint16_t EOI = tjei_be_word(0xffd9);
     tjei_write(state, &EOI, sizeof(uint16_t), 1);
 
-    if (tjei_g_output_buffer_count) {
-        state->write_context.func(state->write_context.context, tjei_g_output_buffer, (int)tjei_g_output_buffer_count);
-        tjei_g_output_buffer_count = 0;
+    if (state->output_buffer_count) {
+        state->write_context.func(state->write_context.context, state->output_buffer, (int)state->output_buffer_count);
+        state->output_buffer_count = 0;
     }
 
     return 1;
 }
 
+static int tjei_encode_main(TJEState* state,
+                            const unsigned char* src_data,
+                            const int width,
+                            const int height,
+                            const int src_num_components)
+{
+    int result = tjei_write_header(state, width, height, src_num_components) &&
+                 tjei_encode_rows(state, src_data, height) &&
+                 tjei_write_end(state);
+    return result;
+}
+
 int tje_encode_to_file(const char* dest_path,
                        const int width,
                        const int height,
@@ -1185,27 +1286,24 @@ int tje_encode_to_file_at_quality(const char* dest_path,
     return result;
 }
 
-int tje_encode_with_func(tje_write_func* func,
-                         void* context,
-                         const int quality,
-                         const int width,
-                         const int height,
-                         const int num_components,
-                         const unsigned char* src_data)
+// Set up quantization tables, huffman tables and the write callback. The state
+// must be zero-initialized.
+static int tjei_init_state(TJEState* state,
+                           tje_write_func* func,
+                           void* context,
+                           const int quality)
 {
     if (quality < 1 || quality > 3) {
         tje_log("[ERROR] -- Valid 'quality' values are 1 (lowest), 2, or 3 (highest)\n");
         return 0;
     }
 
-    TJEState state = { 0 };
-
     uint8_t qt_factor = 1;
     switch(quality) {
     case 3:
         for ( int i = 0; i < 64; ++i ) {
-            state.qt_luma[i]   = 1;
-            state.qt_chroma[i] = 1;
+            state->qt_luma[i]   = 1;
+            state->qt_chroma[i] = 1;
         }
         break;
     case 2:
@@ -1213,13 +1311,13 @@ int tje_encode_with_func(tje_write_func* func,
         // don't break. fall through.
     case 1:
         for ( int i = 0; i < 64; ++i ) {
-            state.qt_luma[i]   = tjei_default_qt_luma_from_spec[i] / qt_factor;
-            if (state.qt_luma[i] == 0) {
-                state.qt_luma[i] = 1;
+            state->qt_luma[i]   = tjei_default_qt_luma_from_spec[i] / qt_factor;
+            if (state->qt_luma[i] == 0) {
+                state->qt_luma[i] = 1;
             }
-            state.qt_chroma[i] = tjei_default_qt_chroma_from_paper[i] / qt_factor;
-            if (state.qt_chroma[i] == 0) {
-                state.qt_chroma[i] = 1;
+            state->qt_chroma[i] = tjei_default_qt_chroma_from_paper[i] / qt_factor;
+            if (state->qt_chroma[i] == 0) {
+                state->qt_chroma[i] = 1;
             }
         }
         break;
@@ -1233,15 +1331,68 @@ int tje_encode_with_func(tje_write_func* func,
     wc.context = context;
     wc.func = func;
 
-    state.write_context = wc;
+    state->write_context = wc;
+
+
+    tjei_huff_expand(state);
+
+    return 1;
+}
 
+int tje_encode_with_func(tje_write_func* func,
+                         void* context,
+                         const int quality,
+                         const int width,
+                         const int height,
+                         const int num_components,
+                         const unsigned char* src_data)
+{
+    TJEState state = { 0 };
 
-    tjei_huff_expand(&state);
+    if (!tjei_init_state(&state, func, context, quality)) {
+        return 0;
+    }
 
     int result = tjei_encode_main(&state, src_data, width, height, num_components);
 
     return result;
 }
+
+TJEStream* tje_encode_begin(tje_write_func* func,
+                            void* context,
+                            const int quality,
+                            const int width,
+                            const int height,
+                            const int num_components)
+{
+    TJEState* state = (TJEState*)TJE_MALLOC(sizeof(TJEState));
+    if (!state) {
+        return NULL;
+    }
+    memset(state, 0, sizeof(TJEState));
+
+    if (!tjei_init_state(state, func, context, quality) ||
+        !tjei_write_header(state, width, height, num_components)) {
+        TJE_FREE(state);
+        return NULL;
+    }
+
+    return state;
+}
+
+int tje_encode_rows(TJEStream* stream,
+                    const unsigned char* src_rows,
+                    const int num_rows)
+{
+    return tjei_encode_rows(stream, src_rows, num_rows);
+}
+
+int tje_encode_end(TJEStream* stream)
+{
+    int result = tjei_write_end(stream);
+    TJE_FREE(stream);
+    return result;
+}
 // ============================================================
 #endif // TJE_IMPLEMENTATION
 // ============================================================
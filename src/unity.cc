@@ -2,11 +2,15 @@
 
 
 #include "canvas.cc"
+#include "cold_strokes.cc"
 #include "color.cc"
+#include "deflate.cc"
+#include "export_queue.cc"
 #include "gl_helpers.cc"
 #include "gui.cc"
 #include "hardware_renderer.cc"
 #include "hash.cc"
+#include "image_writer.cc"
 #include "localization.cc"
 #include "memory.cc"
 #include "milton.cc"
@@ -15,6 +19,7 @@
 #include "profiler.cc"
 #include "sdl_milton.cc"
 #include "shadergen.cc"
+#include "stroke_codec.cc"
 #include "StrokeList.cc"
 #include "tests.cc"
 #include "third_party_libs.cc"
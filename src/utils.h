@@ -120,6 +120,7 @@ Rect rect_without_size();
 // Set operations on rectangles
 Rect rect_union(Rect a, Rect b);
 Rect rect_intersect(Rect a, Rect b);
+b32  rect_intersects_rect(Rect a, Rect b);
 Rect rect_stretch(Rect rect, i32 width);
 
 Rect rect_clip_to_screen(Rect limits, v2i screen_size);
@@ -88,6 +88,11 @@ Build {
                 "src/vector.cc",
                 "src/sdl_milton.cc",
                 "src/StrokeList.cc",
+                "src/deflate.cc",
+                "src/export_queue.cc",
+                "src/image_writer.cc",
+                "src/stroke_codec.cc",
+                "src/cold_strokes.cc",
                 {"src/platform_windows.cc"; Config = { "win*" }},
                 {"src/platform_unix.cc"; Config = { "linux-*", "macos" }},
                 {"src/platform_linux.cc"; Config = { "linux-*" }},